@@ -7,4 +7,19 @@ target("count_lines_fmt")
   add_packages("fmt")
   if is_plat("windows") then
     add_links("shell32")
-  end
\ No newline at end of file
+  else
+    add_syslinks("pthread")
+  end
+
+-- Not built by default: xmake build count_lines_bench
+target("count_lines_bench")
+  set_kind("binary")
+  set_default(false)
+  add_defines("USE_FMTLIB")
+  add_files("../../src/umutech/count_lines/count_lines_bench.cpp")
+  add_packages("fmt")
+  if is_plat("windows") then
+    add_links("shell32")
+  else
+    add_syslinks("pthread")
+  end
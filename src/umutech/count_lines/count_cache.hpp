@@ -0,0 +1,361 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/nowide/fstream.hpp>
+
+#include "hash.hpp"
+#include "input_file.hpp"
+#include "line_counter.hpp"
+#include "sloc.hpp"
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+namespace umutech::count_lines {
+
+// What identifies a version of a file without reading it. Windows has no
+// cheap inode, there device and inode stay 0.
+struct FileStamp {
+  std::uint64_t device;
+  std::uint64_t inode;
+  std::uint64_t size;
+  std::int64_t mtime_ns;
+
+  friend bool operator==(const FileStamp&, const FileStamp&) = default;
+};
+
+inline bool StampFile(const boost::filesystem::path& filename,
+                      FileStamp& stamp) noexcept {
+#ifdef _WIN32
+  WIN32_FILE_ATTRIBUTE_DATA data;
+  if (!::GetFileAttributesExW(filename.c_str(), GetFileExInfoStandard,
+                              &data)) {
+    return false;
+  }
+  stamp.device = 0;
+  stamp.inode = 0;
+  stamp.size = static_cast<std::uint64_t>(data.nFileSizeHigh) << 32 |
+               data.nFileSizeLow;
+  ULARGE_INTEGER mtime;
+  mtime.LowPart = data.ftLastWriteTime.dwLowDateTime;
+  mtime.HighPart = data.ftLastWriteTime.dwHighDateTime;
+  // FILETIME counts 100 ns ticks
+  stamp.mtime_ns = static_cast<std::int64_t>(mtime.QuadPart) * 100;
+#else
+  struct stat st;
+  if (0 != ::stat(filename.c_str(), &st)) {
+    return false;
+  }
+  stamp.device = static_cast<std::uint64_t>(st.st_dev);
+  stamp.inode = static_cast<std::uint64_t>(st.st_ino);
+  stamp.size = static_cast<std::uint64_t>(st.st_size);
+#ifdef __APPLE__
+  const auto& mtime = st.st_mtimespec;
+#else
+  const auto& mtime = st.st_mtim;
+#endif
+  stamp.mtime_ns =
+      static_cast<std::int64_t>(mtime.tv_sec) * 1'000'000'000 + mtime.tv_nsec;
+#endif
+  return true;
+}
+
+// What the cache keeps of a file in one --ignore-empty mode
+struct CachedCounts {
+  FileInfo info;
+  std::optional<SlocInfo> sloc;
+};
+
+// Line counts of files from earlier runs, keyed by path and FileStamp.
+//
+// The file is a header, a table of fixed-size records sorted by the hash
+// of their path, and then the paths. It's searched in place through a
+// read-only mapping, so loading is one pass over it, for a checksum and
+// the bounds and order of the records, with nothing parsed or copied. The
+// checksum over everything after the header catches truncated or corrupt
+// files, which are ignored and rewritten.
+//
+// Find() may be called from many threads; Store() and Save() may not.
+class CountCache {
+ public:
+  // Returns false if the file exists but isn't a valid cache
+  bool Load(const boost::filesystem::path& filename) noexcept;
+
+  // Entries without code/comment/blank counts don't match `need_sloc`
+  std::optional<CachedCounts> Find(const boost::filesystem::path& filename,
+                                   const FileStamp& stamp,
+                                   bool ignore_empty,
+                                   bool need_sloc) const noexcept;
+
+  // Adds an entry for the next Save()
+  void Store(const boost::filesystem::path& filename,
+             const FileStamp& stamp,
+             bool ignore_empty,
+             const CachedCounts& counts);
+
+  // Writes the stored entries, plus the loaded ones of the other
+  // --ignore-empty mode whose file is stored too, so switching modes
+  // doesn't throw the other half away. Files that have disappeared drop
+  // out. The new cache replaces the old one atomically.
+  bool Save(const boost::filesystem::path& filename);
+
+  std::size_t hits() const noexcept {
+    return hits_.load(std::memory_order_relaxed);
+  }
+  std::size_t misses() const noexcept {
+    return misses_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  static constexpr char kMagic[8] = {'C', 'L', 'C', 'A', 'C', 'H', 'E', 0};
+  // 3: byte order marks aren't counted, UTF-16 counts in code units
+  static constexpr std::uint32_t kVersion = 3;
+  // Part of the key
+  static constexpr std::uint32_t kIgnoreEmpty = 1;
+  // code, comment and blank are valid
+  static constexpr std::uint32_t kHasSloc = 2;
+
+  struct Header {
+    char magic[8];
+    std::uint32_t version;
+    // Catches a cache written by a build with another layout or byte order
+    std::uint32_t record_size;
+    std::uint64_t record_count;
+    std::uint64_t names_size;
+    std::uint64_t checksum;
+  };
+
+  struct Record {
+    std::uint64_t path_hash;
+    std::uint64_t name_offset;
+    std::uint32_t name_size;
+    std::uint32_t flags;
+    FileStamp stamp;
+    std::uint64_t lines;
+    std::uint64_t column_limit;
+    std::uint64_t code;
+    std::uint64_t comment;
+    std::uint64_t blank;
+  };
+
+  using Name =
+      std::basic_string_view<boost::filesystem::path::value_type>;
+
+  static std::uint64_t HashName(Name name) noexcept {
+    return Xxh64::Hash(name.data(), name.size() * sizeof(name[0]));
+  }
+
+  static bool Before(const Record& lhs, const Record& rhs) noexcept {
+    return lhs.path_hash < rhs.path_hash ||
+           (lhs.path_hash == rhs.path_hash &&
+            (lhs.flags & kIgnoreEmpty) < (rhs.flags & kIgnoreEmpty));
+  }
+
+  Name LoadedName(const Record& record) const noexcept {
+    return {reinterpret_cast<const Name::value_type*>(names_ +
+                                                      record.name_offset),
+            record.name_size / sizeof(Name::value_type)};
+  }
+
+  InputFile file_;
+  const Record* records_{};
+  std::size_t record_count_{};
+  const char* names_{};
+
+  std::vector<Record> stored_;
+  std::vector<Name::value_type> stored_names_;
+
+  mutable std::atomic<std::size_t> hits_{0};
+  mutable std::atomic<std::size_t> misses_{0};
+};
+
+inline bool CountCache::Load(const boost::filesystem::path& filename) noexcept {
+  boost::system::error_code ec;
+  if (!boost::filesystem::exists(filename, ec)) {
+    return true;
+  }
+  if (!file_.Open(filename) || file_.size() < sizeof(Header) ||
+      !file_.Map()) {
+    file_.Close();
+    return false;
+  }
+
+  Header header;
+  std::memcpy(&header, file_.data(), sizeof(header));
+  const std::uint64_t body_size = file_.size() - sizeof(header);
+  if (0 != std::memcmp(header.magic, kMagic, sizeof(kMagic)) ||
+      kVersion != header.version || sizeof(Record) != header.record_size ||
+      body_size / sizeof(Record) < header.record_count ||
+      body_size != header.record_count * sizeof(Record) + header.names_size ||
+      header.checksum !=
+          Xxh64::Hash(file_.data() + sizeof(header),
+                      static_cast<std::size_t>(body_size))) {
+    file_.Close();
+    return false;
+  }
+
+  records_ = reinterpret_cast<const Record*>(file_.data() + sizeof(header));
+  record_count_ = static_cast<std::size_t>(header.record_count);
+  names_ = file_.data() + sizeof(header) + record_count_ * sizeof(Record);
+  for (std::size_t i = 0; i < record_count_; ++i) {
+    const Record& record = records_[i];
+    if (header.names_size < record.name_offset ||
+        header.names_size - record.name_offset < record.name_size ||
+        0 != record.name_size % sizeof(Name::value_type) ||
+        0 != record.name_offset % sizeof(Name::value_type) ||
+        (0 != i && Before(record, records_[i - 1]))) {
+      records_ = nullptr;
+      record_count_ = 0;
+      file_.Close();
+      return false;
+    }
+  }
+  return true;
+}
+
+inline std::optional<CachedCounts> CountCache::Find(
+    const boost::filesystem::path& filename,
+    const FileStamp& stamp,
+    bool ignore_empty,
+    bool need_sloc) const noexcept {
+  const Name name = filename.native();
+  Record key{};
+  key.path_hash = HashName(name);
+  key.flags = ignore_empty ? kIgnoreEmpty : 0;
+  const Record* end = records_ + record_count_;
+  for (const Record* record = std::lower_bound(records_, end, key, Before);
+       record != end && !Before(key, *record); ++record) {
+    if (record->stamp == stamp && LoadedName(*record) == name) {
+      const bool has_sloc = 0 != (record->flags & kHasSloc);
+      if (need_sloc && !has_sloc) {
+        break;
+      }
+      hits_.fetch_add(1, std::memory_order_relaxed);
+      CachedCounts counts{{static_cast<std::size_t>(record->lines),
+                           static_cast<std::size_t>(record->column_limit)},
+                          std::nullopt};
+      if (has_sloc) {
+        counts.sloc = SlocInfo{static_cast<std::size_t>(record->code),
+                               static_cast<std::size_t>(record->comment),
+                               static_cast<std::size_t>(record->blank)};
+      }
+      return counts;
+    }
+  }
+  misses_.fetch_add(1, std::memory_order_relaxed);
+  return std::nullopt;
+}
+
+inline void CountCache::Store(const boost::filesystem::path& filename,
+                              const FileStamp& stamp,
+                              bool ignore_empty,
+                              const CachedCounts& counts) {
+  const Name name = filename.native();
+  Record record{};
+  record.path_hash = HashName(name);
+  record.name_offset = stored_names_.size() * sizeof(Name::value_type);
+  record.name_size = static_cast<std::uint32_t>(name.size() *
+                                                sizeof(Name::value_type));
+  record.flags = ignore_empty ? kIgnoreEmpty : 0;
+  record.stamp = stamp;
+  record.lines = counts.info.lines;
+  record.column_limit = counts.info.column_limit;
+  if (counts.sloc) {
+    record.flags |= kHasSloc;
+    record.code = counts.sloc->code;
+    record.comment = counts.sloc->comment;
+    record.blank = counts.sloc->blank;
+  }
+  stored_.push_back(record);
+  stored_names_.insert(stored_names_.end(), name.begin(), name.end());
+}
+
+inline bool CountCache::Save(const boost::filesystem::path& filename) {
+  std::vector<Record> records = stored_;
+  std::vector<Name::value_type> names = stored_names_;
+  std::sort(records.begin(), records.end(), Before);
+  const std::size_t stored_count = records.size();
+
+  for (std::size_t i = 0; i < record_count_; ++i) {
+    const Record& old = records_[i];
+    const Name name = LoadedName(old);
+    // Only keep the other mode of files seen in this run
+    bool seen = false;
+    bool same_mode = false;
+    const auto stored_end = records.begin() + stored_count;
+    for (auto it = std::lower_bound(records.begin(), stored_end, old,
+                                    [](const Record& lhs, const Record& rhs) {
+                                      return lhs.path_hash < rhs.path_hash;
+                                    });
+         it != stored_end && it->path_hash == old.path_hash; ++it) {
+      const Name stored_name{
+          stored_names_.data() + it->name_offset / sizeof(Name::value_type),
+          it->name_size / sizeof(Name::value_type)};
+      if (stored_name == name) {
+        seen = true;
+        same_mode = same_mode || 0 == ((it->flags ^ old.flags) & kIgnoreEmpty);
+      }
+    }
+    if (seen && !same_mode) {
+      Record record = old;
+      record.name_offset = names.size() * sizeof(Name::value_type);
+      records.push_back(record);
+      names.insert(names.end(), name.begin(), name.end());
+    }
+  }
+  std::sort(records.begin(), records.end(), Before);
+  // Windows can't replace a file that is still mapped
+  records_ = nullptr;
+  record_count_ = 0;
+  names_ = nullptr;
+  file_.Close();
+
+  Header header{};
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.record_size = sizeof(Record);
+  header.record_count = records.size();
+  header.names_size = names.size() * sizeof(Name::value_type);
+  std::vector<char> body(records.size() * sizeof(Record) +
+                         static_cast<std::size_t>(header.names_size));
+  if (!records.empty()) {
+    std::memcpy(body.data(), records.data(), records.size() * sizeof(Record));
+  }
+  if (!names.empty()) {
+    std::memcpy(body.data() + records.size() * sizeof(Record), names.data(),
+                static_cast<std::size_t>(header.names_size));
+  }
+  header.checksum = Xxh64::Hash(body.data(), body.size());
+
+  // Don't overwrite the old cache in place, it may still be mapped and
+  // a crash halfway would leave it broken
+  boost::filesystem::path temp = filename;
+  temp += ".tmp";
+  {
+    boost::nowide::ofstream f(temp.string(),
+                              std::ios::binary | std::ios::trunc);
+    if (!f) {
+      return false;
+    }
+    f.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    f.write(body.data(), static_cast<std::streamsize>(body.size()));
+    if (!f.flush()) {
+      return false;
+    }
+  }
+  boost::system::error_code ec;
+  boost::filesystem::rename(temp, filename, ec);
+  return !ec;
+}
+
+}  // namespace umutech::count_lines
@@ -7,75 +7,81 @@ namespace cpp = fmt;
 
 namespace cpp = std;
 #endif
-#include <set>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <memory>
+#include <map>
+#include <optional>
 
-#include <boost/algorithm/string/case_conv.hpp>
+#include <boost/algorithm/string/split.hpp>
 #include <boost/algorithm/string/trim.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/nowide/args.hpp>
 #include <boost/nowide/filesystem.hpp>
-#include <boost/nowide/fstream.hpp>
 #include <boost/nowide/iostream.hpp>
 #include <boost/program_options.hpp>
 
+#include "dir_walker.hpp"
+#include "dir_watcher.hpp"
+#include "file_counter.hpp"
+#include "language.hpp"
+#include "live_totals.hpp"
+#include "report.hpp"
+#include "snapshot.hpp"
+#include "sorted_runs.hpp"
+#include "tar_stream.hpp"
+
 namespace nw = boost::nowide;
 namespace fs = boost::filesystem;
 namespace po = boost::program_options;
 
 using nw::cerr;
 using nw::cout;
-using nw::ifstream;
-
-struct FileInfo {
-  std::size_t lines;
-  std::size_t column_limit;
-};
-
-FileInfo CountLines(const fs::path& filename, bool ignore_empty) noexcept {
-  FileInfo info{};
-
-  ifstream f(filename);
-  if (!f) {
-    cout << "Can't open " << filename << '\n';
-    return info;
-  }
-
-  std::string line;
-  while (f) {
-    if (std::getline(f, line)) {
-      if (info.column_limit < line.size()) {
-        info.column_limit = line.size();
-      }
-      if (ignore_empty) {
-        if (line.empty()) {
-          continue;
-        }
-        std::string_view line_view{line};
-        line_view = boost::algorithm::trim_copy(line_view);
-        if (line_view.empty()) {
-          continue;
-        }
-      }
-      ++info.lines;
-    }
-  }
-  f.close();
-  return info;
-}
 
-std::string GetLowerCaseExtension(std::string ext) {
-  if (ext != ".C") {
-    boost::algorithm::to_lower(ext);
-  }
-  return ext;
-}
+using umutech::count_lines::CountCache;
+using umutech::count_lines::CountedFile;
+using umutech::count_lines::CountOptions;
+using umutech::count_lines::DirTree;
+using umutech::count_lines::DirWalker;
+using umutech::count_lines::DirWatcher;
+using umutech::count_lines::ExtensionFilter;
+using umutech::count_lines::FileChange;
+using umutech::count_lines::FileStream;
+using umutech::count_lines::Language;
+using umutech::count_lines::LineHistogram;
+using umutech::count_lines::LiveTotals;
+using umutech::count_lines::ParallelCounter;
+using umutech::count_lines::ReportFormat;
+using umutech::count_lines::ReportTotals;
+using umutech::count_lines::ReportWriter;
+using umutech::count_lines::SlocInfo;
+using umutech::count_lines::Snapshot;
+using umutech::count_lines::SortedRuns;
+using umutech::count_lines::Stats;
+using umutech::count_lines::StreamStatus;
+using umutech::count_lines::ThreadPool;
 
 int main(int argc, char* argv[]) try {
   nw::args _(argc, argv);
 
   bool absolute_path;
+  bool code_points;
+  bool dedupe;
+  bool histogram;
   bool include_cpp;
   bool ignore_empty;
+  bool io_uring;
+  bool respect_gitignore;
+  unsigned jobs;
+  std::size_t memory;
+  std::size_t over;
+  bool sloc;
+  bool stats;
+  bool summary_only;
+  std::size_t top;
+  bool watch;
 
   po::options_description desc("Usage");
   // clang-format off
@@ -83,18 +89,87 @@ int main(int argc, char* argv[]) try {
     ("abs",
       po::value<bool>(&absolute_path)->default_value(false),
       "Absolute path.")
+    ("cache",
+      po::value<std::string>(),
+      "Cache file of line counts. Unchanged files aren't read again.")
+    ("code-points",
+      po::value<bool>(&code_points)->default_value(false),
+      "Column limits in code points instead of bytes, or of UTF-16 code "
+      "units.")
     ("cpp",
       po::value<bool>(&include_cpp)->default_value(false),
       "Include C++ file extensions.")
+    ("dedupe",
+      po::value<bool>(&dedupe)->default_value(false),
+      "Count files with the same content once, and report the copies.")
+    ("depth",
+      po::value<std::size_t>(),
+      "Print totals of the input directories and of their subdirectories "
+      "down to this depth.")
+    ("diff",
+      po::value<std::vector<std::string>>()->multitoken(),
+      "Compare two trees or snapshots, old then new, and print the files "
+      "and directories whose lines changed. A tree only reads the files "
+      "whose size or mtime differ from the old side.")
+    ("exclude",
+      po::value<std::vector<std::string>>()->composing()->multitoken(),
+      "Skip what matches the gitignore style glob, e.g. third_party/.")
     ("ext",
       po::value<std::vector<std::string>>()->composing()->multitoken(),
       "File extension included. Case sensitive!")
+    ("format",
+      po::value<std::string>()->default_value("text"),
+      "Output format: text, jsonl or csv.")
+    ("histogram",
+      po::value<bool>(&histogram)->default_value(false),
+      "Print how many lines have which length, with p50, p90 and p99.")
     ("ignore-empty",
       po::value<bool>(&ignore_empty)->default_value(false),
       "Ignore empty lines.")
     ("input,i",
       po::value<std::vector<std::string>>()->composing()->multitoken(),
-      "Input path. Can be file or directory.");
+      "Input path. Can be file, directory, tar archive or - for stdin.")
+    ("io-uring",
+      po::value<bool>(&io_uring)->default_value(false),
+      "Read small files through io_uring where Linux supports it.")
+    ("jobs,j",
+      po::value<unsigned>(&jobs)->default_value(1),
+      "Number of counting threads, 0 for one per hardware thread.")
+    ("lang",
+      po::value<std::vector<std::string>>()->composing()->multitoken(),
+      "Include the file extensions of languages, e.g. rust,python. "
+      "Extensionless scripts count by their #! line.")
+    ("memory",
+      po::value<std::size_t>(&memory)->default_value(0),
+      "Keep the list of files within about this many MiB, in sorted runs "
+      "on temporary files. 0 keeps it in memory.")
+    ("over",
+      po::value<std::size_t>(&over)->default_value(0),
+      "List where the lines longer than this are, in columns.")
+    ("respect-gitignore",
+      po::value<bool>(&respect_gitignore)->default_value(false),
+      "Skip what git ignores, in git repositories.")
+    ("save-snapshot",
+      po::value<std::string>(),
+      "Write the counts of the input directory, or of the new side of "
+      "--diff, to this file for a later --diff.")
+    ("sloc",
+      po::value<bool>(&sloc)->default_value(false),
+      "Count code, comment and blank lines.")
+    ("stats",
+      po::value<bool>(&stats)->default_value(false),
+      "Print times and counters of each phase, and peak memory.")
+    ("summary-only",
+      po::value<bool>(&summary_only)->default_value(false),
+      "Only print the totals.")
+    ("top",
+      po::value<std::size_t>(&top)->default_value(0),
+      "Only print the directories with most lines, this many. Implies "
+      "--depth if it isn't given.")
+    ("watch",
+      po::value<bool>(&watch)->default_value(false),
+      "Keep running after the report, and report the files that change "
+      "in the input directories with new totals. Linux only.");
   // clang-format on
   po::positional_options_description p;
   p.add("input", -1);
@@ -109,85 +184,525 @@ int main(int argc, char* argv[]) try {
          << desc
          << "\nExamples:\n"
             "  count_lines --cpp=1 C:\\cpp\\\n"
-            "  count_lines --ext \"\" -i C:\\cpp\\ C:\\js\\\n";
+            "  count_lines --ext \"\" -i C:\\cpp\\ C:\\js\\\n"
+            "  count_lines --cpp=1 -j 0 C:\\cpp\\\n"
+            "  count_lines --lang rust,python,shell ~/src\n"
+            "  count_lines --cpp=1 -j 0 --io-uring=1 /usr/include\n"
+            "  count_lines --cpp=1 --cache lines.cache C:\\cpp\\\n"
+            "  count_lines --cpp=1 --sloc=1 C:\\cpp\\\n"
+            "  count_lines --cpp=1 --format=jsonl --summary-only=1 "
+            "C:\\cpp\\\n"
+            "  count_lines --cpp=1 --stats=1 C:\\cpp\\\n"
+            "  count_lines --cpp=1 --respect-gitignore=1 --exclude test/ "
+            "C:\\cpp\\\n"
+            "  count_lines --cpp=1 --depth 1 --top 10 C:\\cpp\\\n"
+            "  count_lines --cpp=1 --dedupe=1 C:\\cpp\\\n"
+            "  count_lines --cpp=1 --histogram=1 --over 120 C:\\cpp\\\n"
+            "  count_lines --ext .rc --code-points=1 C:\\cpp\\\n"
+            "  count_lines --cpp=1 --watch=1 --format=jsonl ~/src\n"
+            "  count_lines --cpp=1 -j 0 --memory 64 /\n"
+            "  count_lines --cpp=1 --save-snapshot v1.snapshot C:\\cpp\\\n"
+            "  count_lines --cpp=1 --diff v1.snapshot C:\\cpp\\\n"
+            "  count_lines --cpp=1 release.tar.gz\n"
+            "  tar -c src | count_lines --cpp=1 -\n";
     return EXIT_SUCCESS;
   }
 
-  std::set<std::string> exts;
+  ReportFormat format;
+  if (!umutech::count_lines::ParseReportFormat(vm["format"].as<std::string>(),
+                                               format)) {
+    cerr << "Unknown format " << vm["format"].as<std::string>() << '\n';
+    return EXIT_FAILURE;
+  }
+
+  ExtensionFilter filter;
   if (include_cpp) {
-    exts.insert(".C");
-    exts.insert(".c++");
-    exts.insert(".cc");
-    exts.insert(".cpp");
-    exts.insert(".cppm");
-    exts.insert(".cxx");
-    exts.insert(".h");
-    exts.insert(".h++");
-    exts.insert(".hh");
-    exts.insert(".hpp");
-    exts.insert(".hxx");
-    exts.insert(".inl");
-    exts.insert(".ipp");
-    exts.insert(".ixx");
-    exts.insert(".tlh");
-    exts.insert(".tli");
+    filter.AddLanguage(Language::kCpp);
+  }
+
+  std::vector<std::string> languages;
+  if (vm.count("lang")) {
+    for (const auto& list : vm["lang"].as<std::vector<std::string>>()) {
+      std::vector<std::string> names;
+      boost::algorithm::split(names, list, [](char c) { return ',' == c; });
+      for (auto& name : names) {
+        boost::algorithm::trim(name);
+        if (name.empty()) {
+          continue;
+        }
+        const auto language = umutech::count_lines::FindLanguage(name);
+        if (!language) {
+          cerr << "Unknown language " << name << ", known are:";
+          for (const auto& info : umutech::count_lines::language::kLanguages) {
+            if (Language::kUnknown != info.language) {
+              cerr << ' ' << info.name;
+            }
+          }
+          cerr << '\n';
+          return EXIT_FAILURE;
+        }
+        filter.AddLanguage(*language);
+        languages.push_back(std::move(name));
+      }
+    }
   }
 
   if (vm.count("ext")) {
-    for (const auto& _ext : vm["ext"].as<std::vector<std::string>>()) {
-      auto ext = GetLowerCaseExtension(boost::algorithm::trim_copy(_ext));
+    for (const auto& ext : vm["ext"].as<std::vector<std::string>>()) {
       // Support --ext "" to count those files without extension
-      if (ext.empty() || ext.starts_with('.')) {
-        exts.insert(ext);
-      } else {
-        exts.insert("." + ext);
-      }
+      filter.AddExtension(boost::algorithm::trim_copy(ext));
     }
   }
 
-  cout << cpp::format("cpp         : {}\n", include_cpp);
-  cout << "ext         :";
-  for (const auto& ext : exts) {
-    cout << " " << ext;
+  if (watch && dedupe) {
+    cerr << "--watch doesn't go with --dedupe\n";
+    return EXIT_FAILURE;
+  }
+  // The lengths of a file's lines aren't kept, so they can't be taken out
+  // again once it changes, or once it turns out to be a copy
+  if (histogram && (watch || dedupe)) {
+    cerr << "--histogram doesn't go with --" << (watch ? "watch" : "dedupe")
+         << '\n';
+    return EXIT_FAILURE;
+  }
+  // Those need every file at the end
+  if (0 != memory && (dedupe || watch || vm.count("cache"))) {
+    cerr << "--memory doesn't go with --"
+         << (dedupe ? "dedupe" : watch ? "watch" : "cache") << '\n';
+    return EXIT_FAILURE;
+  }
+
+  // Directory totals, by default of every level
+  const bool directories = vm.count("depth") || 0 != top;
+  const std::size_t depth = vm.count("depth")
+                                ? vm["depth"].as<std::size_t>()
+                                : std::numeric_limits<std::size_t>::max();
+
+  // A diff prints changes, nothing of one tree
+  if (vm.count("diff") && (vm.count("input") || watch || 0 != memory ||
+                           dedupe || histogram || 0 != over ||
+                           directories || stats)) {
+    cerr << "--diff doesn't go with inputs, --watch, --memory, --dedupe, "
+            "--histogram, --over, --depth, --top or --stats\n";
+    return EXIT_FAILURE;
+  }
+  if (vm.count("diff") &&
+      2 != vm["diff"].as<std::vector<std::string>>().size()) {
+    cerr << "--diff takes two trees or snapshots, old and new\n";
+    return EXIT_FAILURE;
+  }
+  // Names in a snapshot are below one root
+  if (vm.count("save-snapshot") && !vm.count("diff") &&
+      (!vm.count("input") ||
+       1 != vm["input"].as<std::vector<std::string>>().size() ||
+       !fs::is_directory(vm["input"].as<std::vector<std::string>>()[0]) ||
+       0 != memory)) {
+    cerr << "--save-snapshot needs one input directory and no --memory, or "
+            "--diff\n";
+    return EXIT_FAILURE;
+  }
+
+  // Machine readable output is nothing but the report
+  if (ReportFormat::kText == format) {
+    cout << cpp::format("cpp         : {}\n", include_cpp);
+    cout << "ext         :";
+    for (const auto& ext : filter.Extensions()) {
+      cout << " " << ext;
+    }
+    cout << "\n";
+    if (!languages.empty()) {
+      cout << "lang        :";
+      for (const auto& language : languages) {
+        cout << " " << language;
+      }
+      cout << "\n";
+    }
+    cout << cpp::format("ignore-empty: {}\n", ignore_empty);
+    // The options left as they were are left out, as before there were any
+    if (code_points) {
+      cout << cpp::format("code-points : {}\n", code_points);
+    }
+    if (respect_gitignore) {
+      cout << cpp::format("gitignore   : {}\n", respect_gitignore);
+    }
+    if (vm.count("exclude")) {
+      cout << "exclude     :";
+      for (const auto& pattern : vm["exclude"].as<std::vector<std::string>>()) {
+        cout << " " << pattern;
+      }
+      cout << "\n";
+    }
+    if (stats) {
+      cout << cpp::format("kernel      : {}\n",
+                          umutech::count_lines::KernelName(
+                              umutech::count_lines::ActiveKernel()));
+    }
+    if (sloc) {
+      cout << cpp::format("sloc        : {}\n", sloc);
+    }
+    if (dedupe) {
+      cout << cpp::format("dedupe      : {}\n", dedupe);
+    }
+    if (histogram) {
+      cout << cpp::format("histogram   : {}\n", histogram);
+    }
+    if (0 != over) {
+      cout << cpp::format("over        : {}\n", over);
+    }
+    if (1 != jobs) {
+      cout << cpp::format("jobs        : {}\n",
+                          umutech::count_lines::ThreadPool::Resolve(jobs));
+    }
+    if (io_uring) {
+      cout << cpp::format("io-uring    : {}\n", io_uring);
+    }
+    if (watch) {
+      cout << cpp::format("watch       : {}\n", watch);
+    }
+    if (0 != memory) {
+      cout << cpp::format("memory      : {}\n", memory);
+    }
+    if (vm.count("diff")) {
+      const auto& sides = vm["diff"].as<std::vector<std::string>>();
+      cout << "diff        : " << sides[0] << " " << sides[1] << "\n";
+    }
+    if (vm.count("save-snapshot")) {
+      cout << "snapshot    : " << vm["save-snapshot"].as<std::string>()
+           << "\n";
+    }
+    if (directories) {
+      if (vm.count("depth")) {
+        cout << cpp::format("depth       : {}\n", depth);
+      }
+      cout << cpp::format("top         : {}\n", top);
+    }
   }
-  cout << "\n";
-  cout << cpp::format("ignore-empty: {}\n", ignore_empty);
 
   nw::nowide_filesystem();
 
-  std::set<fs::path> filenames;
+  Stats statistics;
+  if (stats) {
+    statistics.Activate();
+  }
+
+  std::unique_ptr<ThreadPool> pool;
+  if (1 != ThreadPool::Resolve(jobs)) {
+    pool = std::make_unique<ThreadPool>(jobs);
+  }
+  const CountOptions count_options{
+      ignore_empty, sloc, dedupe, histogram, over, code_points};
+  ParallelCounter counter(count_options, pool.get());
+  if (io_uring && !counter.UseIoUring()) {
+    cerr << "io_uring isn't available, read files one by one\n";
+  }
+  if (vm.count("save-snapshot")) {
+    counter.StampFiles();
+  }
+  std::unique_ptr<CountCache> cache;
+  if (vm.count("cache")) {
+    cache = std::make_unique<CountCache>();
+    if (!cache->Load(vm["cache"].as<std::string>())) {
+      cerr << "Ignore invalid cache " << vm["cache"].as<std::string>()
+           << '\n';
+    }
+    counter.UseCache(cache.get());
+  }
+  std::unique_ptr<DirTree> tree;
+  if (directories) {
+    tree = std::make_unique<DirTree>();
+    counter.UseDirTree(tree.get());
+  }
+  // Files are sorted as they come, in runs within the budget
+  std::unique_ptr<SortedRuns> runs;
+  if (0 != memory) {
+    runs = std::make_unique<SortedRuns>(memory << 20);
+    runs->UseDirTree(tree.get());
+    counter.StreamTo([&runs](CountedFile file) { runs->Add(file); });
+  }
+  // Directories are watched as the walk enters them
+  std::unique_ptr<DirWatcher> watcher;
+  std::atomic<std::size_t> unwatched{0};
+  if (watch) {
+    watcher = std::make_unique<DirWatcher>();
+    if (!watcher->Open()) {
+      cerr << "--watch needs inotify, which this system doesn't have\n";
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Extensionless files only get past the filter for their #! line
+  const auto shebang_matches = [&filter](const fs::path& filename) {
+    if (filter.NeedsShebang(filename.filename().native()) &&
+        !filter.MatchesShebang(filename)) {
+      Stats::Add(Stats::Counter::kFilesSkippedByExtension);
+      return false;
+    }
+    return true;
+  };
+  const auto make_walker = [&](ParallelCounter& counter) {
+    auto walker = std::make_unique<DirWalker>(
+        pool.get(),
+        [&filter](DirWalker::NameView name) { return filter.Matches(name); },
+        [&shebang_matches, &counter](fs::path filename) {
+          if (shebang_matches(filename)) {
+            counter.Add(std::move(filename));
+          }
+        });
+    if (respect_gitignore) {
+      walker->RespectGitignore();
+    }
+    if (vm.count("exclude")) {
+      for (const auto& pattern :
+           vm["exclude"].as<std::vector<std::string>>()) {
+        walker->Exclude(pattern);
+      }
+    }
+    if (watcher) {
+      walker->OnDirectory([&watcher, &unwatched](const fs::path& dir) {
+        if (!watcher->Watch(dir)) {
+          unwatched.fetch_add(1, std::memory_order_relaxed);
+        }
+      });
+    }
+    return walker;
+  };
 
+  const Snapshot::Options snapshot_options{ignore_empty, sloc, code_points};
+  const auto fill_snapshot = [&](const std::vector<CountedFile>& files,
+                                 const fs::path& root, Snapshot& snapshot) {
+    for (const auto& file : files) {
+      snapshot.Add({umutech::count_lines::SnapshotName(file.path, root),
+                    file.stamp, file.opened, file.info, file.sloc});
+    }
+    snapshot.Finish();
+  };
+  // A side of --diff. A tree is counted, and takes what `base` has of the
+  // files whose size and mtime are the same.
+  const auto take_side = [&](const std::string& side, const Snapshot* base,
+                             Snapshot& snapshot) {
+    fs::path path = side;
+    if (!fs::is_directory(path)) {
+      if (!snapshot.Load(path)) {
+        cerr << "Can't read snapshot " << path << '\n';
+        return false;
+      }
+      if (snapshot.options().ignore_empty != ignore_empty ||
+          snapshot.options().code_points != code_points) {
+        cerr << "Snapshot " << path
+             << " was counted with another --ignore-empty or --code-points\n";
+        return false;
+      }
+      return true;
+    }
+    if (absolute_path) {
+      Stats::ScopedTimer timer(Stats::Phase::kCanonical);
+      path = fs::canonical(path);
+    }
+    ParallelCounter side_counter(count_options, pool.get());
+    side_counter.StampFiles();
+    if (nullptr != base) {
+      side_counter.UseSnapshot(base, path);
+    }
+    if (io_uring) {
+      side_counter.UseIoUring();
+    }
+    if (cache) {
+      side_counter.UseCache(cache.get());
+    }
+    const std::unique_ptr<DirWalker> side_walker = make_walker(side_counter);
+    side_walker->Walk(path);
+    fill_snapshot(side_counter.Finish(), path, snapshot);
+    for (const auto& dir : side_walker->TakeFailures()) {
+      cerr << "Can't read directory " << dir << '\n';
+    }
+    return true;
+  };
+
+  if (vm.count("diff")) {
+    const auto& sides = vm["diff"].as<std::vector<std::string>>();
+    Snapshot before(snapshot_options);
+    Snapshot after(snapshot_options);
+    if (!take_side(sides[0], nullptr, before) ||
+        !take_side(sides[1], &before, after)) {
+      return EXIT_FAILURE;
+    }
+
+    ReportWriter writer(cout, format, sloc);
+    writer.Begin();
+    ReportTotals totals{};
+    SlocInfo total_sloc{};
+    ReportTotals::Diff diff{};
+    // Changed files and their lines below each directory
+    std::map<std::string, std::pair<std::size_t, std::int64_t>> dirs;
+    umutech::count_lines::DiffSnapshots(
+        before, after,
+        [&](const Snapshot::File* old, const Snapshot::File* now) {
+          if (now) {
+            ++totals.files;
+            totals.lines += now->info.lines;
+            totals.column_limit =
+                std::max(totals.column_limit, now->info.column_limit);
+            if (now->sloc) {
+              total_sloc.code += now->sloc->code;
+              total_sloc.comment += now->sloc->comment;
+              total_sloc.blank += now->sloc->blank;
+            }
+          }
+          const Snapshot::File& file = now ? *now : *old;
+          FileChange change;
+          std::int64_t lines_delta = static_cast<std::int64_t>(
+              now ? now->info.lines : 0);
+          if (!old) {
+            change = FileChange::kAdded;
+            ++diff.added_files;
+          } else if (!now) {
+            change = FileChange::kRemoved;
+            lines_delta = -static_cast<std::int64_t>(old->info.lines);
+            ++diff.removed_files;
+          } else {
+            // Code, comment and blank only count if both sides have them
+            const bool same_sloc =
+                !old->sloc || !now->sloc ||
+                (old->sloc->code == now->sloc->code &&
+                 old->sloc->comment == now->sloc->comment &&
+                 old->sloc->blank == now->sloc->blank);
+            if (old->opened == now->opened &&
+                old->info.lines == now->info.lines &&
+                old->info.column_limit == now->info.column_limit &&
+                same_sloc) {
+              return;
+            }
+            change = FileChange::kModified;
+            lines_delta -= static_cast<std::int64_t>(old->info.lines);
+            ++diff.modified_files;
+          }
+          if (0 < lines_delta) {
+            diff.lines_added += static_cast<std::size_t>(lines_delta);
+          } else {
+            diff.lines_removed += static_cast<std::size_t>(-lines_delta);
+          }
+          writer.Change(change,
+                        {fs::path(std::string(file.name)), file.opened,
+                         file.info, file.sloc, false, {}, file.stamp},
+                        lines_delta);
+          for (auto slash = file.name.rfind('/');
+               0 != slash && std::string_view::npos != slash;
+               slash = file.name.rfind('/', slash - 1)) {
+            auto& [files, lines] = dirs[std::string(file.name, 0, slash)];
+            ++files;
+            lines += lines_delta;
+          }
+        });
+    for (const auto& [dir, change] : dirs) {
+      writer.DirectoryChange(dir, change.first, change.second);
+    }
+    if (sloc) {
+      totals.sloc = total_sloc;
+    }
+    totals.diff = diff;
+    if (cache) {
+      totals.cache_hits_misses.emplace(cache->hits(), cache->misses());
+    }
+    writer.Summary(totals);
+    writer.Flush();
+
+    if (vm.count("save-snapshot")) {
+      if (!after.Save(vm["save-snapshot"].as<std::string>())) {
+        cerr << "Can't write snapshot "
+             << vm["save-snapshot"].as<std::string>() << '\n';
+      }
+    }
+    if (cache) {
+      if (!cache->Save(vm["cache"].as<std::string>())) {
+        cerr << "Can't write cache " << vm["cache"].as<std::string>() << '\n';
+      }
+    }
+    return EXIT_SUCCESS;
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  // Files are counted while the walk goes on
+  const std::unique_ptr<DirWalker> walker_ptr = make_walker(counter);
+  DirWalker& walker = *walker_ptr;
+
+  // Archives and stdin are counted here, while the pool works on the walk
+  LineHistogram stream_histogram;
+  const auto count_stream = [&](FileStream& stream, const fs::path& name) {
+    if (tree) {
+      tree->MarkRoot(tree->Intern(name));
+    }
+    const StreamStatus status = umutech::count_lines::CountStream(
+        stream, name, count_options, &stream_histogram,
+        // Members can't be peeked at for a #! line
+        [&filter](const fs::path& member) {
+          const fs::path name = member.filename();
+          return filter.Matches(name.native()) &&
+                 !filter.NeedsShebang(name.native());
+        },
+        [&counter](CountedFile file) { counter.AddCounted(std::move(file)); });
+    switch (status) {
+      case StreamStatus::kCounted:
+        break;
+      case StreamStatus::kReadFailed:
+        cerr << "Can't read " << name << '\n';
+        break;
+      case StreamStatus::kBroken:
+        cerr << "Broken archive " << name << '\n';
+        break;
+      case StreamStatus::kUnsupported:
+        cerr << "Can't decompress " << name
+             << ", this build has no zlib or zstd for it\n";
+        break;
+    }
+  };
+
+  // The input directory of --save-snapshot
+  fs::path snapshot_root;
   if (vm.count("input")) {
     for (const auto& input : vm["input"].as<std::vector<std::string>>()) {
+      if ("-" == input) {
+        FileStream stream;
+        stream.OpenStdin();
+        count_stream(stream, input);
+        continue;
+      }
       fs::path path;
       if (absolute_path) {
+        Stats::ScopedTimer timer(Stats::Phase::kCanonical);
         path = fs::canonical(input);
       } else {
         path = input;
       }
       auto status = fs::status(path);
       if (!fs::exists(status)) {
-        cout << "File " << path << " doesn't exist!" << '\n';
+        (ReportFormat::kText == format ? cout : cerr)
+            << "File " << path << " doesn't exist!" << '\n';
         continue;
       }
 
       if (fs::is_directory(status)) {
-        for (const auto& child : fs::recursive_directory_iterator(path)) {
-          if (!fs::is_directory(child.status())) {
-            if (exts.contains(
-                    GetLowerCaseExtension(child.path().extension().string()))) {
-              filenames.insert(child.path());
-            } else {
-#if _DEBUG
-              cout << "Skip file " << child.path() << '\n';
-#endif
-            }
-          }
+        if (tree) {
+          tree->MarkRoot(tree->Intern(path));
+        }
+        if (watcher) {
+          watcher->AddRoot(path);
         }
-      } else if (exts.contains(
-                     GetLowerCaseExtension(path.extension().string()))) {
-        filenames.insert(path);
+        snapshot_root = path;
+        walker.Walk(path);
+      } else if (umutech::count_lines::IsArchiveName(path)) {
+        FileStream stream;
+        if (stream.Open(path)) {
+          count_stream(stream, path);
+        } else {
+          counter.Add(path);
+        }
+      } else if (const fs::path name = path.filename();
+                 filter.Matches(name.native()) &&
+                 (!filter.NeedsShebang(name.native()) ||
+                  filter.MatchesShebang(path))) {
+        counter.Add(path);
       } else {
+        Stats::Add(Stats::Counter::kFilesSkippedByExtension);
 #if _DEBUG
         cout << "Skip file " << path << '\n';
 #endif
@@ -195,24 +710,216 @@ int main(int argc, char* argv[]) try {
     }
   }
 
-  std::size_t total_files{0};
-  std::size_t total_lines{0};
-  std::size_t column_limit{};
-  for (const auto& filename : filenames) {
-    FileInfo info = CountLines(filename, ignore_empty);
-    ++total_files;
-    total_lines += info.lines;
-    if (column_limit < info.column_limit) {
-      column_limit = info.column_limit;
+  auto files = counter.Finish();
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  for (const auto& dir : walker.TakeFailures()) {
+    cerr << "Can't read directory " << dir << '\n';
+  }
+
+  std::optional<Stats::ScopedTimer> output_timer;
+  output_timer.emplace(Stats::Phase::kOutput);
+  ReportWriter writer(cout, format, sloc, dedupe);
+  writer.Begin();
+  ReportTotals totals{};
+  SlocInfo total_sloc{};
+  ReportTotals::Dedupe total_dedupe{};
+  std::size_t total_long_lines = 0;
+  const auto report_file = [&](const CountedFile& file) {
+    ++totals.files;
+    totals.lines += file.info.lines;
+    if (totals.column_limit < file.info.column_limit) {
+      totals.column_limit = file.info.column_limit;
+    }
+    if (file.duplicate) {
+      ++total_dedupe.duplicate_files;
+      total_dedupe.duplicate_lines += file.info.lines;
+    } else {
+      ++total_dedupe.unique_files;
+      total_dedupe.unique_lines += file.info.lines;
+    }
+    if (sloc && file.sloc) {
+      total_sloc.code += file.sloc->code;
+      total_sloc.comment += file.sloc->comment;
+      total_sloc.blank += file.sloc->blank;
+    }
+    if (!summary_only) {
+      writer.File(file);
+    } else if (!file.opened) {
+      cerr << "Can't open " << file.path << '\n';
+    }
+    total_long_lines += file.long_lines.size();
+    writer.LongLines(file);
+  };
+  for (const auto& file : files) {
+    report_file(file);
+  }
+  if (runs && !runs->Merge(report_file)) {
+    cerr << "Can't write or read the sorted runs of --memory\n";
+    return EXIT_FAILURE;
+  }
+
+  if (tree) {
+    tree->Reduce(pool.get());
+    for (const auto& row : tree->Report(depth, top)) {
+      writer.Directory(row);
     }
-    cout << "File " << filename << " has " << info.lines
-         << (1 < info.lines ? " lines" : " line") << ", column limit "
-         << info.column_limit << '\n';
   }
 
-  if (0 != total_files) {
-    cout << "Total files: " << total_files << "\nTotal lines: " << total_lines
-         << "\nColumnLimit: " << column_limit << '\n';
+  if (histogram) {
+    LineHistogram all = counter.histogram();
+    all.Merge(stream_histogram);
+    writer.Histogram(all);
+  }
+
+  if (sloc) {
+    totals.sloc = total_sloc;
+  }
+  if (0 != over) {
+    totals.long_lines = total_long_lines;
+  }
+  if (dedupe) {
+    totals.dedupe = total_dedupe;
+  }
+  if (0 < elapsed.count()) {
+    totals.files_per_second = totals.files / elapsed.count();
+  }
+  totals.throughput = stats || io_uring;
+  if (cache) {
+    totals.cache_hits_misses.emplace(cache->hits(), cache->misses());
+  }
+  writer.Summary(totals);
+  writer.Flush();
+  output_timer.reset();
+
+  if (stats) {
+    const std::chrono::duration<double> wall =
+        std::chrono::steady_clock::now() - start;
+    if (ReportFormat::kCsv == format) {
+      ReportWriter error_writer(cerr, ReportFormat::kText, sloc);
+      error_writer.Statistics(statistics, wall.count());
+      error_writer.Flush();
+    } else {
+      writer.Statistics(statistics, wall.count());
+      writer.Flush();
+    }
+  }
+  if (cache) {
+    if (!cache->Save(vm["cache"].as<std::string>())) {
+      cerr << "Can't write cache " << vm["cache"].as<std::string>() << '\n';
+    }
+  }
+  if (vm.count("save-snapshot")) {
+    Snapshot snapshot(snapshot_options);
+    fill_snapshot(files, snapshot_root, snapshot);
+    if (!snapshot.Save(vm["save-snapshot"].as<std::string>())) {
+      cerr << "Can't write snapshot " << vm["save-snapshot"].as<std::string>()
+           << '\n';
+    }
+  }
+
+  if (!watcher) {
+    return EXIT_SUCCESS;
+  }
+  if (0 != unwatched) {
+    cerr << "Can't watch " << unwatched
+         << " directories, see fs.inotify.max_user_watches\n";
+  }
+  // Changes that come within this of each other are one batch
+  static constexpr std::chrono::milliseconds kSettle(200);
+  LiveTotals live(sloc);
+  live.Reset(std::move(files));
+  while (!watcher->empty()) {
+    const std::vector<DirWatcher::Event> events = watcher->Wait(kSettle);
+    if (events.empty()) {
+      cerr << "Can't watch any more\n";
+      return EXIT_FAILURE;
+    }
+
+    // What is on disk now counts, so each directory is walked and each file
+    // counted once per batch, whatever happened to it in between
+    std::map<fs::path, std::size_t> rescans;
+    std::map<fs::path, std::pair<std::size_t, bool>> touched;
+    for (const auto& event : events) {
+      if (DirWatcher::kNoRoot == event.root) {
+        continue;
+      }
+      switch (event.change) {
+        case DirWatcher::Change::kFile:
+          touched[event.path] = {event.root, true};
+          // Other files may be ignored now, or not any more
+          if (respect_gitignore && ".gitignore" == event.path.filename()) {
+            rescans.emplace(event.path.parent_path(), event.root);
+          }
+          break;
+        case DirWatcher::Change::kFileRemoved:
+          touched[event.path] = {event.root, false};
+          break;
+        case DirWatcher::Change::kDirectoryRemoved:
+          watcher->Forget(event.path);
+          rescans.emplace(event.path, event.root);
+          break;
+        case DirWatcher::Change::kDirectory:
+          rescans.emplace(event.path, event.root);
+          break;
+        case DirWatcher::Change::kOverflow:
+          rescans.emplace(event.path, event.root);
+          break;
+      }
+    }
+
+    std::vector<LiveTotals::Change> changes;
+    for (const auto& [dir, root] : rescans) {
+      ParallelCounter rescan(count_options, pool.get());
+      if (io_uring) {
+        rescan.UseIoUring();
+      }
+      const std::unique_ptr<DirWalker> rescan_walker = make_walker(rescan);
+      boost::system::error_code ec;
+      if (fs::is_directory(dir, ec) &&
+          (dir == watcher->root(root) || !walker.Skips(watcher->root(root),
+                                                       dir, true))) {
+        rescan_walker->Walk(dir, watcher->root(root));
+      }
+      live.Replace(dir, rescan.Finish(), changes);
+    }
+
+    ParallelCounter recount(count_options, pool.get());
+    if (io_uring) {
+      recount.UseIoUring();
+    }
+    for (const auto& [path, change] : touched) {
+      const auto [root, exists] = change;
+      boost::system::error_code ec;
+      if (exists && !fs::is_directory(path, ec) &&
+          filter.Matches(path.filename().native()) && shebang_matches(path) &&
+          !walker.Skips(watcher->root(root), path, false)) {
+        recount.Add(path);
+      } else if (auto removed = live.Remove(path)) {
+        changes.push_back(std::move(*removed));
+      }
+    }
+    for (auto& file : recount.Finish()) {
+      if (auto updated = live.Update(std::move(file))) {
+        changes.push_back(std::move(*updated));
+      }
+    }
+
+    if (changes.empty()) {
+      continue;
+    }
+    std::stable_sort(changes.begin(), changes.end(),
+                     [](const auto& lhs, const auto& rhs) {
+                       return lhs.file.path < rhs.file.path;
+                     });
+    for (const auto& change : changes) {
+      writer.Change(change.kind, change.file, change.lines_delta);
+      if (FileChange::kRemoved != change.kind) {
+        writer.LongLines(change.file);
+      }
+    }
+    writer.Summary(live.Totals());
+    writer.Flush();
   }
 } catch (const std::exception& e) {
   cerr << "Error: " << e.what() << '\n';
@@ -0,0 +1,319 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+#include "line_counter.hpp"
+#include "thread_pool.hpp"
+
+namespace umutech::count_lines {
+
+// Lines, files and column limits per directory, summed up the tree. Every
+// directory is a node that refers to its parent and to an interned name,
+// so a tree of millions of files holds each directory once and each
+// distinct name ("src", "include", "detail", ...) once, instead of a map
+// keyed by full paths.
+//
+// Workers add files while they count them, straight into the node of the
+// directory, and Reduce() then sums the nodes bottom-up, one level at a
+// time, with the nodes of a level spread over the pool.
+class DirTree {
+ public:
+  using NodeId = std::uint32_t;
+  static constexpr NodeId kRoot = 0;
+
+  struct Totals {
+    std::uint64_t files;
+    std::uint64_t lines;
+    std::uint64_t column_limit;
+  };
+
+  DirTree();
+
+  // The node of a directory, created with its ancestors if needed. Thread
+  // safe; files of one directory tend to come in a row, so each thread
+  // remembers the last one.
+  NodeId Intern(const boost::filesystem::path& dir);
+
+  // A directory that was given as input; Report() starts at those
+  void MarkRoot(NodeId node);
+
+  // Thread safe. Lines and column limit may come in parts, e.g. chunk by
+  // chunk, since they add up or take the maximum.
+  void AddFile(NodeId node) noexcept {
+    At(node).files.fetch_add(1, std::memory_order_relaxed);
+  }
+  void AddLines(NodeId node, const FileInfo& info) noexcept;
+  // Takes back a file that was added twice; its column limit is the same as
+  // that of the other one, so it stays
+  void RemoveFile(NodeId node, const FileInfo& info) noexcept {
+    At(node).files.fetch_sub(1, std::memory_order_relaxed);
+    At(node).lines.fetch_sub(info.lines, std::memory_order_relaxed);
+  }
+
+  // Call it once everything is added; without a pool it runs right away
+  void Reduce(ThreadPool* pool);
+
+  struct Row {
+    std::string path;
+    // Below the input directory, which is 0
+    std::size_t depth;
+    Totals totals;
+  };
+
+  // The input directories and their subdirectories down to `depth` levels,
+  // ordered by path, or the `top` with most lines if that isn't 0
+  std::vector<Row> Report(std::size_t depth, std::size_t top) const;
+
+ private:
+  static constexpr unsigned kBlockBits = 16;
+  static constexpr std::size_t kBlockSize = std::size_t{1} << kBlockBits;
+  static constexpr std::size_t kMaxBlocks = std::size_t{1} << 16;
+  static constexpr NodeId kNone = ~NodeId{};
+
+  struct Node {
+    NodeId parent;
+    std::uint32_t name;
+    std::uint32_t depth;
+    NodeId first_child;
+    NodeId next_sibling;
+    bool root;
+    // Files right in the directory
+    std::atomic<std::uint64_t> files;
+    std::atomic<std::uint64_t> lines;
+    std::atomic<std::uint64_t> column_limit;
+    // Everything below, after Reduce()
+    Totals totals;
+  };
+
+  // Nodes live in fixed blocks that never move, so workers can update them
+  // while others are added
+  Node& At(NodeId id) noexcept {
+    return blocks_[id >> kBlockBits][id & (kBlockSize - 1)];
+  }
+  const Node& At(NodeId id) const noexcept {
+    return blocks_[id >> kBlockBits][id & (kBlockSize - 1)];
+  }
+
+  // Needs mutex_
+  NodeId Child(NodeId parent, const std::string& name);
+  std::string PathOf(NodeId id) const;
+
+  // Tells trees apart in the cache of Intern(), even at the same address
+  inline static std::atomic<std::uint64_t> serials_{0};
+  const std::uint64_t serial_ = ++serials_;
+
+  std::unique_ptr<std::unique_ptr<Node[]>[]> blocks_;
+  std::mutex mutex_;
+  std::uint32_t size_{};
+  std::unordered_map<std::string, std::uint32_t> name_ids_;
+  std::vector<const std::string*> names_;
+  // (parent << 32 | name) -> child
+  std::unordered_map<std::uint64_t, NodeId> children_;
+};
+
+inline DirTree::DirTree() : blocks_(new std::unique_ptr<Node[]>[kMaxBlocks]) {
+  blocks_[0].reset(new Node[kBlockSize]);
+  Node& root = At(kRoot);
+  root.parent = kNone;
+  root.name = 0;
+  root.depth = 0;
+  root.first_child = kNone;
+  root.next_sibling = kNone;
+  root.root = false;
+  names_.push_back(&name_ids_.emplace(std::string(), 0).first->first);
+  size_ = 1;
+}
+
+inline DirTree::NodeId DirTree::Intern(const boost::filesystem::path& dir) {
+  struct Last {
+    std::uint64_t serial;
+    boost::filesystem::path::string_type dir;
+    NodeId node;
+  };
+  thread_local Last last{0, {}, kRoot};
+  if (serial_ == last.serial && dir.native() == last.dir) {
+    return last.node;
+  }
+
+  NodeId node = kRoot;
+  {
+    std::lock_guard lock(mutex_);
+    for (const auto& component : dir) {
+      // "a/" and "a/." are "a", but "./a" keeps its "."
+      const std::string name = component.string();
+      if (kRoot != node && (name.empty() || "." == name)) {
+        continue;
+      }
+      node = Child(node, name);
+    }
+  }
+  last = {serial_, dir.native(), node};
+  return node;
+}
+
+inline DirTree::NodeId DirTree::Child(NodeId parent, const std::string& name) {
+  auto [name_it, new_name] =
+      name_ids_.emplace(name, static_cast<std::uint32_t>(names_.size()));
+  if (new_name) {
+    names_.push_back(&name_it->first);
+  }
+  const std::uint64_t key =
+      static_cast<std::uint64_t>(parent) << 32 | name_it->second;
+  auto [child_it, new_child] = children_.emplace(key, size_);
+  if (!new_child) {
+    return child_it->second;
+  }
+
+  const NodeId id = size_++;
+  if (0 == (id & (kBlockSize - 1))) {
+    if (kMaxBlocks <= (id >> kBlockBits)) {
+      throw std::length_error("Too many directories");
+    }
+    blocks_[id >> kBlockBits].reset(new Node[kBlockSize]);
+  }
+  Node& node = At(id);
+  Node& parent_node = At(parent);
+  node.parent = parent;
+  node.name = name_it->second;
+  node.depth = parent_node.depth + 1;
+  node.first_child = kNone;
+  node.next_sibling = parent_node.first_child;
+  node.root = false;
+  parent_node.first_child = id;
+  return id;
+}
+
+inline void DirTree::MarkRoot(NodeId node) {
+  std::lock_guard lock(mutex_);
+  At(node).root = true;
+}
+
+inline void DirTree::AddLines(NodeId node, const FileInfo& info) noexcept {
+  Node& n = At(node);
+  n.lines.fetch_add(info.lines, std::memory_order_relaxed);
+  std::uint64_t limit = n.column_limit.load(std::memory_order_relaxed);
+  while (limit < info.column_limit &&
+         !n.column_limit.compare_exchange_weak(limit, info.column_limit,
+                                               std::memory_order_relaxed)) {
+  }
+}
+
+inline void DirTree::Reduce(ThreadPool* pool) {
+  static constexpr std::size_t kTaskSize = 1024;
+
+  std::vector<std::vector<NodeId>> levels;
+  for (NodeId id = 0; id < size_; ++id) {
+    const std::size_t depth = At(id).depth;
+    if (levels.size() <= depth) {
+      levels.resize(depth + 1);
+    }
+    levels[depth].push_back(id);
+  }
+
+  const auto reduce = [this](const NodeId* begin, const NodeId* end) {
+    for (; begin != end; ++begin) {
+      Node& node = At(*begin);
+      Totals totals{node.files.load(std::memory_order_relaxed),
+                    node.lines.load(std::memory_order_relaxed),
+                    node.column_limit.load(std::memory_order_relaxed)};
+      for (NodeId child = node.first_child; kNone != child;
+           child = At(child).next_sibling) {
+        const Totals& sub = At(child).totals;
+        totals.files += sub.files;
+        totals.lines += sub.lines;
+        totals.column_limit = std::max(totals.column_limit, sub.column_limit);
+      }
+      node.totals = totals;
+    }
+  };
+
+  // A level only reads the totals of the one below, which is done
+  for (auto level = levels.rbegin(); level != levels.rend(); ++level) {
+    const NodeId* data = level->data();
+    const std::size_t size = level->size();
+    if (nullptr == pool || size <= kTaskSize) {
+      reduce(data, data + size);
+      continue;
+    }
+    for (std::size_t begin = 0; begin < size; begin += kTaskSize) {
+      const std::size_t end = std::min(size, begin + kTaskSize);
+      pool->Submit([&reduce, data, begin, end] {
+        reduce(data + begin, data + end);
+      });
+    }
+    pool->Wait();
+  }
+}
+
+inline std::string DirTree::PathOf(NodeId id) const {
+  std::vector<NodeId> chain;
+  for (; kRoot != id; id = At(id).parent) {
+    chain.push_back(id);
+  }
+  boost::filesystem::path path;
+  for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+    path /= *names_[At(*it).name];
+  }
+  return path.string();
+}
+
+inline std::vector<DirTree::Row> DirTree::Report(std::size_t depth,
+                                                 std::size_t top) const {
+  std::vector<Row> rows;
+  // Roots may nest, e.g. "a" and "a/b"; the outer one covers the inner
+  std::vector<std::pair<NodeId, std::size_t>> pending;
+  for (NodeId id = 0; id < size_; ++id) {
+    if (!At(id).root) {
+      continue;
+    }
+    bool nested = false;
+    for (NodeId up = At(id).parent; kNone != up; up = At(up).parent) {
+      nested = nested || At(up).root;
+    }
+    if (!nested) {
+      pending.emplace_back(id, 0);
+    }
+  }
+  while (!pending.empty()) {
+    const auto [id, level] = pending.back();
+    pending.pop_back();
+    rows.push_back({PathOf(id), level, At(id).totals});
+    if (level < depth) {
+      for (NodeId child = At(id).first_child; kNone != child;
+           child = At(child).next_sibling) {
+        pending.emplace_back(child, level + 1);
+      }
+    }
+  }
+
+  if (0 == top) {
+    std::sort(rows.begin(), rows.end(), [](const Row& lhs, const Row& rhs) {
+      return boost::filesystem::path(lhs.path) <
+             boost::filesystem::path(rhs.path);
+    });
+  } else {
+    const auto more_lines = [](const Row& lhs, const Row& rhs) {
+      return lhs.totals.lines != rhs.totals.lines
+                 ? lhs.totals.lines > rhs.totals.lines
+                 : lhs.path < rhs.path;
+    };
+    top = std::min(top, rows.size());
+    std::partial_sort(rows.begin(), rows.begin() + top, rows.end(),
+                      more_lines);
+    rows.resize(top);
+  }
+  return rows;
+}
+
+}  // namespace umutech::count_lines
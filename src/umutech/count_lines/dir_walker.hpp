@@ -0,0 +1,435 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#ifdef _WIN32
+#include <boost/nowide/convert.hpp>
+#endif
+
+#ifdef __linux__
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "gitignore.hpp"
+#include "stats.hpp"
+#include "thread_pool.hpp"
+
+namespace umutech::count_lines {
+
+// Walks directory trees and hands every file that passes the filter to a
+// sink, while the walk is still going. With a ThreadPool each directory is
+// a task of its own, so subdirectories fan out over all workers.
+//
+// Like boost::filesystem::recursive_directory_iterator, symbolic links to
+// directories aren't followed and everything that isn't a directory is a
+// file. On Linux directories are read with getdents64, and the d_type it
+// returns saves the stat per entry; only symbolic links and entries of
+// unknown type (some network file systems don't fill it in) are stat'ed.
+//
+// Ignored directories are pruned before they're opened, so nothing below
+// them costs a syscall.
+class DirWalker {
+ public:
+  using NameView = std::basic_string_view<boost::filesystem::path::value_type>;
+  // Gets the file name without its directory
+  using Filter = std::function<bool(NameView name)>;
+  using Sink = std::function<void(boost::filesystem::path)>;
+  // Gets every directory the walk enters, before it's read
+  using DirectorySink = std::function<void(const boost::filesystem::path&)>;
+
+  DirWalker(ThreadPool* pool, Filter filter, Sink sink)
+      : pool_(pool), filter_(std::move(filter)), sink_(std::move(sink)) {}
+
+  // Skips what git would ignore: .gitignore files, .git/info/exclude and
+  // the global excludes file. Only in git repositories.
+  void RespectGitignore() noexcept { respect_gitignore_ = true; }
+  // Skips what matches a gitignore(5) pattern, relative to the root given
+  // to Walk(). Wins over the .gitignore files.
+  void Exclude(std::string_view pattern) { excludes_.Add(pattern); }
+  void OnDirectory(DirectorySink sink) { directory_sink_ = std::move(sink); }
+
+  // Without a pool the walk is done when it returns, otherwise it goes on
+  // in the background until the pool is idle
+  void Walk(const boost::filesystem::path& root) { Walk(root, root); }
+  // Walks `dir`, a directory below `root`, the way the walk of `root` would
+  // get there, e.g. to catch up with a directory created since
+  void Walk(const boost::filesystem::path& dir,
+            const boost::filesystem::path& root);
+  // Whether the walk of `root` skips `path` below it, as --exclude or the
+  // .gitignore files have it. Loads the ignore files anew, so it's for
+  // single files that changed after the walk, not for the walk itself.
+  bool Skips(const boost::filesystem::path& root,
+             const boost::filesystem::path& path,
+             bool is_directory) const;
+
+  // Directories that couldn't be read, sorted. Call it once the walk is
+  // done.
+  std::vector<boost::filesystem::path> TakeFailures();
+
+ private:
+#ifdef __linux__
+  // Directories opened ahead for pending tasks hold a descriptor each, so
+  // a wide tree would run out of them; beyond this, tasks open by path
+  static constexpr int kMaxOpenDirs = 128;
+  static constexpr std::size_t kBufferSize = 64 << 10;
+
+  struct LinuxDirent64 {
+    std::uint64_t d_ino;
+    std::int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[256];
+  };
+#endif
+
+  struct Directory {
+    boost::filesystem::path path;
+    // Already opened with openat() by the parent, or -1
+    int fd;
+    // Whether to read .gitignore files, i.e. in a repository
+    bool gitignore = false;
+    std::shared_ptr<const IgnoreNode> ignores;
+    // Relative to the repository (or the root outside of one), with '/'
+    // separators and a trailing '/'. Only kept when ignoring anything.
+    std::string relative;
+    // Length of the root's prefix in `relative`
+    std::size_t root_size = 0;
+  };
+
+  // The filter, counted for --stats
+  bool Accept(NameView name) const {
+    Stats::Add(Stats::Counter::kFilesVisited);
+    if (filter_(name)) {
+      return true;
+    }
+    Stats::Add(Stats::Counter::kFilesSkippedByExtension);
+    return false;
+  }
+  bool Filtering(const Directory& dir) const noexcept {
+    return dir.gitignore || !excludes_.empty();
+  }
+  // `dir` below `root` with the ignore files of the directories above it
+  Directory Enter(const boost::filesystem::path& dir,
+                  const boost::filesystem::path& root) const;
+  // Appends `name` to the directory's path in `relative`
+  bool Ignored(const Directory& dir,
+               std::string_view name,
+               bool is_directory,
+               std::string& relative) const;
+  Directory Child(const Directory& parent,
+                  const boost::filesystem::path& path,
+                  int fd,
+                  std::string& relative) const;
+
+  void Spawn(Directory dir);
+  void Visit(Directory dir) noexcept;
+  void Fail(const boost::filesystem::path& dir);
+
+  ThreadPool* pool_;
+  Filter filter_;
+  Sink sink_;
+  DirectorySink directory_sink_;
+  bool respect_gitignore_ = false;
+  IgnoreList excludes_;
+  // Only used without a pool
+  std::vector<Directory> pending_;
+  std::mutex mutex_;
+  std::vector<boost::filesystem::path> failures_;
+#ifdef __linux__
+  std::atomic<int> open_dirs_{0};
+#endif
+};
+
+inline void DirWalker::Walk(const boost::filesystem::path& dir,
+                            const boost::filesystem::path& root) {
+  Spawn(Enter(dir, root));
+  if (nullptr == pool_) {
+    while (!pending_.empty()) {
+      Directory dir = std::move(pending_.back());
+      pending_.pop_back();
+      Visit(std::move(dir));
+    }
+  }
+}
+
+inline bool DirWalker::Skips(const boost::filesystem::path& root,
+                             const boost::filesystem::path& path,
+                             bool is_directory) const {
+  Directory parent = Enter(path.parent_path(), root);
+  if (!Filtering(parent)) {
+    return false;
+  }
+  if (std::string text;
+      parent.gitignore && ReadTextFile(parent.path / ".gitignore", text)) {
+    parent.ignores = ChainIgnoreFile(std::move(parent.ignores), text,
+                                     parent.relative.size());
+  }
+  std::string relative;
+  return Ignored(parent, path.filename().generic_string(), is_directory,
+                 relative);
+}
+
+inline std::vector<boost::filesystem::path> DirWalker::TakeFailures() {
+  std::lock_guard lock(mutex_);
+  std::sort(failures_.begin(), failures_.end());
+  return std::move(failures_);
+}
+
+inline bool DirWalker::Ignored(const Directory& dir,
+                               std::string_view name,
+                               bool is_directory,
+                               std::string& relative) const {
+  if (dir.gitignore && is_directory && ".git" == name) {
+    return true;
+  }
+  relative.assign(dir.relative).append(name);
+  if (!excludes_.empty()) {
+    const auto match = excludes_.Find(
+        std::string_view(relative).substr(dir.root_size), is_directory);
+    if (IgnoreList::Match::kIncluded == match) {
+      return false;
+    }
+    if (IgnoreList::Match::kIgnored == match) {
+      if (!is_directory) {
+        Stats::Add(Stats::Counter::kFilesIgnored);
+      }
+      return true;
+    }
+  }
+  if (!IsIgnored(dir.ignores.get(), relative, is_directory)) {
+    return false;
+  }
+  if (!is_directory) {
+    Stats::Add(Stats::Counter::kFilesIgnored);
+  }
+  return true;
+}
+
+inline DirWalker::Directory DirWalker::Enter(
+    const boost::filesystem::path& dir,
+    const boost::filesystem::path& root) const {
+  Directory entered;
+  entered.path = dir;
+  entered.fd = -1;
+  // Excludes are relative to the root
+  std::string below;
+  if (dir != root) {
+    below = dir.lexically_relative(root).generic_string();
+    below += '/';
+  }
+  if (respect_gitignore_) {
+    entered.gitignore =
+        LoadRepositoryIgnores(dir, entered.ignores, entered.relative);
+  }
+  if (entered.gitignore) {
+    entered.root_size = entered.relative.size() -
+                        std::min(below.size(), entered.relative.size());
+  } else {
+    entered.relative = std::move(below);
+  }
+  return entered;
+}
+
+inline DirWalker::Directory DirWalker::Child(
+    const Directory& parent,
+    const boost::filesystem::path& path,
+    int fd,
+    std::string& relative) const {
+  Directory dir;
+  dir.path = path;
+  dir.fd = fd;
+  dir.gitignore = parent.gitignore;
+  dir.ignores = parent.ignores;
+  if (Filtering(parent)) {
+    dir.relative = std::move(relative);
+    dir.relative += '/';
+    dir.root_size = parent.root_size;
+  }
+  return dir;
+}
+
+inline void DirWalker::Spawn(Directory dir) {
+  if (nullptr == pool_) {
+    pending_.push_back(std::move(dir));
+  } else {
+    pool_->Submit([this, dir = std::move(dir)]() mutable {
+      Visit(std::move(dir));
+    });
+  }
+}
+
+inline void DirWalker::Fail(const boost::filesystem::path& dir) {
+  std::lock_guard lock(mutex_);
+  failures_.push_back(dir);
+}
+
+#ifdef __linux__
+inline void DirWalker::Visit(Directory dir) noexcept {
+  Stats::ScopedTimer timer(Stats::Phase::kWalk);
+  Stats::Add(Stats::Counter::kDirectories);
+  int fd = dir.fd;
+  if (fd < 0) {
+    fd = ::open(dir.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+      Fail(dir.path);
+      return;
+    }
+  } else {
+    open_dirs_.fetch_sub(1, std::memory_order_relaxed);
+  }
+  if (directory_sink_) {
+    directory_sink_(dir.path);
+  }
+
+  const bool filtering = Filtering(dir);
+  std::string relative;
+  if (dir.gitignore) {
+    const int ignore_fd = ::openat(fd, ".gitignore", O_RDONLY | O_CLOEXEC);
+    if (0 <= ignore_fd) {
+      std::string text;
+      char chunk[4096];
+      for (ssize_t n; 0 < (n = ::read(ignore_fd, chunk, sizeof(chunk)));) {
+        text.append(chunk, static_cast<std::size_t>(n));
+      }
+      ::close(ignore_fd);
+      dir.ignores = ChainIgnoreFile(std::move(dir.ignores), text,
+                                    dir.relative.size());
+    }
+  }
+
+  // Tasks don't nest, so one buffer per thread is enough
+  alignas(LinuxDirent64) thread_local char buffer[kBufferSize];
+  for (;;) {
+    const long size = ::syscall(SYS_getdents64, fd, buffer, kBufferSize);
+    if (size < 0) {
+      Fail(dir.path);
+      break;
+    }
+    if (0 == size) {
+      break;
+    }
+    for (long offset = 0; offset < size;) {
+      const auto* entry =
+          reinterpret_cast<const LinuxDirent64*>(buffer + offset);
+      offset += entry->d_reclen;
+      const char* name = entry->d_name;
+      if ('.' == name[0] &&
+          ('\0' == name[1] || ('.' == name[1] && '\0' == name[2]))) {
+        continue;
+      }
+
+      bool is_directory = DT_DIR == entry->d_type;
+      // Links are accepted before they're followed, and only once
+      bool accepted = false;
+      if (DT_LNK == entry->d_type) {
+        // A link to a directory is neither followed nor counted
+        struct stat st;
+        if (!Accept(name) ||
+            (0 == ::fstatat(fd, name, &st, 0) && S_ISDIR(st.st_mode))) {
+          continue;
+        }
+        accepted = true;
+      } else if (DT_UNKNOWN == entry->d_type) {
+        struct stat st;
+        if (0 == ::fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+          if (S_ISLNK(st.st_mode)) {
+            if (!Accept(name) ||
+                (0 == ::fstatat(fd, name, &st, 0) && S_ISDIR(st.st_mode))) {
+              continue;
+            }
+            accepted = true;
+          } else {
+            is_directory = S_ISDIR(st.st_mode);
+          }
+        }
+      }
+
+      if (is_directory) {
+        if (filtering && Ignored(dir, name, true, relative)) {
+          continue;
+        }
+        int child = -1;
+        if (open_dirs_.load(std::memory_order_relaxed) < kMaxOpenDirs) {
+          child = ::openat(fd, name,
+                           O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+          if (0 <= child) {
+            open_dirs_.fetch_add(1, std::memory_order_relaxed);
+          }
+        }
+        Spawn(Child(dir, dir.path / name, child, relative));
+      } else if ((accepted || Accept(name)) &&
+                 !(filtering && Ignored(dir, name, false, relative))) {
+        sink_(dir.path / name);
+      }
+    }
+  }
+  ::close(fd);
+}
+#else
+inline void DirWalker::Visit(Directory dir) noexcept {
+  namespace fs = boost::filesystem;
+  Stats::ScopedTimer timer(Stats::Phase::kWalk);
+  Stats::Add(Stats::Counter::kDirectories);
+  const bool filtering = Filtering(dir);
+  std::string relative;
+  if (std::string text;
+      dir.gitignore && ReadTextFile(dir.path / ".gitignore", text)) {
+    dir.ignores =
+        ChainIgnoreFile(std::move(dir.ignores), text, dir.relative.size());
+  }
+  const auto ignored = [&](const fs::path& path, bool is_directory) {
+#ifdef _WIN32
+    const std::string name = boost::nowide::narrow(path.filename().native());
+#else
+    const std::string& name = path.filename().native();
+#endif
+    return filtering && Ignored(dir, name, is_directory, relative);
+  };
+
+  boost::system::error_code ec;
+  fs::directory_iterator it(dir.path, ec);
+  if (!ec && directory_sink_) {
+    directory_sink_(dir.path);
+  }
+  for (; !ec && it != fs::directory_iterator(); it.increment(ec)) {
+    const fs::path& path = it->path();
+    const fs::file_status status = it->symlink_status(ec);
+    if (ec) {
+      break;
+    }
+    if (fs::is_symlink(status)) {
+      if (Accept(path.filename().native()) &&
+          !fs::is_directory(it->status(ec)) && !ignored(path, false)) {
+        sink_(path);
+      }
+      ec.clear();
+    } else if (fs::is_directory(status)) {
+      if (!ignored(path, true)) {
+        Spawn(Child(dir, path, -1, relative));
+      }
+    } else if (Accept(path.filename().native()) && !ignored(path, false)) {
+      sink_(path);
+    }
+  }
+  if (ec) {
+    Fail(dir.path);
+  }
+}
+#endif
+
+}  // namespace umutech::count_lines
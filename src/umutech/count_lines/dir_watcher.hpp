@@ -0,0 +1,270 @@
+﻿#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <cerrno>
+#endif
+
+namespace umutech::count_lines {
+
+// Tells what changed in directory trees after they were walked, for
+// --watch. Every directory is watched on its own, as DirWalker enters it,
+// so ignored directories are never watched. Only Linux has it, through
+// inotify; elsewhere Open() fails.
+class DirWatcher {
+ public:
+  enum class Change {
+    // Created, written or moved in
+    kFile,
+    kFileRemoved,
+    // Created or moved in, with whatever it holds by now
+    kDirectory,
+    kDirectoryRemoved,
+    // Events were lost, so anything below the root may have changed
+    kOverflow,
+  };
+
+  struct Event {
+    Change change;
+    boost::filesystem::path path;
+    // Index of the root it's below, see AddRoot()
+    std::size_t root;
+  };
+
+  static constexpr std::size_t kNoRoot = ~std::size_t{};
+
+  DirWatcher() = default;
+  DirWatcher(const DirWatcher&) = delete;
+  DirWatcher& operator=(const DirWatcher&) = delete;
+  ~DirWatcher();
+
+  bool Open() noexcept;
+
+  // An input directory, before its walk; returns its index
+  std::size_t AddRoot(boost::filesystem::path root) {
+    roots_.push_back(std::move(root));
+    return roots_.size() - 1;
+  }
+  const boost::filesystem::path& root(std::size_t index) const noexcept {
+    return roots_[index];
+  }
+
+  // Thread safe, so a walk on a pool can call it. Returns false if the
+  // directory can't be watched, e.g. beyond fs.inotify.max_user_watches.
+  bool Watch(const boost::filesystem::path& dir);
+  // Stops watching `dir` and everything below, which moved away or is gone
+  void Forget(const boost::filesystem::path& dir);
+  // The innermost root `path` is in or below, or kNoRoot
+  std::size_t RootOf(const boost::filesystem::path& path) const noexcept;
+  bool empty() const noexcept { return dirs_.empty(); }
+
+  // Blocks until something changes, then collects what else changes until
+  // things are quiet for `settle`, so a checkout or a build comes as one
+  // batch; but no longer than ten times that, so a tree that never settles
+  // is still reported. Returns nothing on errors.
+  std::vector<Event> Wait(std::chrono::milliseconds settle);
+
+ private:
+  struct Watched {
+    boost::filesystem::path path;
+    std::size_t root;
+    // Given as input; nothing above it is watched
+    bool is_root;
+  };
+
+#ifdef __linux__
+  bool Read(std::vector<Event>& events);
+
+  int fd_ = -1;
+#endif
+  std::vector<boost::filesystem::path> roots_;
+  std::mutex mutex_;
+  // By inotify watch descriptor
+  std::unordered_map<int, Watched> dirs_;
+};
+
+// Whether `path` is `dir` or below it, by their spelling
+inline bool IsWithin(const boost::filesystem::path& path,
+                     const boost::filesystem::path& dir) noexcept {
+  using Char = boost::filesystem::path::value_type;
+  const auto& spelled = path.native();
+  auto prefix = std::basic_string_view<Char>(dir.native());
+  while (1 < prefix.size() &&
+         boost::filesystem::path::preferred_separator == prefix.back()) {
+    prefix.remove_suffix(1);
+  }
+  return spelled.starts_with(prefix) &&
+         (spelled.size() == prefix.size() ||
+          boost::filesystem::path::preferred_separator ==
+              spelled[prefix.size()] ||
+          boost::filesystem::path::preferred_separator == prefix.back());
+}
+
+inline std::size_t DirWatcher::RootOf(
+    const boost::filesystem::path& path) const noexcept {
+  std::size_t root = kNoRoot;
+  for (std::size_t i = 0; i < roots_.size(); ++i) {
+    if (IsWithin(path, roots_[i]) &&
+        (kNoRoot == root ||
+         roots_[root].native().size() < roots_[i].native().size())) {
+      root = i;
+    }
+  }
+  return root;
+}
+
+#ifdef __linux__
+inline DirWatcher::~DirWatcher() {
+  if (0 <= fd_) {
+    ::close(fd_);
+  }
+}
+
+inline bool DirWatcher::Open() noexcept {
+  fd_ = ::inotify_init1(IN_CLOEXEC);
+  return 0 <= fd_;
+}
+
+inline bool DirWatcher::Watch(const boost::filesystem::path& dir) {
+  static constexpr std::uint32_t kMask =
+      IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+      IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW;
+  const int wd = ::inotify_add_watch(fd_, dir.c_str(), kMask);
+  if (wd < 0) {
+    return false;
+  }
+  const std::size_t root = RootOf(dir);
+  std::lock_guard lock(mutex_);
+  // A directory moved within the tree keeps its descriptor
+  dirs_[wd] = {dir, root, kNoRoot != root && roots_[root] == dir};
+  return true;
+}
+
+inline void DirWatcher::Forget(const boost::filesystem::path& dir) {
+  std::lock_guard lock(mutex_);
+  for (auto it = dirs_.begin(); it != dirs_.end();) {
+    if (IsWithin(it->second.path, dir)) {
+      ::inotify_rm_watch(fd_, it->first);
+      it = dirs_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+inline std::vector<DirWatcher::Event> DirWatcher::Wait(
+    std::chrono::milliseconds settle) {
+  using Clock = std::chrono::steady_clock;
+  std::vector<Event> events;
+  pollfd poll_fd{fd_, POLLIN, 0};
+  int timeout = -1;
+  Clock::time_point deadline;
+  for (;;) {
+    const int ready = ::poll(&poll_fd, 1, timeout);
+    if (ready < 0 && EINTR == errno) {
+      continue;
+    }
+    if (0 == ready && events.empty()) {
+      // Only events of what isn't watched any more
+      timeout = -1;
+      continue;
+    }
+    if (ready <= 0 || !Read(events)) {
+      break;
+    }
+    if (timeout < 0) {
+      deadline = Clock::now() + 10 * settle;
+    } else if (deadline <= Clock::now()) {
+      break;
+    }
+    timeout = static_cast<int>(settle.count());
+  }
+  return events;
+}
+
+inline bool DirWatcher::Read(std::vector<Event>& events) {
+  alignas(inotify_event) char buffer[64 << 10];
+  const ssize_t size = ::read(fd_, buffer, sizeof(buffer));
+  if (size <= 0) {
+    return false;
+  }
+  std::lock_guard lock(mutex_);
+  for (ssize_t offset = 0; offset < size;) {
+    const auto* event = reinterpret_cast<const inotify_event*>(buffer + offset);
+    offset += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+    const std::uint32_t mask = event->mask;
+    if (mask & IN_Q_OVERFLOW) {
+      // Which roots lost events isn't known
+      for (std::size_t root = 0; root < roots_.size(); ++root) {
+        events.push_back({Change::kOverflow, roots_[root], root});
+      }
+      continue;
+    }
+    const auto it = dirs_.find(event->wd);
+    if (dirs_.end() == it) {
+      continue;
+    }
+    const Watched& watched = it->second;
+    if (mask & IN_IGNORED) {
+      dirs_.erase(it);
+      continue;
+    }
+    if (mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+      // Below a root, the parent tells about it
+      if (watched.is_root) {
+        events.push_back(
+            {Change::kDirectoryRemoved, watched.path, watched.root});
+      }
+      continue;
+    }
+    if (0 == event->len) {
+      continue;
+    }
+    boost::filesystem::path path = watched.path / event->name;
+    Change change;
+    if (mask & IN_ISDIR) {
+      change = mask & (IN_DELETE | IN_MOVED_FROM) ? Change::kDirectoryRemoved
+                                                  : Change::kDirectory;
+    } else {
+      change = mask & (IN_DELETE | IN_MOVED_FROM) ? Change::kFileRemoved
+                                                  : Change::kFile;
+    }
+    events.push_back({change, std::move(path), watched.root});
+  }
+  return true;
+}
+#else
+inline DirWatcher::~DirWatcher() = default;
+
+inline bool DirWatcher::Open() noexcept {
+  return false;
+}
+
+inline bool DirWatcher::Watch(const boost::filesystem::path&) {
+  return false;
+}
+
+inline void DirWatcher::Forget(const boost::filesystem::path&) {}
+
+inline std::vector<DirWatcher::Event> DirWatcher::Wait(
+    std::chrono::milliseconds) {
+  return {};
+}
+#endif
+
+}  // namespace umutech::count_lines
@@ -0,0 +1,156 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace umutech::count_lines {
+
+// How a file's text is stored, as its byte order mark tells. Files without
+// one are kUtf8, which covers any other 8-bit encoding too; only
+// --code-points reads them as UTF-8.
+enum class Encoding : std::uint8_t { kUnknown, kUtf8, kUtf16Le, kUtf16Be };
+
+constexpr const char* EncodingName(Encoding encoding) noexcept {
+  switch (encoding) {
+    case Encoding::kUtf8:
+      return "utf-8";
+    case Encoding::kUtf16Le:
+      return "utf-16le";
+    case Encoding::kUtf16Be:
+      return "utf-16be";
+    default:
+      return "unknown";
+  }
+}
+
+constexpr bool IsUtf16(Encoding encoding) noexcept {
+  return Encoding::kUtf16Le == encoding || Encoding::kUtf16Be == encoding;
+}
+
+struct ByteOrderMark {
+  Encoding encoding;
+  // Bytes of the mark itself, which aren't text
+  std::size_t size;
+};
+
+// The encoding the start of a file tells. Returns kUnknown while `data` is
+// the start of a mark but too short to tell, unless it's `complete`.
+inline ByteOrderMark DetectEncoding(const char* data,
+                                    std::size_t size,
+                                    bool complete) noexcept {
+  static constexpr struct {
+    const char* mark;
+    std::size_t size;
+    Encoding encoding;
+  } kMarks[] = {
+      {"\xEF\xBB\xBF", 3, Encoding::kUtf8},
+      {"\xFF\xFE", 2, Encoding::kUtf16Le},
+      {"\xFE\xFF", 2, Encoding::kUtf16Be},
+  };
+  for (const auto& mark : kMarks) {
+    const std::size_t common = std::min(size, mark.size);
+    if (0 != std::memcmp(data, mark.mark, common)) {
+      continue;
+    }
+    if (mark.size <= size) {
+      return {mark.encoding, mark.size};
+    }
+    if (!complete) {
+      return {Encoding::kUnknown, 0};
+    }
+  }
+  return {Encoding::kUtf8, 0};
+}
+
+// Where the line that holds data[from] ends, just past its newline, or
+// `size`. Splits files into chunks that count on their own; in UTF-16 only
+// a whole '\n' code unit ends a line.
+inline std::size_t FindLineEnd(const char* data,
+                               std::size_t size,
+                               std::size_t from,
+                               Encoding encoding) noexcept {
+  while (from < size) {
+    const void* found = std::memchr(data + from, '\n', size - from);
+    if (nullptr == found) {
+      break;
+    }
+    const auto at = static_cast<std::size_t>(static_cast<const char*>(found) -
+                                              data);
+    // Code units start at even offsets, after the mark too
+    if (Encoding::kUtf16Le == encoding) {
+      if (0 == at % 2 && at + 1 < size && '\0' == data[at + 1]) {
+        return at + 2;
+      }
+    } else if (Encoding::kUtf16Be == encoding) {
+      if (1 == at % 2 && '\0' == data[at - 1]) {
+        return at + 1;
+      }
+    } else {
+      return at + 1;
+    }
+    from = at + 1;
+  }
+  return size;
+}
+
+// Takes the byte order mark off a stream fed in blocks of any size, and
+// hands on the rest once the encoding is known. Only the first few bytes
+// are held back, and only while they may be a mark.
+class BomReader {
+ public:
+  Encoding encoding() const noexcept { return encoding_; }
+
+  // For data that doesn't start the file, e.g. a chunk in the middle
+  void Assume(Encoding encoding) noexcept { encoding_ = encoding; }
+
+  // Calls `consume(data, size)` with the text after the mark
+  template <typename Consume>
+  void Feed(const char* data, std::size_t size, Consume&& consume) {
+    if (Encoding::kUnknown != encoding_) {
+      consume(data, size);
+      return;
+    }
+    const std::size_t earlier = head_size_;
+    const std::size_t taken = std::min(size, sizeof(head_) - head_size_);
+    std::memcpy(head_ + head_size_, data, taken);
+    head_size_ += taken;
+    const ByteOrderMark mark = DetectEncoding(head_, head_size_, false);
+    if (Encoding::kUnknown == mark.encoding) {
+      return;
+    }
+    encoding_ = mark.encoding;
+    if (mark.size < earlier) {
+      consume(head_ + mark.size, earlier - mark.size);
+    }
+    const std::size_t skip = earlier < mark.size ? mark.size - earlier : 0;
+    if (skip < size) {
+      consume(data + skip, size - skip);
+    }
+  }
+
+  // At the end of a stream shorter than a mark
+  template <typename Consume>
+  void Finish(Consume&& consume) {
+    if (Encoding::kUnknown == encoding_) {
+      const ByteOrderMark mark = DetectEncoding(head_, head_size_, true);
+      encoding_ = mark.encoding;
+      if (mark.size < head_size_) {
+        consume(head_ + mark.size, head_size_ - mark.size);
+      }
+    }
+  }
+
+  void Reset() noexcept {
+    encoding_ = Encoding::kUnknown;
+    head_size_ = 0;
+  }
+
+ private:
+  Encoding encoding_{Encoding::kUnknown};
+  char head_[3]{};
+  std::size_t head_size_{};
+};
+
+}  // namespace umutech::count_lines
@@ -0,0 +1,891 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+#include "count_cache.hpp"
+#include "dir_tree.hpp"
+#include "encoding.hpp"
+#include "hash.hpp"
+#include "input_file.hpp"
+#include "language.hpp"
+#include "line_counter.hpp"
+#include "line_lengths.hpp"
+#include "sloc.hpp"
+#include "snapshot.hpp"
+#include "stats.hpp"
+#include "thread_pool.hpp"
+#include "uring_reader.hpp"
+
+namespace umutech::count_lines {
+
+// Returns std::nullopt if the file can't be opened
+inline std::optional<FileInfo> CountLines(
+    const boost::filesystem::path& filename,
+    bool ignore_empty) noexcept {
+  InputFile f;
+  if (!f.Open(filename)) {
+    return std::nullopt;
+  }
+
+  LineCounter counter(ignore_empty);
+  f.ForEachBlock([&counter](const char* data, std::size_t size) {
+    counter.Feed(data, size);
+  });
+  return counter.Finish();
+}
+
+struct CountOptions {
+  bool ignore_empty;
+  // Also split lines into code, comment and blank
+  bool sloc;
+  // Count files with the same content only once, see ParallelCounter
+  bool dedupe;
+  // Collect the lengths of all lines into ParallelCounter::histogram()
+  bool histogram;
+  // List the lines longer than this in CountedFile::long_lines, 0 for none
+  std::size_t over;
+  // Column limits in code points instead of bytes, see LineCounter
+  bool code_points;
+};
+
+struct CountedFile {
+  boost::filesystem::path path;
+  bool opened;
+  FileInfo info;
+  // Set with CountOptions::sloc, and on cache hits that have it
+  std::optional<SlocInfo> sloc;
+  // With CountOptions::dedupe: a file with the same content was counted, and
+  // these are its counts
+  bool duplicate;
+  // With CountOptions::over, in order
+  std::vector<LongLine> long_lines;
+  // With a cache, a snapshot or ParallelCounter::StampFiles(): how the file
+  // was before it was read
+  std::optional<FileStamp> stamp;
+};
+
+// Counts files on a ThreadPool, or right away in Add() without one. A file
+// of at least two chunks is mapped and cut into chunks that end right after
+// a '\n', so every chunk holds whole lines and can be counted on its own;
+// otherwise one huge file would keep a single worker busy long after the
+// others are done. The SLOC state machine needs the lines in order, so
+// files aren't split with CountOptions::sloc.
+//
+// With io_uring, files are queued in batches and each batch goes through
+// the ring of the thread that picks it up, which is worth it for trees of
+// many small files. Files that turn out to be large are counted the usual
+// way.
+//
+// With CountOptions::dedupe, files are hashed with XXH64 while they are
+// counted. As soon as the first kPrefixSize bytes are in, the file is
+// looked up by their length and hash: if an earlier file matches, the rest
+// is only hashed, not counted, and Finish() makes it a duplicate if the
+// full hashes match too, or counts it after all if they don't.
+//
+// With CountOptions::histogram, each task borrows a histogram that no other
+// task adds to at the same time, and Finish() adds them up.
+//
+// With StreamTo(), each file leaves as soon as its last chunk is counted,
+// and its entry is taken again by the next Add(), so the entries are those
+// in flight, not all files.
+class ParallelCounter {
+ public:
+  static constexpr std::uint64_t kChunkSize = 8 << 20;
+  static constexpr std::uint64_t kPrefixSize = 64 << 10;
+  // With StreamTo(), Add() counts on the calling thread while this many
+  // files are queued or counted, so a walk that outpaces the counting
+  // doesn't queue the whole tree
+  static constexpr std::size_t kMaxInFlight = 4096;
+#ifdef UMU_HAS_IO_URING
+  static constexpr std::size_t kBatchSize = 4 * UringReader::kDepth;
+#endif
+
+  // The pool may be shared with other work, such as a DirWalker
+  ParallelCounter(const CountOptions& options, ThreadPool* pool)
+      : options_(options), pool_(pool) {}
+
+  // Files whose FileStamp matches the cache aren't opened at all, and
+  // Finish() stores what it counted into the cache
+  void UseCache(CountCache* cache) noexcept { cache_ = cache; }
+
+  // Files whose size and mtime match their name below `root` in the
+  // snapshot aren't opened either. The snapshot must have been counted
+  // with the same CountOptions.
+  void UseSnapshot(const Snapshot* snapshot, boost::filesystem::path root) {
+    snapshot_ = snapshot;
+    snapshot_root_ = std::move(root);
+  }
+
+  // Fills in CountedFile::stamp even without a cache or a snapshot
+  void StampFiles() noexcept { stamp_ = true; }
+
+  // Each file is added to the node of its directory as soon as it's
+  // counted, chunk by chunk for split files. The caller reduces the tree
+  // after Finish().
+  void UseDirTree(DirTree* tree) noexcept { tree_ = tree; }
+
+  // Returns false if io_uring isn't available, then nothing changes
+  bool UseIoUring() noexcept;
+
+  // Hands each file to `sink` once it's counted, on the thread that counted
+  // it, instead of keeping it for Finish(); files added with AddCounted()
+  // go right through. Doesn't go with CountOptions::dedupe or a cache, which
+  // need all files at the end.
+  void StreamTo(std::function<void(CountedFile)> sink) {
+    sink_ = std::move(sink);
+  }
+
+  // Thread safe
+  void Add(boost::filesystem::path path);
+  // A file that was counted elsewhere, e.g. a member of an archive. Thread
+  // safe.
+  void AddCounted(CountedFile file);
+
+  // Waits for the pool to become idle. The result is sorted by path without
+  // duplicates, and lines and column limits of chunks are merged, so it
+  // doesn't depend on scheduling. With StreamTo() it's empty.
+  std::vector<CountedFile> Finish();
+
+  // Of all counted lines, after Finish()
+  const LineHistogram& histogram() const noexcept { return histogram_; }
+
+ private:
+  struct Entry {
+    CountedFile file;
+    std::vector<FileInfo> chunks;
+    // Only with CountOptions::over, per chunk
+    std::vector<LineObserver> chunk_observers;
+    // Only with a DirTree
+    DirTree::NodeId dir;
+    // Only with CountOptions::dedupe. An entry with an original is a copy
+    // until Finish() checks it.
+    bool hashed;
+    std::uint64_t hashed_size;
+    std::uint64_t hash;
+    Entry* original;
+    // The hashes didn't match, count it as it is
+    bool recount;
+    // Not counted yet, guarded by mutex_
+    std::size_t chunks_left;
+  };
+
+  struct PrefixKey {
+    std::uint64_t size;
+    std::uint64_t hash;
+    bool operator==(const PrefixKey&) const noexcept = default;
+  };
+  struct PrefixKeyHash {
+    std::size_t operator()(const PrefixKey& key) const noexcept {
+      return static_cast<std::size_t>(key.hash ^ key.size);
+    }
+  };
+
+  // A histogram for one task, or none without CountOptions::histogram
+  class Lease {
+   public:
+    explicit Lease(ParallelCounter& counter);
+    Lease(const Lease&) = delete;
+    Lease& operator=(const Lease&) = delete;
+    ~Lease();
+
+    LineHistogram* get() const noexcept { return histogram_.get(); }
+
+   private:
+    ParallelCounter& counter_;
+    std::unique_ptr<LineHistogram> histogram_;
+  };
+
+  // Hashes a file block by block while it's counted, and looks it up once
+  // the prefix is in
+  class Fingerprint {
+   public:
+    Fingerprint(ParallelCounter& counter, Entry& entry) noexcept
+        : counter_(counter), entry_(entry) {}
+
+    // Returns false if the block needn't be counted, as the file looks
+    // like a copy
+    bool Feed(const char* data, std::size_t size) noexcept;
+    // After the last block. Returns false for a copy.
+    bool Finish() noexcept;
+
+   private:
+    void Claim() noexcept;
+
+    ParallelCounter& counter_;
+    Entry& entry_;
+    Xxh64 hash_;
+    bool claimed_{};
+  };
+
+  void Count(Entry& entry) noexcept {
+    if (FromCache(entry)) {
+      Settled(entry);
+    } else {
+      CountFile(entry);
+    }
+  }
+  void Counted(const Entry& entry, const FileInfo& info) noexcept {
+    if (nullptr != tree_) {
+      tree_->AddLines(entry.dir, info);
+    }
+  }
+  bool Observing() const noexcept {
+    return options_.histogram || 0 != options_.over;
+  }
+  bool FromCache(Entry& entry) noexcept;
+  // Settles the entry, unless it's split into chunks; then the last one
+  // does
+  void CountFile(Entry& entry) noexcept;
+  // The counts of the entry are final. With a sink it's handed over and the
+  // entry is free for the next Add().
+  void Settled(Entry& entry) noexcept;
+  // Adds up the chunks of the entry into its file
+  static void JoinChunks(Entry& entry);
+  void MergeHistograms() noexcept;
+  // The entry that came first with this prefix, nullptr if that is `entry`
+  Entry* Claim(Entry& entry, const PrefixKey& key);
+  // Confirms copies by their full hashes, counts those that aren't, and
+  // marks all copies but the first by path as duplicates
+  void Deduplicate();
+  void CountBatch(std::vector<Entry*> batch) noexcept;
+
+  CountOptions options_;
+  std::mutex mutex_;
+  // std::deque doesn't move elements on push_back, so workers may write to
+  // an entry while others are added
+  std::deque<Entry> entries_;
+  ThreadPool* pool_;
+  CountCache* cache_{};
+  const Snapshot* snapshot_{};
+  boost::filesystem::path snapshot_root_;
+  bool stamp_{};
+  DirTree* tree_{};
+  bool io_uring_{};
+  // Guarded by mutex_
+  std::vector<Entry*> batch_;
+  std::function<void(CountedFile)> sink_;
+  // With a sink: settled entries to reuse, and the number of the others,
+  // both guarded by mutex_
+  std::vector<Entry*> free_;
+  std::size_t in_flight_{};
+  std::mutex prefixes_mutex_;
+  std::unordered_map<PrefixKey, Entry*, PrefixKeyHash> prefixes_;
+  std::mutex histograms_mutex_;
+  // Not lent out at the moment
+  std::vector<std::unique_ptr<LineHistogram>> histograms_;
+  LineHistogram histogram_;
+};
+
+inline ParallelCounter::Lease::Lease(ParallelCounter& counter)
+    : counter_(counter) {
+  if (!counter_.options_.histogram) {
+    return;
+  }
+  std::lock_guard lock(counter_.histograms_mutex_);
+  if (counter_.histograms_.empty()) {
+    histogram_ = std::make_unique<LineHistogram>();
+  } else {
+    histogram_ = std::move(counter_.histograms_.back());
+    counter_.histograms_.pop_back();
+  }
+}
+
+inline ParallelCounter::Lease::~Lease() {
+  if (histogram_) {
+    std::lock_guard lock(counter_.histograms_mutex_);
+    counter_.histograms_.push_back(std::move(histogram_));
+  }
+}
+
+inline bool ParallelCounter::Fingerprint::Feed(const char* data,
+                                               std::size_t size) noexcept {
+  if (!claimed_) {
+    const auto head = static_cast<std::size_t>(
+        std::min<std::uint64_t>(size, kPrefixSize - hash_.size()));
+    hash_.Update(data, head);
+    if (kPrefixSize == hash_.size()) {
+      Claim();
+    }
+    data += head;
+    size -= head;
+  }
+  hash_.Update(data, size);
+  return nullptr == entry_.original;
+}
+
+inline bool ParallelCounter::Fingerprint::Finish() noexcept {
+  // Files shorter than the prefix are looked up whole
+  if (!claimed_) {
+    Claim();
+  }
+  entry_.hashed = true;
+  entry_.hashed_size = hash_.size();
+  entry_.hash = hash_.Digest();
+  return nullptr == entry_.original;
+}
+
+inline void ParallelCounter::Fingerprint::Claim() noexcept {
+  claimed_ = true;
+  entry_.original = counter_.Claim(entry_, {hash_.size(), hash_.Digest()});
+}
+
+inline bool ParallelCounter::UseIoUring() noexcept {
+#ifdef UMU_HAS_IO_URING
+  io_uring_ = UringReader::Supported();
+#endif
+  return io_uring_;
+}
+
+inline void ParallelCounter::Add(boost::filesystem::path path) {
+  DirTree::NodeId dir = DirTree::kRoot;
+  if (nullptr != tree_) {
+    dir = tree_->Intern(path.parent_path());
+    tree_->AddFile(dir);
+  }
+  Entry added{{std::move(path), false, {}, std::nullopt, false, {},
+               std::nullopt},
+              {},
+              {},
+              dir,
+              false,
+              0,
+              0,
+              nullptr,
+              false,
+              0};
+  Entry* entry;
+  std::vector<Entry*> batch;
+  bool busy = false;
+  {
+    std::lock_guard lock(mutex_);
+    if (free_.empty()) {
+      entry = &entries_.emplace_back(std::move(added));
+    } else {
+      entry = free_.back();
+      free_.pop_back();
+      *entry = std::move(added);
+    }
+    if (sink_) {
+      busy = kMaxInFlight <= ++in_flight_;
+    }
+#ifdef UMU_HAS_IO_URING
+    if (io_uring_) {
+      batch_.push_back(entry);
+      if (batch_.size() < kBatchSize) {
+        return;
+      }
+      batch.swap(batch_);
+    }
+#endif
+  }
+  if (!batch.empty()) {
+    if (nullptr != pool_ && !busy) {
+      pool_->Submit([this, batch = std::move(batch)]() mutable {
+        CountBatch(std::move(batch));
+      });
+    } else {
+      CountBatch(std::move(batch));
+    }
+  } else if (nullptr != pool_ && !busy) {
+    pool_->Submit([this, entry] { Count(*entry); });
+  } else {
+    Count(*entry);
+  }
+}
+
+inline void ParallelCounter::AddCounted(CountedFile file) {
+  DirTree::NodeId dir = DirTree::kRoot;
+  if (nullptr != tree_) {
+    dir = tree_->Intern(file.path.parent_path());
+    tree_->AddFile(dir);
+    tree_->AddLines(dir, file.info);
+  }
+  if (sink_) {
+    sink_(std::move(file));
+    return;
+  }
+  std::lock_guard lock(mutex_);
+  entries_.emplace_back(
+      Entry{std::move(file), {}, {}, dir, false, 0, 0, nullptr, false, 0});
+}
+
+inline ParallelCounter::Entry* ParallelCounter::Claim(Entry& entry,
+                                                      const PrefixKey& key) {
+  std::lock_guard lock(prefixes_mutex_);
+  // A file left over from an io_uring batch is looked up again
+  Entry* first = prefixes_.emplace(key, &entry).first->second;
+  return &entry == first ? nullptr : first;
+}
+
+inline bool ParallelCounter::FromCache(Entry& entry) noexcept {
+  if (nullptr == cache_ && nullptr == snapshot_ && !stamp_) {
+    return false;
+  }
+  {
+    Stats::ScopedTimer timer(Stats::Phase::kStat);
+    FileStamp stamp;
+    if (StampFile(entry.file.path, stamp)) {
+      entry.file.stamp = stamp;
+    }
+  }
+  // Copies are found by content, and neither has line lengths, so then
+  // every file has to be read
+  if (!entry.file.stamp || options_.dedupe || Observing()) {
+    return false;
+  }
+  std::optional<CachedCounts> counts;
+  // The cache has no code points
+  if (nullptr != cache_ && !options_.code_points) {
+    counts = cache_->Find(entry.file.path, *entry.file.stamp,
+                          options_.ignore_empty, options_.sloc);
+  }
+  if (!counts && nullptr != snapshot_) {
+    counts = snapshot_->Find(SnapshotName(entry.file.path, snapshot_root_),
+                             *entry.file.stamp, options_.sloc);
+  }
+  if (!counts) {
+    return false;
+  }
+  entry.file.opened = true;
+  entry.file.info = counts->info;
+  entry.file.sloc = counts->sloc;
+  Counted(entry, entry.file.info);
+  return true;
+}
+
+inline void ParallelCounter::CountFile(Entry& entry) noexcept {
+  auto file = std::make_shared<InputFile>();
+  if (!file->Open(entry.file.path)) {
+    Settled(entry);
+    return;
+  }
+  entry.file.opened = true;
+  Stats::Add(Stats::Counter::kFilesCounted);
+
+  std::optional<Fingerprint> fingerprint;
+  if (options_.dedupe && !entry.recount) {
+    fingerprint.emplace(*this, entry);
+  }
+
+  if (nullptr == pool_ || options_.sloc || file->size() < 2 * kChunkSize ||
+      !file->Map()) {
+    LineCounter counter(options_.ignore_empty, options_.code_points);
+    const Lease lease(*this);
+    LineObserver observer(lease.get(), options_.over);
+    if (Observing()) {
+      counter.Observe(&observer);
+    }
+    if (options_.sloc) {
+      SlocCounter sloc(SyntaxFor(entry.file.path));
+      file->ForEachBlock([&](const char* data, std::size_t size) {
+        if (fingerprint && !fingerprint->Feed(data, size)) {
+          return;
+        }
+        Stats::ScopedTimer timer(Stats::Phase::kCount);
+        counter.Feed(data, size);
+        sloc.Feed(data, size);
+      });
+      entry.file.sloc = sloc.Finish();
+    } else {
+      file->ForEachBlock([&](const char* data, std::size_t size) {
+        if (fingerprint && !fingerprint->Feed(data, size)) {
+          return;
+        }
+        Stats::ScopedTimer timer(Stats::Phase::kCount);
+        counter.Feed(data, size);
+      });
+    }
+    if (fingerprint && !fingerprint->Finish()) {
+      Settled(entry);
+      return;
+    }
+    entry.file.info = counter.Finish();
+    entry.file.long_lines = std::move(observer.long_lines());
+    Counted(entry, entry.file.info);
+    Settled(entry);
+    return;
+  }
+
+  const char* data = file->data();
+  const auto size = static_cast<std::size_t>(file->size());
+  Stats::Add(Stats::Counter::kBytesRead, size);
+  // Hashing the mapping is cheap next to counting it in chunks
+  if (fingerprint) {
+    fingerprint->Feed(data, size);
+    if (!fingerprint->Finish()) {
+      Settled(entry);
+      return;
+    }
+  }
+  // Chunks after the first have no byte order mark to tell the encoding
+  const Encoding encoding = DetectEncoding(data, size, true).encoding;
+  std::vector<std::pair<std::size_t, std::size_t>> ranges;
+  for (std::size_t begin = 0; begin < size;) {
+    std::size_t end = size;
+    if (kChunkSize < size - begin) {
+      end = FindLineEnd(data, size, begin + kChunkSize - 1, encoding);
+    }
+    ranges.emplace_back(begin, end);
+    begin = end;
+  }
+
+  entry.chunks.resize(ranges.size());
+  {
+    std::lock_guard lock(mutex_);
+    entry.chunks_left = ranges.size();
+  }
+  if (0 != options_.over) {
+    entry.chunk_observers.assign(ranges.size(), LineObserver(nullptr, 0));
+  }
+  for (std::size_t i = 0; i < ranges.size(); ++i) {
+    pool_->Submit([this, file, &entry, i, range = ranges[i], encoding] {
+      Stats::ScopedTimer timer(Stats::Phase::kCount);
+      LineCounter counter(options_.ignore_empty, options_.code_points);
+      if (0 != i) {
+        counter.Assume(encoding);
+      }
+      // Line numbers are made whole in Finish(), once all chunks are in
+      const Lease lease(*this);
+      LineObserver observer(lease.get(), options_.over);
+      if (Observing()) {
+        counter.Observe(&observer);
+      }
+      counter.Feed(file->data() + range.first, range.second - range.first);
+      entry.chunks[i] = counter.Finish();
+      if (0 != options_.over) {
+        entry.chunk_observers[i] = std::move(observer);
+      }
+      Counted(entry, entry.chunks[i]);
+      bool last;
+      {
+        std::lock_guard lock(mutex_);
+        last = 0 == --entry.chunks_left;
+      }
+      if (last) {
+        Settled(entry);
+      }
+    });
+  }
+}
+
+inline void ParallelCounter::Settled(Entry& entry) noexcept {
+  if (!sink_) {
+    return;
+  }
+  JoinChunks(entry);
+  sink_(std::move(entry.file));
+  std::lock_guard lock(mutex_);
+  free_.push_back(&entry);
+  --in_flight_;
+}
+
+inline void ParallelCounter::JoinChunks(Entry& entry) {
+  for (const auto& chunk : entry.chunks) {
+    entry.file.info.lines += chunk.lines;
+    entry.file.info.column_limit =
+        std::max(entry.file.info.column_limit, chunk.column_limit);
+  }
+  // Chunks numbered their lines from 1
+  std::size_t first_line = 0;
+  for (auto& observer : entry.chunk_observers) {
+    for (const auto& line : observer.long_lines()) {
+      entry.file.long_lines.push_back({first_line + line.line, line.length});
+    }
+    first_line += observer.lines();
+  }
+}
+
+inline void ParallelCounter::MergeHistograms() noexcept {
+  for (const auto& histogram : histograms_) {
+    histogram_.Merge(*histogram);
+  }
+  histograms_.clear();
+}
+
+inline void ParallelCounter::CountBatch(std::vector<Entry*> batch) noexcept {
+#ifdef UMU_HAS_IO_URING
+  thread_local UringReader reader;
+  if (!reader.Init()) {
+    for (Entry* entry : batch) {
+      Count(*entry);
+    }
+    return;
+  }
+  std::erase_if(batch, [this](Entry* entry) {
+    if (!FromCache(*entry)) {
+      return false;
+    }
+    Settled(*entry);
+    return true;
+  });
+
+  struct Handler {
+    ParallelCounter& self;
+    const std::vector<Entry*>& batch;
+    std::vector<LineCounter> counters;
+    std::vector<LineObserver> observers;
+    // With CountOptions::histogram, of the files in flight. A file may
+    // be left to CountFile() after some blocks, so its lengths only go to
+    // `histogram` once it's read whole.
+    LineHistogram* histogram;
+    std::vector<std::unique_ptr<LineHistogram>> pending;
+    std::vector<std::unique_ptr<LineHistogram>> idle;
+    std::vector<std::optional<SlocCounter>> slocs;
+    std::vector<std::optional<Fingerprint>> fingerprints;
+    std::vector<std::uint64_t> sizes;
+    // Large or unreadable, left to CountFile()
+    std::vector<Entry*> rest;
+
+    const char* Path(std::size_t i) const noexcept {
+      return batch[i]->file.path.c_str();
+    }
+
+    bool Block(std::size_t i, const char* data, std::size_t size) {
+      sizes[i] += size;
+      if (InputFile::kMapThreshold <= sizes[i]) {
+        return false;
+      }
+      Stats::Add(Stats::Counter::kBytesRead, size);
+      if (fingerprints[i] && !fingerprints[i]->Feed(data, size)) {
+        return true;
+      }
+      Stats::ScopedTimer timer(Stats::Phase::kCount);
+      if (nullptr != histogram && !pending[i]) {
+        if (idle.empty()) {
+          pending[i] = std::make_unique<LineHistogram>();
+        } else {
+          pending[i] = std::move(idle.back());
+          idle.pop_back();
+        }
+        observers[i] = LineObserver(pending[i].get(), self.options_.over);
+      }
+      counters[i].Feed(data, size);
+      if (slocs[i]) {
+        slocs[i]->Feed(data, size);
+      }
+      return true;
+    }
+
+    void Done(std::size_t i, UringReader::Status status) {
+      Entry& entry = *batch[i];
+      if (!pending.empty() && pending[i]) {
+        if (UringReader::Status::kRead == status) {
+          histogram->Merge(*pending[i]);
+        }
+        pending[i]->Clear();
+        idle.push_back(std::move(pending[i]));
+      }
+      switch (status) {
+        case UringReader::Status::kRead:
+          Stats::Add(Stats::Counter::kFilesCounted);
+          entry.file.opened = true;
+          if (fingerprints[i] && !fingerprints[i]->Finish()) {
+            self.Settled(entry);
+            break;
+          }
+          entry.file.info = counters[i].Finish();
+          if (!observers.empty()) {
+            entry.file.long_lines = std::move(observers[i].long_lines());
+          }
+          if (slocs[i]) {
+            entry.file.sloc = slocs[i]->Finish();
+          }
+          self.Counted(entry, entry.file.info);
+          self.Settled(entry);
+          break;
+        case UringReader::Status::kOpenFailed:
+          self.Settled(entry);
+          break;
+        case UringReader::Status::kReadFailed:
+        case UringReader::Status::kStopped:
+          rest.push_back(&entry);
+          break;
+      }
+    }
+  } handler{*this, batch, {}, {}, nullptr, {}, {}, {}, {}, {}, {}};
+
+  handler.counters.assign(
+      batch.size(), LineCounter(options_.ignore_empty, options_.code_points));
+  const Lease lease(*this);
+  if (Observing()) {
+    handler.histogram = lease.get();
+    handler.pending.resize(batch.size());
+    handler.observers.assign(batch.size(),
+                             LineObserver(nullptr, options_.over));
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+      handler.counters[i].Observe(&handler.observers[i]);
+    }
+  }
+  handler.slocs.resize(batch.size());
+  if (options_.sloc) {
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+      handler.slocs[i].emplace(SyntaxFor(batch[i]->file.path));
+    }
+  }
+  handler.fingerprints.resize(batch.size());
+  if (options_.dedupe) {
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+      handler.fingerprints[i].emplace(*this, *batch[i]);
+    }
+  }
+  handler.sizes.assign(batch.size(), 0);
+  reader.ReadAll(batch.size(), handler);
+
+  for (Entry* entry : handler.rest) {
+    if (nullptr != pool_) {
+      pool_->Submit([this, entry] { CountFile(*entry); });
+    } else {
+      CountFile(*entry);
+    }
+  }
+#else
+  for (Entry* entry : batch) {
+    Count(*entry);
+  }
+#endif
+}
+
+inline void ParallelCounter::Deduplicate() {
+  // Entries that were counted, by their full content
+  std::unordered_map<PrefixKey, Entry*, PrefixKeyHash> contents;
+  for (auto& entry : entries_) {
+    if (entry.hashed && nullptr == entry.original) {
+      contents.emplace(PrefixKey{entry.hashed_size, entry.hash}, &entry);
+    }
+  }
+  // A prefix can be shared by several contents. Copies of none of them are
+  // counted after all.
+  bool recounted = false;
+  for (auto& entry : entries_) {
+    if (nullptr == entry.original) {
+      continue;
+    }
+    auto [it, inserted] =
+        contents.emplace(PrefixKey{entry.hashed_size, entry.hash}, &entry);
+    if (inserted) {
+      entry.original = nullptr;
+      entry.recount = true;
+      recounted = true;
+      CountFile(entry);
+    } else {
+      entry.original = it->second;
+    }
+  }
+  if (recounted && nullptr != pool_) {
+    pool_->Wait();
+  }
+
+  // Which copy comes first depends on scheduling, so the first by path is
+  // the one that isn't a duplicate
+  std::unordered_map<const Entry*, CountedFile*> firsts;
+  for (auto& entry : entries_) {
+    if (!entry.hashed) {
+      continue;
+    }
+    const Entry* original = entry.original ? entry.original : &entry;
+    auto [it, inserted] = firsts.emplace(original, &entry.file);
+    if (inserted) {
+      continue;
+    }
+    CountedFile*& first = it->second;
+    if (entry.file.path < first->path) {
+      first->duplicate = true;
+      first = &entry.file;
+    } else {
+      entry.file.duplicate = true;
+    }
+    Stats::Add(Stats::Counter::kDuplicateFiles);
+  }
+}
+
+inline std::vector<CountedFile> ParallelCounter::Finish() {
+  // Walkers may still add files while the pool drains, so batches keep
+  // coming until it's idle with none left
+  for (;;) {
+    if (nullptr != pool_) {
+      pool_->Wait();
+    }
+    std::vector<Entry*> batch;
+    {
+      std::lock_guard lock(mutex_);
+      batch.swap(batch_);
+    }
+    if (batch.empty()) {
+      break;
+    }
+    CountBatch(std::move(batch));
+  }
+
+  if (sink_) {
+    // Every entry went to the sink already
+    MergeHistograms();
+    entries_.clear();
+    free_.clear();
+    return {};
+  }
+
+  if (options_.dedupe) {
+    Deduplicate();
+  }
+
+  for (auto& entry : entries_) {
+    JoinChunks(entry);
+  }
+  MergeHistograms();
+
+  std::vector<CountedFile> files;
+  files.reserve(entries_.size());
+  for (auto& entry : entries_) {
+    if (const Entry* original = entry.original) {
+      entry.file.info = original->file.info;
+      entry.file.sloc = original->file.sloc;
+      entry.file.long_lines = original->file.long_lines;
+      Counted(entry, entry.file.info);
+    }
+    if (nullptr != cache_ && entry.file.stamp && entry.file.opened &&
+        !options_.code_points) {
+      cache_->Store(entry.file.path, *entry.file.stamp, options_.ignore_empty,
+                    {entry.file.info, entry.file.sloc});
+    }
+    files.push_back(std::move(entry.file));
+  }
+  entries_.clear();
+  prefixes_.clear();
+
+  // Of a file added twice, keep the one that isn't a duplicate
+  std::sort(files.begin(), files.end(),
+            [](const CountedFile& lhs, const CountedFile& rhs) {
+              const int order = lhs.path.compare(rhs.path);
+              return order < 0 || (0 == order && lhs.duplicate < rhs.duplicate);
+            });
+  files.erase(std::unique(files.begin(), files.end(),
+                          [this](const CountedFile& lhs,
+                                 const CountedFile& rhs) {
+                            if (lhs.path != rhs.path) {
+                              return false;
+                            }
+                            if (nullptr != tree_) {
+                              tree_->RemoveFile(
+                                  tree_->Intern(rhs.path.parent_path()),
+                                  rhs.info);
+                            }
+                            return true;
+                          }),
+              files.end());
+  return files;
+}
+
+}  // namespace umutech::count_lines
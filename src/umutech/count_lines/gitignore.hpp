@@ -0,0 +1,419 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstdlib>
+#include <ios>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/nowide/fstream.hpp>
+
+namespace umutech::count_lines {
+
+// The patterns of one ignore file (or --exclude list), compiled once.
+// Follows gitignore(5): '#' comments, '!' negation, a trailing '/' for
+// directories only, patterns with a '/' are anchored to the directory of
+// the file, and '*', '?', '[...]' and '**' wildcards. Most patterns are a
+// plain name or "*.ext", those are matched without the glob engine.
+class IgnoreList {
+ public:
+  enum class Match { kNone, kIgnored, kIncluded };
+
+  void Parse(std::string_view text);
+  void Add(std::string_view pattern);
+  bool empty() const noexcept { return patterns_.empty(); }
+
+  // `path` is relative to the directory of the ignore file, with '/'
+  // separators and without a trailing one. The last matching pattern
+  // decides.
+  Match Find(std::string_view path, bool is_directory) const noexcept;
+
+ private:
+  enum class Kind { kLiteral, kSuffix, kPrefix, kGlob };
+
+  struct Pattern {
+    std::string text;
+    Kind kind;
+    bool negated;
+    bool directory_only;
+    // Matched against the whole path instead of the last component
+    bool anchored;
+  };
+
+  static bool Glob(std::string_view pattern, std::string_view text) noexcept;
+  static bool MatchClass(std::string_view& pattern, char c) noexcept;
+
+  std::vector<Pattern> patterns_;
+};
+
+inline void IgnoreList::Parse(std::string_view text) {
+  while (!text.empty()) {
+    auto newline = text.find('\n');
+    if (std::string_view::npos == newline) {
+      newline = text.size();
+    }
+    Add(text.substr(0, newline));
+    text.remove_prefix(std::min(newline + 1, text.size()));
+  }
+}
+
+inline void IgnoreList::Add(std::string_view line) {
+  if (!line.empty() && '\r' == line.back()) {
+    line.remove_suffix(1);
+  }
+  // Trailing spaces don't count unless escaped
+  while (!line.empty() && ' ' == line.back() &&
+         !(2 <= line.size() && '\\' == line[line.size() - 2])) {
+    line.remove_suffix(1);
+  }
+  if (line.empty() || '#' == line.front()) {
+    return;
+  }
+
+  Pattern pattern{};
+  if ('!' == line.front()) {
+    pattern.negated = true;
+    line.remove_prefix(1);
+  } else if (line.starts_with("\\!") || line.starts_with("\\#")) {
+    line.remove_prefix(1);
+  }
+  if (!line.empty() && '/' == line.back()) {
+    pattern.directory_only = true;
+    line.remove_suffix(1);
+  }
+  if (line.starts_with("**/") &&
+      std::string_view::npos == line.find('/', 3)) {
+    // Same as the pattern without '/'. With more of them it stays a glob,
+    // which matches "**/" at any depth.
+    line.remove_prefix(3);
+  }
+  if (!line.empty() && '/' == line.front()) {
+    pattern.anchored = true;
+    line.remove_prefix(1);
+  }
+  if (line.empty()) {
+    return;
+  }
+  pattern.anchored =
+      pattern.anchored || std::string_view::npos != line.find('/');
+
+  const auto wildcard = line.find_first_of("*?[\\");
+  if (std::string_view::npos == wildcard) {
+    pattern.kind = Kind::kLiteral;
+    pattern.text = line;
+  } else if (0 == wildcard && '*' == line[0] &&
+             std::string_view::npos == line.find_first_of("*?[\\/", 1) &&
+             !pattern.anchored) {
+    pattern.kind = Kind::kSuffix;
+    pattern.text = line.substr(1);
+  } else if (line.size() - 1 == wildcard && '*' == line.back() &&
+             !pattern.anchored) {
+    pattern.kind = Kind::kPrefix;
+    pattern.text = line.substr(0, wildcard);
+  } else {
+    pattern.kind = Kind::kGlob;
+    pattern.text = line;
+  }
+  patterns_.push_back(std::move(pattern));
+}
+
+inline IgnoreList::Match IgnoreList::Find(std::string_view path,
+                                          bool is_directory) const noexcept {
+  const auto slash = path.rfind('/');
+  const std::string_view name =
+      std::string_view::npos == slash ? path : path.substr(slash + 1);
+  for (auto it = patterns_.rbegin(); it != patterns_.rend(); ++it) {
+    const Pattern& pattern = *it;
+    if (pattern.directory_only && !is_directory) {
+      continue;
+    }
+    const std::string_view subject = pattern.anchored ? path : name;
+    bool matched = false;
+    switch (pattern.kind) {
+      case Kind::kLiteral:
+        matched = subject == pattern.text;
+        break;
+      case Kind::kSuffix:
+        matched = subject.ends_with(pattern.text);
+        break;
+      case Kind::kPrefix:
+        matched = subject.starts_with(pattern.text);
+        break;
+      case Kind::kGlob:
+        matched = Glob(pattern.text, subject);
+        break;
+    }
+    if (matched) {
+      return pattern.negated ? Match::kIncluded : Match::kIgnored;
+    }
+  }
+  return Match::kNone;
+}
+
+inline bool IgnoreList::MatchClass(std::string_view& pattern,
+                                   char c) noexcept {
+  // pattern starts right after '['
+  std::size_t i = 0;
+  bool negated = false;
+  if (i < pattern.size() && ('!' == pattern[i] || '^' == pattern[i])) {
+    negated = true;
+    ++i;
+  }
+  bool matched = false;
+  bool first = true;
+  for (; i < pattern.size() && (first || ']' != pattern[i]); first = false) {
+    char low = pattern[i++];
+    if ('\\' == low && i < pattern.size()) {
+      low = pattern[i++];
+    }
+    char high = low;
+    if (i + 1 < pattern.size() && '-' == pattern[i] && ']' != pattern[i + 1]) {
+      high = pattern[i + 1];
+      i += 2;
+    }
+    matched = matched || (low <= c && c <= high);
+  }
+  pattern.remove_prefix(std::min(i + 1, pattern.size()));
+  return matched != negated;
+}
+
+inline bool IgnoreList::Glob(std::string_view pattern,
+                             std::string_view text) noexcept {
+  while (!pattern.empty()) {
+    const char p = pattern.front();
+    if ('*' == p) {
+      if (pattern.starts_with("**") &&
+          (2 == pattern.size() || '/' == pattern[2])) {
+        if (2 == pattern.size()) {
+          return true;
+        }
+        // "**/" matches zero or more whole directories
+        pattern.remove_prefix(3);
+        for (;;) {
+          if (Glob(pattern, text)) {
+            return true;
+          }
+          const auto slash = text.find('/');
+          if (std::string_view::npos == slash) {
+            return false;
+          }
+          text.remove_prefix(slash + 1);
+        }
+      }
+      pattern.remove_prefix(1);
+      for (;;) {
+        if (Glob(pattern, text)) {
+          return true;
+        }
+        if (text.empty() || '/' == text.front()) {
+          return false;
+        }
+        text.remove_prefix(1);
+      }
+    }
+    if (text.empty()) {
+      return false;
+    }
+    const char c = text.front();
+    if ('?' == p) {
+      if ('/' == c) {
+        return false;
+      }
+      pattern.remove_prefix(1);
+    } else if ('[' == p) {
+      pattern.remove_prefix(1);
+      if ('/' == c || !MatchClass(pattern, c)) {
+        return false;
+      }
+    } else {
+      if ('\\' == p && 1 < pattern.size()) {
+        pattern.remove_prefix(1);
+      }
+      if (pattern.front() != c) {
+        return false;
+      }
+      pattern.remove_prefix(1);
+    }
+    text.remove_prefix(1);
+  }
+  return text.empty();
+}
+
+// One ignore file in the chain from a directory up to the repository. The
+// paths it sees are relative to its directory, which is `base` bytes into
+// the path relative to the repository.
+struct IgnoreNode {
+  std::shared_ptr<const IgnoreNode> parent;
+  IgnoreList list;
+  std::size_t base;
+};
+
+// Deeper ignore files win over those above, and .gitignore files over
+// .git/info/exclude and the global excludes file, as in git.
+inline bool IsIgnored(const IgnoreNode* node,
+                      std::string_view path,
+                      bool is_directory) noexcept {
+  for (; nullptr != node; node = node->parent.get()) {
+    const auto match = node->list.Find(path.substr(node->base), is_directory);
+    if (IgnoreList::Match::kNone != match) {
+      return IgnoreList::Match::kIgnored == match;
+    }
+  }
+  return false;
+}
+
+inline std::shared_ptr<const IgnoreNode> ChainIgnoreFile(
+    std::shared_ptr<const IgnoreNode> parent,
+    std::string_view text,
+    std::size_t base) {
+  auto node = std::make_shared<IgnoreNode>();
+  node->list.Parse(text);
+  if (node->list.empty()) {
+    return parent;
+  }
+  node->parent = std::move(parent);
+  node->base = base;
+  return node;
+}
+
+inline bool ReadTextFile(const boost::filesystem::path& filename,
+                         std::string& text) {
+  boost::nowide::ifstream f(filename.string(), std::ios::binary);
+  if (!f) {
+    return false;
+  }
+  text.assign(std::istreambuf_iterator<char>(f),
+              std::istreambuf_iterator<char>());
+  return true;
+}
+
+// Where git looks for the global excludes file: core.excludesFile in
+// ~/.gitconfig, else $XDG_CONFIG_HOME/git/ignore or ~/.config/git/ignore
+inline boost::filesystem::path GlobalExcludesFile() {
+  namespace fs = boost::filesystem;
+#ifdef _WIN32
+  const char* home = std::getenv("USERPROFILE");
+#else
+  const char* home = std::getenv("HOME");
+#endif
+  std::string config;
+  if (nullptr != home && ReadTextFile(fs::path(home) / ".gitconfig", config)) {
+    bool in_core = false;
+    std::string_view rest(config);
+    while (!rest.empty()) {
+      auto newline = rest.find('\n');
+      std::string_view line = rest.substr(0, newline);
+      rest.remove_prefix(std::string_view::npos == newline ? rest.size()
+                                                           : newline + 1);
+      const auto begin = line.find_first_not_of(" \t");
+      if (std::string_view::npos == begin) {
+        continue;
+      }
+      line.remove_prefix(begin);
+      while (!line.empty() && std::string_view(" \t\r").find(line.back()) !=
+                                  std::string_view::npos) {
+        line.remove_suffix(1);
+      }
+      if ('[' == line.front()) {
+        in_core = line.size() >= 6 &&
+                  0 == line.substr(1, 4).compare("core") &&
+                  (']' == line[5] || ' ' == line[5]);
+        continue;
+      }
+      const auto equal = line.find('=');
+      if (!in_core || std::string_view::npos == equal) {
+        continue;
+      }
+      std::string key(line.substr(0, line.find_first_of(" \t=")));
+      for (auto& c : key) {
+        c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+      }
+      if ("excludesfile" != key) {
+        continue;
+      }
+      std::string_view value = line.substr(equal + 1);
+      value.remove_prefix(std::min(value.find_first_not_of(" \t"),
+                                   value.size()));
+      if (2 <= value.size() && '"' == value.front() && '"' == value.back()) {
+        value = value.substr(1, value.size() - 2);
+      }
+      if (value.starts_with("~/")) {
+        return fs::path(home) / std::string(value.substr(2));
+      }
+      return fs::path(std::string(value));
+    }
+  }
+
+  if (const char* xdg = std::getenv("XDG_CONFIG_HOME");
+      nullptr != xdg && '\0' != *xdg) {
+    return fs::path(xdg) / "git" / "ignore";
+  }
+  if (nullptr != home) {
+    return fs::path(home) / ".config" / "git" / "ignore";
+  }
+  return {};
+}
+
+// Sets up the ignore chain for a walk starting at `root`. Like git, only
+// works inside a repository and returns false otherwise. The chain gets
+// the global excludes, .git/info/exclude and the .gitignore files of the
+// directories from the repository down to the parent of `root`; `prefix`
+// becomes the path of `root` relative to the repository, with a trailing
+// '/'.
+inline bool LoadRepositoryIgnores(const boost::filesystem::path& root,
+                                  std::shared_ptr<const IgnoreNode>& chain,
+                                  std::string& prefix) {
+  namespace fs = boost::filesystem;
+  chain.reset();
+  prefix.clear();
+  boost::system::error_code ec;
+  const fs::path absolute = fs::weakly_canonical(fs::absolute(root), ec);
+  if (ec) {
+    return false;
+  }
+  fs::path repository;
+  for (fs::path dir = absolute; !dir.empty(); dir = dir.parent_path()) {
+    if (fs::exists(dir / ".git", ec)) {
+      repository = dir;
+      break;
+    }
+    if (dir == dir.root_path()) {
+      break;
+    }
+  }
+  if (repository.empty()) {
+    return false;
+  }
+
+  std::string text;
+  if (const fs::path global = GlobalExcludesFile();
+      !global.empty() && ReadTextFile(global, text)) {
+    chain = ChainIgnoreFile(std::move(chain), text, 0);
+  }
+  if (ReadTextFile(repository / ".git" / "info" / "exclude", text)) {
+    chain = ChainIgnoreFile(std::move(chain), text, 0);
+  }
+
+  fs::path dir = repository;
+  for (const auto& component : absolute.lexically_relative(repository)) {
+    if ("." == component) {
+      continue;
+    }
+    if (ReadTextFile(dir / ".gitignore", text)) {
+      chain = ChainIgnoreFile(std::move(chain), text, prefix.size());
+    }
+    dir /= component;
+    prefix += component.generic_string();
+    prefix += '/';
+  }
+  return true;
+}
+
+}  // namespace umutech::count_lines
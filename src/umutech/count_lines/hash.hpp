@@ -0,0 +1,195 @@
+﻿#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace umutech::count_lines {
+
+// XXH64 by Yann Collet, see https://github.com/Cyan4973/xxHash. Fast,
+// non-cryptographic, and its output is stable across platforms, so it can
+// be written to disk.
+class Xxh64 {
+ public:
+  static std::uint64_t Hash(const void* data,
+                            std::size_t size,
+                            std::uint64_t seed = 0) noexcept;
+
+  explicit Xxh64(std::uint64_t seed = 0) noexcept { Reset(seed); }
+
+  // Streaming: Update() with the data in pieces of any size gives the same
+  // Digest() as Hash() of it all. Digest() doesn't end the stream.
+  void Reset(std::uint64_t seed = 0) noexcept;
+  void Update(const void* data, std::size_t size) noexcept;
+  std::uint64_t Digest() const noexcept;
+  std::uint64_t size() const noexcept { return total_; }
+
+ private:
+  static constexpr std::uint64_t kPrime1 = 0x9E3779B185EBCA87ULL;
+  static constexpr std::uint64_t kPrime2 = 0xC2B2AE3D27D4EB4FULL;
+  static constexpr std::uint64_t kPrime3 = 0x165667B19E3779F9ULL;
+  static constexpr std::uint64_t kPrime4 = 0x85EBCA77C2B2AE63ULL;
+  static constexpr std::uint64_t kPrime5 = 0x27D4EB2F165667C5ULL;
+
+  static std::uint64_t Read64(const unsigned char* p) noexcept {
+    std::uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    if constexpr (std::endian::native == std::endian::big) {
+      v = ((v & 0x00000000000000FFULL) << 56) |
+          ((v & 0x000000000000FF00ULL) << 40) |
+          ((v & 0x0000000000FF0000ULL) << 24) |
+          ((v & 0x00000000FF000000ULL) << 8) |
+          ((v & 0x000000FF00000000ULL) >> 8) |
+          ((v & 0x0000FF0000000000ULL) >> 24) |
+          ((v & 0x00FF000000000000ULL) >> 40) |
+          ((v & 0xFF00000000000000ULL) >> 56);
+    }
+    return v;
+  }
+
+  static std::uint32_t Read32(const unsigned char* p) noexcept {
+    return static_cast<std::uint32_t>(p[0]) |
+           static_cast<std::uint32_t>(p[1]) << 8 |
+           static_cast<std::uint32_t>(p[2]) << 16 |
+           static_cast<std::uint32_t>(p[3]) << 24;
+  }
+
+  static std::uint64_t Round(std::uint64_t acc, std::uint64_t input) noexcept {
+    acc += input * kPrime2;
+    acc = std::rotl(acc, 31);
+    return acc * kPrime1;
+  }
+
+  static std::uint64_t MergeRound(std::uint64_t acc,
+                                  std::uint64_t val) noexcept {
+    acc ^= Round(0, val);
+    return acc * kPrime1 + kPrime4;
+  }
+
+  // Hashes what's left after the 32 byte stripes, and mixes the result
+  static std::uint64_t Finalize(std::uint64_t h,
+                                const unsigned char* p,
+                                const unsigned char* end) noexcept;
+
+  std::uint64_t v_[4];
+  std::uint64_t seed_;
+  std::uint64_t total_;
+  unsigned char buffer_[32];
+  std::size_t buffered_;
+};
+
+inline std::uint64_t Xxh64::Hash(const void* data,
+                                 std::size_t size,
+                                 std::uint64_t seed) noexcept {
+  const auto* p = static_cast<const unsigned char*>(data);
+  const unsigned char* const end = p + size;
+  std::uint64_t h;
+
+  if (32 <= size) {
+    const unsigned char* const limit = end - 32;
+    std::uint64_t v1 = seed + kPrime1 + kPrime2;
+    std::uint64_t v2 = seed + kPrime2;
+    std::uint64_t v3 = seed;
+    std::uint64_t v4 = seed - kPrime1;
+    do {
+      v1 = Round(v1, Read64(p));
+      v2 = Round(v2, Read64(p + 8));
+      v3 = Round(v3, Read64(p + 16));
+      v4 = Round(v4, Read64(p + 24));
+      p += 32;
+    } while (p <= limit);
+    h = std::rotl(v1, 1) + std::rotl(v2, 7) + std::rotl(v3, 12) +
+        std::rotl(v4, 18);
+    h = MergeRound(h, v1);
+    h = MergeRound(h, v2);
+    h = MergeRound(h, v3);
+    h = MergeRound(h, v4);
+  } else {
+    h = seed + kPrime5;
+  }
+
+  h += static_cast<std::uint64_t>(size);
+  return Finalize(h, p, end);
+}
+
+inline std::uint64_t Xxh64::Finalize(std::uint64_t h,
+                                     const unsigned char* p,
+                                     const unsigned char* end) noexcept {
+  for (; p + 8 <= end; p += 8) {
+    h ^= Round(0, Read64(p));
+    h = std::rotl(h, 27) * kPrime1 + kPrime4;
+  }
+  if (p + 4 <= end) {
+    h ^= static_cast<std::uint64_t>(Read32(p)) * kPrime1;
+    h = std::rotl(h, 23) * kPrime2 + kPrime3;
+    p += 4;
+  }
+  for (; p < end; ++p) {
+    h ^= static_cast<std::uint64_t>(*p) * kPrime5;
+    h = std::rotl(h, 11) * kPrime1;
+  }
+
+  h ^= h >> 33;
+  h *= kPrime2;
+  h ^= h >> 29;
+  h *= kPrime3;
+  h ^= h >> 32;
+  return h;
+}
+
+inline void Xxh64::Reset(std::uint64_t seed) noexcept {
+  seed_ = seed;
+  v_[0] = seed + kPrime1 + kPrime2;
+  v_[1] = seed + kPrime2;
+  v_[2] = seed;
+  v_[3] = seed - kPrime1;
+  total_ = 0;
+  buffered_ = 0;
+}
+
+inline void Xxh64::Update(const void* data, std::size_t size) noexcept {
+  const auto* p = static_cast<const unsigned char*>(data);
+  const unsigned char* const end = p + size;
+  total_ += size;
+
+  if (buffered_ + size < sizeof(buffer_)) {
+    std::memcpy(buffer_ + buffered_, p, size);
+    buffered_ += size;
+    return;
+  }
+  if (0 != buffered_) {
+    const std::size_t fill = sizeof(buffer_) - buffered_;
+    std::memcpy(buffer_ + buffered_, p, fill);
+    p += fill;
+    for (std::size_t i = 0; i < 4; ++i) {
+      v_[i] = Round(v_[i], Read64(buffer_ + 8 * i));
+    }
+    buffered_ = 0;
+  }
+  for (; p + 32 <= end; p += 32) {
+    v_[0] = Round(v_[0], Read64(p));
+    v_[1] = Round(v_[1], Read64(p + 8));
+    v_[2] = Round(v_[2], Read64(p + 16));
+    v_[3] = Round(v_[3], Read64(p + 24));
+  }
+  buffered_ = static_cast<std::size_t>(end - p);
+  std::memcpy(buffer_, p, buffered_);
+}
+
+inline std::uint64_t Xxh64::Digest() const noexcept {
+  std::uint64_t h;
+  if (32 <= total_) {
+    h = std::rotl(v_[0], 1) + std::rotl(v_[1], 7) + std::rotl(v_[2], 12) +
+        std::rotl(v_[3], 18);
+    for (const std::uint64_t v : v_) {
+      h = MergeRound(h, v);
+    }
+  } else {
+    h = seed_ + kPrime5;
+  }
+  h += total_;
+  return Finalize(h, buffer_, buffer_ + buffered_);
+}
+
+}  // namespace umutech::count_lines
@@ -0,0 +1,212 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include <boost/filesystem/path.hpp>
+
+#include "stats.hpp"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace umutech::count_lines {
+
+// Read-only view of a whole file. Large files are memory-mapped, small
+// ones (and those that can't be mapped) are read in large blocks into a
+// per-thread buffer, so no bytes are copied into per-line strings.
+class InputFile {
+ public:
+  // Below this size read() beats setting up and tearing down a mapping
+  static constexpr std::uint64_t kMapThreshold = 1 << 20;
+  static constexpr std::size_t kBlockSize = 1 << 18;
+
+  InputFile() = default;
+  InputFile(const InputFile&) = delete;
+  InputFile& operator=(const InputFile&) = delete;
+  ~InputFile() { Close(); }
+
+  bool Open(const boost::filesystem::path& filename) noexcept;
+  void Close() noexcept;
+
+  std::uint64_t size() const noexcept { return size_; }
+  // The whole file after a successful Map(), otherwise nullptr
+  const char* data() const noexcept { return view_; }
+
+  bool Map() noexcept;
+
+  // Calls visitor(const char* data, std::size_t size) for consecutive
+  // blocks of the file. Returns false if a read failed midway.
+  template <typename Visitor>
+  bool ForEachBlock(Visitor&& visitor) noexcept;
+
+ private:
+  // Returns the number of bytes read, 0 at the end of file and -1 on error
+  std::ptrdiff_t Read(char* buffer, std::size_t size) noexcept;
+
+  static char* Buffer() noexcept {
+    thread_local std::unique_ptr<char[]> buffer{new char[kBlockSize]};
+    return buffer.get();
+  }
+
+#ifdef _WIN32
+  HANDLE file_{INVALID_HANDLE_VALUE};
+#else
+  int file_{-1};
+#endif
+  std::uint64_t size_{};
+  const char* view_{};
+};
+
+inline bool InputFile::Open(const boost::filesystem::path& filename) noexcept {
+  Close();
+  Stats::ScopedTimer timer(Stats::Phase::kOpen);
+#ifdef _WIN32
+  file_ = ::CreateFileW(filename.c_str(), GENERIC_READ,
+                        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                        nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN,
+                        nullptr);
+  if (INVALID_HANDLE_VALUE == file_) {
+    return false;
+  }
+  LARGE_INTEGER size;
+  if (!::GetFileSizeEx(file_, &size)) {
+    Close();
+    return false;
+  }
+  size_ = static_cast<std::uint64_t>(size.QuadPart);
+#else
+  file_ = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (file_ < 0) {
+    return false;
+  }
+  struct stat st;
+  if (0 != ::fstat(file_, &st) || S_ISDIR(st.st_mode)) {
+    Close();
+    return false;
+  }
+  // Pipes and files under /proc report a size of 0, so only trust it for
+  // regular files
+  size_ = S_ISREG(st.st_mode) ? static_cast<std::uint64_t>(st.st_size) : 0;
+#endif
+  return true;
+}
+
+inline void InputFile::Close() noexcept {
+#ifdef _WIN32
+  if (nullptr != view_) {
+    ::UnmapViewOfFile(view_);
+  }
+  if (INVALID_HANDLE_VALUE != file_) {
+    ::CloseHandle(file_);
+    file_ = INVALID_HANDLE_VALUE;
+  }
+#else
+  if (nullptr != view_) {
+    ::munmap(const_cast<char*>(view_), static_cast<std::size_t>(size_));
+  }
+  if (0 <= file_) {
+    ::close(file_);
+    file_ = -1;
+  }
+#endif
+  view_ = nullptr;
+  size_ = 0;
+}
+
+inline bool InputFile::Map() noexcept {
+  if (nullptr != view_) {
+    return true;
+  }
+  // A multi-GB file doesn't fit into a 32-bit address space
+  if (size_ != static_cast<std::size_t>(size_)) {
+    return false;
+  }
+  Stats::ScopedTimer timer(Stats::Phase::kOpen);
+#ifdef _WIN32
+  HANDLE mapping =
+      ::CreateFileMappingW(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (nullptr == mapping) {
+    return false;
+  }
+  view_ = static_cast<const char*>(
+      ::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+  // The view keeps the mapping object alive
+  ::CloseHandle(mapping);
+  return nullptr != view_;
+#else
+  void* view = ::mmap(nullptr, static_cast<std::size_t>(size_), PROT_READ,
+                      MAP_PRIVATE, file_, 0);
+  if (MAP_FAILED == view) {
+    return false;
+  }
+  ::madvise(view, static_cast<std::size_t>(size_), MADV_SEQUENTIAL);
+  view_ = static_cast<const char*>(view);
+  return true;
+#endif
+}
+
+inline std::ptrdiff_t InputFile::Read(char* buffer, std::size_t size) noexcept {
+  Stats::ScopedTimer timer(Stats::Phase::kRead);
+#ifdef _WIN32
+  DWORD bytes_read = 0;
+  if (!::ReadFile(file_, buffer, static_cast<DWORD>(size), &bytes_read,
+                  nullptr)) {
+    return -1;
+  }
+  return static_cast<std::ptrdiff_t>(bytes_read);
+#else
+  for (;;) {
+    const ssize_t bytes_read = ::read(file_, buffer, size);
+    if (0 <= bytes_read || EINTR != errno) {
+      return bytes_read;
+    }
+  }
+#endif
+}
+
+template <typename Visitor>
+bool InputFile::ForEachBlock(Visitor&& visitor) noexcept {
+  if (kMapThreshold <= size_ && Map()) {
+    Stats::Add(Stats::Counter::kBytesRead, size_);
+    // Hand the mapping out in blocks too, so visitors see bounded spans
+    for (std::uint64_t offset = 0; offset < size_; offset += kBlockSize) {
+      const auto size = static_cast<std::size_t>(
+          std::min<std::uint64_t>(kBlockSize, size_ - offset));
+      visitor(view_ + offset, size);
+    }
+    return true;
+  }
+
+  char* buffer = Buffer();
+  for (;;) {
+    const std::ptrdiff_t bytes_read = Read(buffer, kBlockSize);
+    if (bytes_read < 0) {
+      return false;
+    }
+    if (0 == bytes_read) {
+      return true;
+    }
+    Stats::Add(Stats::Counter::kBytesRead,
+               static_cast<std::uint64_t>(bytes_read));
+    visitor(static_cast<const char*>(buffer),
+            static_cast<std::size_t>(bytes_read));
+  }
+}
+
+}  // namespace umutech::count_lines
@@ -0,0 +1,546 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include <boost/algorithm/string/case_conv.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/nowide/cstdio.hpp>
+
+#include "sloc.hpp"
+
+namespace umutech::count_lines {
+
+// Extensions match case-insensitively, except ".C", which is C++ and not C
+inline std::string GetLowerCaseExtension(std::string ext) {
+  if (ext != ".C") {
+    boost::algorithm::to_lower(ext);
+  }
+  return ext;
+}
+
+enum class Language : std::uint8_t {
+  kUnknown,
+  kAssembly,
+  kC,
+  kClojure,
+  kCMake,
+  kCpp,
+  kCSharp,
+  kCss,
+  kCuda,
+  kDart,
+  kEmacsLisp,
+  kErlang,
+  kGo,
+  kHaskell,
+  kHtml,
+  kIni,
+  kJava,
+  kJavaScript,
+  kKotlin,
+  kLess,
+  kLisp,
+  kLua,
+  kMakefile,
+  kMsBuild,
+  kObjectiveC,
+  kObjectiveCpp,
+  kPerl,
+  kPhp,
+  kPowerShell,
+  kPython,
+  kR,
+  kRuby,
+  kRust,
+  kScala,
+  kScheme,
+  kScss,
+  kShell,
+  kSql,
+  kSwift,
+  kTex,
+  kToml,
+  kTypeScript,
+  kXml,
+  kYaml,
+  kLanguages,
+};
+
+struct LanguageInfo {
+  Language language;
+  // As --lang takes it
+  std::string_view name;
+  const Syntax* syntax;
+};
+
+struct ExtensionInfo {
+  // With the dot. Spellings with upper case letters match only as they are,
+  // all others match in any case.
+  std::string_view extension;
+  Language language;
+};
+
+namespace language {
+
+using namespace syntax;
+
+// In the order of Language
+inline constexpr LanguageInfo kLanguages[] = {
+    {Language::kUnknown, "unknown", &kPlain},
+    {Language::kAssembly, "assembly", &kSemicolon},
+    {Language::kC, "c", &kCpp},
+    {Language::kClojure, "clojure", &kSemicolon},
+    {Language::kCMake, "cmake", &kHash},
+    {Language::kCpp, "cpp", &kCpp},
+    {Language::kCSharp, "csharp", &kCLike},
+    {Language::kCss, "css", &kCss},
+    {Language::kCuda, "cuda", &kCpp},
+    {Language::kDart, "dart", &kCLike},
+    {Language::kEmacsLisp, "elisp", &kSemicolon},
+    {Language::kErlang, "erlang", &kPercent},
+    {Language::kGo, "go", &kJavaScript},
+    {Language::kHaskell, "haskell", &kHaskell},
+    {Language::kHtml, "html", &kMarkup},
+    {Language::kIni, "ini", &kIni},
+    {Language::kJava, "java", &kCLike},
+    {Language::kJavaScript, "javascript", &kJavaScript},
+    {Language::kKotlin, "kotlin", &kCLike},
+    {Language::kLess, "less", &kCLike},
+    {Language::kLisp, "lisp", &kSemicolon},
+    {Language::kLua, "lua", &kLua},
+    {Language::kMakefile, "makefile", &kHash},
+    {Language::kMsBuild, "msbuild", &kMarkup},
+    {Language::kObjectiveC, "objc", &kCpp},
+    {Language::kObjectiveCpp, "objcpp", &kCpp},
+    {Language::kPerl, "perl", &kHash},
+    {Language::kPhp, "php", &kPhp},
+    {Language::kPowerShell, "powershell", &kPowerShell},
+    {Language::kPython, "python", &kPython},
+    {Language::kR, "r", &kHash},
+    {Language::kRuby, "ruby", &kHash},
+    {Language::kRust, "rust", &kRust},
+    {Language::kScala, "scala", &kCLike},
+    {Language::kScheme, "scheme", &kSemicolon},
+    {Language::kScss, "scss", &kCLike},
+    {Language::kShell, "shell", &kHash},
+    {Language::kSql, "sql", &kSql},
+    {Language::kSwift, "swift", &kCLike},
+    {Language::kTex, "tex", &kPercent},
+    {Language::kToml, "toml", &kHash},
+    {Language::kTypeScript, "typescript", &kJavaScript},
+    {Language::kXml, "xml", &kMarkup},
+    {Language::kYaml, "yaml", &kHash},
+};
+
+inline constexpr ExtensionInfo kExtensions[] = {
+    {".asm", Language::kAssembly},
+    {".bash", Language::kShell},
+    {".c", Language::kC},
+    {".C", Language::kCpp},
+    {".c++", Language::kCpp},
+    {".cc", Language::kCpp},
+    {".cjs", Language::kJavaScript},
+    {".clj", Language::kClojure},
+    {".cmake", Language::kCMake},
+    {".cpp", Language::kCpp},
+    {".cppm", Language::kCpp},
+    {".cs", Language::kCSharp},
+    {".css", Language::kCss},
+    {".cu", Language::kCuda},
+    {".cuh", Language::kCuda},
+    {".cxx", Language::kCpp},
+    {".dart", Language::kDart},
+    {".el", Language::kEmacsLisp},
+    {".erl", Language::kErlang},
+    {".go", Language::kGo},
+    {".h", Language::kCpp},
+    {".h++", Language::kCpp},
+    {".hh", Language::kCpp},
+    {".hpp", Language::kCpp},
+    {".hs", Language::kHaskell},
+    {".htm", Language::kHtml},
+    {".html", Language::kHtml},
+    {".hxx", Language::kCpp},
+    {".ini", Language::kIni},
+    {".inl", Language::kCpp},
+    {".ipp", Language::kCpp},
+    {".ixx", Language::kCpp},
+    {".java", Language::kJava},
+    {".js", Language::kJavaScript},
+    {".jsx", Language::kJavaScript},
+    {".kt", Language::kKotlin},
+    {".kts", Language::kKotlin},
+    {".less", Language::kLess},
+    {".lisp", Language::kLisp},
+    {".lua", Language::kLua},
+    {".m", Language::kObjectiveC},
+    {".mjs", Language::kJavaScript},
+    {".mk", Language::kMakefile},
+    {".mm", Language::kObjectiveCpp},
+    {".php", Language::kPhp},
+    {".pl", Language::kPerl},
+    {".pm", Language::kPerl},
+    {".props", Language::kMsBuild},
+    {".ps1", Language::kPowerShell},
+    {".psm1", Language::kPowerShell},
+    {".py", Language::kPython},
+    {".pyi", Language::kPython},
+    {".r", Language::kR},
+    {".rb", Language::kRuby},
+    {".rs", Language::kRust},
+    {".scala", Language::kScala},
+    {".scm", Language::kScheme},
+    {".scss", Language::kScss},
+    {".sh", Language::kShell},
+    {".slnx", Language::kMsBuild},
+    {".sql", Language::kSql},
+    {".svg", Language::kXml},
+    {".swift", Language::kSwift},
+    {".targets", Language::kMsBuild},
+    {".tex", Language::kTex},
+    {".tlh", Language::kCpp},
+    {".tli", Language::kCpp},
+    {".toml", Language::kToml},
+    {".ts", Language::kTypeScript},
+    {".tsx", Language::kTypeScript},
+    {".vcxproj", Language::kMsBuild},
+    {".xaml", Language::kXml},
+    {".xml", Language::kXml},
+    {".yaml", Language::kYaml},
+    {".yml", Language::kYaml},
+    {".zsh", Language::kShell},
+};
+
+// Interpreters of "#!" lines, without version suffixes
+struct Interpreter {
+  std::string_view name;
+  Language language;
+};
+
+inline constexpr Interpreter kInterpreters[] = {
+    {"ash", Language::kShell},       {"bash", Language::kShell},
+    {"dash", Language::kShell},      {"ksh", Language::kShell},
+    {"lua", Language::kLua},         {"luajit", Language::kLua},
+    {"node", Language::kJavaScript}, {"nodejs", Language::kJavaScript},
+    {"perl", Language::kPerl},       {"php", Language::kPhp},
+    {"pwsh", Language::kPowerShell}, {"python", Language::kPython},
+    {"Rscript", Language::kR},       {"ruby", Language::kRuby},
+    {"sh", Language::kShell},        {"zsh", Language::kShell},
+};
+
+inline constexpr std::size_t kMaxExtensionSize = 16;
+
+// FNV-1a; the seed is picked at compile time so that no two extensions
+// share a slot
+constexpr std::uint32_t Hash(std::string_view text,
+                             std::uint32_t seed) noexcept {
+  std::uint32_t h = 2166136261u ^ seed;
+  for (const char c : text) {
+    h = (h ^ static_cast<unsigned char>(c)) * 16777619u;
+  }
+  return h ^ (h >> 16);
+}
+
+struct PerfectHash {
+  static constexpr std::size_t kSlots = 1024;
+
+  std::uint32_t seed;
+  // Index into kExtensions plus 1, 0 if empty
+  std::array<std::uint8_t, kSlots> slots;
+
+  constexpr std::size_t Slot(std::string_view extension) const noexcept {
+    return Hash(extension, seed) & (kSlots - 1);
+  }
+};
+
+consteval std::optional<PerfectHash> BuildPerfectHash() {
+  for (std::uint32_t seed = 0; seed < 10000; ++seed) {
+    PerfectHash table{seed, {}};
+    bool collision = false;
+    for (std::size_t i = 0; i < std::size(kExtensions) && !collision; ++i) {
+      std::uint8_t& slot = table.slots[table.Slot(kExtensions[i].extension)];
+      collision = 0 != slot;
+      slot = static_cast<std::uint8_t>(i + 1);
+    }
+    if (!collision) {
+      return table;
+    }
+  }
+  return std::nullopt;
+}
+
+inline constexpr std::optional<PerfectHash> kPerfectHash = BuildPerfectHash();
+static_assert(kPerfectHash, "No seed spreads the extensions without collision");
+static_assert(std::size(kExtensions) < 255);
+
+consteval bool IsRegistryValid() {
+  for (std::size_t i = 0; i < std::size(kLanguages); ++i) {
+    if (static_cast<std::size_t>(kLanguages[i].language) != i) {
+      return false;
+    }
+  }
+  for (const auto& extension : kExtensions) {
+    if (kMaxExtensionSize < extension.extension.size()) {
+      return false;
+    }
+  }
+  return std::size(kLanguages) ==
+         static_cast<std::size_t>(Language::kLanguages);
+}
+static_assert(IsRegistryValid());
+
+constexpr int Find(std::string_view extension) noexcept {
+  const std::uint8_t slot = kPerfectHash->slots[kPerfectHash->Slot(extension)];
+  return 0 != slot && kExtensions[slot - 1].extension == extension ? slot - 1
+                                                                    : -1;
+}
+
+}  // namespace language
+
+inline constexpr std::size_t kExtensionCount = std::size(language::kExtensions);
+
+// The part of a file name from its last '.', as boost::filesystem's
+// extension() has it, without building a path
+template <typename Char>
+constexpr std::basic_string_view<Char> ExtensionOf(
+    std::basic_string_view<Char> name) noexcept {
+  const std::size_t dot = name.rfind(Char('.'));
+  // "." and ".." have none
+  if (std::basic_string_view<Char>::npos == dot ||
+      (name.size() <= 2 && name.find_first_not_of(Char('.')) == name.npos)) {
+    return {};
+  }
+  return name.substr(dot);
+}
+
+template <typename Char>
+constexpr bool IsAscii(Char c) noexcept {
+  return static_cast<std::make_unsigned_t<Char>>(c) < 0x80;
+}
+
+// Looks an extension up in the registry, without allocating. Returns the
+// index into language::kExtensions, or -1.
+template <typename Char>
+constexpr int FindExtension(std::basic_string_view<Char> extension) noexcept {
+  if (extension.empty() || language::kMaxExtensionSize < extension.size()) {
+    return -1;
+  }
+  char buffer[language::kMaxExtensionSize];
+  bool upper = false;
+  for (std::size_t i = 0; i < extension.size(); ++i) {
+    const Char c = extension[i];
+    // Nothing in the registry is beyond ASCII
+    if (!IsAscii(c)) {
+      return -1;
+    }
+    buffer[i] = static_cast<char>(c);
+    upper = upper || ('A' <= c && c <= 'Z');
+  }
+  const std::string_view exact(buffer, extension.size());
+  const int index = language::Find(exact);
+  if (0 <= index || !upper) {
+    return index;
+  }
+  for (std::size_t i = 0; i < extension.size(); ++i) {
+    if ('A' <= buffer[i] && buffer[i] <= 'Z') {
+      buffer[i] = static_cast<char>(buffer[i] - 'A' + 'a');
+    }
+  }
+  return language::Find(exact);
+}
+
+inline std::optional<Language> FindLanguage(std::string_view name) noexcept {
+  for (const auto& info : language::kLanguages) {
+    if (name == info.name && Language::kUnknown != info.language) {
+      return info.language;
+    }
+  }
+  return std::nullopt;
+}
+
+inline const LanguageInfo& GetLanguageInfo(Language language) noexcept {
+  return language::kLanguages[static_cast<std::size_t>(language)];
+}
+
+// The language of a "#!" line, such as "#!/usr/bin/env python3"
+inline Language LanguageOfShebang(std::string_view line) noexcept {
+  if (!line.starts_with("#!")) {
+    return Language::kUnknown;
+  }
+  line = line.substr(2, line.find('\n') - 2);
+  const auto next_word = [&line]() {
+    const std::size_t begin = line.find_first_not_of(" \t\r");
+    if (std::string_view::npos == begin) {
+      line = {};
+      return std::string_view();
+    }
+    line.remove_prefix(begin);
+    const std::string_view word = line.substr(0, line.find_first_of(" \t\r"));
+    line.remove_prefix(word.size());
+    return word;
+  };
+  std::string_view program = next_word();
+  program.remove_prefix(program.rfind('/') + 1);
+  // env may be given options, such as -S
+  while ("env" == program || program.starts_with('-')) {
+    program = next_word();
+  }
+  // python3.12 is python
+  program = program.substr(0, program.find_first_of("0123456789."));
+  for (const auto& interpreter : language::kInterpreters) {
+    if (interpreter.name == program) {
+      return interpreter.language;
+    }
+  }
+  return Language::kUnknown;
+}
+
+// Reads the first line of a file for LanguageOfShebang()
+inline Language LanguageOfScript(const boost::filesystem::path& filename) {
+  std::FILE* f = boost::nowide::fopen(filename.string().c_str(), "rb");
+  if (nullptr == f) {
+    return Language::kUnknown;
+  }
+  char line[256];
+  const std::size_t size = std::fread(line, 1, sizeof(line), f);
+  std::fclose(f);
+  return LanguageOfShebang(std::string_view(line, size));
+}
+
+inline const Syntax& SyntaxFor(const boost::filesystem::path& filename) {
+  const int index = FindExtension(
+      ExtensionOf(std::basic_string_view<boost::filesystem::path::value_type>(
+          filename.filename().native())));
+  return 0 <= index
+             ? *GetLanguageInfo(language::kExtensions[index].language).syntax
+             : syntax::kPlain;
+}
+
+// Which files are counted, by extension: those of whole languages, and
+// extensions given one by one, in the registry or not. Extensionless
+// files can be picked by their "#!" line.
+class ExtensionFilter {
+ public:
+  using NameView = std::basic_string_view<boost::filesystem::path::value_type>;
+
+  void AddLanguage(Language language) noexcept;
+  // Like --ext: "cpp", ".cpp", or "" for files without extension, matched
+  // as GetLowerCaseExtension() spells them
+  void AddExtension(std::string extension);
+
+  // Of a file name without directory. Allocation-free unless the extension
+  // is neither ASCII nor in the registry.
+  bool Matches(NameView name) const;
+  // Matches() let it through only to look at its "#!" line
+  bool NeedsShebang(NameView name) const noexcept {
+    return ExtensionOf(name).empty() && !no_extension_ && scripts_.any();
+  }
+  bool MatchesShebang(const boost::filesystem::path& filename) const {
+    return scripts_.test(static_cast<std::size_t>(LanguageOfScript(filename)));
+  }
+
+  // Sorted, as the option echo prints them
+  std::vector<std::string> Extensions() const;
+
+ private:
+  std::bitset<kExtensionCount> extensions_;
+  // Lower case, outside the registry
+  std::vector<std::string> others_;
+  bool no_extension_{};
+  std::bitset<static_cast<std::size_t>(Language::kLanguages)> scripts_;
+};
+
+inline void ExtensionFilter::AddLanguage(Language language) noexcept {
+  for (std::size_t i = 0; i < kExtensionCount; ++i) {
+    if (language == language::kExtensions[i].language) {
+      extensions_.set(i);
+    }
+  }
+  for (const auto& interpreter : language::kInterpreters) {
+    if (language == interpreter.language) {
+      scripts_.set(static_cast<std::size_t>(language));
+    }
+  }
+}
+
+inline void ExtensionFilter::AddExtension(std::string extension) {
+  extension = GetLowerCaseExtension(std::move(extension));
+  if (extension.empty()) {
+    no_extension_ = true;
+    return;
+  }
+  if (!extension.starts_with('.')) {
+    extension.insert(0, 1, '.');
+  }
+  const int index = FindExtension(std::string_view(extension));
+  if (0 <= index) {
+    extensions_.set(static_cast<std::size_t>(index));
+  } else if (others_.end() ==
+             std::find(others_.begin(), others_.end(), extension)) {
+    others_.push_back(std::move(extension));
+  }
+}
+
+inline bool ExtensionFilter::Matches(NameView name) const {
+  const NameView extension = ExtensionOf(name);
+  if (extension.empty()) {
+    return no_extension_ || scripts_.any();
+  }
+  const int index = FindExtension(extension);
+  if (0 <= index) {
+    return extensions_.test(static_cast<std::size_t>(index));
+  }
+  if (others_.empty()) {
+    return false;
+  }
+  const auto matches = [&extension](const std::string& other) {
+    if (other.size() != extension.size()) {
+      return false;
+    }
+    for (std::size_t i = 0; i < other.size(); ++i) {
+      auto c = extension[i];
+      if ('A' <= c && c <= 'Z') {
+        c = static_cast<decltype(c)>(c - 'A' + 'a');
+      }
+      if (c != static_cast<unsigned char>(other[i])) {
+        return false;
+      }
+    }
+    return true;
+  };
+  if (!std::all_of(extension.begin(), extension.end(),
+                   [](auto c) { return IsAscii(c); })) {
+    // Beyond ASCII, compare what --ext got in the same encoding
+    const std::string spelled = GetLowerCaseExtension(
+        boost::filesystem::path(extension.begin(), extension.end()).string());
+    return others_.end() != std::find(others_.begin(), others_.end(), spelled);
+  }
+  return std::any_of(others_.begin(), others_.end(), matches);
+}
+
+inline std::vector<std::string> ExtensionFilter::Extensions() const {
+  std::vector<std::string> extensions(others_);
+  for (std::size_t i = 0; i < kExtensionCount; ++i) {
+    if (extensions_.test(i)) {
+      extensions.emplace_back(language::kExtensions[i].extension);
+    }
+  }
+  if (no_extension_) {
+    extensions.emplace_back();
+  }
+  std::sort(extensions.begin(), extensions.end());
+  return extensions;
+}
+
+}  // namespace umutech::count_lines
@@ -0,0 +1,714 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || \
+    defined(__i386__)
+#define UMU_ARCH_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define UMU_HAS_SSE2 1
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define UMU_HAS_NEON 1
+#include <arm_neon.h>
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#define UMU_FORCE_INLINE __forceinline
+#define UMU_TARGET_AVX2
+#else
+#define UMU_FORCE_INLINE inline __attribute__((always_inline))
+#define UMU_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+#include "encoding.hpp"
+#include "line_lengths.hpp"
+
+namespace umutech::count_lines {
+
+struct FileInfo {
+  std::size_t lines;
+  std::size_t column_limit;
+};
+
+// SIMD flavour used to classify bytes, picked once at runtime.
+enum class Kernel { kScalar, kSse2, kAvx2, kNeon };
+
+constexpr const char* KernelName(Kernel kernel) noexcept {
+  switch (kernel) {
+    case Kernel::kSse2:
+      return "sse2";
+    case Kernel::kAvx2:
+      return "avx2";
+    case Kernel::kNeon:
+      return "neon";
+    default:
+      return "scalar";
+  }
+}
+
+namespace detail {
+
+// Text mode streams on Windows turn "\r\n" into "\n" before std::getline
+// sees it, so the '\r' isn't part of the line there.
+#ifdef _WIN32
+inline constexpr bool kTextModeNewlines = true;
+#else
+inline constexpr bool kTextModeNewlines = false;
+#endif
+
+// What the kernels tell about a block of up to 64 code units, a bit per
+// unit
+struct BlockMasks {
+  std::uint64_t newlines;
+  // Not white space
+  std::uint64_t content;
+  // '\r', only with kTextModeNewlines
+  std::uint64_t returns;
+  // Units that don't start a code point, only with code points: UTF-8
+  // continuation bytes or low surrogates
+  std::uint64_t trailing;
+};
+
+}  // namespace detail
+
+// Streaming line counter. Feed it a file in blocks of any size, then call
+// Finish(). Lines are split the way std::getline splits them: every '\n'
+// ends a line, and a non-empty tail without '\n' is one more line. Only
+// ' ', '\t', '\n', '\v', '\f' and '\r' count as white space, the same set
+// boost::algorithm::trim uses under the "C" locale.
+//
+// A byte order mark at the start isn't text. After a UTF-16 mark, '\n' and
+// the white space are code units, and a column is a code unit instead of a
+// byte. With `code_points`, a column is a code point: UTF-8 continuation
+// bytes and low surrogates don't count, which costs nothing on blocks of
+// plain ASCII.
+class LineCounter {
+ public:
+  explicit LineCounter(bool ignore_empty, bool code_points = false) noexcept
+      : ignore_empty_(ignore_empty), code_points_(code_points) {}
+
+  // Tells `observer` about every line from now on; without one the only
+  // cost is a well predicted branch per line
+  void Observe(LineObserver* observer) noexcept { observer_ = observer; }
+  // For data that doesn't start the file, so it has no byte order mark
+  void Assume(Encoding encoding) noexcept { bom_.Assume(encoding); }
+
+  void Feed(const char* data, std::size_t size) noexcept;
+  FileInfo Finish() noexcept;
+  // Once known, i.e. after the first bytes
+  Encoding encoding() const noexcept { return bom_.encoding(); }
+
+  // Called by the kernels for every block of at most 64 code units. Bits at
+  // or above `size` must be clear.
+  UMU_FORCE_INLINE void ConsumeBlock(const detail::BlockMasks& masks,
+                                     std::size_t size) noexcept;
+
+ private:
+  static constexpr std::uint64_t LowMask(std::size_t bits) noexcept {
+    return bits >= 64 ? ~std::uint64_t{} : (std::uint64_t{1} << bits) - 1;
+  }
+
+  // After the byte order mark, in whole code units
+  void Scan(const char* data, std::size_t size) noexcept;
+
+  void EndLine(std::size_t length, bool has_content) noexcept {
+    if (column_limit_ < length) {
+      column_limit_ = length;
+    }
+    const bool counted = !ignore_empty_ || has_content;
+    if (nullptr != observer_) {
+      observer_->Line(length, counted);
+    }
+    if (counted) {
+      ++lines_;
+    }
+  }
+
+  bool ignore_empty_;
+  bool code_points_;
+  LineObserver* observer_{};
+  BomReader bom_;
+  std::size_t lines_{};
+  std::size_t column_limit_{};
+  // The line which isn't terminated yet
+  std::size_t line_length_{};
+  bool line_has_content_{};
+  bool last_return_{};
+  // Of a UTF-16 code unit split between blocks
+  bool has_odd_byte_{};
+  char odd_byte_{};
+};
+
+UMU_FORCE_INLINE void LineCounter::ConsumeBlock(
+    const detail::BlockMasks& masks,
+    std::size_t size) noexcept {
+  // Plain ASCII has no trailing units, and without code points the mask is
+  // a constant 0 the compiler drops
+  const auto trailing = [&masks](std::uint64_t range) noexcept {
+    if (0 == masks.trailing) {
+      return std::size_t{0};
+    }
+    return static_cast<std::size_t>(std::popcount(masks.trailing & range));
+  };
+  std::uint64_t newlines = masks.newlines;
+  std::size_t start = 0;
+  while (newlines != 0) {
+    const auto pos = static_cast<std::size_t>(std::countr_zero(newlines));
+    const std::uint64_t range = LowMask(pos) & ~LowMask(start);
+    std::size_t length = line_length_ + pos - start - trailing(range);
+    if constexpr (detail::kTextModeNewlines) {
+      if (length != 0 && (0 != pos ? 0 != (masks.returns >> (pos - 1) & 1)
+                                   : last_return_)) {
+        --length;
+      }
+    }
+    EndLine(length, line_has_content_ || 0 != (masks.content & range));
+    line_length_ = 0;
+    line_has_content_ = false;
+    start = pos + 1;
+    newlines &= newlines - 1;
+  }
+  line_length_ += size - start - trailing(~LowMask(start));
+  line_has_content_ =
+      line_has_content_ || 0 != (masks.content & ~LowMask(start));
+  if constexpr (detail::kTextModeNewlines) {
+    last_return_ = 0 != (masks.returns >> (size - 1) & 1);
+  }
+}
+
+inline FileInfo LineCounter::Finish() noexcept {
+  bom_.Finish([this](const char* text, std::size_t text_size) {
+    Scan(text, text_size);
+  });
+  // A byte short of a code unit isn't text
+  if (0 != line_length_) {
+    EndLine(line_length_, line_has_content_);
+  }
+  FileInfo info{lines_, column_limit_};
+  bom_.Reset();
+  lines_ = 0;
+  column_limit_ = 0;
+  line_length_ = 0;
+  line_has_content_ = false;
+  last_return_ = false;
+  has_odd_byte_ = false;
+  return info;
+}
+
+namespace detail {
+
+// Runs `classify` on every 64-byte block, of 64 / kUnitSize code units;
+// the tail is copied into a zeroed block and its out-of-range bits are
+// dropped. `size` is a multiple of kUnitSize.
+template <BlockMasks (*classify)(const char*), std::size_t kUnitSize = 1>
+UMU_FORCE_INLINE void ScanBlocks(const char* data,
+                                 std::size_t size,
+                                 LineCounter& counter) noexcept {
+  while (64 <= size) {
+    counter.ConsumeBlock(classify(data), 64 / kUnitSize);
+    data += 64;
+    size -= 64;
+  }
+  if (0 != size) {
+    alignas(64) char tail[64]{};
+    std::memcpy(tail, data, size);
+    BlockMasks masks = classify(tail);
+    const std::size_t units = size / kUnitSize;
+    const std::uint64_t valid = (std::uint64_t{1} << units) - 1;
+    masks.newlines &= valid;
+    masks.content &= valid;
+    masks.returns &= valid;
+    masks.trailing &= valid;
+    counter.ConsumeBlock(masks, units);
+  }
+}
+
+// Of a UTF-16 code unit: its low byte comes first in little endian
+template <bool kBigEndian>
+UMU_FORCE_INLINE unsigned LoadUnit(const char* p) noexcept {
+  const auto first = static_cast<unsigned char>(p[0]);
+  const auto second = static_cast<unsigned char>(p[1]);
+  return kBigEndian ? (first << 8 | second) : (second << 8 | first);
+}
+
+template <bool kCodePoints>
+UMU_FORCE_INLINE BlockMasks ClassifyScalar(const char* block) noexcept {
+  BlockMasks masks{};
+  for (unsigned i = 0; i < 64; ++i) {
+    const auto c = static_cast<unsigned char>(block[i]);
+    const bool space = ' ' == c || static_cast<unsigned char>(c - '\t') <= 4;
+    masks.newlines |= std::uint64_t{'\n' == c} << i;
+    masks.content |= std::uint64_t{!space} << i;
+    if constexpr (kTextModeNewlines) {
+      masks.returns |= std::uint64_t{'\r' == c} << i;
+    }
+    if constexpr (kCodePoints) {
+      masks.trailing |= std::uint64_t{0x80 == (c & 0xC0)} << i;
+    }
+  }
+  return masks;
+}
+
+template <bool kBigEndian, bool kCodePoints>
+UMU_FORCE_INLINE BlockMasks ClassifyScalarUtf16(const char* block) noexcept {
+  BlockMasks masks{};
+  for (unsigned i = 0; i < 32; ++i) {
+    const unsigned unit = LoadUnit<kBigEndian>(block + 2 * i);
+    const bool space = ' ' == unit || unit - '\t' <= 4;
+    masks.newlines |= std::uint64_t{'\n' == unit} << i;
+    masks.content |= std::uint64_t{!space} << i;
+    if constexpr (kTextModeNewlines) {
+      masks.returns |= std::uint64_t{'\r' == unit} << i;
+    }
+    if constexpr (kCodePoints) {
+      masks.trailing |= std::uint64_t{0xDC00 == (unit & 0xFC00)} << i;
+    }
+  }
+  return masks;
+}
+
+template <bool kCodePoints>
+inline void ScanScalar(const char* data,
+                       std::size_t size,
+                       LineCounter& counter) noexcept {
+  ScanBlocks<ClassifyScalar<kCodePoints>>(data, size, counter);
+}
+
+template <bool kBigEndian, bool kCodePoints>
+inline void ScanScalarUtf16(const char* data,
+                            std::size_t size,
+                            LineCounter& counter) noexcept {
+  ScanBlocks<ClassifyScalarUtf16<kBigEndian, kCodePoints>, 2>(data, size,
+                                                               counter);
+}
+
+#ifdef UMU_HAS_SSE2
+// Bytes of 16 code units: `low` holds what identifies ASCII, which has 0 in
+// `high`
+struct Sse2Units {
+  __m128i low;
+  __m128i high;
+};
+
+template <bool kBigEndian>
+UMU_FORCE_INLINE Sse2Units LoadSse2Units(const char* p) noexcept {
+  const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+  const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16));
+  const __m128i byte = _mm_set1_epi16(0xFF);
+  const __m128i even = _mm_packus_epi16(_mm_and_si128(a, byte),
+                                        _mm_and_si128(b, byte));
+  const __m128i odd =
+      _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+  return kBigEndian ? Sse2Units{odd, even} : Sse2Units{even, odd};
+}
+
+// Masks of 16 code units: ASCII bytes, or the low bytes of UTF-16 units
+// whose `ascii` lanes are set
+template <bool kCodePoints>
+UMU_FORCE_INLINE BlockMasks ClassifySse2Lanes(__m128i v,
+                                              __m128i ascii,
+                                              __m128i trailing) noexcept {
+  const __m128i newline = _mm_set1_epi8('\n');
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i four = _mm_set1_epi8(4);
+  // '\t' <= v <= '\r' as an unsigned range check
+  const __m128i shifted = _mm_sub_epi8(v, tab);
+  const __m128i control = _mm_cmpeq_epi8(_mm_min_epu8(shifted, four), shifted);
+  const __m128i blank = _mm_and_si128(
+      ascii, _mm_or_si128(control, _mm_cmpeq_epi8(v, space)));
+  BlockMasks masks{};
+  masks.newlines = static_cast<std::uint32_t>(
+      _mm_movemask_epi8(_mm_and_si128(ascii, _mm_cmpeq_epi8(v, newline))));
+  masks.content = ~static_cast<std::uint32_t>(_mm_movemask_epi8(blank)) &
+                  0xFFFFu;
+  if constexpr (kTextModeNewlines) {
+    masks.returns = static_cast<std::uint32_t>(_mm_movemask_epi8(
+        _mm_and_si128(ascii, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')))));
+  }
+  if constexpr (kCodePoints) {
+    masks.trailing = static_cast<std::uint32_t>(_mm_movemask_epi8(trailing));
+  }
+  return masks;
+}
+
+template <bool kCodePoints>
+UMU_FORCE_INLINE BlockMasks ClassifySse2(const char* block) noexcept {
+  const __m128i all = _mm_set1_epi8(-1);
+  BlockMasks masks{};
+  for (unsigned i = 0; i < 4; ++i) {
+    const __m128i v =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + i * 16));
+    // 0x80 to 0xBF, as signed bytes
+    const __m128i trailing =
+        kCodePoints ? _mm_cmplt_epi8(v, _mm_set1_epi8(-64)) : __m128i{};
+    const BlockMasks lanes = ClassifySse2Lanes<kCodePoints>(v, all, trailing);
+    masks.newlines |= lanes.newlines << (i * 16);
+    masks.content |= lanes.content << (i * 16);
+    masks.returns |= lanes.returns << (i * 16);
+    masks.trailing |= lanes.trailing << (i * 16);
+  }
+  return masks;
+}
+
+template <bool kBigEndian, bool kCodePoints>
+UMU_FORCE_INLINE BlockMasks ClassifySse2Utf16(const char* block) noexcept {
+  BlockMasks masks{};
+  for (unsigned i = 0; i < 2; ++i) {
+    const Sse2Units units = LoadSse2Units<kBigEndian>(block + i * 32);
+    const __m128i ascii = _mm_cmpeq_epi8(units.high, _mm_setzero_si128());
+    // 0xDC to 0xDF
+    const __m128i trailing =
+        kCodePoints ? _mm_cmpeq_epi8(
+                          _mm_and_si128(units.high, _mm_set1_epi8(-4)),
+                          _mm_set1_epi8(static_cast<char>(0xDC)))
+                    : __m128i{};
+    const BlockMasks lanes =
+        ClassifySse2Lanes<kCodePoints>(units.low, ascii, trailing);
+    masks.newlines |= lanes.newlines << (i * 16);
+    masks.content |= lanes.content << (i * 16);
+    masks.returns |= lanes.returns << (i * 16);
+    masks.trailing |= lanes.trailing << (i * 16);
+  }
+  return masks;
+}
+
+template <bool kCodePoints>
+inline void ScanSse2(const char* data,
+                     std::size_t size,
+                     LineCounter& counter) noexcept {
+  ScanBlocks<ClassifySse2<kCodePoints>>(data, size, counter);
+}
+
+template <bool kBigEndian, bool kCodePoints>
+inline void ScanSse2Utf16(const char* data,
+                          std::size_t size,
+                          LineCounter& counter) noexcept {
+  ScanBlocks<ClassifySse2Utf16<kBigEndian, kCodePoints>, 2>(data, size,
+                                                             counter);
+}
+#endif
+
+#ifdef UMU_ARCH_X86
+// Masks of 32 code units, like ClassifySse2Lanes()
+template <bool kCodePoints>
+UMU_TARGET_AVX2 inline BlockMasks ClassifyAvx2Lanes(__m256i v,
+                                                    __m256i ascii,
+                                                    __m256i trailing) noexcept {
+  const __m256i newline = _mm256_set1_epi8('\n');
+  const __m256i space = _mm256_set1_epi8(' ');
+  const __m256i tab = _mm256_set1_epi8('\t');
+  const __m256i four = _mm256_set1_epi8(4);
+  const __m256i shifted = _mm256_sub_epi8(v, tab);
+  const __m256i control =
+      _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, four), shifted);
+  const __m256i blank = _mm256_and_si256(
+      ascii, _mm256_or_si256(control, _mm256_cmpeq_epi8(v, space)));
+  BlockMasks masks{};
+  masks.newlines = static_cast<std::uint32_t>(_mm256_movemask_epi8(
+      _mm256_and_si256(ascii, _mm256_cmpeq_epi8(v, newline))));
+  masks.content = ~static_cast<std::uint32_t>(_mm256_movemask_epi8(blank));
+  if constexpr (kTextModeNewlines) {
+    masks.returns = static_cast<std::uint32_t>(_mm256_movemask_epi8(
+        _mm256_and_si256(ascii, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')))));
+  }
+  if constexpr (kCodePoints) {
+    masks.trailing =
+        static_cast<std::uint32_t>(_mm256_movemask_epi8(trailing));
+  }
+  return masks;
+}
+
+template <bool kCodePoints>
+UMU_TARGET_AVX2 inline BlockMasks ClassifyAvx2(const char* block) noexcept {
+  const __m256i all = _mm256_set1_epi8(-1);
+  BlockMasks masks{};
+  for (unsigned i = 0; i < 2; ++i) {
+    const __m256i v =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + i * 32));
+    const __m256i trailing =
+        kCodePoints ? _mm256_cmpgt_epi8(_mm256_set1_epi8(-64), v)
+                    : __m256i{};
+    const BlockMasks lanes = ClassifyAvx2Lanes<kCodePoints>(v, all, trailing);
+    masks.newlines |= lanes.newlines << (i * 32);
+    masks.content |= lanes.content << (i * 32);
+    masks.returns |= lanes.returns << (i * 32);
+    masks.trailing |= lanes.trailing << (i * 32);
+  }
+  return masks;
+}
+
+template <bool kBigEndian, bool kCodePoints>
+UMU_TARGET_AVX2 inline BlockMasks ClassifyAvx2Utf16(
+    const char* block) noexcept {
+  const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block));
+  const __m256i b =
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + 32));
+  const __m256i byte = _mm256_set1_epi16(0xFF);
+  // Packing works within 128-bit lanes, so the quarters come out of order
+  const __m256i even = _mm256_permute4x64_epi64(
+      _mm256_packus_epi16(_mm256_and_si256(a, byte), _mm256_and_si256(b, byte)),
+      0xD8);
+  const __m256i odd = _mm256_permute4x64_epi64(
+      _mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8)),
+      0xD8);
+  const __m256i low = kBigEndian ? odd : even;
+  const __m256i high = kBigEndian ? even : odd;
+  const __m256i ascii = _mm256_cmpeq_epi8(high, _mm256_setzero_si256());
+  const __m256i trailing =
+      kCodePoints
+          ? _mm256_cmpeq_epi8(_mm256_and_si256(high, _mm256_set1_epi8(-4)),
+                              _mm256_set1_epi8(static_cast<char>(0xDC)))
+          : __m256i{};
+  return ClassifyAvx2Lanes<kCodePoints>(low, ascii, trailing);
+}
+
+template <bool kCodePoints>
+UMU_TARGET_AVX2 inline void ScanAvx2(const char* data,
+                                     std::size_t size,
+                                     LineCounter& counter) noexcept {
+  ScanBlocks<ClassifyAvx2<kCodePoints>>(data, size, counter);
+}
+
+template <bool kBigEndian, bool kCodePoints>
+UMU_TARGET_AVX2 inline void ScanAvx2Utf16(const char* data,
+                                          std::size_t size,
+                                          LineCounter& counter) noexcept {
+  ScanBlocks<ClassifyAvx2Utf16<kBigEndian, kCodePoints>, 2>(data, size,
+                                                             counter);
+}
+
+inline bool CpuHasAvx2() noexcept {
+#if defined(_MSC_VER) && !defined(__clang__)
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7) {
+    return false;
+  }
+  __cpuid(info, 1);
+  constexpr int kOsXsave = 1 << 27;
+  constexpr int kAvx = 1 << 28;
+  if ((info[2] & (kOsXsave | kAvx)) != (kOsXsave | kAvx)) {
+    return false;
+  }
+  // The OS must save the YMM registers on context switches
+  if ((_xgetbv(0) & 6) != 6) {
+    return false;
+  }
+  __cpuidex(info, 7, 0);
+  return 0 != (info[1] & (1 << 5));
+#else
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+#ifdef UMU_HAS_NEON
+UMU_FORCE_INLINE std::uint64_t NeonMovemask(uint8x16_t m0,
+                                            uint8x16_t m1,
+                                            uint8x16_t m2,
+                                            uint8x16_t m3) noexcept {
+  const uint8x16_t bits = {1, 2, 4, 8, 16, 32, 64, 128,
+                           1, 2, 4, 8, 16, 32, 64, 128};
+  uint8x16_t sum0 = vpaddq_u8(vandq_u8(m0, bits), vandq_u8(m1, bits));
+  uint8x16_t sum1 = vpaddq_u8(vandq_u8(m2, bits), vandq_u8(m3, bits));
+  sum0 = vpaddq_u8(sum0, sum1);
+  sum0 = vpaddq_u8(sum0, sum0);
+  return vgetq_lane_u64(vreinterpretq_u64_u8(sum0), 0);
+}
+
+// Per lane of 16 code units, like ClassifySse2Lanes()
+struct NeonLanes {
+  uint8x16_t newlines;
+  uint8x16_t content;
+  uint8x16_t returns;
+};
+
+UMU_FORCE_INLINE NeonLanes ClassifyNeonLanes(uint8x16_t v,
+                                             uint8x16_t ascii) noexcept {
+  const uint8x16_t newline = vdupq_n_u8('\n');
+  const uint8x16_t space = vdupq_n_u8(' ');
+  const uint8x16_t tab = vdupq_n_u8('\t');
+  const uint8x16_t four = vdupq_n_u8(4);
+  const uint8x16_t blank = vandq_u8(
+      ascii, vorrq_u8(vcleq_u8(vsubq_u8(v, tab), four), vceqq_u8(v, space)));
+  return {vandq_u8(ascii, vceqq_u8(v, newline)), vmvnq_u8(blank),
+          vandq_u8(ascii, vceqq_u8(v, vdupq_n_u8('\r')))};
+}
+
+template <bool kCodePoints>
+UMU_FORCE_INLINE BlockMasks ClassifyNeon(const char* block) noexcept {
+  const auto* p = reinterpret_cast<const std::uint8_t*>(block);
+  const uint8x16_t all = vdupq_n_u8(0xFF);
+  NeonLanes lanes[4];
+  uint8x16_t trailing[4];
+  for (unsigned i = 0; i < 4; ++i) {
+    const uint8x16_t v = vld1q_u8(p + i * 16);
+    lanes[i] = ClassifyNeonLanes(v, all);
+    trailing[i] = vceqq_u8(vandq_u8(v, vdupq_n_u8(0xC0)), vdupq_n_u8(0x80));
+  }
+  BlockMasks masks{};
+  masks.newlines = NeonMovemask(lanes[0].newlines, lanes[1].newlines,
+                                lanes[2].newlines, lanes[3].newlines);
+  masks.content = NeonMovemask(lanes[0].content, lanes[1].content,
+                               lanes[2].content, lanes[3].content);
+  if constexpr (kTextModeNewlines) {
+    masks.returns = NeonMovemask(lanes[0].returns, lanes[1].returns,
+                                 lanes[2].returns, lanes[3].returns);
+  }
+  if constexpr (kCodePoints) {
+    masks.trailing =
+        NeonMovemask(trailing[0], trailing[1], trailing[2], trailing[3]);
+  }
+  return masks;
+}
+
+template <bool kBigEndian, bool kCodePoints>
+UMU_FORCE_INLINE BlockMasks ClassifyNeonUtf16(const char* block) noexcept {
+  const auto* p = reinterpret_cast<const std::uint8_t*>(block);
+  const uint8x16_t none = vdupq_n_u8(0);
+  NeonLanes lanes[2];
+  uint8x16_t trailing[2];
+  for (unsigned i = 0; i < 2; ++i) {
+    // Splits even and odd bytes
+    const uint8x16x2_t bytes = vld2q_u8(p + i * 32);
+    const uint8x16_t low = bytes.val[kBigEndian ? 1 : 0];
+    const uint8x16_t high = bytes.val[kBigEndian ? 0 : 1];
+    lanes[i] = ClassifyNeonLanes(low, vceqq_u8(high, none));
+    trailing[i] = vceqq_u8(vandq_u8(high, vdupq_n_u8(0xFC)), vdupq_n_u8(0xDC));
+  }
+  BlockMasks masks{};
+  masks.newlines =
+      NeonMovemask(lanes[0].newlines, lanes[1].newlines, none, none);
+  masks.content =
+      NeonMovemask(lanes[0].content, lanes[1].content, none, none);
+  if constexpr (kTextModeNewlines) {
+    masks.returns =
+        NeonMovemask(lanes[0].returns, lanes[1].returns, none, none);
+  }
+  if constexpr (kCodePoints) {
+    masks.trailing = NeonMovemask(trailing[0], trailing[1], none, none);
+  }
+  return masks;
+}
+
+template <bool kCodePoints>
+inline void ScanNeon(const char* data,
+                     std::size_t size,
+                     LineCounter& counter) noexcept {
+  ScanBlocks<ClassifyNeon<kCodePoints>>(data, size, counter);
+}
+
+template <bool kBigEndian, bool kCodePoints>
+inline void ScanNeonUtf16(const char* data,
+                          std::size_t size,
+                          LineCounter& counter) noexcept {
+  ScanBlocks<ClassifyNeonUtf16<kBigEndian, kCodePoints>, 2>(data, size,
+                                                             counter);
+}
+#endif
+
+using ScanFunction = void (*)(const char*, std::size_t, LineCounter&);
+
+// A kernel's scans of bytes and of UTF-16, with and without code points
+enum class ScanMode : std::uint8_t {
+  kBytes,
+  kCodePoints,
+  kUtf16Le,
+  kUtf16LeCodePoints,
+  kUtf16Be,
+  kUtf16BeCodePoints,
+  kScans,
+};
+
+constexpr ScanMode ScanOf(Encoding encoding, bool code_points) noexcept {
+  switch (encoding) {
+    case Encoding::kUtf16Le:
+      return code_points ? ScanMode::kUtf16LeCodePoints : ScanMode::kUtf16Le;
+    case Encoding::kUtf16Be:
+      return code_points ? ScanMode::kUtf16BeCodePoints : ScanMode::kUtf16Be;
+    default:
+      return code_points ? ScanMode::kCodePoints : ScanMode::kBytes;
+  }
+}
+
+struct ScanDispatch {
+  Kernel kernel;
+  ScanFunction scans[static_cast<std::size_t>(ScanMode::kScans)];
+};
+
+// In the order of ScanMode
+#define UMU_SCANS(name)                                              \
+  {                                                                  \
+    name<false>, name<true>, name##Utf16<false, false>,              \
+        name##Utf16<false, true>, name##Utf16<true, false>,          \
+        name##Utf16<true, true>                                      \
+  }
+
+inline ScanDispatch SelectKernel() noexcept {
+#ifdef UMU_ARCH_X86
+  if (CpuHasAvx2()) {
+    return {Kernel::kAvx2, UMU_SCANS(ScanAvx2)};
+  }
+#endif
+#if defined(UMU_HAS_SSE2)
+  return {Kernel::kSse2, UMU_SCANS(ScanSse2)};
+#elif defined(UMU_HAS_NEON)
+  return {Kernel::kNeon, UMU_SCANS(ScanNeon)};
+#else
+  return {Kernel::kScalar, UMU_SCANS(ScanScalar)};
+#endif
+}
+
+#undef UMU_SCANS
+
+inline const ScanDispatch& Dispatch() noexcept {
+  static const ScanDispatch dispatch = SelectKernel();
+  return dispatch;
+}
+
+}  // namespace detail
+
+inline Kernel ActiveKernel() noexcept {
+  return detail::Dispatch().kernel;
+}
+
+inline void LineCounter::Scan(const char* data, std::size_t size) noexcept {
+  const detail::ScanFunction scan = detail::Dispatch().scans[
+      static_cast<std::size_t>(detail::ScanOf(bom_.encoding(), code_points_))];
+  if (!IsUtf16(bom_.encoding())) {
+    scan(data, size, *this);
+    return;
+  }
+  if (has_odd_byte_ && 0 != size) {
+    const char unit[2] = {odd_byte_, data[0]};
+    scan(unit, 2, *this);
+    has_odd_byte_ = false;
+    ++data;
+    --size;
+  }
+  if (0 != size % 2) {
+    odd_byte_ = data[size - 1];
+    has_odd_byte_ = true;
+    --size;
+  }
+  scan(data, size, *this);
+}
+
+inline void LineCounter::Feed(const char* data, std::size_t size) noexcept {
+  bom_.Feed(data, size, [this](const char* text, std::size_t text_size) {
+    Scan(text, text_size);
+  });
+}
+
+}  // namespace umutech::count_lines
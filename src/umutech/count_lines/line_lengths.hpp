@@ -0,0 +1,164 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace umutech::count_lines {
+
+// How many lines have each length, in bytes without the newline, for
+// --histogram. Lengths below kExact have a bucket each, which covers any
+// column limit worth picking; longer ones share a bucket per power of two.
+// The buckets are fixed, so adding a line is an increment and histograms
+// of several threads add up bucket by bucket.
+class LineHistogram {
+ public:
+  static constexpr std::size_t kExact = 1024;
+
+  struct Bucket {
+    std::size_t min;
+    std::size_t max;
+    std::uint64_t lines;
+  };
+
+  void Add(std::size_t length) noexcept {
+    ++counts_[BucketOf(length)];
+    max_ = std::max(max_, length);
+  }
+  void Merge(const LineHistogram& other) noexcept;
+  void Clear() noexcept {
+    counts_.fill(0);
+    max_ = 0;
+  }
+
+  std::uint64_t lines() const noexcept;
+  std::size_t max() const noexcept { return max_; }
+  // The shortest length that `fraction` of the lines fit in, e.g. 0.99 for
+  // p99. Beyond kExact it's the end of the bucket, or the longest line.
+  std::size_t Percentile(double fraction) const noexcept;
+  // Non-empty buckets of `width` lengths each up to kExact, then those of
+  // powers of two
+  std::vector<Bucket> Buckets(std::size_t width) const;
+
+ private:
+  static constexpr unsigned kExactBits = std::bit_width(kExact - 1);
+  static constexpr std::size_t kBuckets =
+      kExact + std::numeric_limits<std::size_t>::digits - kExactBits;
+
+  static std::size_t BucketOf(std::size_t length) noexcept {
+    return length < kExact
+               ? length
+               : kExact + std::bit_width(length) - kExactBits - 1;
+  }
+  static std::size_t MaxOf(std::size_t bucket) noexcept {
+    if (bucket < kExact) {
+      return bucket;
+    }
+    const std::size_t bits = bucket - kExact + kExactBits + 1;
+    return bits < std::numeric_limits<std::size_t>::digits
+               ? (std::size_t{1} << bits) - 1
+               : ~std::size_t{};
+  }
+
+  std::array<std::uint64_t, kBuckets> counts_{};
+  std::size_t max_{};
+};
+
+struct LongLine {
+  // 1-based, counting empty lines even with --ignore-empty
+  std::size_t line;
+  std::size_t length;
+};
+
+// What LineCounter tells about each line besides the counts: its length
+// for the histogram, and where it is if it's longer than `over`
+class LineObserver {
+ public:
+  LineObserver(LineHistogram* histogram, std::size_t over) noexcept
+      : histogram_(histogram), over_(over) {}
+
+  void Line(std::size_t length, bool counted) {
+    ++lines_;
+    if (!counted) {
+      return;
+    }
+    if (nullptr != histogram_) {
+      histogram_->Add(length);
+    }
+    if (0 != over_ && over_ < length) {
+      long_lines_.push_back({lines_, length});
+    }
+  }
+
+  // All lines so far, counted or not
+  std::size_t lines() const noexcept { return lines_; }
+  std::vector<LongLine>& long_lines() noexcept { return long_lines_; }
+
+ private:
+  LineHistogram* histogram_;
+  std::size_t over_;
+  std::size_t lines_{};
+  std::vector<LongLine> long_lines_;
+};
+
+inline void LineHistogram::Merge(const LineHistogram& other) noexcept {
+  for (std::size_t i = 0; i < kBuckets; ++i) {
+    counts_[i] += other.counts_[i];
+  }
+  max_ = std::max(max_, other.max_);
+}
+
+inline std::uint64_t LineHistogram::lines() const noexcept {
+  std::uint64_t lines = 0;
+  for (const std::uint64_t count : counts_) {
+    lines += count;
+  }
+  return lines;
+}
+
+inline std::size_t LineHistogram::Percentile(double fraction) const noexcept {
+  const std::uint64_t total = lines();
+  if (0 == total) {
+    return 0;
+  }
+  // Nearest rank: the line at ceil(fraction * total), counting from 1
+  const auto rank = std::max<std::uint64_t>(
+      1, static_cast<std::uint64_t>(
+             std::ceil(fraction * static_cast<double>(total))));
+  std::uint64_t seen = 0;
+  for (std::size_t i = 0; i < kBuckets; ++i) {
+    seen += counts_[i];
+    if (rank <= seen) {
+      return std::min(MaxOf(i), max_);
+    }
+  }
+  return max_;
+}
+
+inline std::vector<LineHistogram::Bucket> LineHistogram::Buckets(
+    std::size_t width) const {
+  width = std::max<std::size_t>(1, width);
+  std::vector<Bucket> buckets;
+  for (std::size_t i = 0; i < kBuckets; ++i) {
+    if (0 == counts_[i]) {
+      continue;
+    }
+    const std::size_t min =
+        i < kExact ? i / width * width : MaxOf(i - 1) + 1;
+    const std::size_t max =
+        i < kExact ? std::min(min + width, kExact) - 1 : MaxOf(i);
+    if (!buckets.empty() && buckets.back().min == min) {
+      buckets.back().lines += counts_[i];
+    } else {
+      buckets.push_back({min, std::min(max, max_), counts_[i]});
+    }
+  }
+  return buckets;
+}
+
+}  // namespace umutech::count_lines
@@ -0,0 +1,177 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+#include "file_counter.hpp"
+#include "report.hpp"
+
+namespace umutech::count_lines {
+
+// The counts of every file that --watch keeps up to date, and their
+// totals. Files are keyed by path, so everything below a directory is one
+// range. Column limits are kept with the number of files of each, as the
+// largest has to be found again once its file is gone.
+class LiveTotals {
+ public:
+  struct Change {
+    FileChange kind;
+    // The counts after, or before for kRemoved
+    CountedFile file;
+    std::int64_t lines_delta;
+  };
+
+  explicit LiveTotals(bool sloc) : sloc_(sloc) {}
+
+  void Reset(std::vector<CountedFile> files);
+  // A file counted again; nothing if its counts are the same
+  std::optional<Change> Update(CountedFile file);
+  std::optional<Change> Remove(const boost::filesystem::path& path);
+  // Whatever is below `dir` is `files` now, e.g. after the directory was
+  // created, removed or walked again
+  void Replace(const boost::filesystem::path& dir,
+               std::vector<CountedFile> files,
+               std::vector<Change>& changes);
+
+  ReportTotals Totals() const;
+
+ private:
+  void Add(const CountedFile& file);
+  void Subtract(const CountedFile& file);
+
+  bool sloc_;
+  std::map<std::string, CountedFile> files_;
+  std::map<std::size_t, std::size_t> column_limits_;
+  std::size_t lines_{};
+  SlocInfo total_sloc_{};
+};
+
+inline void LiveTotals::Reset(std::vector<CountedFile> files) {
+  files_.clear();
+  column_limits_.clear();
+  lines_ = 0;
+  total_sloc_ = {};
+  for (auto& file : files) {
+    std::string key = file.path.string();
+    if (const auto [it, added] = files_.emplace(std::move(key), file); added) {
+      Add(it->second);
+    }
+  }
+}
+
+inline std::optional<LiveTotals::Change> LiveTotals::Update(
+    CountedFile file) {
+  std::string key = file.path.string();
+  const auto it = files_.find(key);
+  if (files_.end() == it) {
+    Add(file);
+    const auto lines = static_cast<std::int64_t>(file.info.lines);
+    files_.emplace(std::move(key), file);
+    return Change{FileChange::kAdded, std::move(file), lines};
+  }
+  CountedFile& old = it->second;
+  const bool same_sloc =
+      old.sloc.has_value() == file.sloc.has_value() &&
+      (!old.sloc || (old.sloc->code == file.sloc->code &&
+                     old.sloc->comment == file.sloc->comment &&
+                     old.sloc->blank == file.sloc->blank));
+  if (old.opened == file.opened && old.info.lines == file.info.lines &&
+      old.info.column_limit == file.info.column_limit && same_sloc) {
+    return std::nullopt;
+  }
+  const std::int64_t lines_delta =
+      static_cast<std::int64_t>(file.info.lines) -
+      static_cast<std::int64_t>(old.info.lines);
+  Subtract(old);
+  Add(file);
+  old = file;
+  return Change{FileChange::kModified, std::move(file), lines_delta};
+}
+
+inline std::optional<LiveTotals::Change> LiveTotals::Remove(
+    const boost::filesystem::path& path) {
+  const auto it = files_.find(path.string());
+  if (files_.end() == it) {
+    return std::nullopt;
+  }
+  Subtract(it->second);
+  const auto lines = static_cast<std::int64_t>(it->second.info.lines);
+  Change change{FileChange::kRemoved, std::move(it->second), -lines};
+  files_.erase(it);
+  return change;
+}
+
+inline void LiveTotals::Replace(const boost::filesystem::path& dir,
+                                std::vector<CountedFile> files,
+                                std::vector<Change>& changes) {
+  std::string prefix = dir.string();
+  const auto separator =
+      static_cast<char>(boost::filesystem::path::preferred_separator);
+  if (!prefix.ends_with(separator)) {
+    prefix += separator;
+  }
+  std::unordered_set<std::string> found;
+  for (auto& file : files) {
+    found.insert(file.path.string());
+    if (auto change = Update(std::move(file))) {
+      changes.push_back(std::move(*change));
+    }
+  }
+  std::vector<std::string> gone;
+  for (auto it = files_.lower_bound(prefix);
+       files_.end() != it && it->first.starts_with(prefix); ++it) {
+    if (!found.contains(it->first)) {
+      gone.push_back(it->first);
+    }
+  }
+  for (const auto& path : gone) {
+    if (auto change = Remove(path)) {
+      changes.push_back(std::move(*change));
+    }
+  }
+}
+
+inline ReportTotals LiveTotals::Totals() const {
+  ReportTotals totals{};
+  totals.files = files_.size();
+  totals.lines = lines_;
+  if (!column_limits_.empty()) {
+    totals.column_limit = column_limits_.rbegin()->first;
+  }
+  if (sloc_) {
+    totals.sloc = total_sloc_;
+  }
+  return totals;
+}
+
+inline void LiveTotals::Add(const CountedFile& file) {
+  lines_ += file.info.lines;
+  ++column_limits_[file.info.column_limit];
+  if (file.sloc) {
+    total_sloc_.code += file.sloc->code;
+    total_sloc_.comment += file.sloc->comment;
+    total_sloc_.blank += file.sloc->blank;
+  }
+}
+
+inline void LiveTotals::Subtract(const CountedFile& file) {
+  lines_ -= file.info.lines;
+  const auto it = column_limits_.find(file.info.column_limit);
+  if (0 == --it->second) {
+    column_limits_.erase(it);
+  }
+  if (file.sloc) {
+    total_sloc_.code -= file.sloc->code;
+    total_sloc_.comment -= file.sloc->comment;
+    total_sloc_.blank -= file.sloc->blank;
+  }
+}
+
+}  // namespace umutech::count_lines
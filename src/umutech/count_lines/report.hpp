@@ -0,0 +1,667 @@
+﻿#pragma once
+
+#ifdef USE_FMTLIB
+#include <fmt/format.h>
+#else
+#include <format>
+#endif
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "dir_tree.hpp"
+#include "file_counter.hpp"
+#include "line_lengths.hpp"
+#include "stats.hpp"
+
+namespace umutech::count_lines {
+
+#ifdef USE_FMTLIB
+namespace cpp = fmt;
+#else
+namespace cpp = std;
+#endif
+
+enum class ReportFormat { kText, kJsonLines, kCsv };
+
+inline bool ParseReportFormat(std::string_view name, ReportFormat& format) {
+  if ("text" == name) {
+    format = ReportFormat::kText;
+  } else if ("jsonl" == name) {
+    format = ReportFormat::kJsonLines;
+  } else if ("csv" == name) {
+    format = ReportFormat::kCsv;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// How --watch or --diff saw a file change
+enum class FileChange { kAdded, kModified, kRemoved };
+
+struct ReportTotals {
+  std::size_t files;
+  std::size_t lines;
+  std::size_t column_limit;
+  // With --sloc
+  std::optional<SlocInfo> sloc;
+  double files_per_second;
+  // Whether text has Files/s too, with --stats or --io-uring; the other
+  // formats always have it
+  bool throughput;
+  // With --cache
+  std::optional<std::pair<std::uint64_t, std::uint64_t>> cache_hits_misses;
+  // With --dedupe: files and lines of the first of each content, and of
+  // the copies
+  struct Dedupe {
+    std::size_t unique_files;
+    std::size_t unique_lines;
+    std::size_t duplicate_files;
+    std::size_t duplicate_lines;
+  };
+  std::optional<Dedupe> dedupe;
+  // With --over: how many lines are longer
+  std::optional<std::size_t> long_lines;
+  // With --diff: changed files, and the lines that files gained and lost
+  struct Diff {
+    std::size_t added_files;
+    std::size_t modified_files;
+    std::size_t removed_files;
+    std::size_t lines_added;
+    std::size_t lines_removed;
+  };
+  std::optional<Diff> diff;
+};
+
+// Formats the report into one buffer that is reused for the whole run and
+// only written out when it's full or on Flush(), instead of going through
+// the stream per field. Text is what count_lines always printed; jsonl is
+// an object per line and csv a header and a row per file, with the totals
+// last.
+class ReportWriter {
+ public:
+  static constexpr std::size_t kFlushSize = 1 << 20;
+
+  ReportWriter(std::ostream& out,
+               ReportFormat format,
+               bool sloc,
+               bool dedupe = false)
+      : out_(out), format_(format), sloc_(sloc), dedupe_(dedupe) {
+    buffer_.reserve(kFlushSize + 4096);
+  }
+
+  // Writes the csv header; call it before anything else
+  void Begin();
+  void File(const CountedFile& file);
+  // Where the lines of --over are, also with --summary-only
+  void LongLines(const CountedFile& file);
+  // Totals of a directory and everything below it
+  void Directory(const DirTree::Row& row);
+  // A file that changed while watching: its counts now, and how many lines
+  // it gained. Removed files have no counts.
+  void Change(FileChange change,
+              const CountedFile& file,
+              std::int64_t lines_delta);
+  // Of --diff: how many files changed below a directory, and how many lines
+  // they gained
+  void DirectoryChange(std::string_view path,
+                       std::size_t files,
+                       std::int64_t lines_delta);
+  // Of --histogram: percentiles, then the buckets with their share
+  void Histogram(const LineHistogram& histogram);
+  void Summary(const ReportTotals& totals);
+  // Times of --stats in ms, the others as they are. Not for csv, whose
+  // rows are files.
+  void Statistics(const Stats& stats, double wall_seconds);
+
+  void Flush() {
+    out_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+    out_.flush();
+    buffer_.clear();
+  }
+
+ private:
+  template <typename... Args>
+  void Append(cpp::format_string<Args...> format, Args&&... args) {
+    cpp::format_to(std::back_inserter(buffer_), format,
+                   std::forward<Args>(args)...);
+  }
+  void FlushIfFull() {
+    if (kFlushSize <= buffer_.size()) {
+      Flush();
+    }
+  }
+
+  // Like operator<< of boost::filesystem::path: in double quotes, with '&'
+  // escaping '"' and itself
+  void AppendQuoted(std::string_view text);
+  void AppendJsonString(std::string_view text);
+  void AppendCsvField(std::string_view text);
+  // The sloc and dedupe columns of a row that has none of them
+  void EndCsvRow();
+
+  std::ostream& out_;
+  ReportFormat format_;
+  bool sloc_;
+  bool dedupe_;
+  std::string buffer_;
+};
+
+inline void ReportWriter::Begin() {
+  if (ReportFormat::kCsv == format_) {
+    Append("kind,path,opened,lines,column_limit{}{}\n",
+           sloc_ ? ",code,comment,blank" : "", dedupe_ ? ",duplicate" : "");
+  }
+}
+
+inline void ReportWriter::File(const CountedFile& file) {
+  const std::string path = file.path.string();
+  const bool has_sloc = sloc_ && file.sloc;
+  switch (format_) {
+    case ReportFormat::kText:
+      if (!file.opened) {
+        buffer_ += "Can't open ";
+        AppendQuoted(path);
+        buffer_ += '\n';
+      }
+      buffer_ += "File ";
+      AppendQuoted(path);
+      Append(" has {} {}, column limit {}", file.info.lines,
+             1 < file.info.lines ? "lines" : "line", file.info.column_limit);
+      if (has_sloc) {
+        Append(", code {}, comment {}, blank {}", file.sloc->code,
+               file.sloc->comment, file.sloc->blank);
+      }
+      if (file.duplicate) {
+        buffer_ += ", duplicate";
+      }
+      buffer_ += '\n';
+      break;
+    case ReportFormat::kJsonLines:
+      buffer_ += "{\"type\":\"file\",\"path\":";
+      AppendJsonString(path);
+      Append(",\"opened\":{},\"lines\":{},\"column_limit\":{}", file.opened,
+             file.info.lines, file.info.column_limit);
+      if (has_sloc) {
+        Append(",\"code\":{},\"comment\":{},\"blank\":{}", file.sloc->code,
+               file.sloc->comment, file.sloc->blank);
+      }
+      if (dedupe_) {
+        Append(",\"duplicate\":{}", file.duplicate);
+      }
+      buffer_ += "}\n";
+      break;
+    case ReportFormat::kCsv:
+      buffer_ += "file,";
+      AppendCsvField(path);
+      Append(",{},{},{}", file.opened ? 1 : 0, file.info.lines,
+             file.info.column_limit);
+      if (sloc_) {
+        if (has_sloc) {
+          Append(",{},{},{}", file.sloc->code, file.sloc->comment,
+                 file.sloc->blank);
+        } else {
+          buffer_ += ",,,";
+        }
+      }
+      if (dedupe_) {
+        Append(",{}", file.duplicate ? 1 : 0);
+      }
+      buffer_ += '\n';
+      break;
+  }
+  FlushIfFull();
+}
+
+inline void ReportWriter::LongLines(const CountedFile& file) {
+  if (file.long_lines.empty()) {
+    return;
+  }
+  const std::string path = file.path.string();
+  for (const auto& line : file.long_lines) {
+    switch (format_) {
+      case ReportFormat::kText:
+        buffer_ += "Long line ";
+        AppendQuoted(path);
+        Append(":{} has {} columns\n", line.line, line.length);
+        break;
+      case ReportFormat::kJsonLines:
+        buffer_ += "{\"type\":\"long_line\",\"path\":";
+        AppendJsonString(path);
+        Append(",\"line\":{},\"length\":{}}}\n", line.line, line.length);
+        break;
+      case ReportFormat::kCsv:
+        // The line number goes in lines, its length in column_limit
+        buffer_ += "long_line,";
+        AppendCsvField(path);
+        Append(",,{},{}", line.line, line.length);
+        EndCsvRow();
+        break;
+    }
+  }
+  FlushIfFull();
+}
+
+inline void ReportWriter::Directory(const DirTree::Row& row) {
+  const DirTree::Totals& totals = row.totals;
+  switch (format_) {
+    case ReportFormat::kText:
+      buffer_ += "Directory ";
+      AppendQuoted(row.path);
+      Append(" has {} {}, {} {}, column limit {}\n", totals.files,
+             1 < totals.files ? "files" : "file", totals.lines,
+             1 < totals.lines ? "lines" : "line", totals.column_limit);
+      break;
+    case ReportFormat::kJsonLines:
+      buffer_ += "{\"type\":\"directory\",\"path\":";
+      AppendJsonString(row.path);
+      Append(
+          ",\"depth\":{},\"files\":{},\"lines\":{},\"column_limit\":{}}}\n",
+          row.depth, totals.files, totals.lines, totals.column_limit);
+      break;
+    case ReportFormat::kCsv:
+      // The opened column holds the number of files
+      buffer_ += "directory,";
+      AppendCsvField(row.path);
+      Append(",{},{},{}{}{}\n", totals.files, totals.lines,
+             totals.column_limit, sloc_ ? ",,," : "", dedupe_ ? "," : "");
+      break;
+  }
+  FlushIfFull();
+}
+
+inline void ReportWriter::Change(FileChange change,
+                                 const CountedFile& file,
+                                 std::int64_t lines_delta) {
+  static constexpr const char* kText[] = {"Added", "Modified", "Removed"};
+  static constexpr const char* kNames[] = {"added", "modified", "removed"};
+  const auto index = static_cast<std::size_t>(change);
+  const bool removed = FileChange::kRemoved == change;
+  const bool has_sloc = sloc_ && file.sloc && !removed;
+  const std::string path = file.path.string();
+  switch (format_) {
+    case ReportFormat::kText:
+      buffer_ += kText[index];
+      buffer_ += ' ';
+      AppendQuoted(path);
+      if (removed) {
+        Append(" ({:+} {})\n", lines_delta,
+               -1 > lines_delta ? "lines" : "line");
+        break;
+      }
+      Append(" has {} {} ({:+}), column limit {}", file.info.lines,
+             1 < file.info.lines ? "lines" : "line", lines_delta,
+             file.info.column_limit);
+      if (has_sloc) {
+        Append(", code {}, comment {}, blank {}", file.sloc->code,
+               file.sloc->comment, file.sloc->blank);
+      }
+      buffer_ += '\n';
+      break;
+    case ReportFormat::kJsonLines:
+      Append("{{\"type\":\"change\",\"change\":\"{}\",\"path\":",
+             kNames[index]);
+      AppendJsonString(path);
+      Append(
+          ",\"opened\":{},\"lines\":{},\"lines_delta\":{},"
+          "\"column_limit\":{}",
+          !removed && file.opened, removed ? 0 : file.info.lines, lines_delta,
+          removed ? 0 : file.info.column_limit);
+      if (has_sloc) {
+        Append(",\"code\":{},\"comment\":{},\"blank\":{}", file.sloc->code,
+               file.sloc->comment, file.sloc->blank);
+      }
+      buffer_ += "}\n";
+      break;
+    case ReportFormat::kCsv:
+      // Like a file row; removed files are left with nothing
+      buffer_ += kNames[index];
+      buffer_ += ',';
+      AppendCsvField(path);
+      Append(",{},{},{}", !removed && file.opened ? 1 : 0,
+             removed ? 0 : file.info.lines,
+             removed ? 0 : file.info.column_limit);
+      if (sloc_) {
+        if (has_sloc) {
+          Append(",{},{},{}", file.sloc->code, file.sloc->comment,
+                 file.sloc->blank);
+        } else {
+          buffer_ += ",,,";
+        }
+      }
+      if (dedupe_) {
+        buffer_ += ",0";
+      }
+      buffer_ += '\n';
+      break;
+  }
+  FlushIfFull();
+}
+
+inline void ReportWriter::DirectoryChange(std::string_view path,
+                                          std::size_t files,
+                                          std::int64_t lines_delta) {
+  switch (format_) {
+    case ReportFormat::kText:
+      buffer_ += "Directory ";
+      AppendQuoted(path);
+      Append(" has {} changed {} ({:+} {})\n", files,
+             1 < files ? "files" : "file", lines_delta,
+             1 < lines_delta || -1 > lines_delta ? "lines" : "line");
+      break;
+    case ReportFormat::kJsonLines:
+      buffer_ += "{\"type\":\"directory_change\",\"path\":";
+      AppendJsonString(path);
+      Append(",\"files\":{},\"lines_delta\":{}}}\n", files, lines_delta);
+      break;
+    case ReportFormat::kCsv:
+      // Like a directory row, with the delta as lines
+      buffer_ += "directory_change,";
+      AppendCsvField(path);
+      Append(",{},{},", files, lines_delta);
+      EndCsvRow();
+      break;
+  }
+  FlushIfFull();
+}
+
+inline void ReportWriter::Histogram(const LineHistogram& histogram) {
+  // Lines of code are short, so this keeps the rows few
+  static constexpr std::size_t kWidth = 10;
+  static constexpr double kPercentiles[] = {0.5, 0.9, 0.99};
+  static constexpr const char* kNames[] = {"p50", "p90", "p99"};
+  const std::uint64_t total = histogram.lines();
+  const std::vector<LineHistogram::Bucket> buckets = histogram.Buckets(kWidth);
+  switch (format_) {
+    case ReportFormat::kText: {
+      buffer_ += "Line lengths:";
+      for (std::size_t i = 0; i < std::size(kPercentiles); ++i) {
+        Append(" {} {},", kNames[i], histogram.Percentile(kPercentiles[i]));
+      }
+      Append(" max {}\n", histogram.max());
+      std::uint64_t seen = 0;
+      for (const auto& bucket : buckets) {
+        seen += bucket.lines;
+        Append("  {:>6}-{:<6}: {:>10} {:>6.2f}% {:>6.2f}%\n", bucket.min,
+               bucket.max, bucket.lines, 100.0 * bucket.lines / total,
+               100.0 * seen / total);
+      }
+      break;
+    }
+    case ReportFormat::kJsonLines:
+      Append("{{\"type\":\"histogram\",\"lines\":{}", total);
+      for (std::size_t i = 0; i < std::size(kPercentiles); ++i) {
+        Append(",\"{}\":{}", kNames[i], histogram.Percentile(kPercentiles[i]));
+      }
+      Append(",\"max\":{},\"buckets\":[", histogram.max());
+      for (std::size_t i = 0; i < buckets.size(); ++i) {
+        Append("{}{{\"min\":{},\"max\":{},\"lines\":{}}}", 0 == i ? "" : ",",
+               buckets[i].min, buckets[i].max, buckets[i].lines);
+      }
+      buffer_ += "]}\n";
+      break;
+    case ReportFormat::kCsv:
+      // A bucket's range is its path, the longest in it its column_limit
+      for (const auto& bucket : buckets) {
+        Append("histogram,{}-{},,{},{}", bucket.min, bucket.max, bucket.lines,
+               bucket.max);
+        EndCsvRow();
+      }
+      for (std::size_t i = 0; i < std::size(kPercentiles); ++i) {
+        Append("percentile,{},,,{}", kNames[i],
+               histogram.Percentile(kPercentiles[i]));
+        EndCsvRow();
+      }
+      break;
+  }
+  FlushIfFull();
+}
+
+inline void ReportWriter::Summary(const ReportTotals& totals) {
+  switch (format_) {
+    case ReportFormat::kText:
+      if (0 != totals.files) {
+        Append("Total files: {}\nTotal lines: {}\nColumnLimit: {}\n",
+               totals.files, totals.lines, totals.column_limit);
+        if (totals.throughput && 0 < totals.files_per_second) {
+          Append("Files/s: {:.0f}\n", totals.files_per_second);
+        }
+        if (totals.sloc) {
+          Append("Total code: {}\nTotal comment: {}\nTotal blank: {}\n",
+                 totals.sloc->code, totals.sloc->comment, totals.sloc->blank);
+        }
+      }
+      if (totals.dedupe) {
+        Append(
+            "Unique files: {}\nUnique lines: {}\nDuplicate files: {}\n"
+            "Duplicate lines: {}\n",
+            totals.dedupe->unique_files, totals.dedupe->unique_lines,
+            totals.dedupe->duplicate_files, totals.dedupe->duplicate_lines);
+      }
+      if (totals.cache_hits_misses) {
+        Append("Cache hits  : {}\nCache misses: {}\n",
+               totals.cache_hits_misses->first,
+               totals.cache_hits_misses->second);
+      }
+      if (totals.long_lines) {
+        Append("Long lines: {}\n", *totals.long_lines);
+      }
+      if (totals.diff) {
+        Append(
+            "Added files: {}\nModified files: {}\nRemoved files: {}\n"
+            "Lines added: {}\nLines removed: {}\n",
+            totals.diff->added_files, totals.diff->modified_files,
+            totals.diff->removed_files, totals.diff->lines_added,
+            totals.diff->lines_removed);
+      }
+      break;
+    case ReportFormat::kJsonLines:
+      Append(
+          "{{\"type\":\"summary\",\"files\":{},\"lines\":{},"
+          "\"column_limit\":{},\"files_per_second\":{:.0f}",
+          totals.files, totals.lines, totals.column_limit,
+          totals.files_per_second);
+      if (totals.sloc) {
+        Append(",\"code\":{},\"comment\":{},\"blank\":{}", totals.sloc->code,
+               totals.sloc->comment, totals.sloc->blank);
+      }
+      if (totals.dedupe) {
+        Append(
+            ",\"unique_files\":{},\"unique_lines\":{},"
+            "\"duplicate_files\":{},\"duplicate_lines\":{}",
+            totals.dedupe->unique_files, totals.dedupe->unique_lines,
+            totals.dedupe->duplicate_files, totals.dedupe->duplicate_lines);
+      }
+      if (totals.cache_hits_misses) {
+        Append(",\"cache_hits\":{},\"cache_misses\":{}",
+               totals.cache_hits_misses->first,
+               totals.cache_hits_misses->second);
+      }
+      if (totals.long_lines) {
+        Append(",\"long_lines\":{}", *totals.long_lines);
+      }
+      if (totals.diff) {
+        Append(
+            ",\"added_files\":{},\"modified_files\":{},"
+            "\"removed_files\":{},\"lines_added\":{},\"lines_removed\":{}",
+            totals.diff->added_files, totals.diff->modified_files,
+            totals.diff->removed_files, totals.diff->lines_added,
+            totals.diff->lines_removed);
+      }
+      buffer_ += "}\n";
+      break;
+    case ReportFormat::kCsv:
+      // Like a directory row, the opened column holds the number of files
+      Append("total,,{},{},{}", totals.files, totals.lines,
+             totals.column_limit);
+      if (sloc_) {
+        if (totals.sloc) {
+          Append(",{},{},{}", totals.sloc->code, totals.sloc->comment,
+                 totals.sloc->blank);
+        } else {
+          buffer_ += ",,,";
+        }
+      }
+      if (dedupe_) {
+        buffer_ += ',';
+      }
+      buffer_ += '\n';
+      // The other totals are a row each, named by the path column, with
+      // files in opened and lines in lines
+      if (totals.dedupe) {
+        Append("dedupe,unique,{},{},", totals.dedupe->unique_files,
+               totals.dedupe->unique_lines);
+        EndCsvRow();
+        Append("dedupe,duplicate,{},{},", totals.dedupe->duplicate_files,
+               totals.dedupe->duplicate_lines);
+        EndCsvRow();
+      }
+      if (totals.cache_hits_misses) {
+        Append("cache,hits,{},,", totals.cache_hits_misses->first);
+        EndCsvRow();
+        Append("cache,misses,{},,", totals.cache_hits_misses->second);
+        EndCsvRow();
+      }
+      if (totals.long_lines) {
+        Append("long_lines,,,{},", *totals.long_lines);
+        EndCsvRow();
+      }
+      if (totals.diff) {
+        Append("diff,added_files,{},,", totals.diff->added_files);
+        EndCsvRow();
+        Append("diff,modified_files,{},,", totals.diff->modified_files);
+        EndCsvRow();
+        Append("diff,removed_files,{},,", totals.diff->removed_files);
+        EndCsvRow();
+        Append("diff,lines_added,,{},", totals.diff->lines_added);
+        EndCsvRow();
+        Append("diff,lines_removed,,{},", totals.diff->lines_removed);
+        EndCsvRow();
+      }
+      break;
+  }
+}
+
+inline void ReportWriter::Statistics(const Stats& stats,
+                                     double wall_seconds) {
+  const bool text = ReportFormat::kText == format_;
+  const auto field = [&](std::string_view name, auto value) {
+    if (text) {
+      Append("  {:<28}: {}\n", name, value);
+    } else {
+      Append(",\"{}\":{}", name, value);
+    }
+  };
+  const auto milliseconds = [&](std::string_view name, double value) {
+    if (text) {
+      Append("  {:<28}: {:.3f} ms\n", name, value);
+    } else {
+      Append(",\"{}_ms\":{:.3f}", name, value);
+    }
+  };
+
+  buffer_ += text ? "Stats:\n" : "{\"type\":\"stats\"";
+  milliseconds("wall", wall_seconds * 1e3);
+  for (std::size_t i = 0; i < static_cast<std::size_t>(Stats::Phase::kPhases);
+       ++i) {
+    const auto phase = static_cast<Stats::Phase>(i);
+    milliseconds(Stats::PhaseName(phase),
+                 std::chrono::duration<double, std::milli>(stats.time(phase))
+                     .count());
+  }
+  for (std::size_t i = 0;
+       i < static_cast<std::size_t>(Stats::Counter::kCounters); ++i) {
+    const auto counter = static_cast<Stats::Counter>(i);
+    field(Stats::CounterName(counter), stats.count(counter));
+  }
+  const Stats::Process process = Stats::ReadProcess();
+  if (process.read_syscalls) {
+    field("read_syscalls", *process.read_syscalls);
+  }
+  if (process.write_syscalls) {
+    field("write_syscalls", *process.write_syscalls);
+  }
+  if (process.peak_rss) {
+    field("peak_rss", *process.peak_rss);
+  }
+  if (!text) {
+    buffer_ += "}\n";
+  }
+}
+
+inline void ReportWriter::EndCsvRow() {
+  if (sloc_) {
+    buffer_ += ",,,";
+  }
+  if (dedupe_) {
+    buffer_ += ',';
+  }
+  buffer_ += '\n';
+}
+
+inline void ReportWriter::AppendQuoted(std::string_view text) {
+  buffer_ += '"';
+  for (const char c : text) {
+    if ('"' == c || '&' == c) {
+      buffer_ += '&';
+    }
+    buffer_ += c;
+  }
+  buffer_ += '"';
+}
+
+inline void ReportWriter::AppendJsonString(std::string_view text) {
+  buffer_ += '"';
+  for (const char c : text) {
+    switch (c) {
+      case '"':
+        buffer_ += "\\\"";
+        break;
+      case '\\':
+        buffer_ += "\\\\";
+        break;
+      case '\n':
+        buffer_ += "\\n";
+        break;
+      case '\r':
+        buffer_ += "\\r";
+        break;
+      case '\t':
+        buffer_ += "\\t";
+        break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          Append("\\u{:04x}", static_cast<unsigned>(c));
+        } else {
+          buffer_ += c;
+        }
+    }
+  }
+  buffer_ += '"';
+}
+
+inline void ReportWriter::AppendCsvField(std::string_view text) {
+  if (std::string_view::npos == text.find_first_of(",\"\r\n")) {
+    buffer_ += text;
+    return;
+  }
+  buffer_ += '"';
+  for (const char c : text) {
+    if ('"' == c) {
+      buffer_ += '"';
+    }
+    buffer_ += c;
+  }
+  buffer_ += '"';
+}
+
+}  // namespace umutech::count_lines
@@ -0,0 +1,493 @@
+﻿#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include "encoding.hpp"
+
+namespace umutech::count_lines {
+
+struct SlocInfo {
+  std::size_t code;
+  std::size_t comment;
+  std::size_t blank;
+};
+
+// How comments and strings look in a family of languages. Empty tokens
+// don't exist in that family.
+struct Syntax {
+  std::string_view name;
+  std::array<std::string_view, 2> line_comments;
+  std::string_view block_begin;
+  std::string_view block_end;
+  bool nested_blocks;
+  // Strings that end at the end of the line, unless it's escaped
+  std::string_view quotes;
+  // Strings that may span lines, like """ in Python or ` in JavaScript
+  std::array<std::string_view, 2> multiline_quotes;
+  // Raw strings R"x(...)x" and #if 0 ... #endif
+  bool cpp;
+};
+
+namespace syntax {
+
+inline constexpr Syntax kCpp{"C/C++", {"//"}, "/*", "*/", false, "\"'",
+                             {},      true};
+inline constexpr Syntax kCLike{"C-like", {"//"}, "/*", "*/", false, "\"'",
+                               {},       false};
+inline constexpr Syntax kJavaScript{"JavaScript", {"//"}, "/*", "*/", false,
+                                    "\"'",        {"`"},  false};
+inline constexpr Syntax kRust{"Rust", {"//"}, "/*", "*/", true, "\"",
+                              {},     false};
+inline constexpr Syntax kCss{"CSS", {}, "/*", "*/", false, "\"'", {}, false};
+inline constexpr Syntax kPython{"Python", {"#"},  "",  "", false, "\"'",
+                                {R"(""")", "'''"}, false};
+inline constexpr Syntax kHash{"Shell", {"#"}, "", "", false, "\"'", {}, false};
+inline constexpr Syntax kPowerShell{"PowerShell", {"#"}, "<#", "#>", false,
+                                    "\"'",        {},    false};
+inline constexpr Syntax kLua{"Lua", {"--"}, "--[[", "]]", false, "\"'",
+                             {},    false};
+inline constexpr Syntax kSql{"SQL", {"--"}, "/*", "*/", false, "'", {}, false};
+inline constexpr Syntax kHaskell{"Haskell", {"--"}, "{-", "-}", true, "\"",
+                                 {},        false};
+inline constexpr Syntax kMarkup{"Markup", {}, "<!--", "-->", false, "",
+                                {},       false};
+inline constexpr Syntax kSemicolon{"Semicolon", {";"}, "", "", false, "\"",
+                                   {},          false};
+inline constexpr Syntax kIni{"INI", {";", "#"}, "", "", false, "", {}, false};
+inline constexpr Syntax kPercent{"Percent", {"%"}, "", "", false, "\"",
+                                 {},        false};
+inline constexpr Syntax kPhp{"PHP", {"//", "#"}, "/*", "*/", false, "\"'",
+                             {},    false};
+// Files of unknown languages only tell blank lines from the rest
+inline constexpr Syntax kPlain{"Plain", {}, "", "", false, "", {}, false};
+
+}  // namespace syntax
+
+// Splits lines into code, comment and blank in one pass, with a small
+// state machine per line. A line is blank if it holds only white space,
+// code if anything outside a comment is left, and comment otherwise. For
+// C and C++, lines from #if 0 to the matching #endif (or #else) are
+// comments. Lines are split exactly like LineCounter splits them; only a
+// line that crosses the end of a block is copied. UTF-16 is narrowed to
+// bytes on the way in, with every unit beyond ASCII as one non-blank byte.
+class SlocCounter {
+ public:
+  explicit SlocCounter(const Syntax& syntax) noexcept;
+
+  void Feed(const char* data, std::size_t size);
+  SlocInfo Finish();
+
+ private:
+  enum class State { kCode, kBlockComment, kString, kRawString, kDisabled };
+
+  // Bytes of UTF-16 narrowed at a time
+  static constexpr std::size_t kNarrowSize = 4096;
+
+  static bool IsBlank(char c) noexcept {
+    return ' ' == c || static_cast<unsigned char>(c - '\t') <= 4;
+  }
+  static bool IsIdentifier(char c) noexcept {
+    return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') ||
+           ('0' <= c && c <= '9') || '_' == c;
+  }
+  static bool StartsWith(const char* p,
+                         const char* end,
+                         std::string_view token) noexcept {
+    return !token.empty() &&
+           static_cast<std::size_t>(end - p) >= token.size() &&
+           0 == std::memcmp(p, token.data(), token.size());
+  }
+  static const char* SkipBlank(const char* p, const char* end) noexcept {
+    while (p != end && IsBlank(*p)) {
+      ++p;
+    }
+    return p;
+  }
+  // Reads the name of a preprocessor directive after '#'
+  static std::string_view Directive(const char* p, const char* end) noexcept {
+    p = SkipBlank(p, end);
+    const char* name = p;
+    while (p != end && IsIdentifier(*p)) {
+      ++p;
+    }
+    return {name, static_cast<std::size_t>(p - name)};
+  }
+
+  // After the byte order mark
+  void FeedText(const char* data, std::size_t size);
+  void FeedUtf16(const char* data, std::size_t size);
+  void FeedBytes(const char* data, std::size_t size);
+  void ProcessLine(const char* p, std::size_t size);
+  void ProcessDisabledLine(const char* p, const char* end) noexcept;
+  bool IsIfZero(const char* p, const char* end) const noexcept;
+  bool IsRawString(const char* line, const char* p) const noexcept;
+  const char* ScanCode(const char* line,
+                       const char* p,
+                       const char* end,
+                       bool& code,
+                       bool& comment);
+  const char* ScanBlockComment(const char* p,
+                               const char* end,
+                               bool& comment) noexcept;
+  const char* ScanString(const char* p,
+                         const char* end,
+                         bool& escaped_newline) noexcept;
+
+  const Syntax& syntax_;
+  BomReader bom_;
+  // Of a UTF-16 code unit split between blocks
+  bool has_odd_byte_{};
+  char odd_byte_{};
+  // Bytes that may start a comment, a string or a raw string
+  std::array<bool, 256> special_{};
+  State state_{State::kCode};
+  // Nesting of block comments or #if
+  std::size_t depth_{};
+  std::string_view quote_;
+  bool multiline_quote_{};
+  std::string raw_end_;
+  // The line crossing the end of the last block
+  std::string carry_;
+  SlocInfo info_{};
+};
+
+inline SlocCounter::SlocCounter(const Syntax& syntax) noexcept
+    : syntax_(syntax) {
+  const auto mark = [this](std::string_view token) {
+    if (!token.empty()) {
+      special_[static_cast<unsigned char>(token[0])] = true;
+    }
+  };
+  for (const auto token : syntax_.line_comments) {
+    mark(token);
+  }
+  mark(syntax_.block_begin);
+  for (const char quote : syntax_.quotes) {
+    special_[static_cast<unsigned char>(quote)] = true;
+  }
+  for (const auto token : syntax_.multiline_quotes) {
+    mark(token);
+  }
+  if (syntax_.cpp) {
+    special_['R'] = true;
+  }
+}
+
+inline void SlocCounter::Feed(const char* data, std::size_t size) {
+  bom_.Feed(data, size, [this](const char* text, std::size_t text_size) {
+    FeedText(text, text_size);
+  });
+}
+
+inline void SlocCounter::FeedText(const char* data, std::size_t size) {
+  if (IsUtf16(bom_.encoding())) {
+    FeedUtf16(data, size);
+  } else {
+    FeedBytes(data, size);
+  }
+}
+
+inline void SlocCounter::FeedUtf16(const char* data, std::size_t size) {
+  const bool big_endian = Encoding::kUtf16Be == bom_.encoding();
+  const auto narrow = [big_endian](char first, char second) {
+    const char high = big_endian ? first : second;
+    const char low = big_endian ? second : first;
+    return '\0' == high && 0 == (low & 0x80) ? low : '\x80';
+  };
+  char bytes[kNarrowSize];
+  std::size_t count = 0;
+  if (has_odd_byte_ && 0 != size) {
+    bytes[count++] = narrow(odd_byte_, data[0]);
+    has_odd_byte_ = false;
+    ++data;
+    --size;
+  }
+  for (; 2 <= size; data += 2, size -= 2) {
+    bytes[count++] = narrow(data[0], data[1]);
+    if (kNarrowSize == count) {
+      FeedBytes(bytes, count);
+      count = 0;
+    }
+  }
+  if (0 != size) {
+    odd_byte_ = data[0];
+    has_odd_byte_ = true;
+  }
+  FeedBytes(bytes, count);
+}
+
+inline void SlocCounter::FeedBytes(const char* data, std::size_t size) {
+  const char* const end = data + size;
+  while (data != end) {
+    const auto* newline = static_cast<const char*>(
+        std::memchr(data, '\n', static_cast<std::size_t>(end - data)));
+    if (nullptr == newline) {
+      carry_.append(data, end);
+      return;
+    }
+    if (carry_.empty()) {
+      ProcessLine(data, static_cast<std::size_t>(newline - data));
+    } else {
+      carry_.append(data, newline);
+      ProcessLine(carry_.data(), carry_.size());
+      carry_.clear();
+    }
+    data = newline + 1;
+  }
+}
+
+inline SlocInfo SlocCounter::Finish() {
+  bom_.Finish([this](const char* text, std::size_t text_size) {
+    FeedText(text, text_size);
+  });
+  bom_.Reset();
+  has_odd_byte_ = false;
+  // Like std::getline, a non-empty tail is a line
+  if (!carry_.empty()) {
+    ProcessLine(carry_.data(), carry_.size());
+    carry_.clear();
+  }
+  const SlocInfo info = info_;
+  info_ = {};
+  state_ = State::kCode;
+  depth_ = 0;
+  return info;
+}
+
+inline void SlocCounter::ProcessLine(const char* p, std::size_t size) {
+  const char* end = p + size;
+  if (p != end && '\r' == end[-1]) {
+    --end;
+  }
+  const char* const line = p;
+  p = SkipBlank(p, end);
+  if (p == end) {
+    // White space inside a string literal is still part of the code
+    if (State::kString == state_ || State::kRawString == state_) {
+      ++info_.code;
+    } else {
+      ++info_.blank;
+    }
+    if (State::kString == state_ && !multiline_quote_) {
+      state_ = State::kCode;
+    }
+    return;
+  }
+
+  if (State::kDisabled == state_) {
+    ProcessDisabledLine(p, end);
+    return;
+  }
+  if (State::kCode == state_ && syntax_.cpp && '#' == *p &&
+      IsIfZero(p + 1, end)) {
+    state_ = State::kDisabled;
+    depth_ = 1;
+    ++info_.comment;
+    return;
+  }
+
+  bool code = false;
+  bool comment = false;
+  bool escaped_newline = false;
+  while (p != end) {
+    switch (state_) {
+      case State::kCode:
+        p = ScanCode(line, p, end, code, comment);
+        break;
+      case State::kBlockComment:
+        p = ScanBlockComment(p, end, comment);
+        break;
+      case State::kString:
+        code = true;
+        p = ScanString(p, end, escaped_newline);
+        break;
+      case State::kRawString: {
+        code = true;
+        const std::string_view rest(p, static_cast<std::size_t>(end - p));
+        const auto found = rest.find(raw_end_);
+        if (std::string_view::npos == found) {
+          p = end;
+        } else {
+          p += found + raw_end_.size();
+          state_ = State::kCode;
+        }
+        break;
+      }
+      case State::kDisabled:
+        p = end;
+        break;
+    }
+  }
+  if (State::kString == state_ && !multiline_quote_ && !escaped_newline) {
+    state_ = State::kCode;
+  }
+
+  if (code) {
+    ++info_.code;
+  } else if (comment) {
+    ++info_.comment;
+  } else {
+    ++info_.blank;
+  }
+}
+
+inline void SlocCounter::ProcessDisabledLine(const char* p,
+                                             const char* end) noexcept {
+  ++info_.comment;
+  if ('#' != *p) {
+    return;
+  }
+  const auto directive = Directive(p + 1, end);
+  if ("if" == directive || "ifdef" == directive || "ifndef" == directive) {
+    ++depth_;
+  } else if ("endif" == directive) {
+    if (0 == --depth_) {
+      state_ = State::kCode;
+    }
+  } else if (1 == depth_ &&
+             ("else" == directive || "elif" == directive ||
+              "elifdef" == directive || "elifndef" == directive)) {
+    // The other branch is live code, and so is the directive
+    state_ = State::kCode;
+    depth_ = 0;
+    --info_.comment;
+    ++info_.code;
+  }
+}
+
+inline bool SlocCounter::IsIfZero(const char* p,
+                                  const char* end) const noexcept {
+  if ("if" != Directive(p, end)) {
+    return false;
+  }
+  p = SkipBlank(p, end) + 2;
+  const char* zero = SkipBlank(p, end);
+  return zero != p && zero != end && '0' == *zero &&
+         (zero + 1 == end || !IsIdentifier(zero[1]));
+}
+
+inline bool SlocCounter::IsRawString(const char* line,
+                                     const char* p) const noexcept {
+  // R"..." with an optional encoding prefix u8, u, U or L
+  const char* prefix = p;
+  if (prefix != line && ('u' == prefix[-1] || 'U' == prefix[-1] ||
+                         'L' == prefix[-1])) {
+    --prefix;
+  } else if (prefix - line >= 2 && '8' == prefix[-1] && 'u' == prefix[-2]) {
+    prefix -= 2;
+  }
+  return prefix == line || !IsIdentifier(prefix[-1]);
+}
+
+inline const char* SlocCounter::ScanCode(const char* line,
+                                         const char* p,
+                                         const char* end,
+                                         bool& code,
+                                         bool& comment) {
+  while (p != end) {
+    const char c = *p;
+    if (!special_[static_cast<unsigned char>(c)]) {
+      code = code || !IsBlank(c);
+      ++p;
+      continue;
+    }
+    // Longer tokens first, "--[[" before "--" and """ before "
+    if (StartsWith(p, end, syntax_.block_begin)) {
+      comment = true;
+      state_ = State::kBlockComment;
+      depth_ = 1;
+      return p + syntax_.block_begin.size();
+    }
+    for (const auto token : syntax_.line_comments) {
+      if (StartsWith(p, end, token)) {
+        comment = true;
+        return end;
+      }
+    }
+    for (const auto token : syntax_.multiline_quotes) {
+      if (StartsWith(p, end, token)) {
+        code = true;
+        state_ = State::kString;
+        quote_ = token;
+        multiline_quote_ = true;
+        return p + token.size();
+      }
+    }
+    if (syntax_.cpp && 'R' == c && p + 1 != end && '"' == p[1] &&
+        IsRawString(line, p)) {
+      const char* open = p + 2;
+      const char* paren = open;
+      while (paren != end && '(' != *paren && paren - open <= 16) {
+        ++paren;
+      }
+      if (paren != end && '(' == *paren) {
+        code = true;
+        state_ = State::kRawString;
+        raw_end_.assign(1, ')');
+        raw_end_.append(open, paren);
+        raw_end_.push_back('"');
+        return paren + 1;
+      }
+    }
+    if (const auto quote = syntax_.quotes.find(c);
+        std::string_view::npos != quote) {
+      code = true;
+      state_ = State::kString;
+      // Point into the syntax, the line may be gone when the string goes on
+      quote_ = syntax_.quotes.substr(quote, 1);
+      multiline_quote_ = false;
+      return p + 1;
+    }
+    code = true;
+    ++p;
+  }
+  return p;
+}
+
+inline const char* SlocCounter::ScanBlockComment(const char* p,
+                                                 const char* end,
+                                                 bool& comment) noexcept {
+  while (p != end) {
+    if (syntax_.nested_blocks && StartsWith(p, end, syntax_.block_begin)) {
+      ++depth_;
+      p += syntax_.block_begin.size();
+    } else if (StartsWith(p, end, syntax_.block_end)) {
+      comment = true;
+      p += syntax_.block_end.size();
+      if (0 == --depth_) {
+        state_ = State::kCode;
+        return p;
+      }
+    } else {
+      comment = comment || !IsBlank(*p);
+      ++p;
+    }
+  }
+  return p;
+}
+
+inline const char* SlocCounter::ScanString(const char* p,
+                                           const char* end,
+                                           bool& escaped_newline) noexcept {
+  while (p != end) {
+    if ('\\' == *p) {
+      if (1 == end - p) {
+        escaped_newline = true;
+        return end;
+      }
+      p += 2;
+    } else if (StartsWith(p, end, quote_)) {
+      state_ = State::kCode;
+      return p + quote_.size();
+    } else {
+      ++p;
+    }
+  }
+  return p;
+}
+
+}  // namespace umutech::count_lines
@@ -0,0 +1,340 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/nowide/fstream.hpp>
+
+#include "count_cache.hpp"
+#include "hash.hpp"
+#include "input_file.hpp"
+#include "line_counter.hpp"
+#include "sloc.hpp"
+
+namespace umutech::count_lines {
+
+// The name of a file in a snapshot: its path below the root, in UTF-8 with
+// '/', so snapshots of checkouts anywhere, on any system, line up
+inline std::string SnapshotName(const boost::filesystem::path& path,
+                                const boost::filesystem::path& root) {
+  auto spelled = path.native();
+  if (spelled.starts_with(root.native())) {
+    spelled.erase(0, root.native().size());
+  }
+  const auto begin = spelled.find_first_not_of(
+      boost::filesystem::path::string_type(1, '/') +
+      boost::filesystem::path::preferred_separator);
+  spelled.erase(0, std::min(begin, spelled.size()));
+  return boost::filesystem::path(spelled).generic_string();
+}
+
+// The counts of every file of a tree at one point, for --save-snapshot and
+// --diff. Like CountCache it's a header, a table of fixed-size records and
+// then the names, searched in place through a read-only mapping; but the
+// records are sorted by name, so two snapshots compare in one pass over
+// both, and their names are relative to the root.
+class Snapshot {
+ public:
+  // What the counts depend on besides the files; snapshots that differ in
+  // these don't compare
+  struct Options {
+    bool ignore_empty;
+    bool sloc;
+    bool code_points;
+  };
+
+  struct File {
+    std::string_view name;
+    std::optional<FileStamp> stamp;
+    bool opened;
+    FileInfo info;
+    std::optional<SlocInfo> sloc;
+  };
+
+  explicit Snapshot(const Options& options = {}) noexcept
+      : options_(options) {}
+  Snapshot(const Snapshot&) = delete;
+  Snapshot& operator=(const Snapshot&) = delete;
+
+  // Returns false if the file is missing or isn't a valid snapshot
+  bool Load(const boost::filesystem::path& filename) noexcept;
+
+  // Files of a snapshot that isn't loaded, in any order; call Finish()
+  // after the last one
+  void Add(const File& file);
+  void Finish();
+
+  // Replaces the file atomically
+  bool Save(const boost::filesystem::path& filename) const;
+
+  const Options& options() const noexcept { return options_; }
+  // In name order
+  std::size_t size() const noexcept { return record_count_; }
+  File operator[](std::size_t i) const noexcept;
+
+  // The counts of `name`, if its size and mtime are still those of `stamp`.
+  // Thread safe. Files without code/comment/blank counts don't match
+  // `need_sloc`.
+  std::optional<CachedCounts> Find(std::string_view name,
+                                   const FileStamp& stamp,
+                                   bool need_sloc) const noexcept;
+
+ private:
+  static constexpr char kMagic[8] = {'C', 'L', 'S', 'N', 'A', 'P', 0, 0};
+  static constexpr std::uint32_t kVersion = 1;
+  // Of Options
+  static constexpr std::uint32_t kIgnoreEmpty = 1;
+  static constexpr std::uint32_t kSloc = 2;
+  static constexpr std::uint32_t kCodePoints = 4;
+  // Of a record
+  static constexpr std::uint32_t kOpened = 1;
+  static constexpr std::uint32_t kHasSloc = 2;
+  static constexpr std::uint32_t kStamped = 4;
+
+  struct Header {
+    char magic[8];
+    std::uint32_t version;
+    // Catches a snapshot written by a build with another layout or byte
+    // order
+    std::uint32_t record_size;
+    std::uint32_t options;
+    std::uint32_t reserved;
+    std::uint64_t record_count;
+    std::uint64_t names_size;
+    std::uint64_t checksum;
+  };
+
+  struct Record {
+    std::uint64_t name_offset;
+    std::uint32_t name_size;
+    std::uint32_t flags;
+    FileStamp stamp;
+    std::uint64_t lines;
+    std::uint64_t column_limit;
+    std::uint64_t code;
+    std::uint64_t comment;
+    std::uint64_t blank;
+  };
+
+  std::string_view NameOf(const Record& record) const noexcept {
+    return {names_ + record.name_offset, record.name_size};
+  }
+
+  Options options_;
+  InputFile file_;
+  const Record* records_{};
+  std::size_t record_count_{};
+  const char* names_{};
+
+  // Of a snapshot that isn't loaded
+  std::vector<Record> added_;
+  std::vector<char> added_names_;
+};
+
+// Goes through two snapshots in name order at once, and calls
+// visit(const Snapshot::File* before, const Snapshot::File* after) for
+// each name, with nullptr for the side that doesn't have it
+template <typename Visit>
+void DiffSnapshots(const Snapshot& before,
+                   const Snapshot& after,
+                   Visit&& visit) {
+  std::size_t i = 0;
+  std::size_t j = 0;
+  while (i < before.size() || j < after.size()) {
+    if (j == after.size()) {
+      const Snapshot::File old = before[i++];
+      visit(&old, nullptr);
+    } else if (i == before.size()) {
+      const Snapshot::File now = after[j++];
+      visit(nullptr, &now);
+    } else {
+      const Snapshot::File old = before[i];
+      const Snapshot::File now = after[j];
+      const int order = old.name.compare(now.name);
+      i += order <= 0;
+      j += 0 <= order;
+      visit(order <= 0 ? &old : nullptr, 0 <= order ? &now : nullptr);
+    }
+  }
+}
+
+inline bool Snapshot::Load(const boost::filesystem::path& filename) noexcept {
+  if (!file_.Open(filename) || file_.size() < sizeof(Header) ||
+      !file_.Map()) {
+    file_.Close();
+    return false;
+  }
+
+  Header header;
+  std::memcpy(&header, file_.data(), sizeof(header));
+  const std::uint64_t body_size = file_.size() - sizeof(header);
+  if (0 != std::memcmp(header.magic, kMagic, sizeof(kMagic)) ||
+      kVersion != header.version || sizeof(Record) != header.record_size ||
+      body_size / sizeof(Record) < header.record_count ||
+      body_size != header.record_count * sizeof(Record) + header.names_size ||
+      header.checksum !=
+          Xxh64::Hash(file_.data() + sizeof(header),
+                      static_cast<std::size_t>(body_size))) {
+    file_.Close();
+    return false;
+  }
+
+  records_ = reinterpret_cast<const Record*>(file_.data() + sizeof(header));
+  record_count_ = static_cast<std::size_t>(header.record_count);
+  names_ = file_.data() + sizeof(header) + record_count_ * sizeof(Record);
+  for (std::size_t i = 0; i < record_count_; ++i) {
+    const Record& record = records_[i];
+    if (header.names_size < record.name_offset ||
+        header.names_size - record.name_offset < record.name_size ||
+        (0 != i && NameOf(record) <= NameOf(records_[i - 1]))) {
+      records_ = nullptr;
+      record_count_ = 0;
+      file_.Close();
+      return false;
+    }
+  }
+  options_ = {0 != (header.options & kIgnoreEmpty),
+              0 != (header.options & kSloc),
+              0 != (header.options & kCodePoints)};
+  return true;
+}
+
+inline void Snapshot::Add(const File& file) {
+  Record record{};
+  record.name_offset = added_names_.size();
+  record.name_size = static_cast<std::uint32_t>(file.name.size());
+  record.flags = file.opened ? kOpened : 0;
+  if (file.stamp) {
+    record.flags |= kStamped;
+    record.stamp = *file.stamp;
+  }
+  record.lines = file.info.lines;
+  record.column_limit = file.info.column_limit;
+  if (file.sloc) {
+    record.flags |= kHasSloc;
+    record.code = file.sloc->code;
+    record.comment = file.sloc->comment;
+    record.blank = file.sloc->blank;
+  }
+  added_.push_back(record);
+  added_names_.insert(added_names_.end(), file.name.begin(), file.name.end());
+}
+
+inline void Snapshot::Finish() {
+  names_ = added_names_.data();
+  std::sort(added_.begin(), added_.end(),
+            [this](const Record& lhs, const Record& rhs) {
+              return NameOf(lhs) < NameOf(rhs);
+            });
+  // A file given twice is there once
+  added_.erase(std::unique(added_.begin(), added_.end(),
+                           [this](const Record& lhs, const Record& rhs) {
+                             return NameOf(lhs) == NameOf(rhs);
+                           }),
+               added_.end());
+  records_ = added_.data();
+  record_count_ = added_.size();
+}
+
+inline bool Snapshot::Save(const boost::filesystem::path& filename) const {
+  // Names go out in record order, so a snapshot reads front to back
+  std::vector<Record> records(records_, records_ + record_count_);
+  std::string names;
+  for (Record& record : records) {
+    const std::string_view name = NameOf(record);
+    record.name_offset = names.size();
+    names += name;
+  }
+
+  Header header{};
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.record_size = sizeof(Record);
+  header.options = (options_.ignore_empty ? kIgnoreEmpty : 0) |
+                   (options_.sloc ? kSloc : 0) |
+                   (options_.code_points ? kCodePoints : 0);
+  header.record_count = records.size();
+  header.names_size = names.size();
+  std::vector<char> body(records.size() * sizeof(Record) + names.size());
+  if (!records.empty()) {
+    std::memcpy(body.data(), records.data(), records.size() * sizeof(Record));
+  }
+  std::copy(names.begin(), names.end(),
+            body.begin() + records.size() * sizeof(Record));
+  header.checksum = Xxh64::Hash(body.data(), body.size());
+
+  // Don't overwrite it in place, it may be the one loaded and mapped
+  boost::filesystem::path temp = filename;
+  temp += ".tmp";
+  {
+    boost::nowide::ofstream f(temp.string(),
+                              std::ios::binary | std::ios::trunc);
+    if (!f) {
+      return false;
+    }
+    f.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    f.write(body.data(), static_cast<std::streamsize>(body.size()));
+    if (!f.flush()) {
+      return false;
+    }
+  }
+  boost::system::error_code ec;
+  boost::filesystem::rename(temp, filename, ec);
+  return !ec;
+}
+
+inline Snapshot::File Snapshot::operator[](std::size_t i) const noexcept {
+  const Record& record = records_[i];
+  File file{NameOf(record),
+            std::nullopt,
+            0 != (record.flags & kOpened),
+            {static_cast<std::size_t>(record.lines),
+             static_cast<std::size_t>(record.column_limit)},
+            std::nullopt};
+  if (record.flags & kStamped) {
+    file.stamp = record.stamp;
+  }
+  if (record.flags & kHasSloc) {
+    file.sloc = SlocInfo{static_cast<std::size_t>(record.code),
+                         static_cast<std::size_t>(record.comment),
+                         static_cast<std::size_t>(record.blank)};
+  }
+  return file;
+}
+
+inline std::optional<CachedCounts> Snapshot::Find(
+    std::string_view name,
+    const FileStamp& stamp,
+    bool need_sloc) const noexcept {
+  const Record* end = records_ + record_count_;
+  const Record* record = std::lower_bound(
+      records_, end, name, [this](const Record& lhs, std::string_view rhs) {
+        return NameOf(lhs) < rhs;
+      });
+  // A checkout elsewhere has other devices and inodes
+  if (end == record || NameOf(*record) != name ||
+      0 == (record->flags & kStamped) || 0 == (record->flags & kOpened) ||
+      record->stamp.size != stamp.size ||
+      record->stamp.mtime_ns != stamp.mtime_ns ||
+      (need_sloc && 0 == (record->flags & kHasSloc))) {
+    return std::nullopt;
+  }
+  CachedCounts counts{{static_cast<std::size_t>(record->lines),
+                       static_cast<std::size_t>(record->column_limit)},
+                      std::nullopt};
+  if (record->flags & kHasSloc) {
+    counts.sloc = SlocInfo{static_cast<std::size_t>(record->code),
+                           static_cast<std::size_t>(record->comment),
+                           static_cast<std::size_t>(record->blank)};
+  }
+  return counts;
+}
+
+}  // namespace umutech::count_lines
@@ -0,0 +1,451 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+#include "dir_tree.hpp"
+#include "file_counter.hpp"
+#include "line_counter.hpp"
+#include "line_lengths.hpp"
+#include "sloc.hpp"
+#include "stats.hpp"
+
+namespace umutech::count_lines {
+
+// A path spelled in two pieces, its directory with the trailing separator
+// and its name, so files needn't be put together to be compared
+struct Spelling {
+  using Char = boost::filesystem::path::value_type;
+  using Piece = std::basic_string_view<Char>;
+
+  Piece prefix;
+  Piece name;
+
+  std::size_t size() const noexcept { return prefix.size() + name.size(); }
+  Char operator[](std::size_t i) const noexcept {
+    return i < prefix.size() ? prefix[i] : name[i - prefix.size()];
+  }
+};
+
+inline bool IsSeparator(Spelling::Char c) noexcept {
+  return '/' == c || boost::filesystem::path::preferred_separator == c;
+}
+
+// Orders spellings as path::compare() orders the paths of a walk, element
+// by element. Without repeated separators that's the order of characters,
+// with a separator below any other.
+inline int CompareSpellings(const Spelling& lhs,
+                            const Spelling& rhs) noexcept {
+  const auto rank = [](Spelling::Char c) -> std::uint32_t {
+    return IsSeparator(c)
+               ? 0
+               : static_cast<std::make_unsigned_t<Spelling::Char>>(c) + 1u;
+  };
+  // Files of a directory share the interned prefix
+  std::size_t i = 0;
+  if (lhs.prefix.data() == rhs.prefix.data() &&
+      lhs.prefix.size() == rhs.prefix.size()) {
+    i = lhs.prefix.size();
+  }
+  for (const std::size_t size = std::min(lhs.size(), rhs.size()); i < size;
+       ++i) {
+    const std::uint32_t left = rank(lhs[i]);
+    const std::uint32_t right = rank(rhs[i]);
+    if (left != right) {
+      return left < right ? -1 : 1;
+    }
+  }
+  return lhs.size() == rhs.size() ? 0 : lhs.size() < rhs.size() ? -1 : 1;
+}
+
+// Counted files in path order within a memory budget, for --memory. Files
+// come in as they are counted, in any order, and are kept as compact
+// records: each directory is spelled once in an arena, and a record only
+// adds its name and counts. Once the records outgrow the budget they are
+// sorted into a run in a temporary file, and Merge() reads the runs back
+// side by side, one file of each at a time. Every kMaxRuns runs are merged
+// into one, so the open files and their buffers stay bounded too.
+class SortedRuns {
+ public:
+  // Of each run file
+  static constexpr std::size_t kBufferSize = 16 << 10;
+  static constexpr std::size_t kMaxRuns = 64;
+
+  explicit SortedRuns(std::size_t budget) noexcept : budget_(budget) {}
+  SortedRuns(const SortedRuns&) = delete;
+  SortedRuns& operator=(const SortedRuns&) = delete;
+
+  // Merge() gives a file that was added twice once, and takes the other
+  // out of the tree again
+  void UseDirTree(DirTree* tree) noexcept { tree_ = tree; }
+
+  // Thread safe
+  void Add(const CountedFile& file);
+
+  // After the last Add(), calls `visit` with each file in path order.
+  // Returns false if a run couldn't be written or read back.
+  template <typename Visit>
+  bool Merge(Visit&& visit);
+
+ private:
+  using Char = Spelling::Char;
+  using Piece = Spelling::Piece;
+
+  struct Record {
+    Spelling spelling;
+    std::uint64_t lines;
+    std::uint64_t column_limit;
+    SlocInfo sloc;
+    // Into long_lines_
+    std::size_t long_lines;
+    std::size_t long_line_count;
+    bool opened;
+    bool has_sloc;
+    bool duplicate;
+  };
+
+  struct Block {
+    std::unique_ptr<Char[]> data;
+    std::size_t size;
+  };
+
+  struct FileCloser {
+    void operator()(std::FILE* file) const noexcept { std::fclose(file); }
+  };
+  using File = std::unique_ptr<std::FILE, FileCloser>;
+
+  // The next file of a run, or of the records without a file
+  struct Cursor {
+    File file;
+    std::size_t next;
+    CountedFile head;
+  };
+
+  static constexpr std::size_t kBlockSize = 64 << 10;
+
+  template <typename T>
+  static bool Put(std::FILE* file, const T& value) noexcept {
+    return 1 == std::fwrite(&value, sizeof(value), 1, file);
+  }
+  template <typename T>
+  static bool Get(std::FILE* file, T& value) noexcept {
+    return 1 == std::fread(&value, sizeof(value), 1, file);
+  }
+  // Empty arrays may have no data at all
+  template <typename T>
+  static bool PutArray(std::FILE* file, const T* data, std::size_t size) {
+    return 0 == size || size == std::fwrite(data, sizeof(T), size, file);
+  }
+  template <typename T>
+  static bool GetArray(std::FILE* file, T* data, std::size_t size) {
+    return 0 == size || size == std::fread(data, sizeof(T), size, file);
+  }
+  static Record RecordOf(const CountedFile& file,
+                         const Spelling& spelling,
+                         std::size_t long_lines) noexcept {
+    return {spelling,
+            file.info.lines,
+            file.info.column_limit,
+            file.sloc.value_or(SlocInfo{}),
+            long_lines,
+            file.long_lines.size(),
+            file.opened,
+            file.sloc.has_value(),
+            file.duplicate};
+  }
+
+  // Copies `piece` into the arena
+  Piece Copy(Piece piece);
+  // Bytes held by the records, roughly
+  std::size_t Used() const noexcept;
+  void Sort();
+  void Spill();
+  // Merges all runs into one
+  void Compact();
+  void Clear() noexcept;
+  // Calls `visit` with the heads of the cursors in path order
+  template <typename Visit>
+  void Interleave(std::vector<Cursor>& cursors, Visit&& visit);
+  bool Advance(Cursor& cursor);
+  static File CreateRun() noexcept;
+  static bool Write(std::FILE* file,
+                    const Record& record,
+                    const LongLine* long_lines) noexcept;
+  // Returns false at the end of the run, or on errors
+  bool Read(std::FILE* file, CountedFile& counted);
+
+  std::size_t budget_;
+  DirTree* tree_{};
+  std::mutex mutex_;
+  std::vector<Block> blocks_;
+  // Of the last block
+  std::size_t filled_{};
+  std::unordered_set<Piece> prefixes_;
+  std::vector<Record> records_;
+  std::vector<LongLine> long_lines_;
+  std::vector<File> runs_;
+  bool failed_{};
+};
+
+inline void SortedRuns::Add(const CountedFile& file) {
+  const auto& spelled = file.path.native();
+  const auto separator =
+      std::find_if(spelled.rbegin(), spelled.rend(), IsSeparator);
+  const auto split = static_cast<std::size_t>(spelled.rend() - separator);
+  const Piece path(spelled);
+
+  std::lock_guard lock(mutex_);
+  auto prefix = prefixes_.find(path.substr(0, split));
+  if (prefixes_.end() == prefix) {
+    prefix = prefixes_.insert(Copy(path.substr(0, split))).first;
+  }
+  records_.push_back(RecordOf(file, {*prefix, Copy(path.substr(split))},
+                              long_lines_.size()));
+  long_lines_.insert(long_lines_.end(), file.long_lines.begin(),
+                     file.long_lines.end());
+  if (budget_ <= Used()) {
+    Spill();
+  }
+}
+
+template <typename Visit>
+bool SortedRuns::Merge(Visit&& visit) {
+  // The last run stays in memory
+  Sort();
+  std::vector<Cursor> cursors(runs_.size() + 1);
+  for (std::size_t i = 0; i < runs_.size(); ++i) {
+    cursors[i].file = std::move(runs_[i]);
+  }
+  runs_.clear();
+  if (!failed_) {
+    boost::filesystem::path::string_type previous;
+    bool first = true;
+    Interleave(cursors, [&](const CountedFile& file) {
+      if (!first && previous == file.path.native()) {
+        if (nullptr != tree_) {
+          tree_->RemoveFile(tree_->Intern(file.path.parent_path()),
+                            file.info);
+        }
+        return;
+      }
+      first = false;
+      previous = file.path.native();
+      visit(file);
+    });
+  }
+  Clear();
+  return !failed_;
+}
+
+template <typename Visit>
+void SortedRuns::Interleave(std::vector<Cursor>& cursors, Visit&& visit) {
+  // A min-heap of the cursors by their next file
+  const auto later = [&cursors](std::size_t lhs, std::size_t rhs) {
+    const auto& left = cursors[lhs].head.path.native();
+    const auto& right = cursors[rhs].head.path.native();
+    return 0 < CompareSpellings({left, {}}, {right, {}});
+  };
+  std::vector<std::size_t> heap;
+  for (std::size_t i = 0; i < cursors.size(); ++i) {
+    if (cursors[i].file) {
+      std::rewind(cursors[i].file.get());
+    }
+    if (Advance(cursors[i])) {
+      heap.push_back(i);
+    }
+  }
+  std::make_heap(heap.begin(), heap.end(), later);
+  while (!heap.empty()) {
+    std::pop_heap(heap.begin(), heap.end(), later);
+    Cursor& cursor = cursors[heap.back()];
+    visit(std::as_const(cursor.head));
+    if (Advance(cursor)) {
+      std::push_heap(heap.begin(), heap.end(), later);
+    } else {
+      heap.pop_back();
+    }
+  }
+}
+
+inline bool SortedRuns::Advance(Cursor& cursor) {
+  if (cursor.file) {
+    return Read(cursor.file.get(), cursor.head);
+  }
+  if (records_.size() == cursor.next) {
+    return false;
+  }
+  const Record& record = records_[cursor.next++];
+  CountedFile& file = cursor.head;
+  boost::filesystem::path::string_type spelled;
+  spelled.reserve(record.spelling.size());
+  spelled.append(record.spelling.prefix);
+  spelled.append(record.spelling.name);
+  file.path = std::move(spelled);
+  file.opened = record.opened;
+  file.info = {static_cast<std::size_t>(record.lines),
+               static_cast<std::size_t>(record.column_limit)};
+  file.sloc.reset();
+  if (record.has_sloc) {
+    file.sloc = record.sloc;
+  }
+  file.duplicate = record.duplicate;
+  const auto* long_lines = long_lines_.data() + record.long_lines;
+  file.long_lines.assign(long_lines, long_lines + record.long_line_count);
+  return true;
+}
+
+inline SortedRuns::Piece SortedRuns::Copy(Piece piece) {
+  if (blocks_.empty() || blocks_.back().size - filled_ < piece.size()) {
+    const std::size_t size = std::max(kBlockSize, piece.size());
+    blocks_.push_back({std::make_unique<Char[]>(size), size});
+    filled_ = 0;
+  }
+  Char* data = blocks_.back().data.get() + filled_;
+  std::copy(piece.begin(), piece.end(), data);
+  filled_ += piece.size();
+  return {data, piece.size()};
+}
+
+inline std::size_t SortedRuns::Used() const noexcept {
+  std::size_t used = records_.size() * sizeof(Record) +
+                     long_lines_.size() * sizeof(LongLine) +
+                     prefixes_.bucket_count() * sizeof(void*) +
+                     prefixes_.size() * (sizeof(Piece) + 2 * sizeof(void*));
+  for (const Block& block : blocks_) {
+    used += block.size * sizeof(Char);
+  }
+  return used;
+}
+
+inline void SortedRuns::Sort() {
+  std::sort(records_.begin(), records_.end(),
+            [](const Record& lhs, const Record& rhs) {
+              return CompareSpellings(lhs.spelling, rhs.spelling) < 0;
+            });
+}
+
+inline void SortedRuns::Spill() {
+  Sort();
+  File file = CreateRun();
+  bool written = nullptr != file;
+  for (const Record& record : records_) {
+    if (!written) {
+      break;
+    }
+    written = Write(file.get(), record,
+                    long_lines_.data() + record.long_lines);
+  }
+  if (written && 0 == std::fflush(file.get())) {
+    runs_.push_back(std::move(file));
+    Stats::Add(Stats::Counter::kSortedRuns);
+  } else {
+    failed_ = true;
+  }
+  // The vectors keep their capacity for the next run
+  Clear();
+  if (kMaxRuns <= runs_.size()) {
+    Compact();
+  }
+}
+
+inline void SortedRuns::Compact() {
+  std::vector<Cursor> cursors(runs_.size());
+  for (std::size_t i = 0; i < runs_.size(); ++i) {
+    cursors[i].file = std::move(runs_[i]);
+  }
+  runs_.clear();
+  File file = CreateRun();
+  bool written = nullptr != file;
+  Interleave(cursors, [&](const CountedFile& counted) {
+    written = written &&
+              Write(file.get(),
+                    RecordOf(counted, {counted.path.native(), {}}, 0),
+                    counted.long_lines.data());
+  });
+  if (written && 0 == std::fflush(file.get())) {
+    runs_.push_back(std::move(file));
+  } else {
+    failed_ = true;
+  }
+}
+
+inline void SortedRuns::Clear() noexcept {
+  records_.clear();
+  long_lines_.clear();
+  prefixes_.clear();
+  blocks_.clear();
+  filled_ = 0;
+}
+
+inline SortedRuns::File SortedRuns::CreateRun() noexcept {
+  File file(std::tmpfile());
+  if (file && 0 != std::setvbuf(file.get(), nullptr, _IOFBF, kBufferSize)) {
+    file.reset();
+  }
+  return file;
+}
+
+inline bool SortedRuns::Write(std::FILE* file,
+                              const Record& record,
+                              const LongLine* long_lines) noexcept {
+  const auto size = static_cast<std::uint32_t>(record.spelling.size());
+  const auto flags = static_cast<std::uint8_t>(
+      record.opened | record.has_sloc << 1 | record.duplicate << 2);
+  const auto count = static_cast<std::uint64_t>(record.long_line_count);
+  const auto& prefix = record.spelling.prefix;
+  const auto& name = record.spelling.name;
+  return Put(file, size) && PutArray(file, prefix.data(), prefix.size()) &&
+         PutArray(file, name.data(), name.size()) && Put(file, flags) &&
+         Put(file, record.lines) && Put(file, record.column_limit) &&
+         (!record.has_sloc || Put(file, record.sloc)) && Put(file, count) &&
+         PutArray(file, long_lines, record.long_line_count);
+}
+
+inline bool SortedRuns::Read(std::FILE* file, CountedFile& counted) {
+  std::uint32_t size;
+  if (!Get(file, size)) {
+    failed_ = failed_ || 0 != std::ferror(file);
+    return false;
+  }
+  boost::filesystem::path::string_type spelled(size, Char{});
+  std::uint8_t flags;
+  std::uint64_t lines;
+  std::uint64_t column_limit;
+  SlocInfo sloc;
+  std::uint64_t count;
+  bool read = GetArray(file, spelled.data(), size) && Get(file, flags) &&
+              Get(file, lines) && Get(file, column_limit) &&
+              (0 == (flags & 2) || Get(file, sloc)) && Get(file, count);
+  if (read) {
+    counted.long_lines.resize(static_cast<std::size_t>(count));
+    read = GetArray(file, counted.long_lines.data(),
+                    counted.long_lines.size());
+  }
+  if (!read) {
+    failed_ = true;
+    return false;
+  }
+  counted.path = std::move(spelled);
+  counted.opened = 0 != (flags & 1);
+  counted.info = {static_cast<std::size_t>(lines),
+                  static_cast<std::size_t>(column_limit)};
+  counted.sloc.reset();
+  if (0 != (flags & 2)) {
+    counted.sloc = sloc;
+  }
+  counted.duplicate = 0 != (flags & 4);
+  return true;
+}
+
+}  // namespace umutech::count_lines
@@ -0,0 +1,260 @@
+﻿#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+
+#include <cstdio>
+#endif
+
+namespace umutech::count_lines {
+
+// Timers and counters of --stats. Only one Stats is active at a time, and
+// without one every hook is a load and a branch, so the hot loops don't
+// pay for it.
+//
+// Phases are timed per thread and exclusively: a phase that starts inside
+// another pauses it, so when the walk counts a file inline the counting
+// isn't charged to the walk too. With several threads the phases add up to
+// more than the wall clock.
+class Stats {
+ public:
+  enum class Phase {
+    kWalk,
+    kCanonical,
+    kStat,
+    kOpen,
+    kRead,
+    kCount,
+    kOutput,
+    kPhases,
+  };
+
+  enum class Counter {
+    kDirectories,
+    kFilesVisited,
+    kFilesSkippedByExtension,
+    kFilesIgnored,
+    kFilesCounted,
+    kBytesRead,
+    kDuplicateFiles,
+    kSortedRuns,
+    kCounters,
+  };
+
+  // System wide numbers of the process, where the OS has them
+  struct Process {
+    std::optional<std::uint64_t> peak_rss;
+    std::optional<std::uint64_t> read_syscalls;
+    std::optional<std::uint64_t> write_syscalls;
+  };
+
+  class ScopedTimer;
+
+  Stats() = default;
+  Stats(const Stats&) = delete;
+  Stats& operator=(const Stats&) = delete;
+  ~Stats() {
+    if (this == active_.load(std::memory_order_relaxed)) {
+      Deactivate();
+    }
+  }
+
+  static Stats* Active() noexcept {
+    return active_.load(std::memory_order_relaxed);
+  }
+  void Activate() noexcept { active_.store(this, std::memory_order_relaxed); }
+  static void Deactivate() noexcept {
+    active_.store(nullptr, std::memory_order_relaxed);
+  }
+
+  static void Add(Counter counter, std::uint64_t value = 1) noexcept {
+    if (Stats* stats = Active()) {
+      stats->counters_[static_cast<std::size_t>(counter)].fetch_add(
+          value, std::memory_order_relaxed);
+    }
+  }
+
+  std::uint64_t count(Counter counter) const noexcept {
+    return counters_[static_cast<std::size_t>(counter)].load(
+        std::memory_order_relaxed);
+  }
+  // Summed over all threads
+  std::chrono::nanoseconds time(Phase phase) const noexcept {
+    return std::chrono::nanoseconds(
+        nanoseconds_[static_cast<std::size_t>(phase)].load(
+            std::memory_order_relaxed));
+  }
+
+  static const char* PhaseName(Phase phase) noexcept;
+  static const char* CounterName(Counter counter) noexcept;
+  static Process ReadProcess() noexcept;
+
+ private:
+  static constexpr std::size_t kPhases =
+      static_cast<std::size_t>(Phase::kPhases);
+  static constexpr std::size_t kCounters =
+      static_cast<std::size_t>(Counter::kCounters);
+
+  inline static std::atomic<Stats*> active_{nullptr};
+
+  std::atomic<std::uint64_t> counters_[kCounters]{};
+  std::atomic<std::uint64_t> nanoseconds_[kPhases]{};
+};
+
+// Charges the time until it goes out of scope to a phase, if stats are on
+class Stats::ScopedTimer {
+ public:
+  explicit ScopedTimer(Phase phase) noexcept : stats_(Active()) {
+    if (nullptr != stats_) {
+      Start(phase);
+    }
+  }
+  ScopedTimer(const ScopedTimer&) = delete;
+  ScopedTimer& operator=(const ScopedTimer&) = delete;
+  ~ScopedTimer() {
+    if (nullptr != stats_) {
+      Stop();
+    }
+  }
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  void Start(Phase phase) noexcept {
+    phase_ = phase;
+    start_ = Clock::now();
+    outer_ = current_;
+    if (nullptr != outer_) {
+      outer_->Charge(start_);
+    }
+    current_ = this;
+  }
+
+  void Stop() noexcept {
+    const auto now = Clock::now();
+    Charge(now);
+    current_ = outer_;
+    if (nullptr != outer_) {
+      outer_->start_ = now;
+    }
+  }
+
+  void Charge(Clock::time_point now) noexcept {
+    stats_->nanoseconds_[static_cast<std::size_t>(phase_)].fetch_add(
+        static_cast<std::uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(now - start_)
+                .count()),
+        std::memory_order_relaxed);
+  }
+
+  inline static thread_local ScopedTimer* current_ = nullptr;
+
+  Stats* stats_;
+  Phase phase_{};
+  Clock::time_point start_;
+  ScopedTimer* outer_{};
+};
+
+inline const char* Stats::PhaseName(Phase phase) noexcept {
+  switch (phase) {
+    case Phase::kWalk:
+      return "walk";
+    case Phase::kCanonical:
+      return "canonical";
+    case Phase::kStat:
+      return "stat";
+    case Phase::kOpen:
+      return "open";
+    case Phase::kRead:
+      return "read";
+    case Phase::kCount:
+      return "count";
+    case Phase::kOutput:
+      return "output";
+    case Phase::kPhases:
+      break;
+  }
+  return "";
+}
+
+inline const char* Stats::CounterName(Counter counter) noexcept {
+  switch (counter) {
+    case Counter::kDirectories:
+      return "directories";
+    case Counter::kFilesVisited:
+      return "files_visited";
+    case Counter::kFilesSkippedByExtension:
+      return "files_skipped_by_extension";
+    case Counter::kFilesIgnored:
+      return "files_ignored";
+    case Counter::kFilesCounted:
+      return "files_counted";
+    case Counter::kBytesRead:
+      return "bytes_read";
+    case Counter::kDuplicateFiles:
+      return "duplicate_files";
+    case Counter::kSortedRuns:
+      return "sorted_runs";
+    case Counter::kCounters:
+      break;
+  }
+  return "";
+}
+
+inline Stats::Process Stats::ReadProcess() noexcept {
+  Process process;
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS memory{};
+  if (::GetProcessMemoryInfo(::GetCurrentProcess(), &memory, sizeof(memory))) {
+    process.peak_rss = memory.PeakWorkingSetSize;
+  }
+  IO_COUNTERS io{};
+  if (::GetProcessIoCounters(::GetCurrentProcess(), &io)) {
+    process.read_syscalls = io.ReadOperationCount;
+    process.write_syscalls = io.WriteOperationCount;
+  }
+#else
+  struct rusage usage;
+  if (0 == ::getrusage(RUSAGE_SELF, &usage)) {
+#ifdef __APPLE__
+    // Bytes on macOS, KiB elsewhere
+    process.peak_rss = static_cast<std::uint64_t>(usage.ru_maxrss);
+#else
+    process.peak_rss = static_cast<std::uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+  }
+#ifdef __linux__
+  // Counts read- and write-like syscalls, those of all threads
+  if (std::FILE* f = std::fopen("/proc/self/io", "r")) {
+    char line[128];
+    while (std::fgets(line, sizeof(line), f)) {
+      unsigned long long value;
+      if (1 == std::sscanf(line, "syscr: %llu", &value)) {
+        process.read_syscalls = value;
+      } else if (1 == std::sscanf(line, "syscw: %llu", &value)) {
+        process.write_syscalls = value;
+      }
+    }
+    std::fclose(f);
+  }
+#endif
+#endif
+  return process;
+}
+
+}  // namespace umutech::count_lines
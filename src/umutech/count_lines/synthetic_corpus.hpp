@@ -0,0 +1,167 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <ios>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/nowide/fstream.hpp>
+
+namespace umutech::count_lines {
+
+// What a synthetic source tree looks like. File sizes and line lengths
+// follow log-normal distributions, as they do in real trees: most files
+// are small, a few are huge.
+struct CorpusSpec {
+  std::uint64_t seed = 1;
+  std::size_t files = 20000;
+  double size_median = 4096;
+  double size_sigma = 1.2;
+  std::uint64_t max_size = 4 << 20;
+  double line_median = 32;
+  double line_sigma = 0.7;
+  std::size_t max_line = 400;
+  // Share of files with "\r\n" line ends
+  double crlf_ratio = 0.1;
+  // Share of empty lines
+  double empty_ratio = 0.15;
+  // Directories form a tree with `fanout` subdirectories per directory,
+  // and hold `files_per_dir` files each. Fanout 1 is a single chain, a
+  // fanout of at least the number of directories puts them all side by
+  // side.
+  std::size_t fanout = 1 << 20;
+  std::size_t files_per_dir = 1000;
+};
+
+struct CorpusStats {
+  std::size_t files;
+  std::size_t directories;
+  std::uint64_t bytes;
+  // As count_lines counts them without --ignore-empty
+  std::uint64_t lines;
+  std::uint64_t empty_lines;
+};
+
+// SplitMix64 with hand-made distributions: the <random> ones differ
+// between standard libraries, and the same seed has to give the same tree
+// on every platform
+class CorpusRandom {
+ public:
+  explicit CorpusRandom(std::uint64_t seed) noexcept : state_(seed) {}
+
+  std::uint64_t Next() noexcept {
+    std::uint64_t z = (state_ += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+  }
+
+  // In [0, 1)
+  double Uniform() noexcept {
+    return static_cast<double>(Next() >> 11) * 0x1.0p-53;
+  }
+
+  std::size_t Below(std::size_t bound) noexcept {
+    return static_cast<std::size_t>(Uniform() * static_cast<double>(bound));
+  }
+
+  double LogNormal(double median, double sigma) noexcept {
+    // Box-Muller
+    const double u = 1.0 - Uniform();
+    const double z = std::sqrt(-2.0 * std::log(u)) *
+                     std::cos(6.283185307179586 * Uniform());
+    return median * std::exp(sigma * z);
+  }
+
+ private:
+  std::uint64_t state_;
+};
+
+// Left in the root of a generated tree, so that only such a tree is removed
+// to generate it again
+inline constexpr const char kCorpusMarker[] = ".count_lines_corpus";
+
+// Writes the tree below `root`, which should be empty or missing, marked
+// with kCorpusMarker first. Throws boost::filesystem_error or
+// std::runtime_error on I/O errors.
+inline CorpusStats GenerateCorpus(const boost::filesystem::path& root,
+                                  const CorpusSpec& spec) {
+  namespace fs = boost::filesystem;
+  static constexpr const char* kExtensions[] = {
+      ".cpp", ".h", ".hpp", ".cc", ".c", ".CPP", ".H", ".txt", ".md", ".json"};
+  static constexpr char kAlphabet[] =
+      "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"
+      "_(){};,.=+-*/<>&|!     ";
+
+  CorpusRandom random(spec.seed);
+  CorpusStats stats{};
+  const std::size_t files_per_dir =
+      std::max<std::size_t>(1, spec.files_per_dir);
+  const std::size_t fanout = std::max<std::size_t>(1, spec.fanout);
+  stats.directories = (spec.files + files_per_dir - 1) / files_per_dir;
+
+  // Directory k hangs below directory (k - 1) / fanout, 0 is the root
+  std::vector<fs::path> directories;
+  directories.reserve(stats.directories);
+  for (std::size_t k = 0; k < stats.directories; ++k) {
+    directories.push_back(0 == k ? root
+                                 : directories[(k - 1) / fanout] /
+                                       ("d" + std::to_string(k)));
+    fs::create_directories(directories.back());
+  }
+  {
+    boost::nowide::ofstream marker((root / kCorpusMarker).string());
+    if (!marker) {
+      throw std::runtime_error("Can't write " +
+                               (root / kCorpusMarker).string());
+    }
+  }
+
+  std::string content;
+  for (std::size_t i = 0; i < spec.files; ++i) {
+    const auto target = static_cast<std::uint64_t>(std::min(
+        random.LogNormal(spec.size_median, spec.size_sigma),
+        static_cast<double>(spec.max_size)));
+    const bool crlf = random.Uniform() < spec.crlf_ratio;
+    const char* extension = kExtensions[random.Below(std::size(kExtensions))];
+
+    content.clear();
+    while (content.size() < target) {
+      if (random.Uniform() < spec.empty_ratio) {
+        ++stats.empty_lines;
+      } else {
+        const auto length = std::clamp<std::size_t>(
+            static_cast<std::size_t>(
+                random.LogNormal(spec.line_median, spec.line_sigma)),
+            1, std::max<std::size_t>(1, spec.max_line));
+        // Indented like code
+        const std::size_t indent = std::min(length - 1, 2 * random.Below(6));
+        content.append(indent, ' ');
+        for (std::size_t j = indent; j < length; ++j) {
+          content += kAlphabet[random.Below(sizeof(kAlphabet) - 1)];
+        }
+      }
+      content += crlf ? "\r\n" : "\n";
+      ++stats.lines;
+    }
+
+    const fs::path filename = directories[i / files_per_dir] /
+                              ("f" + std::to_string(i) + extension);
+    boost::nowide::ofstream f(filename.string(), std::ios::binary);
+    f.write(content.data(), static_cast<std::streamsize>(content.size()));
+    if (!f) {
+      throw std::runtime_error("Can't write " + filename.string());
+    }
+    ++stats.files;
+    stats.bytes += content.size();
+  }
+  return stats;
+}
+
+}  // namespace umutech::count_lines
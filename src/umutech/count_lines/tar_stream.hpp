@@ -0,0 +1,694 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <boost/filesystem/path.hpp>
+
+#include "file_counter.hpp"
+#include "language.hpp"
+#include "line_counter.hpp"
+#include "sloc.hpp"
+#include "stats.hpp"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace umutech::count_lines {
+
+// Bytes read front to back, once: a file, a pipe, or another stream that is
+// decompressed on the fly
+class ByteStream {
+ public:
+  virtual ~ByteStream() = default;
+  // Returns the number of bytes read, 0 at the end and -1 on error
+  virtual std::ptrdiff_t Read(char* buffer, std::size_t size) noexcept = 0;
+};
+
+// A file, or stdin without a path
+class FileStream : public ByteStream {
+ public:
+  FileStream() = default;
+  FileStream(const FileStream&) = delete;
+  FileStream& operator=(const FileStream&) = delete;
+  ~FileStream() override;
+
+  bool Open(const boost::filesystem::path& filename) noexcept;
+  bool OpenStdin() noexcept;
+
+  std::ptrdiff_t Read(char* buffer, std::size_t size) noexcept override;
+
+ private:
+#ifdef _WIN32
+  HANDLE file_{INVALID_HANDLE_VALUE};
+#else
+  int file_{-1};
+#endif
+  bool owned_{};
+};
+
+inline FileStream::~FileStream() {
+  if (!owned_) {
+    return;
+  }
+#ifdef _WIN32
+  ::CloseHandle(file_);
+#else
+  ::close(file_);
+#endif
+}
+
+inline bool FileStream::Open(const boost::filesystem::path& filename) noexcept {
+  Stats::ScopedTimer timer(Stats::Phase::kOpen);
+#ifdef _WIN32
+  file_ = ::CreateFileW(filename.c_str(), GENERIC_READ,
+                        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                        nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN,
+                        nullptr);
+  owned_ = INVALID_HANDLE_VALUE != file_;
+#else
+  file_ = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  owned_ = 0 <= file_;
+#endif
+  return owned_;
+}
+
+inline bool FileStream::OpenStdin() noexcept {
+#ifdef _WIN32
+  file_ = ::GetStdHandle(STD_INPUT_HANDLE);
+  return INVALID_HANDLE_VALUE != file_ && nullptr != file_;
+#else
+  file_ = STDIN_FILENO;
+  return true;
+#endif
+}
+
+inline std::ptrdiff_t FileStream::Read(char* buffer,
+                                       std::size_t size) noexcept {
+  Stats::ScopedTimer timer(Stats::Phase::kRead);
+#ifdef _WIN32
+  DWORD bytes_read = 0;
+  if (!::ReadFile(file_, buffer,
+                  static_cast<DWORD>(std::min<std::size_t>(size, 1 << 30)),
+                  &bytes_read, nullptr)) {
+    // The writing end of a pipe was closed
+    return ERROR_BROKEN_PIPE == ::GetLastError() ? 0 : -1;
+  }
+  return static_cast<std::ptrdiff_t>(bytes_read);
+#else
+  for (;;) {
+    const ssize_t bytes_read = ::read(file_, buffer, size);
+    if (0 <= bytes_read || EINTR != errno) {
+      return bytes_read;
+    }
+  }
+#endif
+}
+
+// Gives back the bytes that were read ahead to sniff the format, then the
+// rest of the source
+class PrefixStream : public ByteStream {
+ public:
+  PrefixStream(std::string prefix, ByteStream& source)
+      : prefix_(std::move(prefix)), source_(source) {}
+
+  std::ptrdiff_t Read(char* buffer, std::size_t size) noexcept override {
+    if (offset_ == prefix_.size()) {
+      return source_.Read(buffer, size);
+    }
+    size = std::min(size, prefix_.size() - offset_);
+    std::memcpy(buffer, prefix_.data() + offset_, size);
+    offset_ += size;
+    return static_cast<std::ptrdiff_t>(size);
+  }
+
+ private:
+  std::string prefix_;
+  std::size_t offset_{};
+  ByteStream& source_;
+};
+
+#ifdef USE_ZLIB
+// gzip, and zlib too, since inflate tells them apart by the header
+class GzipStream : public ByteStream {
+ public:
+  static constexpr std::size_t kInputSize = 1 << 16;
+
+  explicit GzipStream(ByteStream& source) : source_(source) {
+    initialized_ = Z_OK == ::inflateInit2(&stream_, 15 + 32);
+  }
+  GzipStream(const GzipStream&) = delete;
+  GzipStream& operator=(const GzipStream&) = delete;
+  ~GzipStream() override {
+    if (initialized_) {
+      ::inflateEnd(&stream_);
+    }
+  }
+
+  std::ptrdiff_t Read(char* buffer, std::size_t size) noexcept override;
+
+ private:
+  ByteStream& source_;
+  z_stream stream_{};
+  bool initialized_;
+  // Between two members, where the input may end
+  bool at_boundary_{};
+  std::unique_ptr<char[]> input_{new char[kInputSize]};
+};
+
+inline std::ptrdiff_t GzipStream::Read(char* buffer,
+                                       std::size_t size) noexcept {
+  if (!initialized_) {
+    return -1;
+  }
+  const auto capacity =
+      static_cast<uInt>(std::min<std::size_t>(size, UINT_MAX));
+  stream_.next_out = reinterpret_cast<Bytef*>(buffer);
+  stream_.avail_out = capacity;
+  while (capacity == stream_.avail_out) {
+    if (0 == stream_.avail_in) {
+      const std::ptrdiff_t bytes_read = source_.Read(input_.get(), kInputSize);
+      if (bytes_read <= 0) {
+        return 0 == bytes_read && at_boundary_ ? 0 : -1;
+      }
+      stream_.next_in = reinterpret_cast<Bytef*>(input_.get());
+      stream_.avail_in = static_cast<uInt>(bytes_read);
+    }
+    Stats::ScopedTimer timer(Stats::Phase::kRead);
+    at_boundary_ = false;
+    const int result = ::inflate(&stream_, Z_NO_FLUSH);
+    if (Z_STREAM_END == result) {
+      // Members may follow each other, as `cat a.gz b.gz` makes them
+      if (Z_OK != ::inflateReset(&stream_)) {
+        return -1;
+      }
+      at_boundary_ = true;
+    } else if (Z_OK != result && Z_BUF_ERROR != result) {
+      return -1;
+    }
+  }
+  return static_cast<std::ptrdiff_t>(capacity - stream_.avail_out);
+}
+#endif
+
+#ifdef USE_ZSTD
+class ZstdStream : public ByteStream {
+ public:
+  explicit ZstdStream(ByteStream& source)
+      : source_(source),
+        context_(::ZSTD_createDCtx()),
+        input_size_(::ZSTD_DStreamInSize()),
+        input_(new char[input_size_]) {}
+  ZstdStream(const ZstdStream&) = delete;
+  ZstdStream& operator=(const ZstdStream&) = delete;
+  ~ZstdStream() override { ::ZSTD_freeDCtx(context_); }
+
+  std::ptrdiff_t Read(char* buffer, std::size_t size) noexcept override;
+
+ private:
+  ByteStream& source_;
+  ZSTD_DCtx* context_;
+  std::size_t input_size_;
+  std::unique_ptr<char[]> input_;
+  ZSTD_inBuffer in_{nullptr, 0, 0};
+  bool end_of_input_{};
+  // 0 once a frame is complete
+  std::size_t pending_{};
+};
+
+inline std::ptrdiff_t ZstdStream::Read(char* buffer,
+                                       std::size_t size) noexcept {
+  if (nullptr == context_) {
+    return -1;
+  }
+  ZSTD_outBuffer out{buffer, size, 0};
+  while (0 == out.pos) {
+    if (in_.pos == in_.size && !end_of_input_) {
+      const std::ptrdiff_t bytes_read = source_.Read(input_.get(), input_size_);
+      if (bytes_read < 0) {
+        return -1;
+      }
+      end_of_input_ = 0 == bytes_read;
+      in_ = {input_.get(), static_cast<std::size_t>(bytes_read), 0};
+    }
+    Stats::ScopedTimer timer(Stats::Phase::kRead);
+    // With no input left this still flushes what the context holds
+    pending_ = ::ZSTD_decompressStream(context_, &out, &in_);
+    if (::ZSTD_isError(pending_)) {
+      return -1;
+    }
+    if (0 == out.pos && end_of_input_) {
+      return 0 == pending_ ? 0 : -1;
+    }
+  }
+  return static_cast<std::ptrdiff_t>(out.pos);
+}
+#endif
+
+// Buffers a ByteStream so headers can be looked at in place, and data
+// handed on block by block
+class StreamReader {
+ public:
+  static constexpr std::size_t kBufferSize = 1 << 18;
+
+  explicit StreamReader(ByteStream& stream) : stream_(stream) {}
+
+  // Makes at least `size` bytes available, fewer only at the end. Returns
+  // false on read errors.
+  bool Fill(std::size_t size) noexcept;
+  const char* data() const noexcept { return buffer_.get() + begin_; }
+  std::size_t size() const noexcept { return end_ - begin_; }
+  void Consume(std::size_t size) noexcept { begin_ += size; }
+
+  // Calls visitor(const char* data, std::size_t size) on the next `size`
+  // bytes, or on everything left with std::nullopt. Returns false on read
+  // errors and if the stream ends early.
+  template <typename Visitor>
+  bool Forward(std::optional<std::uint64_t> size, Visitor&& visitor);
+
+ private:
+  ByteStream& stream_;
+  std::unique_ptr<char[]> buffer_{new char[kBufferSize]};
+  std::size_t begin_{};
+  std::size_t end_{};
+  bool end_of_stream_{};
+};
+
+inline bool StreamReader::Fill(std::size_t size) noexcept {
+  if (begin_ + size > kBufferSize) {
+    std::memmove(buffer_.get(), data(), this->size());
+    end_ -= begin_;
+    begin_ = 0;
+  }
+  while (this->size() < size && !end_of_stream_) {
+    const std::ptrdiff_t bytes_read =
+        stream_.Read(buffer_.get() + end_, kBufferSize - end_);
+    if (bytes_read < 0) {
+      return false;
+    }
+    end_of_stream_ = 0 == bytes_read;
+    end_ += static_cast<std::size_t>(bytes_read);
+  }
+  return true;
+}
+
+template <typename Visitor>
+bool StreamReader::Forward(std::optional<std::uint64_t> size,
+                           Visitor&& visitor) {
+  std::uint64_t left = size.value_or(UINT64_MAX);
+  while (0 != left) {
+    if (0 == this->size()) {
+      begin_ = end_ = 0;
+      if (!Fill(1)) {
+        return false;
+      }
+      if (0 == this->size()) {
+        return !size;
+      }
+    }
+    const auto block = static_cast<std::size_t>(
+        std::min<std::uint64_t>(left, this->size()));
+    visitor(data(), block);
+    Consume(block);
+    left -= block;
+  }
+  return true;
+}
+
+// ustar, GNU and pax headers of tar archives. Only what naming a member and
+// finding its data needs is read; owners, modes and times are skipped.
+class TarReader {
+ public:
+  static constexpr std::size_t kBlockSize = 512;
+
+  struct Member {
+    std::string name;
+    std::uint64_t size;
+    bool regular;
+  };
+
+  explicit TarReader(StreamReader& reader) : reader_(reader) {}
+
+  // A tar header with a valid checksum comes first
+  bool Probe();
+
+  // Reads the header of the next member, whose data ReadData() or Skip()
+  // must consume before the next call. Returns false at the end of the
+  // archive; failed() tells whether it ended early or broken.
+  bool Next(Member& member);
+
+  template <typename Visitor>
+  bool ReadData(const Member& member, Visitor&& visitor) {
+    failed_ = !reader_.Forward(member.size, visitor) || !SkipPadding(member);
+    return !failed_;
+  }
+  bool Skip(const Member& member) {
+    return ReadData(member, [](const char*, std::size_t) {});
+  }
+
+  bool failed() const noexcept { return failed_; }
+
+ private:
+  static std::uint64_t ParseNumber(const char* field, std::size_t size);
+  static bool IsValidHeader(const char* header);
+  static std::string_view Field(const char* field, std::size_t size) {
+    return {field, static_cast<std::size_t>(std::find(field, field + size, 0) -
+                                            field)};
+  }
+
+  bool SkipPadding(const Member& member);
+  bool ReadExtension(const Member& member, std::string& text);
+
+  StreamReader& reader_;
+  bool failed_{};
+};
+
+inline std::uint64_t TarReader::ParseNumber(const char* field,
+                                            std::size_t size) {
+  std::uint64_t value = 0;
+  // GNU stores large numbers in base 256 after a set high bit
+  if (0 != (field[0] & 0x80)) {
+    value = static_cast<unsigned char>(field[0]) & 0x7f;
+    for (std::size_t i = 1; i < size; ++i) {
+      value = value << 8 | static_cast<unsigned char>(field[i]);
+    }
+    return value;
+  }
+  std::size_t i = 0;
+  while (i < size && ' ' == field[i]) {
+    ++i;
+  }
+  for (; i < size && '0' <= field[i] && field[i] <= '7'; ++i) {
+    value = value << 3 | static_cast<unsigned>(field[i] - '0');
+  }
+  return value;
+}
+
+inline bool TarReader::IsValidHeader(const char* header) {
+  // The checksum is taken with its own field as spaces, over unsigned bytes
+  // or, by some old tars, over signed ones
+  std::uint64_t unsigned_sum = 8 * ' ';
+  std::int64_t signed_sum = 8 * ' ';
+  for (std::size_t i = 0; i < kBlockSize; ++i) {
+    if (148 <= i && i < 156) {
+      continue;
+    }
+    unsigned_sum += static_cast<unsigned char>(header[i]);
+    signed_sum += static_cast<signed char>(header[i]);
+  }
+  const std::uint64_t checksum = ParseNumber(header + 148, 8);
+  return checksum == unsigned_sum ||
+         static_cast<std::int64_t>(checksum) == signed_sum;
+}
+
+inline bool TarReader::Probe() {
+  return reader_.Fill(kBlockSize) && kBlockSize <= reader_.size() &&
+         IsValidHeader(reader_.data());
+}
+
+inline bool TarReader::SkipPadding(const Member& member) {
+  const std::size_t padding =
+      static_cast<std::size_t>((kBlockSize - member.size % kBlockSize) %
+                               kBlockSize);
+  return reader_.Forward(padding, [](const char*, std::size_t) {});
+}
+
+inline bool TarReader::ReadExtension(const Member& member, std::string& text) {
+  // Long names and pax records are small; anything else is broken
+  if (1 << 20 < member.size) {
+    return false;
+  }
+  text.clear();
+  return ReadData(member, [&text](const char* data, std::size_t size) {
+    text.append(data, size);
+  });
+}
+
+inline bool TarReader::Next(Member& member) {
+  std::optional<std::string> long_name;
+  std::optional<std::uint64_t> long_size;
+  std::string text;
+  for (;;) {
+    if (!reader_.Fill(kBlockSize)) {
+      failed_ = true;
+      return false;
+    }
+    // Archives end with zero blocks, and some writers leave them out
+    if (reader_.size() < kBlockSize) {
+      failed_ = 0 != reader_.size();
+      return false;
+    }
+    const char* header = reader_.data();
+    if (std::all_of(header, header + kBlockSize,
+                    [](char c) { return 0 == c; })) {
+      return false;
+    }
+    if (!IsValidHeader(header)) {
+      failed_ = true;
+      return false;
+    }
+
+    member.name = Field(header, 100);
+    // POSIX ustar splits long names into a prefix and the name; GNU uses
+    // the prefix field for other things
+    if (0 == std::memcmp(header + 257, "ustar\0", 6)) {
+      const std::string_view prefix = Field(header + 345, 155);
+      if (!prefix.empty()) {
+        member.name = std::string(prefix) + '/' + member.name;
+      }
+    }
+    member.size = ParseNumber(header + 124, 12);
+    const char type = header[156];
+    member.regular = '0' == type || '\0' == type || '7' == type;
+    reader_.Consume(kBlockSize);
+
+    switch (type) {
+      case 'L':
+        // GNU long name of the next member
+        if (!ReadExtension(member, text)) {
+          failed_ = true;
+          return false;
+        }
+        long_name = Field(text.data(), text.size());
+        continue;
+      case 'x':
+        // pax records of the next member: "<length> <key>=<value>\n"
+        if (!ReadExtension(member, text)) {
+          failed_ = true;
+          return false;
+        }
+        for (std::size_t begin = 0; begin < text.size();) {
+          const std::size_t length = std::strtoull(text.c_str() + begin,
+                                                   nullptr, 10);
+          const std::size_t space = text.find(' ', begin);
+          if (0 == length || text.size() < begin + length ||
+              std::string::npos == space || begin + length <= space) {
+            break;
+          }
+          const std::string_view record(text.data() + space + 1,
+                                        begin + length - space - 2);
+          if (record.starts_with("path=")) {
+            long_name = std::string(record.substr(5));
+          } else if (record.starts_with("size=")) {
+            long_size = std::strtoull(record.data() + 5, nullptr, 10);
+          }
+          begin += length;
+        }
+        continue;
+      case 'K':
+      case 'g':
+        // Long link names and global pax records
+        if (!Skip(member)) {
+          return false;
+        }
+        continue;
+    }
+
+    if (long_name) {
+      member.name = std::move(*long_name);
+    }
+    if (long_size) {
+      member.size = *long_size;
+    }
+    return true;
+  }
+}
+
+// .tar, .tar.gz, .tgz, .tar.zst and .tzst, in any case
+inline bool IsArchiveName(const boost::filesystem::path& filename) {
+  std::string name = filename.filename().string();
+  for (auto& c : name) {
+    if ('A' <= c && c <= 'Z') {
+      c = static_cast<char>(c - 'A' + 'a');
+    }
+  }
+  for (const std::string_view suffix :
+       {".tar", ".tar.gz", ".tgz", ".tar.zst", ".tzst"}) {
+    if (name.ends_with(suffix)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+enum class StreamStatus {
+  kCounted,
+  kReadFailed,
+  // Truncated or corrupt
+  kBroken,
+  // Compressed in a way this build can't decompress
+  kUnsupported,
+};
+
+// Counts a stream without extracting or buffering it: the members of a tar
+// archive, gzip or zstd compressed or not, that `accept(path)` is true
+// for, or the whole stream as one file if it isn't a tar archive. Each
+// member goes to `sink(CountedFile)` once its last block is counted, named
+// `name/<member name>`. With CountOptions::histogram, line lengths go to
+// `histogram`.
+template <typename Accept, typename Sink>
+StreamStatus CountStream(ByteStream& source,
+                         const boost::filesystem::path& name,
+                         const CountOptions& options,
+                         LineHistogram* histogram,
+                         Accept&& accept,
+                         Sink&& sink) {
+  std::string magic(4, '\0');
+  std::size_t magic_size = 0;
+  while (magic_size < magic.size()) {
+    const std::ptrdiff_t bytes_read =
+        source.Read(magic.data() + magic_size, magic.size() - magic_size);
+    if (bytes_read < 0) {
+      return StreamStatus::kReadFailed;
+    }
+    if (0 == bytes_read) {
+      break;
+    }
+    magic_size += static_cast<std::size_t>(bytes_read);
+  }
+  magic.resize(magic_size);
+  PrefixStream prefixed(magic, source);
+  ByteStream* stream = &prefixed;
+
+  std::unique_ptr<ByteStream> decompressor;
+  if (magic.starts_with("\x1f\x8b")) {
+#ifdef USE_ZLIB
+    decompressor = std::make_unique<GzipStream>(prefixed);
+#else
+    return StreamStatus::kUnsupported;
+#endif
+  } else if (magic.starts_with("\x28\xb5\x2f\xfd")) {
+#ifdef USE_ZSTD
+    decompressor = std::make_unique<ZstdStream>(prefixed);
+#else
+    return StreamStatus::kUnsupported;
+#endif
+  }
+  if (decompressor) {
+    stream = decompressor.get();
+  }
+
+  StreamReader reader(*stream);
+  // `forward(visitor)` hands the data of the file to the visitor
+  const auto count = [&](boost::filesystem::path path, auto&& forward) {
+    CountedFile file{
+        std::move(path), true, {}, std::nullopt, false, {}, std::nullopt};
+    LineCounter counter(options.ignore_empty, options.code_points);
+    LineObserver observer(options.histogram ? histogram : nullptr,
+                          options.over);
+    if (options.histogram || 0 != options.over) {
+      counter.Observe(&observer);
+    }
+    std::optional<SlocCounter> sloc;
+    if (options.sloc) {
+      sloc.emplace(SyntaxFor(file.path));
+    }
+    const bool complete = forward([&](const char* data, std::size_t block) {
+          Stats::Add(Stats::Counter::kBytesRead, block);
+          Stats::ScopedTimer timer(Stats::Phase::kCount);
+          counter.Feed(data, block);
+          if (sloc) {
+            sloc->Feed(data, block);
+          }
+        });
+    file.info = counter.Finish();
+    file.long_lines = std::move(observer.long_lines());
+    if (sloc) {
+      file.sloc = sloc->Finish();
+    }
+    Stats::Add(Stats::Counter::kFilesCounted);
+    sink(std::move(file));
+    return complete;
+  };
+
+  TarReader tar(reader);
+  if (!tar.Probe()) {
+    if (!count(name, [&reader](auto&& visitor) {
+          return reader.Forward(std::nullopt, visitor);
+        })) {
+      return decompressor ? StreamStatus::kBroken : StreamStatus::kReadFailed;
+    }
+    return StreamStatus::kCounted;
+  }
+
+  TarReader::Member member;
+  while (tar.Next(member)) {
+    std::string_view member_name = member.name;
+    while (member_name.starts_with("./")) {
+      member_name.remove_prefix(2);
+    }
+    while (member_name.starts_with('/')) {
+      member_name.remove_prefix(1);
+    }
+    const boost::filesystem::path path = name / std::string(member_name);
+    if (!member.regular) {
+      if (!tar.Skip(member)) {
+        break;
+      }
+      continue;
+    }
+    Stats::Add(Stats::Counter::kFilesVisited);
+    if (!accept(path)) {
+      Stats::Add(Stats::Counter::kFilesSkippedByExtension);
+      if (!tar.Skip(member)) {
+        break;
+      }
+      continue;
+    }
+    if (!count(path, [&tar, &member](auto&& visitor) {
+          return tar.ReadData(member, visitor);
+        })) {
+      return StreamStatus::kBroken;
+    }
+  }
+  return tar.failed() ? StreamStatus::kBroken : StreamStatus::kCounted;
+}
+
+}  // namespace umutech::count_lines
@@ -0,0 +1,166 @@
+﻿#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace umutech::count_lines {
+
+// Fixed-size pool where every worker owns a task queue. A worker takes its
+// own newest task first and, when it runs dry, steals the oldest task of
+// another worker. Tasks submitted from a worker go to that worker's queue,
+// so work spawned by a big task stays local until somebody is idle.
+class ThreadPool {
+ public:
+  using Task = std::function<void()>;
+
+  explicit ThreadPool(unsigned threads);
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+  ~ThreadPool();
+
+  // 0 means one thread per hardware thread
+  static unsigned Resolve(unsigned threads) noexcept {
+    if (0 != threads) {
+      return threads;
+    }
+    const unsigned hardware = std::thread::hardware_concurrency();
+    return 0 != hardware ? hardware : 1;
+  }
+
+  std::size_t size() const noexcept { return threads_.size(); }
+
+  void Submit(Task task);
+  // Blocks until every submitted task, including those submitted by other
+  // tasks, has finished
+  void Wait();
+
+ private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  bool TryPop(std::size_t self, Task& task);
+  void Run(std::size_t self);
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> threads_;
+  std::atomic<std::size_t> next_queue_{0};
+  // Tasks sitting in queues, and tasks not finished yet
+  std::atomic<std::size_t> queued_{0};
+  std::atomic<std::size_t> pending_{0};
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable idle_;
+  bool stop_{};
+
+  static inline thread_local ThreadPool* current_pool_{};
+  static inline thread_local std::size_t current_index_{};
+};
+
+inline ThreadPool::ThreadPool(unsigned threads) {
+  threads = Resolve(threads);
+  queues_.reserve(threads);
+  for (unsigned i = 0; i < threads; ++i) {
+    queues_.push_back(std::make_unique<Queue>());
+  }
+  threads_.reserve(threads);
+  for (unsigned i = 0; i < threads; ++i) {
+    threads_.emplace_back(&ThreadPool::Run, this, i);
+  }
+}
+
+inline ThreadPool::~ThreadPool() {
+  Wait();
+  {
+    std::lock_guard lock(mutex_);
+    stop_ = true;
+  }
+  wake_.notify_all();
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+}
+
+inline void ThreadPool::Submit(Task task) {
+  const std::size_t index =
+      this == current_pool_
+          ? current_index_
+          : next_queue_.fetch_add(1, std::memory_order_relaxed) %
+                queues_.size();
+  pending_.fetch_add(1, std::memory_order_relaxed);
+  {
+    // Taking the lock orders the increment against a worker that is just
+    // about to sleep, so the wake-up can't get lost. Counting before the
+    // push keeps queued_ from going below zero.
+    std::lock_guard lock(mutex_);
+    queued_.fetch_add(1, std::memory_order_relaxed);
+  }
+  {
+    std::lock_guard lock(queues_[index]->mutex);
+    queues_[index]->tasks.push_back(std::move(task));
+  }
+  wake_.notify_one();
+}
+
+inline void ThreadPool::Wait() {
+  std::unique_lock lock(mutex_);
+  idle_.wait(lock, [this] {
+    return 0 == pending_.load(std::memory_order_acquire);
+  });
+}
+
+inline bool ThreadPool::TryPop(std::size_t self, Task& task) {
+  {
+    Queue& own = *queues_[self];
+    std::lock_guard lock(own.mutex);
+    if (!own.tasks.empty()) {
+      task = std::move(own.tasks.back());
+      own.tasks.pop_back();
+      return true;
+    }
+  }
+  for (std::size_t i = 1; i < queues_.size(); ++i) {
+    Queue& victim = *queues_[(self + i) % queues_.size()];
+    std::lock_guard lock(victim.mutex);
+    if (!victim.tasks.empty()) {
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+inline void ThreadPool::Run(std::size_t self) {
+  current_pool_ = this;
+  current_index_ = self;
+  for (;;) {
+    Task task;
+    if (TryPop(self, task)) {
+      queued_.fetch_sub(1, std::memory_order_relaxed);
+      task();
+      if (1 == pending_.fetch_sub(1, std::memory_order_acq_rel)) {
+        std::lock_guard lock(mutex_);
+        idle_.notify_all();
+      }
+      continue;
+    }
+    std::unique_lock lock(mutex_);
+    wake_.wait(lock, [this] {
+      return stop_ || 0 != queued_.load(std::memory_order_relaxed);
+    });
+    if (stop_) {
+      return;
+    }
+  }
+}
+
+}  // namespace umutech::count_lines
@@ -0,0 +1,370 @@
+﻿#pragma once
+
+// Linux only: the rest of the world reads files one by one with InputFile
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define UMU_HAS_IO_URING 1
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "stats.hpp"
+
+namespace umutech::count_lines {
+
+// Reads many small files through one io_uring, so the openat, read and
+// close of dozens of files are in flight at once and cost one
+// io_uring_enter per round instead of three syscalls per file. Talks to the
+// kernel with raw syscalls, so there's no liburing dependency; Supported()
+// tells whether the kernel (5.6 or later) and the sandbox allow it.
+//
+// Every file is opened, read into a buffer of its slot and closed. A read
+// shorter than the buffer is taken as the end of the file, which saves a
+// round per file and holds for regular files.
+class UringReader {
+ public:
+  // Files in flight
+  static constexpr unsigned kDepth = 64;
+  static constexpr std::size_t kBufferSize = 32 << 10;
+
+  enum class Status {
+    kRead,
+    kOpenFailed,
+    // A read failed, or the ring did. The caller may try again without it.
+    kReadFailed,
+    // The handler stopped reading
+    kStopped,
+  };
+
+  UringReader() = default;
+  UringReader(const UringReader&) = delete;
+  UringReader& operator=(const UringReader&) = delete;
+  ~UringReader() { Close(); }
+
+  static bool Supported() noexcept;
+
+  bool Init() noexcept;
+  bool ready() const noexcept { return 0 <= ring_; }
+
+  // Reads the files [0, count). Handler needs
+  //   const char* Path(std::size_t i)
+  //   bool Block(std::size_t i, const char* data, std::size_t size), which
+  //     returns false to stop reading the file
+  //   void Done(std::size_t i, Status status)
+  // and Done() is called exactly once per file.
+  template <typename Handler>
+  void ReadAll(std::size_t count, Handler& handler) noexcept;
+
+ private:
+  enum Operation : std::uint64_t { kOpen, kRead, kClose };
+
+  struct Slot {
+    std::size_t file;
+    int fd;
+    std::uint64_t offset;
+    char* buffer;
+  };
+
+  static int Setup(unsigned entries, io_uring_params* params) noexcept {
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+  }
+
+  void Close() noexcept;
+  io_uring_sqe* NextSqe(Operation operation, unsigned slot) noexcept;
+  bool Enter(unsigned wait) noexcept;
+
+  void PrepareOpen(unsigned slot, const char* path) noexcept;
+  void PrepareRead(unsigned slot) noexcept;
+  void PrepareClose(int fd) noexcept;
+
+  int ring_{-1};
+  void* sq_ring_{MAP_FAILED};
+  std::size_t sq_ring_size_{};
+  void* cq_ring_{MAP_FAILED};
+  std::size_t cq_ring_size_{};
+  io_uring_sqe* sqes_{};
+  std::size_t sqes_size_{};
+
+  unsigned* sq_tail_{};
+  unsigned sq_mask_{};
+  unsigned* sq_array_{};
+  unsigned* cq_head_{};
+  unsigned* cq_tail_{};
+  unsigned cq_mask_{};
+  io_uring_cqe* cqes_{};
+  // Our copy of the tail, published to the kernel by Enter()
+  unsigned tail_{};
+  // Prepared but not submitted yet
+  unsigned queued_{};
+
+  std::unique_ptr<char[]> buffers_;
+  Slot slots_[kDepth];
+};
+
+inline bool UringReader::Supported() noexcept {
+  static const bool supported = [] {
+    UringReader reader;
+    if (!reader.Init()) {
+      return false;
+    }
+    constexpr unsigned kNeeded[] = {IORING_OP_OPENAT, IORING_OP_READ,
+                                    IORING_OP_CLOSE};
+    constexpr unsigned kOps = *std::max_element(kNeeded, kNeeded + 3) + 1;
+    alignas(io_uring_probe) unsigned char
+        buffer[sizeof(io_uring_probe) + kOps * sizeof(io_uring_probe_op)] = {};
+    auto* probe = reinterpret_cast<io_uring_probe*>(buffer);
+    if (0 > ::syscall(__NR_io_uring_register, reader.ring_,
+                      IORING_REGISTER_PROBE, probe, kOps)) {
+      return false;
+    }
+    for (const unsigned op : kNeeded) {
+      if (probe->last_op < op ||
+          0 == (probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+        return false;
+      }
+    }
+    return true;
+  }();
+  return supported;
+}
+
+inline bool UringReader::Init() noexcept {
+  if (ready()) {
+    return true;
+  }
+  // Closes complete on their own time, so leave room for a round of them
+  io_uring_params params{};
+  ring_ = Setup(2 * kDepth, &params);
+  if (ring_ < 0) {
+    return false;
+  }
+
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  const bool single_mmap = 0 != (params.features & IORING_FEAT_SINGLE_MMAP);
+  if (single_mmap) {
+    sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+  }
+  sq_ring_ = ::mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_, IORING_OFF_SQ_RING);
+  if (MAP_FAILED == sq_ring_) {
+    Close();
+    return false;
+  }
+  if (single_mmap) {
+    cq_ring_ = sq_ring_;
+  } else {
+    cq_ring_ = ::mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_, IORING_OFF_CQ_RING);
+    if (MAP_FAILED == cq_ring_) {
+      Close();
+      return false;
+    }
+  }
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  void* sqes = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_, IORING_OFF_SQES);
+  if (MAP_FAILED == sqes) {
+    Close();
+    return false;
+  }
+  sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+  auto* sq = static_cast<char*>(sq_ring_);
+  sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  tail_ = *sq_tail_;
+  auto* cq = static_cast<char*>(cq_ring_);
+  cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+  buffers_.reset(new (std::nothrow) char[kDepth * kBufferSize]);
+  if (!buffers_) {
+    Close();
+    return false;
+  }
+  for (unsigned i = 0; i < kDepth; ++i) {
+    slots_[i].buffer = buffers_.get() + i * kBufferSize;
+  }
+  return true;
+}
+
+inline void UringReader::Close() noexcept {
+  if (nullptr != sqes_) {
+    ::munmap(sqes_, sqes_size_);
+    sqes_ = nullptr;
+  }
+  if (MAP_FAILED != cq_ring_ && cq_ring_ != sq_ring_) {
+    ::munmap(cq_ring_, cq_ring_size_);
+  }
+  cq_ring_ = MAP_FAILED;
+  if (MAP_FAILED != sq_ring_) {
+    ::munmap(sq_ring_, sq_ring_size_);
+    sq_ring_ = MAP_FAILED;
+  }
+  if (0 <= ring_) {
+    ::close(ring_);
+    ring_ = -1;
+  }
+}
+
+inline io_uring_sqe* UringReader::NextSqe(Operation operation,
+                                          unsigned slot) noexcept {
+  const unsigned index = tail_++ & sq_mask_;
+  io_uring_sqe* sqe = &sqes_[index];
+  std::memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = static_cast<std::uint64_t>(slot) << 2 | operation;
+  sq_array_[index] = index;
+  ++queued_;
+  return sqe;
+}
+
+inline bool UringReader::Enter(unsigned wait) noexcept {
+  // The opens and reads in flight, as far as they make us wait
+  Stats::ScopedTimer timer(Stats::Phase::kRead);
+  std::atomic_ref(*sq_tail_).store(tail_, std::memory_order_release);
+  for (;;) {
+    const long submitted =
+        ::syscall(__NR_io_uring_enter, ring_, queued_, wait,
+                  0 == wait ? 0 : IORING_ENTER_GETEVENTS, nullptr, 0);
+    if (0 <= submitted) {
+      queued_ -= static_cast<unsigned>(submitted);
+      return true;
+    }
+    if (EINTR != errno && EAGAIN != errno && EBUSY != errno) {
+      return false;
+    }
+  }
+}
+
+inline void UringReader::PrepareOpen(unsigned slot,
+                                     const char* path) noexcept {
+  io_uring_sqe* sqe = NextSqe(kOpen, slot);
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = reinterpret_cast<std::uintptr_t>(path);
+  sqe->open_flags = O_RDONLY | O_CLOEXEC;
+}
+
+inline void UringReader::PrepareRead(unsigned slot) noexcept {
+  io_uring_sqe* sqe = NextSqe(kRead, slot);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = slots_[slot].fd;
+  sqe->addr = reinterpret_cast<std::uintptr_t>(slots_[slot].buffer);
+  sqe->len = kBufferSize;
+  sqe->off = slots_[slot].offset;
+}
+
+inline void UringReader::PrepareClose(int fd) noexcept {
+  io_uring_sqe* sqe = NextSqe(kClose, 0);
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = fd;
+}
+
+template <typename Handler>
+void UringReader::ReadAll(std::size_t count, Handler& handler) noexcept {
+  std::size_t next = 0;
+  unsigned free_slots[kDepth];
+  unsigned free_count = 0;
+  for (unsigned i = kDepth; 0 < i; --i) {
+    free_slots[free_count++] = i - 1;
+  }
+  unsigned closing = 0;
+
+  const auto finish = [&](unsigned slot, Status status) {
+    handler.Done(slots_[slot].file, status);
+    if (0 <= slots_[slot].fd) {
+      PrepareClose(slots_[slot].fd);
+      ++closing;
+    }
+    free_slots[free_count++] = slot;
+  };
+
+  while (next < count || kDepth != free_count || 0 != closing) {
+    // Closes hold no slot, so don't let them pile up beyond the ring
+    while (0 != free_count && next < count && closing < kDepth) {
+      const unsigned slot = free_slots[--free_count];
+      slots_[slot].file = next;
+      slots_[slot].fd = -1;
+      slots_[slot].offset = 0;
+      PrepareOpen(slot, handler.Path(next));
+      ++next;
+    }
+
+    if (!Enter(1)) {
+      // Give the files back. The kernel may still write to the buffers, so
+      // they and the ring are left alone and never used again.
+      for (unsigned slot = 0; slot < kDepth; ++slot) {
+        if (std::find(free_slots, free_slots + free_count, slot) ==
+            free_slots + free_count) {
+          handler.Done(slots_[slot].file, Status::kReadFailed);
+        }
+      }
+      for (; next < count; ++next) {
+        handler.Done(next, Status::kReadFailed);
+      }
+      buffers_.release();
+      ring_ = -1;
+      return;
+    }
+
+    unsigned head = *cq_head_;
+    const unsigned tail =
+        std::atomic_ref(*cq_tail_).load(std::memory_order_acquire);
+    for (; head != tail; ++head) {
+      const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+      const auto operation = static_cast<Operation>(cqe.user_data & 3);
+      const auto slot = static_cast<unsigned>(cqe.user_data >> 2);
+      const int result = cqe.res;
+      if (kClose == operation) {
+        --closing;
+        continue;
+      }
+      if (kOpen == operation) {
+        if (result < 0) {
+          finish(slot, Status::kOpenFailed);
+        } else {
+          slots_[slot].fd = result;
+          PrepareRead(slot);
+        }
+        continue;
+      }
+
+      if (-EINTR == result || -EAGAIN == result) {
+        PrepareRead(slot);
+      } else if (result < 0) {
+        finish(slot, Status::kReadFailed);
+      } else if (0 == result) {
+        finish(slot, Status::kRead);
+      } else if (!handler.Block(slots_[slot].file, slots_[slot].buffer,
+                                static_cast<std::size_t>(result))) {
+        finish(slot, Status::kStopped);
+      } else if (static_cast<std::size_t>(result) < kBufferSize) {
+        finish(slot, Status::kRead);
+      } else {
+        slots_[slot].offset += static_cast<std::uint64_t>(result);
+        PrepareRead(slot);
+      }
+    }
+    std::atomic_ref(*cq_head_).store(head, std::memory_order_release);
+  }
+}
+
+}  // namespace umutech::count_lines
+
+#endif  // defined(__linux__) && __has_include(<linux/io_uring.h>)
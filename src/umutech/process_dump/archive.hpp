@@ -0,0 +1,662 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+#include "positioned_file.hpp"
+
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+
+namespace umutech::process_dump {
+
+enum class ArchiveStatus {
+  kRead,
+  kReadFailed,
+  // Truncated or corrupt
+  kBroken,
+  // Compressed in a way this build can't decompress
+  kUnsupported,
+};
+
+// Compares ASCII letters without their case, as Windows names are
+inline bool EndsWithNoCase(std::string_view name, std::string_view suffix) {
+  return suffix.size() <= name.size() &&
+         std::equal(suffix.begin(), suffix.end(),
+                    name.end() - suffix.size(), [](char a, char b) {
+                      return a == ('A' <= b && b <= 'Z' ? b - 'A' + 'a' : b);
+                    });
+}
+
+// A name ReadArchive() takes for an archive: *.zip, *.tar, *.tar.gz or
+// *.tgz
+inline bool IsArchiveName(const boost::filesystem::path& filename) {
+  static constexpr std::string_view kSuffixes[] = {".zip", ".tar", ".tar.gz",
+                                                   ".tgz"};
+  const std::string name = filename.filename().string();
+  return std::any_of(std::begin(kSuffixes), std::end(kSuffixes),
+                     [&name](std::string_view suffix) {
+                       return EndsWithNoCase(name, suffix);
+                     });
+}
+
+// A member named *.dmp, in any case
+inline bool IsDumpName(std::string_view name) {
+  return EndsWithNoCase(name, ".dmp");
+}
+
+namespace archive_detail {
+
+inline std::uint16_t Get16(const char* p) noexcept {
+  std::uint16_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+inline std::uint32_t Get32(const char* p) noexcept {
+  std::uint32_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+inline std::uint64_t Get64(const char* p) noexcept {
+  std::uint64_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+// Reads `size` bytes at `offset`, fewer only at the end
+inline bool ReadFully(const PositionedFile& file,
+                      std::uint64_t offset,
+                      char* buffer,
+                      std::size_t size,
+                      std::size_t& done) noexcept {
+  done = 0;
+  while (done < size) {
+    const std::ptrdiff_t bytes_read =
+        file.ReadAt(offset + done, buffer + done, size - done);
+    if (bytes_read < 0) {
+      return false;
+    }
+    if (0 == bytes_read) {
+      break;
+    }
+    done += static_cast<std::size_t>(bytes_read);
+  }
+  return true;
+}
+
+#ifdef USE_ZLIB
+// Inflates the raw deflate data at `offset` until `size` bytes are out, or
+// the data ends. Returns how many are out, or -1 if the data is broken.
+inline std::ptrdiff_t InflateHead(const PositionedFile& file,
+                                  std::uint64_t offset,
+                                  std::uint64_t compressed_size,
+                                  char* buffer,
+                                  std::size_t size) {
+  static constexpr std::size_t kInputSize = 1 << 14;
+  z_stream stream{};
+  if (Z_OK != ::inflateInit2(&stream, -15)) {
+    return -1;
+  }
+  std::unique_ptr<char[]> input{new char[kInputSize]};
+  stream.next_out = reinterpret_cast<Bytef*>(buffer);
+  stream.avail_out = static_cast<uInt>(std::min<std::size_t>(size, UINT_MAX));
+  std::ptrdiff_t result = -1;
+  for (;;) {
+    if (0 == stream.avail_out) {
+      result = static_cast<std::ptrdiff_t>(stream.total_out);
+      break;
+    }
+    if (0 == stream.avail_in) {
+      const auto wanted = static_cast<std::size_t>(
+          std::min<std::uint64_t>(kInputSize, compressed_size));
+      std::size_t bytes_read;
+      if (0 == wanted ||
+          !ReadFully(file, offset, input.get(), wanted, bytes_read) ||
+          0 == bytes_read) {
+        break;
+      }
+      offset += bytes_read;
+      compressed_size -= bytes_read;
+      stream.next_in = reinterpret_cast<Bytef*>(input.get());
+      stream.avail_in = static_cast<uInt>(bytes_read);
+    }
+    const int status = ::inflate(&stream, Z_NO_FLUSH);
+    if (Z_STREAM_END == status) {
+      result = static_cast<std::ptrdiff_t>(stream.total_out);
+      break;
+    }
+    if (Z_OK != status) {
+      break;
+    }
+  }
+  ::inflateEnd(&stream);
+  return result;
+}
+#endif
+
+// The bytes of a tar archive front to back, plain or gzip compressed.
+// Skipping a plain one is a seek; a compressed one is inflated and dropped.
+class TarSource {
+ public:
+  static constexpr std::size_t kInputSize = 1 << 16;
+
+  TarSource(const PositionedFile& file, bool gzip);
+  TarSource(const TarSource&) = delete;
+  TarSource& operator=(const TarSource&) = delete;
+  ~TarSource();
+
+  // Returns how many bytes it read, fewer only at the end, or -1
+  std::ptrdiff_t Read(char* buffer, std::size_t size);
+  // False past the end
+  bool Skip(std::uint64_t size);
+  // Whether reading the file failed, rather than the archive being cut
+  // short or corrupt
+  bool failed() const noexcept { return failed_; }
+
+ private:
+#ifdef USE_ZLIB
+  // Hands zlib the next compressed bytes; false at the end of the file, or
+  // if reading failed
+  bool Refill();
+#endif
+
+  const PositionedFile& file_;
+  std::optional<std::uint64_t> file_size_;
+  // Of the file, not of the archive
+  std::uint64_t offset_{};
+  bool gzip_;
+  bool failed_{};
+#ifdef USE_ZLIB
+  z_stream stream_{};
+  bool initialized_{};
+  std::unique_ptr<char[]> input_;
+#endif
+};
+
+inline TarSource::TarSource(const PositionedFile& file, bool gzip)
+    : file_(file), file_size_(file.Size()), gzip_(gzip) {
+#ifdef USE_ZLIB
+  if (gzip_) {
+    initialized_ = Z_OK == ::inflateInit2(&stream_, 15 + 16);
+    input_.reset(new char[kInputSize]);
+  }
+#endif
+}
+
+inline TarSource::~TarSource() {
+#ifdef USE_ZLIB
+  if (initialized_) {
+    ::inflateEnd(&stream_);
+  }
+#endif
+}
+
+inline std::ptrdiff_t TarSource::Read(char* buffer, std::size_t size) {
+  if (!gzip_) {
+    std::size_t done;
+    if (!ReadFully(file_, offset_, buffer, size, done)) {
+      failed_ = true;
+      return -1;
+    }
+    offset_ += done;
+    return static_cast<std::ptrdiff_t>(done);
+  }
+#ifdef USE_ZLIB
+  if (!initialized_) {
+    return -1;
+  }
+  std::size_t done = 0;
+  while (done < size) {
+    if (0 == stream_.avail_in && !Refill()) {
+      if (failed_) {
+        return -1;
+      }
+      break;
+    }
+    stream_.next_out = reinterpret_cast<Bytef*>(buffer + done);
+    stream_.avail_out =
+        static_cast<uInt>(std::min<std::size_t>(size - done, UINT_MAX));
+    const uInt capacity = stream_.avail_out;
+    const int status = ::inflate(&stream_, Z_NO_FLUSH);
+    done += capacity - stream_.avail_out;
+    if (Z_STREAM_END == status) {
+      // gzip allows more members after this one, which go on with the tar
+      if (Z_OK != ::inflateReset(&stream_)) {
+        return -1;
+      }
+    } else if (Z_OK != status && Z_BUF_ERROR != status) {
+      return -1;
+    }
+  }
+  return static_cast<std::ptrdiff_t>(done);
+#else
+  return -1;
+#endif
+}
+
+#ifdef USE_ZLIB
+inline bool TarSource::Refill() {
+  std::size_t bytes_read;
+  if (!ReadFully(file_, offset_, input_.get(), kInputSize, bytes_read)) {
+    failed_ = true;
+    return false;
+  }
+  offset_ += bytes_read;
+  stream_.next_in = reinterpret_cast<Bytef*>(input_.get());
+  stream_.avail_in = static_cast<uInt>(bytes_read);
+  return 0 != bytes_read;
+}
+#endif
+
+inline bool TarSource::Skip(std::uint64_t size) {
+  if (!gzip_) {
+    offset_ += size;
+    return !file_size_ || offset_ <= *file_size_;
+  }
+  char scratch[1 << 14];
+  while (0 != size) {
+    const auto wanted = static_cast<std::size_t>(
+        std::min<std::uint64_t>(sizeof(scratch), size));
+    if (Read(scratch, wanted) != static_cast<std::ptrdiff_t>(wanted)) {
+      return false;
+    }
+    size -= wanted;
+  }
+  return true;
+}
+
+// The fields of a 512 byte tar header that ReadTar() looks at
+struct TarHeader {
+  std::string name;
+  std::uint64_t size;
+  char type;
+};
+
+// Octal, padded with spaces or NULs, or past 8 GiB in the size field,
+// binary and big-endian with the top bit of the first byte set
+inline std::uint64_t TarNumber(std::string_view field) {
+  std::uint64_t value = 0;
+  if (!field.empty() && 0 != (field[0] & 0x80)) {
+    for (std::size_t i = 0; i < field.size(); ++i) {
+      const auto byte = static_cast<unsigned char>(field[i]);
+      value = value << 8 | (0 == i ? byte & 0x7f : byte);
+    }
+    return value;
+  }
+  const std::size_t digits = field.find_first_not_of(' ');
+  if (std::string_view::npos != digits) {
+    std::from_chars(field.data() + digits, field.data() + field.size(), value,
+                    8);
+  }
+  return value;
+}
+
+// Up to the first NUL of a text field, which a full one doesn't have
+inline std::string_view TarText(const char* block,
+                                std::size_t offset,
+                                std::size_t size) {
+  const std::string_view field(block + offset, size);
+  return field.substr(0, field.find('\0'));
+}
+
+// False if `block` isn't a header, by its checksum: the sum of its bytes
+// with the checksum's own 8 as spaces. Some old writers summed signed
+// chars, which differs once a name has non-ASCII bytes.
+inline bool ParseTarHeader(const char* block, TarHeader& header) {
+  std::uint64_t sum = 0;
+  std::int64_t signed_sum = 0;
+  for (std::size_t i = 0; i < 512; ++i) {
+    const char c = 148 <= i && i < 156 ? ' ' : block[i];
+    sum += static_cast<unsigned char>(c);
+    signed_sum += static_cast<signed char>(c);
+  }
+  const std::uint64_t checksum = TarNumber({block + 148, 8});
+  if (checksum != sum && static_cast<std::int64_t>(checksum) != signed_sum) {
+    return false;
+  }
+  header.name = TarText(block, 0, 100);
+  // In ustar archives, the directories of a name past 100 bytes; GNU tar
+  // has other fields there
+  if (0 == std::memcmp(block + 257, "ustar\0", 6)) {
+    const std::string_view prefix = TarText(block, 345, 155);
+    if (!prefix.empty()) {
+      header.name.insert(0, std::string(prefix) + '/');
+    }
+  }
+  header.size = TarNumber({block + 124, 12});
+  header.type = block[156];
+  return true;
+}
+
+// Takes the path and the size out of the records of a pax header, each
+// "<length> <key>=<value>\n" with the length counting the whole record.
+// Sizes of 8 GiB or more are only found here.
+inline void ReadPaxRecords(std::string_view records,
+                           std::optional<std::string>& path,
+                           std::optional<std::uint64_t>& size) {
+  while (!records.empty()) {
+    std::size_t length = 0;
+    const char* const begin = records.data();
+    const auto [digits_end, error] =
+        std::from_chars(begin, begin + records.size(), length);
+    const auto key = static_cast<std::size_t>(digits_end - begin) + 1;
+    if (std::errc() != error || records.size() < length || length <= key ||
+        ' ' != *digits_end) {
+      return;
+    }
+    const std::string_view record = records.substr(key, length - key - 1);
+    records.remove_prefix(length);
+    const std::size_t equals = record.find('=');
+    if (std::string_view::npos == equals) {
+      continue;
+    }
+    const std::string_view name = record.substr(0, equals);
+    const std::string_view value = record.substr(equals + 1);
+    std::uint64_t number;
+    if ("path" == name) {
+      path = std::string(value);
+    } else if ("size" == name &&
+               std::errc() == std::from_chars(value.data(),
+                                              value.data() + value.size(),
+                                              number)
+                                  .ec) {
+      size = number;
+    }
+  }
+}
+
+}  // namespace archive_detail
+
+// Calls visit(std::string_view name, std::optional<std::string_view> head)
+// for each member of the zip archive in `file` named *.dmp, with up to
+// `head_size` bytes of its start, or nothing if it's encrypted or
+// compressed in a way this build can't decompress. Members are found
+// through the central directory, so only the directory and the heads are
+// read, however big the archive is. Zip64 archives are understood.
+template <typename Visit>
+ArchiveStatus ReadZip(const PositionedFile& file,
+                      std::size_t head_size,
+                      Visit&& visit) {
+  using archive_detail::Get16;
+  using archive_detail::Get32;
+  using archive_detail::Get64;
+  using archive_detail::ReadFully;
+  static constexpr std::size_t kEndSize = 22;
+  static constexpr std::size_t kLocatorSize = 20;
+  static constexpr std::size_t kEnd64Size = 56;
+  static constexpr std::size_t kEntrySize = 46;
+  static constexpr std::size_t kLocalSize = 30;
+
+  const auto size = file.Size();
+  if (!size) {
+    return ArchiveStatus::kReadFailed;
+  }
+  // The end of central directory record comes last, before a comment of
+  // up to 64 KiB
+  std::vector<char> tail(static_cast<std::size_t>(
+      std::min<std::uint64_t>(*size, 0xFFFF + kEndSize + kLocatorSize)));
+  std::size_t bytes_read;
+  if (!ReadFully(file, *size - tail.size(), tail.data(), tail.size(),
+                 bytes_read) ||
+      tail.size() != bytes_read) {
+    return ArchiveStatus::kReadFailed;
+  }
+  if (tail.size() < kEndSize) {
+    return ArchiveStatus::kBroken;
+  }
+  // The last signature whose comment ends with the file
+  std::size_t end = tail.size() - kEndSize;
+  while (0 != std::memcmp(tail.data() + end, "PK\5\6", 4) ||
+         tail.size() < end + kEndSize + Get16(tail.data() + end + 20)) {
+    if (0 == end--) {
+      return ArchiveStatus::kBroken;
+    }
+  }
+  const char* record = tail.data() + end;
+  std::uint64_t entries = Get16(record + 10);
+  std::uint64_t directory_size = Get32(record + 12);
+  std::uint64_t directory_offset = Get32(record + 16);
+  if (kLocatorSize <= end &&
+      0 == std::memcmp(record - kLocatorSize, "PK\6\7", 4)) {
+    char end64[kEnd64Size];
+    if (!ReadFully(file, Get64(record - kLocatorSize + 8), end64,
+                   sizeof(end64), bytes_read) ||
+        sizeof(end64) != bytes_read || 0 != std::memcmp(end64, "PK\6\6", 4)) {
+      return ArchiveStatus::kBroken;
+    }
+    entries = Get64(end64 + 32);
+    directory_size = Get64(end64 + 40);
+    directory_offset = Get64(end64 + 48);
+  }
+  if (*size < directory_offset || *size - directory_offset < directory_size) {
+    return ArchiveStatus::kBroken;
+  }
+
+  std::vector<char> directory(static_cast<std::size_t>(directory_size));
+  if (!ReadFully(file, directory_offset, directory.data(), directory.size(),
+                 bytes_read) ||
+      directory.size() != bytes_read) {
+    return ArchiveStatus::kReadFailed;
+  }
+  std::vector<char> head(head_size);
+  std::size_t position = 0;
+  for (std::uint64_t i = 0; i < entries; ++i) {
+    const char* entry = directory.data() + position;
+    if (directory.size() - position < kEntrySize ||
+        0 != std::memcmp(entry, "PK\1\2", 4)) {
+      return ArchiveStatus::kBroken;
+    }
+    const std::uint16_t flags = Get16(entry + 8);
+    const std::uint16_t method = Get16(entry + 10);
+    std::uint64_t compressed_size = Get32(entry + 20);
+    std::uint64_t uncompressed_size = Get32(entry + 24);
+    const std::size_t name_size = Get16(entry + 28);
+    const std::size_t extra_size = Get16(entry + 30);
+    const std::size_t comment_size = Get16(entry + 32);
+    std::uint64_t local_offset = Get32(entry + 42);
+    if (directory.size() - position - kEntrySize <
+        name_size + extra_size + comment_size) {
+      return ArchiveStatus::kBroken;
+    }
+    const std::string_view name(entry + kEntrySize, name_size);
+    // Zip64 sizes and offset, in this order, for those that don't fit
+    const char* extra = entry + kEntrySize + name_size;
+    for (std::size_t at = 0; at + 4 <= extra_size;) {
+      const std::uint16_t id = Get16(extra + at);
+      const std::size_t field_size = Get16(extra + at + 2);
+      if (extra_size - at - 4 < field_size) {
+        break;
+      }
+      if (1 == id) {
+        const char* field = extra + at + 4;
+        const char* field_end = field + field_size;
+        for (std::uint64_t* value :
+             {&uncompressed_size, &compressed_size, &local_offset}) {
+          if (0xFFFFFFFF == *value && field + 8 <= field_end) {
+            *value = Get64(field);
+            field += 8;
+          }
+        }
+      }
+      at += 4 + field_size;
+    }
+    position += kEntrySize + name_size + extra_size + comment_size;
+    if (name.ends_with('/') || !IsDumpName(name)) {
+      continue;
+    }
+
+    char local[kLocalSize];
+    if (!ReadFully(file, local_offset, local, sizeof(local), bytes_read) ||
+        sizeof(local) != bytes_read || 0 != std::memcmp(local, "PK\3\4", 4)) {
+      return ArchiveStatus::kBroken;
+    }
+    const std::uint64_t data_offset =
+        local_offset + kLocalSize + Get16(local + 26) + Get16(local + 28);
+    const std::size_t wanted = static_cast<std::size_t>(
+        std::min<std::uint64_t>(head_size, uncompressed_size));
+    std::ptrdiff_t head_read = -1;
+    if (0 != (flags & 1)) {
+      // Encrypted
+    } else if (0 == method) {
+      if (!ReadFully(file, data_offset, head.data(), wanted, bytes_read)) {
+        return ArchiveStatus::kReadFailed;
+      }
+      head_read = static_cast<std::ptrdiff_t>(bytes_read);
+    } else if (8 == method) {
+#ifdef USE_ZLIB
+      head_read = archive_detail::InflateHead(file, data_offset,
+                                              compressed_size, head.data(),
+                                              wanted);
+#endif
+    }
+    if (head_read < 0) {
+      visit(name, std::nullopt);
+    } else {
+      visit(name, std::string_view(head.data(),
+                                   static_cast<std::size_t>(head_read)));
+    }
+  }
+  return ArchiveStatus::kRead;
+}
+
+// Calls visit() like ReadZip() for the members of a tar archive named
+// *.dmp, plain or gzip compressed. A plain archive is read header by
+// header, seeking over the data; a compressed one has to be inflated to
+// its end, but nothing past the heads is kept.
+template <typename Visit>
+ArchiveStatus ReadTar(const PositionedFile& file,
+                      bool gzip,
+                      std::size_t head_size,
+                      Visit&& visit) {
+  static constexpr std::size_t kBlockSize = 512;
+#ifndef USE_ZLIB
+  if (gzip) {
+    return ArchiveStatus::kUnsupported;
+  }
+#endif
+  archive_detail::TarSource source(file, gzip);
+  const auto broken = [&source] {
+    return source.failed() ? ArchiveStatus::kReadFailed
+                           : ArchiveStatus::kBroken;
+  };
+  std::vector<char> head(head_size);
+  // Of the next member, from GNU 'L' and pax 'x' headers before it
+  std::optional<std::string> next_name;
+  std::optional<std::uint64_t> next_size;
+  std::string records;
+  archive_detail::TarHeader header;
+  char block[kBlockSize];
+  for (;;) {
+    const std::ptrdiff_t bytes_read = source.Read(block, kBlockSize);
+    if (bytes_read < 0) {
+      return broken();
+    }
+    // A zero block ends the archive, and so does the end of the data for
+    // writers that don't add the two zero blocks
+    if (0 == bytes_read ||
+        std::all_of(block, block + bytes_read, [](char c) { return 0 == c; })) {
+      return ArchiveStatus::kRead;
+    }
+    if (kBlockSize != static_cast<std::size_t>(bytes_read) ||
+        !archive_detail::ParseTarHeader(block, header)) {
+      return ArchiveStatus::kBroken;
+    }
+    const auto padding = [&header] {
+      return (kBlockSize - header.size % kBlockSize) % kBlockSize;
+    };
+
+    if ('L' == header.type || 'x' == header.type) {
+      // A name or a few records; a megabyte of them is no archive
+      if (1 << 20 < header.size) {
+        return ArchiveStatus::kBroken;
+      }
+      records.resize(static_cast<std::size_t>(header.size));
+      if (source.Read(records.data(), records.size()) !=
+              static_cast<std::ptrdiff_t>(records.size()) ||
+          !source.Skip(padding())) {
+        return broken();
+      }
+      if ('L' == header.type) {
+        next_name = std::string(records.c_str());
+      } else {
+        archive_detail::ReadPaxRecords(records, next_name, next_size);
+      }
+      continue;
+    }
+    if ('K' == header.type || 'g' == header.type) {
+      // A long link name, or pax records of all the members after it; the
+      // next member still takes the name and size above
+      if (!source.Skip(header.size + padding())) {
+        return broken();
+      }
+      continue;
+    }
+
+    if (next_name) {
+      header.name = std::move(*next_name);
+      next_name.reset();
+    }
+    if (next_size) {
+      header.size = *next_size;
+      next_size.reset();
+    }
+    std::uint64_t left = header.size + padding();
+    if (('0' == header.type || '\0' == header.type || '7' == header.type) &&
+        IsDumpName(header.name)) {
+      const auto wanted = static_cast<std::size_t>(
+          std::min<std::uint64_t>(head_size, header.size));
+      if (source.Read(head.data(), wanted) !=
+          static_cast<std::ptrdiff_t>(wanted)) {
+        return broken();
+      }
+      std::string_view member = header.name;
+      while (member.starts_with("./")) {
+        member.remove_prefix(2);
+      }
+      visit(member, std::string_view(head.data(), wanted));
+      left -= wanted;
+    }
+    if (!source.Skip(left)) {
+      return broken();
+    }
+  }
+}
+
+// Reads a zip or tar archive, telling them apart by their first bytes
+template <typename Visit>
+ArchiveStatus ReadArchive(const boost::filesystem::path& filename,
+                          std::size_t head_size,
+                          Visit&& visit) {
+  PositionedFile file;
+  char magic[4] = {};
+  if (!file.Open(filename) || file.ReadAt(0, magic, sizeof(magic)) < 0) {
+    return ArchiveStatus::kReadFailed;
+  }
+  // A local file header, the end of an empty archive, or the marker of a
+  // spanned one. Only "PK" could be a tar whose first name starts so
+  if (0 == std::memcmp(magic, "PK\3\4", 4) ||
+      0 == std::memcmp(magic, "PK\5\6", 4) ||
+      0 == std::memcmp(magic, "PK\7\10", 4)) {
+    return ReadZip(file, head_size, visit);
+  }
+  return ReadTar(file, 0 == std::memcmp(magic, "\x1f\x8b", 2), head_size,
+                 visit);
+}
+
+}  // namespace umutech::process_dump
@@ -0,0 +1,296 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ios>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/filesystem/operations.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/nowide/fstream.hpp>
+
+#include "mapped_file.hpp"
+#include "minidump.hpp"
+
+namespace umutech::process_dump {
+
+// FNV-1a, stable across platforms and runs, so it can be written to disk
+inline std::uint64_t SignatureHash(std::string_view text) noexcept {
+  std::uint64_t hash = 0xCBF29CE484222325ULL;
+  for (const char c : text) {
+    hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+inline void AppendHex(std::string& text, std::uint64_t value) {
+  static constexpr char kDigits[] = "0123456789abcdef";
+  char digits[16];
+  std::size_t size = 0;
+  do {
+    digits[size++] = kDigits[value & 0xF];
+    value >>= 4;
+  } while (0 != value);
+  text += "0x";
+  while (0 != size) {
+    text += digits[--size];
+  }
+}
+
+// What makes two crashes the same crash: the exception code, the module
+// and offset it's at, and up to `frames` values on the crashing thread's
+// stack that point into a module, as return addresses do, from the top of
+// the stack down. Offsets in modules rather than addresses, so the same
+// crash with other load addresses has the same signature; module names in
+// lower case, as Windows doesn't tell them apart by case.
+inline std::string CrashSignature(const Minidump& dump, std::size_t frames) {
+  const auto exception = dump.Exception();
+  if (!exception) {
+    return "no exception";
+  }
+
+  struct Image {
+    std::uint64_t base;
+    std::uint64_t size;
+    std::uint32_t name_rva;
+  };
+  std::vector<Image> images;
+  const MinidumpRecords<MinidumpModule> modules = dump.Modules();
+  images.reserve(modules.size());
+  for (std::size_t i = 0; i < modules.size(); ++i) {
+    const MinidumpModule module = modules[i];
+    images.push_back(
+        {module.BaseOfImage, module.SizeOfImage, module.ModuleNameRva});
+  }
+  std::sort(images.begin(), images.end(),
+            [](const Image& a, const Image& b) { return a.base < b.base; });
+  std::unordered_map<std::uint32_t, std::string> names;
+  // Appends `address` as module+offset; false if no module holds it
+  const auto append_location = [&](std::string& text, std::uint64_t address) {
+    auto it = std::upper_bound(
+        images.begin(), images.end(), address,
+        [](std::uint64_t address, const Image& image) {
+          return address < image.base;
+        });
+    if (images.begin() == it || (--it)->size <= address - it->base) {
+      return false;
+    }
+    auto [name, added] = names.try_emplace(it->name_rva);
+    if (added) {
+      name->second = dump.ModuleName(it->name_rva);
+      for (char& c : name->second) {
+        if ('A' <= c && c <= 'Z') {
+          c = static_cast<char>(c - 'A' + 'a');
+        }
+      }
+    }
+    text += ' ';
+    text += name->second;
+    text += '+';
+    AppendHex(text, address - it->base);
+    return true;
+  };
+
+  const MinidumpException& record = exception->ExceptionRecord;
+  std::string text;
+  AppendHex(text, record.ExceptionCode);
+  if (!append_location(text, record.ExceptionAddress)) {
+    text += ' ';
+    AppendHex(text, record.ExceptionAddress);
+  }
+
+  const MinidumpRecords<MinidumpThread> threads = dump.Threads();
+  std::string_view stack;
+  for (std::size_t i = 0; i < threads.size(); ++i) {
+    const MinidumpThread thread = threads[i];
+    if (thread.ThreadId == exception->ThreadId) {
+      stack = dump.At(thread.Stack.Memory);
+      break;
+    }
+  }
+  // PROCESSOR_ARCHITECTURE_INTEL and _ARM have 4-byte pointers
+  const auto system = dump.SystemInfo();
+  const std::size_t pointer_size =
+      system && (0 == system->ProcessorArchitecture ||
+                 5 == system->ProcessorArchitecture)
+          ? 4
+          : 8;
+  for (std::size_t offset = 0;
+       0 != frames && pointer_size <= stack.size() - offset;
+       offset += pointer_size) {
+    std::uint64_t value = 0;
+    std::memcpy(&value, stack.data() + offset, pointer_size);
+    if (append_location(text, value)) {
+      --frames;
+    }
+  }
+  return text;
+}
+
+// Crash signatures of dumps by path from the directory of the index, for
+// --buckets. The index is a header, then records of a fixed part, the path
+// and the signature, each padded to 8 bytes. It's only ever appended to: a
+// rerun maps it, takes the signatures of the dumps whose size and mtime are
+// the same, and appends those of the others; the last record of a path wins.
+class BucketIndex {
+ public:
+  struct Entry {
+    std::uint64_t size;
+    std::int64_t mtime;
+    std::uint64_t signature;
+    std::string_view text;
+  };
+
+  struct NewEntry {
+    std::string path;
+    std::uint64_t size;
+    std::int64_t mtime;
+    // SignatureHash() of the text
+    std::uint64_t signature;
+    std::string text;
+  };
+
+  explicit BucketIndex(std::uint32_t frames) noexcept : frames_(frames) {}
+
+  // Returns false if the file is something else than an index. A missing
+  // index, or one of another number of frames, starts anew.
+  bool Load(const boost::filesystem::path& filename);
+  std::size_t size() const noexcept { return entries_.size(); }
+  const Entry* Find(std::string_view path,
+                    std::uint64_t size,
+                    std::int64_t mtime) const noexcept;
+  // Ends the views of Find(). A record cut short by a crash before is
+  // written over.
+  bool Append(const boost::filesystem::path& filename,
+              const std::vector<NewEntry>& entries);
+
+ private:
+  static constexpr char kMagic[8] = {'P', 'D', 'B', 'U', 'C', 'K', 'E', 'T'};
+  static constexpr std::uint32_t kVersion = 1;
+
+  struct Header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t frames;
+  };
+
+  struct Record {
+    std::uint64_t size;
+    std::int64_t mtime;
+    std::uint64_t signature;
+    std::uint32_t path_size;
+    std::uint32_t text_size;
+  };
+
+  static std::uint64_t Padded(std::uint64_t size) noexcept {
+    return (size + 7) / 8 * 8;
+  }
+
+  std::uint32_t frames_;
+  MappedFile file_;
+  // Of the whole records, where the next one goes
+  std::uint64_t end_{};
+  std::unordered_map<std::string_view, Entry> entries_;
+};
+
+inline bool BucketIndex::Load(const boost::filesystem::path& filename) {
+  entries_.clear();
+  end_ = 0;
+  if (!file_.Open(filename) || 0 == file_.size()) {
+    return true;
+  }
+  const std::string_view data(file_.data(),
+                              static_cast<std::size_t>(file_.size()));
+  const auto header = ReadRecord<Header>(data);
+  if (!header || 0 != std::memcmp(header->magic, kMagic, sizeof(kMagic))) {
+    file_.Close();
+    return false;
+  }
+  if (kVersion != header->version || frames_ != header->frames) {
+    file_.Close();
+    return true;
+  }
+  std::size_t offset = sizeof(Header);
+  while (const auto record = ReadRecord<Record>(data, offset)) {
+    const std::uint64_t size = Padded(sizeof(Record) +
+                                      std::uint64_t{record->path_size} +
+                                      record->text_size);
+    if (data.size() - offset < size) {
+      break;
+    }
+    const std::string_view path =
+        data.substr(offset + sizeof(Record), record->path_size);
+    const std::string_view text =
+        data.substr(offset + sizeof(Record) + record->path_size,
+                    record->text_size);
+    entries_[path] = {record->size, record->mtime, record->signature, text};
+    offset += static_cast<std::size_t>(size);
+  }
+  end_ = offset;
+  return true;
+}
+
+inline const BucketIndex::Entry* BucketIndex::Find(
+    std::string_view path,
+    std::uint64_t size,
+    std::int64_t mtime) const noexcept {
+  const auto it = entries_.find(path);
+  if (entries_.end() == it || size != it->second.size ||
+      mtime != it->second.mtime) {
+    return nullptr;
+  }
+  return &it->second;
+}
+
+inline bool BucketIndex::Append(const boost::filesystem::path& filename,
+                                const std::vector<NewEntry>& entries) {
+  entries_.clear();
+  const bool fresh = 0 == end_;
+  const bool torn = !fresh && end_ != file_.size();
+  // Windows can't resize a mapped file
+  file_.Close();
+  if (torn) {
+    boost::system::error_code ec;
+    boost::filesystem::resize_file(filename, end_, ec);
+    if (ec) {
+      return false;
+    }
+  }
+  boost::nowide::ofstream f(
+      filename.string(),
+      std::ios::binary | (fresh ? std::ios::trunc : std::ios::app));
+  if (!f) {
+    return false;
+  }
+  if (fresh) {
+    Header header{};
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.frames = frames_;
+    f.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    end_ = sizeof(header);
+  }
+  static constexpr char kPadding[8] = {};
+  for (const NewEntry& entry : entries) {
+    const Record record{entry.size,
+                        entry.mtime,
+                        entry.signature,
+                        static_cast<std::uint32_t>(entry.path.size()),
+                        static_cast<std::uint32_t>(entry.text.size())};
+    f.write(reinterpret_cast<const char*>(&record), sizeof(record));
+    f.write(entry.path.data(), static_cast<std::streamsize>(entry.path.size()));
+    f.write(entry.text.data(), static_cast<std::streamsize>(entry.text.size()));
+    const std::uint64_t size =
+        sizeof(record) + entry.path.size() + entry.text.size();
+    f.write(kPadding, static_cast<std::streamsize>(Padded(size) - size));
+    end_ += Padded(size);
+  }
+  return static_cast<bool>(f.flush());
+}
+
+}  // namespace umutech::process_dump
@@ -0,0 +1,283 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define UMU_HAS_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#include "minidump.hpp"
+
+namespace umutech::process_dump {
+
+// What --grep looks for, one of
+//   hex:<bytes>  bytes in hex, spaces between them allowed
+//   ptr:<value>  a pointer in hex, as wide as those of the dumped process
+//   str:<text>   text, in UTF-8 and in UTF-16LE; without a prefix too
+struct GrepPattern {
+  enum class Kind { kBytes, kPointer, kText };
+
+  Kind kind;
+  // As given
+  std::string spelling;
+  // The bytes, the pointer in 8 little endian bytes, or the text in UTF-8
+  std::string bytes;
+};
+
+struct GrepHit {
+  std::uint64_t address;
+  // Index in the patterns
+  std::size_t pattern;
+  // Text found as UTF-16LE
+  bool utf16;
+};
+
+// Nothing for empty patterns and bad hex
+inline std::optional<GrepPattern> ParseGrepPattern(std::string_view arg) {
+  const auto hex_digit = [](char c) -> int {
+    if ('0' <= c && c <= '9') {
+      return c - '0';
+    }
+    c = static_cast<char>(c | 0x20);
+    return 'a' <= c && c <= 'f' ? c - 'a' + 10 : -1;
+  };
+  GrepPattern pattern{GrepPattern::Kind::kText, std::string(arg), {}};
+  if (arg.starts_with("hex:")) {
+    pattern.kind = GrepPattern::Kind::kBytes;
+    std::string digits;
+    for (const char c : arg.substr(4)) {
+      if (' ' != c) {
+        digits += c;
+      }
+    }
+    if (0 != digits.size() % 2) {
+      return std::nullopt;
+    }
+    for (std::size_t i = 0; i < digits.size(); i += 2) {
+      const int high = hex_digit(digits[i]);
+      const int low = hex_digit(digits[i + 1]);
+      if (high < 0 || low < 0) {
+        return std::nullopt;
+      }
+      pattern.bytes += static_cast<char>(high << 4 | low);
+    }
+  } else if (arg.starts_with("ptr:")) {
+    pattern.kind = GrepPattern::Kind::kPointer;
+    std::string_view digits = arg.substr(4);
+    if (digits.starts_with("0x") || digits.starts_with("0X")) {
+      digits.remove_prefix(2);
+    }
+    std::uint64_t value = 0;
+    const auto [end, error] = std::from_chars(
+        digits.data(), digits.data() + digits.size(), value, 16);
+    if (std::errc{} != error || digits.data() + digits.size() != end) {
+      return std::nullopt;
+    }
+    for (unsigned i = 0; i < 8; ++i) {
+      pattern.bytes += static_cast<char>(value >> i * 8 & 0xFF);
+    }
+  } else {
+    pattern.bytes = arg.starts_with("str:") ? arg.substr(4) : arg;
+  }
+  if (pattern.bytes.empty()) {
+    return std::nullopt;
+  }
+  return pattern;
+}
+
+// UTF-8 as UTF-16LE bytes; what isn't UTF-8 becomes U+FFFD
+inline std::string Utf16Le(std::string_view text) {
+  std::string units;
+  const auto append = [&units](std::uint32_t unit) {
+    units += static_cast<char>(unit & 0xFF);
+    units += static_cast<char>(unit >> 8);
+  };
+  for (std::size_t i = 0; i < text.size();) {
+    const auto lead = static_cast<unsigned char>(text[i]);
+    const std::size_t size = lead < 0x80           ? 1
+                             : (lead & 0xE0) == 0xC0 ? 2
+                             : (lead & 0xF0) == 0xE0 ? 3
+                             : (lead & 0xF8) == 0xF0 ? 4
+                                                     : 0;
+    std::uint32_t code = 1 == size ? lead : lead & (0x7F >> size);
+    bool valid = 0 != size && size <= text.size() - i;
+    for (std::size_t j = 1; valid && j < size; ++j) {
+      const auto next = static_cast<unsigned char>(text[i + j]);
+      valid = (next & 0xC0) == 0x80;
+      code = code << 6 | (next & 0x3F);
+    }
+    if (!valid) {
+      code = 0xFFFD;
+    }
+    i += valid ? size : 1;
+    if (0x10000 <= code && code < 0x110000) {
+      append(0xD800 + ((code - 0x10000) >> 10));
+      append(0xDC00 + ((code - 0x10000) & 0x3FF));
+    } else {
+      append(code < 0x110000 ? code : 0xFFFD);
+    }
+  }
+  return units;
+}
+
+// Finds a few byte strings at once in one pass over the data. Each start
+// is filtered by the first two bytes of the patterns, 16 starts at a time
+// with SSE2, and only where they match are the patterns compared. Memory
+// is mostly zeros and pointers, so few starts get that far.
+class PatternSet {
+ public:
+  // `id` is told back with each match
+  void Add(std::string bytes, std::size_t id);
+  bool empty() const noexcept { return patterns_.empty(); }
+
+  // Calls hit(offset, id) for each match in `data`, in order of offset;
+  // matches may overlap
+  template <typename Hit>
+  void Scan(std::string_view data, Hit&& hit) const;
+
+ private:
+  struct Pattern {
+    std::string bytes;
+    std::size_t id;
+  };
+  struct Anchor {
+    char first;
+    char second;
+    // A pattern of one byte has no second
+    bool paired;
+
+    bool operator==(const Anchor&) const = default;
+  };
+
+  template <typename Hit>
+  void Match(std::string_view data, std::size_t offset, Hit& hit) const {
+    for (const Pattern& pattern : patterns_) {
+      if (pattern.bytes.size() <= data.size() - offset &&
+          0 == std::memcmp(data.data() + offset, pattern.bytes.data(),
+                           pattern.bytes.size())) {
+        hit(offset, pattern.id);
+      }
+    }
+  }
+
+  std::vector<Pattern> patterns_;
+  // Distinct
+  std::vector<Anchor> anchors_;
+  // The first bytes, for the starts SSE2 doesn't cover
+  std::array<bool, 256> first_{};
+};
+
+inline void PatternSet::Add(std::string bytes, std::size_t id) {
+  if (bytes.empty()) {
+    return;
+  }
+  const Anchor anchor{bytes[0], 1 < bytes.size() ? bytes[1] : '\0',
+                      1 < bytes.size()};
+  if (anchors_.end() == std::find(anchors_.begin(), anchors_.end(), anchor)) {
+    anchors_.push_back(anchor);
+  }
+  first_[static_cast<unsigned char>(bytes[0])] = true;
+  patterns_.push_back({std::move(bytes), id});
+}
+
+template <typename Hit>
+void PatternSet::Scan(std::string_view data, Hit&& hit) const {
+  std::size_t i = 0;
+#ifdef UMU_HAS_SSE2
+  // As long as the second bytes of all 16 starts are there
+  for (; i + 17 <= data.size(); i += 16) {
+    const __m128i first = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(data.data() + i));
+    const __m128i second = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(data.data() + i + 1));
+    int mask = 0;
+    for (const Anchor& anchor : anchors_) {
+      __m128i match = _mm_cmpeq_epi8(first, _mm_set1_epi8(anchor.first));
+      if (anchor.paired) {
+        match = _mm_and_si128(
+            match, _mm_cmpeq_epi8(second, _mm_set1_epi8(anchor.second)));
+      }
+      mask |= _mm_movemask_epi8(match);
+    }
+    for (auto bits = static_cast<unsigned>(mask); 0 != bits;
+         bits &= bits - 1) {
+      Match(data, i + std::countr_zero(bits), hit);
+    }
+  }
+#endif
+  for (; i < data.size(); ++i) {
+    if (first_[static_cast<unsigned char>(data[i])]) {
+      Match(data, i, hit);
+    }
+  }
+}
+
+// Scans the memory captured in `dump` for `patterns`. Ranges that follow
+// each other in the process and in the file are scanned as one, so what
+// spans pages of a full memory dump is found.
+inline std::vector<GrepHit> GrepMinidump(
+    const Minidump& dump,
+    const std::vector<GrepPattern>& patterns) {
+  // x86 and ARM processes have 4-byte pointers
+  const auto system = dump.SystemInfo();
+  const bool narrow = system && (0 == system->ProcessorArchitecture ||
+                                 5 == system->ProcessorArchitecture);
+  PatternSet set;
+  for (std::size_t i = 0; i < patterns.size(); ++i) {
+    const GrepPattern& pattern = patterns[i];
+    switch (pattern.kind) {
+      case GrepPattern::Kind::kBytes:
+        set.Add(pattern.bytes, i * 2);
+        break;
+      case GrepPattern::Kind::kPointer:
+        if (!narrow) {
+          set.Add(pattern.bytes, i * 2);
+        } else if (pattern.bytes.find_first_not_of('\0', 4) ==
+                   std::string::npos) {
+          set.Add(pattern.bytes.substr(0, 4), i * 2);
+        }
+        break;
+      case GrepPattern::Kind::kText:
+        set.Add(pattern.bytes, i * 2);
+        set.Add(Utf16Le(pattern.bytes), i * 2 + 1);
+        break;
+    }
+  }
+
+  std::vector<MinidumpMemoryRange> ranges = dump.Memory();
+  std::vector<GrepHit> hits;
+  if (set.empty()) {
+    return hits;
+  }
+  for (std::size_t i = 0; i < ranges.size();) {
+    MinidumpMemoryRange range = ranges[i];
+    for (++i; i < ranges.size() &&
+              range.address + range.bytes.size() == ranges[i].address &&
+              range.bytes.data() + range.bytes.size() ==
+                  ranges[i].bytes.data();
+         ++i) {
+      range.bytes = std::string_view(range.bytes.data(),
+                                     range.bytes.size() +
+                                         ranges[i].bytes.size());
+    }
+    set.Scan(range.bytes, [&](std::size_t offset, std::size_t id) {
+      hits.push_back({range.address + offset, id / 2, 0 != id % 2});
+    });
+  }
+  return hits;
+}
+
+}  // namespace umutech::process_dump
@@ -0,0 +1,104 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string_view>
+
+namespace umutech::process_dump {
+
+// The fixed header of a 64-bit kernel dump, DUMP_HEADER64, is the first
+// 0x2000 bytes; a bitmap dump follows it with a header whose signature
+// tells a full dump from a kernel one. This many bytes hold both.
+constexpr std::size_t kKernelHeaderSize = 0x2000 + sizeof(std::uint32_t);
+
+struct KernelDump {
+  // 0xF for a free build, 0xC for a checked one
+  std::uint32_t major_version;
+  // The build number of Windows
+  std::uint32_t minor_version;
+  // IMAGE_FILE_MACHINE_*
+  std::uint32_t machine;
+  std::uint32_t processors;
+  std::uint32_t bugcheck_code;
+  std::uint64_t bugcheck_parameters[4];
+  std::uint32_t dump_type;
+  // 'SDMP' or 'FDMP' after the header of a bitmap dump, else 0
+  std::uint32_t bitmap_signature;
+};
+
+// Decodes the fields of DUMP_HEADER64 at their offsets; nothing if `head`
+// is too short for them
+inline std::optional<KernelDump> DecodeKernelDump(std::string_view head) {
+  static constexpr std::size_t kMajorVersion = 0x008;
+  static constexpr std::size_t kMinorVersion = 0x00C;
+  static constexpr std::size_t kMachineImageType = 0x030;
+  static constexpr std::size_t kNumberProcessors = 0x034;
+  static constexpr std::size_t kBugCheckCode = 0x038;
+  static constexpr std::size_t kBugCheckParameters = 0x040;
+  static constexpr std::size_t kDumpType = 0xF98;
+  static constexpr std::size_t kBitmapHeader = 0x2000;
+
+  if (head.size() < kDumpType + sizeof(std::uint32_t)) {
+    return std::nullopt;
+  }
+  const auto read = [head](std::size_t offset, auto& field) {
+    std::memcpy(&field, head.data() + offset, sizeof(field));
+  };
+  KernelDump dump{};
+  read(kMajorVersion, dump.major_version);
+  read(kMinorVersion, dump.minor_version);
+  read(kMachineImageType, dump.machine);
+  read(kNumberProcessors, dump.processors);
+  read(kBugCheckCode, dump.bugcheck_code);
+  read(kBugCheckParameters, dump.bugcheck_parameters);
+  read(kDumpType, dump.dump_type);
+  if (kBitmapHeader + sizeof(std::uint32_t) <= head.size()) {
+    read(kBitmapHeader, dump.bitmap_signature);
+  }
+  return dump;
+}
+
+inline const char* DumpTypeName(const KernelDump& dump) noexcept {
+  switch (dump.dump_type) {
+    case 1:
+      return "full";
+    case 2:
+      return "kernel";
+    case 4:
+      return "triage";
+    case 5:
+      // Kernel memory and automatic dumps are both 'SDMP'
+      return 'PMDS' == dump.bitmap_signature   ? "bitmap kernel"
+             : 'PMDF' == dump.bitmap_signature ? "bitmap full"
+                                                : "bitmap";
+    case 6:
+      return "live kernel";
+    case 8:
+      return "kernel memory";
+    case 9:
+      return "kernel and user memory";
+    case 10:
+      return "complete memory";
+    default:
+      return "unknown";
+  }
+}
+
+inline const char* MachineName(std::uint32_t machine) noexcept {
+  switch (machine) {
+    case 0x014C:
+      return "x86";
+    case 0x01C4:
+      return "ARM";
+    case 0x8664:
+      return "x64";
+    case 0xAA64:
+      return "ARM64";
+    default:
+      return "unknown machine";
+  }
+}
+
+}  // namespace umutech::process_dump
@@ -0,0 +1,120 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <boost/filesystem/path.hpp>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace umutech::process_dump {
+
+// Read-only mapping of a whole file. A dump is read where it lies: only the
+// pages that are looked at come from the disk, however big the dump is.
+class MappedFile {
+ public:
+  MappedFile() = default;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  ~MappedFile() { Close(); }
+
+  // An empty file opens, with no data
+  bool Open(const boost::filesystem::path& filename) noexcept;
+  void Close() noexcept;
+
+  const char* data() const noexcept { return view_; }
+  std::uint64_t size() const noexcept { return size_; }
+
+ private:
+  const char* view_{};
+  std::uint64_t size_{};
+};
+
+inline bool MappedFile::Open(const boost::filesystem::path& filename) noexcept {
+  Close();
+#ifdef _WIN32
+  HANDLE file = ::CreateFileW(
+      filename.c_str(), GENERIC_READ,
+      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+      OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+  if (INVALID_HANDLE_VALUE == file) {
+    return false;
+  }
+  LARGE_INTEGER size;
+  bool opened = ::GetFileSizeEx(file, &size);
+  if (opened && 0 != size.QuadPart) {
+    // A multi-GB file doesn't fit into a 32-bit address space
+    opened = static_cast<std::uint64_t>(size.QuadPart) ==
+             static_cast<std::size_t>(size.QuadPart);
+    HANDLE mapping = opened ? ::CreateFileMappingW(file, nullptr,
+                                                   PAGE_READONLY, 0, 0, nullptr)
+                            : nullptr;
+    if (nullptr != mapping) {
+      view_ = static_cast<const char*>(
+          ::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+      // The view keeps the mapping object alive
+      ::CloseHandle(mapping);
+    }
+    opened = nullptr != view_;
+  }
+  ::CloseHandle(file);
+  if (!opened) {
+    return false;
+  }
+  size_ = static_cast<std::uint64_t>(size.QuadPart);
+#else
+  const int file = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (file < 0) {
+    return false;
+  }
+  struct stat st;
+  bool opened = 0 == ::fstat(file, &st) && S_ISREG(st.st_mode);
+  if (opened && 0 != st.st_size) {
+    opened = static_cast<std::uint64_t>(st.st_size) ==
+             static_cast<std::size_t>(st.st_size);
+    void* view = opened ? ::mmap(nullptr, static_cast<std::size_t>(st.st_size),
+                                 PROT_READ, MAP_PRIVATE, file, 0)
+                        : MAP_FAILED;
+    opened = MAP_FAILED != view;
+    if (opened) {
+      // Streams are scattered all over the dump
+      ::madvise(view, static_cast<std::size_t>(st.st_size), MADV_RANDOM);
+      view_ = static_cast<const char*>(view);
+    }
+  }
+  // The mapping outlives the descriptor
+  ::close(file);
+  if (!opened) {
+    return false;
+  }
+  size_ = static_cast<std::uint64_t>(st.st_size);
+#endif
+  return true;
+}
+
+inline void MappedFile::Close() noexcept {
+  if (nullptr != view_) {
+#ifdef _WIN32
+    ::UnmapViewOfFile(view_);
+#else
+    ::munmap(const_cast<char*>(view_), static_cast<std::size_t>(size_));
+#endif
+  }
+  view_ = nullptr;
+  size_ = 0;
+}
+
+}  // namespace umutech::process_dump
@@ -0,0 +1,427 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace umutech::process_dump {
+
+// The layouts of minidumpapiset.h. A dump is little endian and packs them
+// to 4 bytes at any offset, so they are copied out with memcpy, one record
+// at a time, and never cast in place.
+#pragma pack(push, 4)
+
+struct MinidumpLocation {
+  std::uint32_t DataSize;
+  std::uint32_t Rva;
+};
+
+struct MinidumpHeader {
+  std::uint32_t Signature;
+  std::uint32_t Version;
+  std::uint32_t NumberOfStreams;
+  std::uint32_t StreamDirectoryRva;
+  std::uint32_t CheckSum;
+  union {
+    std::uint32_t Reserved;
+    std::uint32_t TimeDateStamp;
+  };
+  std::uint64_t Flags;
+};
+
+struct MinidumpDirectory {
+  std::uint32_t StreamType;
+  MinidumpLocation Location;
+};
+
+struct MinidumpMemoryDescriptor {
+  std::uint64_t StartOfMemoryRange;
+  MinidumpLocation Memory;
+};
+
+// MINIDUMP_MEMORY_DESCRIPTOR64: the data of all of them follows BaseRva of
+// the list, one range after another
+struct MinidumpMemoryDescriptor64 {
+  std::uint64_t StartOfMemoryRange;
+  std::uint64_t DataSize;
+};
+
+struct MinidumpMemory64List {
+  std::uint64_t NumberOfMemoryRanges;
+  std::uint64_t BaseRva;
+};
+
+struct MinidumpThread {
+  std::uint32_t ThreadId;
+  std::uint32_t SuspendCount;
+  std::uint32_t PriorityClass;
+  std::uint32_t Priority;
+  std::uint64_t Teb;
+  MinidumpMemoryDescriptor Stack;
+  MinidumpLocation ThreadContext;
+};
+
+struct MinidumpModule {
+  std::uint64_t BaseOfImage;
+  std::uint32_t SizeOfImage;
+  std::uint32_t CheckSum;
+  std::uint32_t TimeDateStamp;
+  std::uint32_t ModuleNameRva;
+  // VS_FIXEDFILEINFO
+  std::uint32_t VersionInfo[13];
+  MinidumpLocation CvRecord;
+  MinidumpLocation MiscRecord;
+  std::uint64_t Reserved0;
+  std::uint64_t Reserved1;
+};
+
+struct MinidumpException {
+  std::uint32_t ExceptionCode;
+  std::uint32_t ExceptionFlags;
+  std::uint64_t ExceptionRecord;
+  std::uint64_t ExceptionAddress;
+  std::uint32_t NumberParameters;
+  std::uint32_t UnusedAlignment;
+  std::uint64_t ExceptionInformation[15];
+};
+
+struct MinidumpExceptionStream {
+  std::uint32_t ThreadId;
+  std::uint32_t Alignment;
+  MinidumpException ExceptionRecord;
+  MinidumpLocation ThreadContext;
+};
+
+struct MinidumpSystemInfo {
+  std::uint16_t ProcessorArchitecture;
+  std::uint16_t ProcessorLevel;
+  std::uint16_t ProcessorRevision;
+  std::uint8_t NumberOfProcessors;
+  std::uint8_t ProductType;
+  std::uint32_t MajorVersion;
+  std::uint32_t MinorVersion;
+  std::uint32_t BuildNumber;
+  std::uint32_t PlatformId;
+  std::uint32_t CSDVersionRva;
+  std::uint16_t SuiteMask;
+  std::uint16_t Reserved2;
+  // CPU_INFORMATION
+  std::uint8_t Cpu[24];
+};
+
+// MINIDUMP_MISC_INFO; the later versions only add to it
+struct MinidumpMiscInfo {
+  std::uint32_t SizeOfInfo;
+  std::uint32_t Flags1;
+  std::uint32_t ProcessId;
+  std::uint32_t ProcessCreateTime;
+  std::uint32_t ProcessUserTime;
+  std::uint32_t ProcessKernelTime;
+};
+
+#pragma pack(pop)
+
+static_assert(32 == sizeof(MinidumpHeader));
+static_assert(12 == sizeof(MinidumpDirectory));
+static_assert(16 == sizeof(MinidumpMemoryDescriptor));
+static_assert(16 == sizeof(MinidumpMemoryDescriptor64));
+static_assert(48 == sizeof(MinidumpThread));
+static_assert(108 == sizeof(MinidumpModule));
+static_assert(168 == sizeof(MinidumpExceptionStream));
+static_assert(56 == sizeof(MinidumpSystemInfo));
+static_assert(24 == sizeof(MinidumpMiscInfo));
+
+enum class MinidumpStream : std::uint32_t {
+  kThreadList = 3,
+  kModuleList = 4,
+  kMemoryList = 5,
+  kException = 6,
+  kSystemInfo = 7,
+  kMemory64List = 9,
+  kMiscInfo = 15,
+};
+
+constexpr std::uint32_t kMinidumpSignature = 'PMDM';
+// MINIDUMP_MISC_INFO.Flags1 when ProcessId is set
+constexpr std::uint32_t kMiscProcessId = 1;
+
+// Captured memory of the process, at its virtual address
+struct MinidumpMemoryRange {
+  std::uint64_t address;
+  std::string_view bytes;
+};
+
+// Copies a record out of `bytes` at `offset`, if it's all there
+template <typename T>
+std::optional<T> ReadRecord(std::string_view bytes,
+                            std::size_t offset = 0) noexcept {
+  if (bytes.size() < offset || bytes.size() - offset < sizeof(T)) {
+    return std::nullopt;
+  }
+  T record;
+  std::memcpy(&record, bytes.data() + offset, sizeof(T));
+  return record;
+}
+
+// Records of one size side by side in the dump, read one by one
+template <typename T>
+class MinidumpRecords {
+ public:
+  MinidumpRecords() = default;
+  MinidumpRecords(const char* data, std::size_t size) noexcept
+      : data_(data), size_(size) {}
+
+  std::size_t size() const noexcept { return size_; }
+  bool empty() const noexcept { return 0 == size_; }
+  T operator[](std::size_t index) const noexcept {
+    T record;
+    std::memcpy(&record, data_ + index * sizeof(T), sizeof(T));
+    return record;
+  }
+
+ private:
+  const char* data_{};
+  std::size_t size_{};
+};
+
+// Views of the streams of a minidump in memory, usually a MappedFile. Every
+// location is checked against the end of the dump before it's read, so a
+// truncated or broken dump gives empty streams rather than a crash.
+class Minidump {
+ public:
+  enum class Status {
+    kParsed,
+    // Shorter than the header
+    kTooSmall,
+    kNotMinidump,
+    // The stream directory is beyond the end
+    kCorrupted,
+  };
+
+  // `data` must outlive the Minidump
+  Status Parse(std::string_view data) noexcept;
+
+  const MinidumpHeader& header() const noexcept { return header_; }
+  // Empty bytes if any of them are beyond the end
+  std::string_view At(std::uint64_t rva, std::uint64_t size) const noexcept;
+  std::string_view At(MinidumpLocation location) const noexcept {
+    return At(location.Rva, location.DataSize);
+  }
+  // The first stream of `type`, or empty bytes
+  std::string_view Stream(MinidumpStream type) const noexcept;
+
+  std::optional<MinidumpExceptionStream> Exception() const noexcept {
+    return ReadRecord<MinidumpExceptionStream>(
+        Stream(MinidumpStream::kException));
+  }
+  std::optional<MinidumpSystemInfo> SystemInfo() const noexcept {
+    return ReadRecord<MinidumpSystemInfo>(Stream(MinidumpStream::kSystemInfo));
+  }
+  std::optional<MinidumpMiscInfo> MiscInfo() const noexcept;
+  MinidumpRecords<MinidumpThread> Threads() const noexcept {
+    return List<MinidumpThread>(MinidumpStream::kThreadList);
+  }
+  MinidumpRecords<MinidumpModule> Modules() const noexcept {
+    return List<MinidumpModule>(MinidumpStream::kModuleList);
+  }
+  // The ranges of MemoryListStream, then those of Memory64ListStream, in
+  // the order of the dump. A range beyond the end keeps what's there.
+  std::vector<MinidumpMemoryRange> Memory() const;
+  // The module whose image holds `address`
+  std::optional<MinidumpModule> ModuleAt(std::uint64_t address) const noexcept;
+  // The MINIDUMP_STRING at `rva` in UTF-8, empty if it's beyond the end
+  std::string String(std::uint32_t rva) const;
+  // The file name of a module, without the directory
+  std::string ModuleName(std::uint32_t name_rva) const {
+    std::string name = String(name_rva);
+    // Windows paths, whatever the OS that reads them
+    name.erase(0, name.find_last_of("\\/") + 1);
+    return name;
+  }
+
+ private:
+  // A count, then that many records. Some writers pad the count to 8 bytes.
+  template <typename T>
+  MinidumpRecords<T> List(MinidumpStream type) const noexcept;
+  // Up to `size` bytes at `rva`, as many as there are
+  std::string_view Clip(std::uint64_t rva, std::uint64_t size) const noexcept {
+    return rva < data_.size()
+               ? data_.substr(static_cast<std::size_t>(rva),
+                              static_cast<std::size_t>(std::min<std::uint64_t>(
+                                  size, data_.size() - rva)))
+               : std::string_view();
+  }
+
+  std::string_view data_;
+  MinidumpHeader header_{};
+  MinidumpRecords<MinidumpDirectory> directory_;
+};
+
+inline Minidump::Status Minidump::Parse(std::string_view data) noexcept {
+  data_ = data;
+  directory_ = {};
+  const auto header = ReadRecord<MinidumpHeader>(data);
+  if (!header) {
+    return Status::kTooSmall;
+  }
+  header_ = *header;
+  if (kMinidumpSignature != header_.Signature) {
+    return Status::kNotMinidump;
+  }
+  const std::string_view directory =
+      At(header_.StreamDirectoryRva,
+         std::uint64_t{header_.NumberOfStreams} * sizeof(MinidumpDirectory));
+  if (0 != header_.NumberOfStreams && directory.empty()) {
+    return Status::kCorrupted;
+  }
+  directory_ = {directory.data(), header_.NumberOfStreams};
+  return Status::kParsed;
+}
+
+inline std::string_view Minidump::At(std::uint64_t rva,
+                                     std::uint64_t size) const noexcept {
+  if (data_.size() < rva || data_.size() - rva < size) {
+    return {};
+  }
+  return data_.substr(static_cast<std::size_t>(rva),
+                      static_cast<std::size_t>(size));
+}
+
+inline std::string_view Minidump::Stream(MinidumpStream type) const noexcept {
+  for (std::size_t i = 0; i < directory_.size(); ++i) {
+    const MinidumpDirectory entry = directory_[i];
+    if (static_cast<std::uint32_t>(type) == entry.StreamType) {
+      return At(entry.Location);
+    }
+  }
+  return {};
+}
+
+inline std::optional<MinidumpMiscInfo> Minidump::MiscInfo() const noexcept {
+  const std::string_view stream = Stream(MinidumpStream::kMiscInfo);
+  const auto size = ReadRecord<std::uint32_t>(stream);
+  if (!size || *size < sizeof(std::uint32_t)) {
+    return std::nullopt;
+  }
+  // Older writers have fewer fields
+  MinidumpMiscInfo info{};
+  std::memcpy(&info, stream.data(),
+              std::min<std::size_t>({*size, stream.size(), sizeof(info)}));
+  return info;
+}
+
+inline std::vector<MinidumpMemoryRange> Minidump::Memory() const {
+  std::vector<MinidumpMemoryRange> ranges;
+  const auto memory =
+      List<MinidumpMemoryDescriptor>(MinidumpStream::kMemoryList);
+  for (std::size_t i = 0; i < memory.size(); ++i) {
+    const MinidumpMemoryDescriptor descriptor = memory[i];
+    ranges.push_back({descriptor.StartOfMemoryRange,
+                      Clip(descriptor.Memory.Rva, descriptor.Memory.DataSize)});
+  }
+
+  // Full memory dumps: no count padding, and a 64-bit count
+  const std::string_view stream = Stream(MinidumpStream::kMemory64List);
+  const auto list = ReadRecord<MinidumpMemory64List>(stream);
+  if (!list) {
+    return ranges;
+  }
+  const std::uint64_t count =
+      std::min<std::uint64_t>(list->NumberOfMemoryRanges,
+                              (stream.size() - sizeof(*list)) /
+                                  sizeof(MinidumpMemoryDescriptor64));
+  std::uint64_t rva = list->BaseRva;
+  for (std::uint64_t i = 0; i < count; ++i) {
+    const auto descriptor = *ReadRecord<MinidumpMemoryDescriptor64>(
+        stream, sizeof(*list) + i * sizeof(MinidumpMemoryDescriptor64));
+    const std::string_view bytes = Clip(rva, descriptor.DataSize);
+    if (!bytes.empty()) {
+      ranges.push_back({descriptor.StartOfMemoryRange, bytes});
+    }
+    if (bytes.size() != descriptor.DataSize) {
+      // The rest is beyond the end
+      break;
+    }
+    rva += descriptor.DataSize;
+  }
+  return ranges;
+}
+
+inline std::optional<MinidumpModule> Minidump::ModuleAt(
+    std::uint64_t address) const noexcept {
+  const MinidumpRecords<MinidumpModule> modules = Modules();
+  for (std::size_t i = 0; i < modules.size(); ++i) {
+    const MinidumpModule module = modules[i];
+    if (module.BaseOfImage <= address &&
+        address - module.BaseOfImage < module.SizeOfImage) {
+      return module;
+    }
+  }
+  return std::nullopt;
+}
+
+inline std::string Minidump::String(std::uint32_t rva) const {
+  const auto length = ReadRecord<std::uint32_t>(At(rva, sizeof(std::uint32_t)));
+  if (!length) {
+    return {};
+  }
+  const std::string_view units = At(std::uint64_t{rva} + sizeof(*length),
+                                    *length / 2 * 2);
+  std::string name;
+  name.reserve(units.size() / 2);
+  for (std::size_t i = 0; i < units.size(); i += 2) {
+    std::uint32_t code = static_cast<unsigned char>(units[i]) |
+                         static_cast<unsigned char>(units[i + 1]) << 8;
+    if (0xD800 <= code && code < 0xDC00 && i + 4 <= units.size()) {
+      const std::uint32_t low = static_cast<unsigned char>(units[i + 2]) |
+                                static_cast<unsigned char>(units[i + 3]) << 8;
+      if (0xDC00 <= low && low < 0xE000) {
+        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+        i += 2;
+      }
+    }
+    if (0xD800 <= code && code < 0xE000) {
+      // A lone surrogate
+      code = 0xFFFD;
+    }
+    if (code < 0x80) {
+      name += static_cast<char>(code);
+    } else if (code < 0x800) {
+      name += static_cast<char>(0xC0 | code >> 6);
+      name += static_cast<char>(0x80 | (code & 0x3F));
+    } else if (code < 0x10000) {
+      name += static_cast<char>(0xE0 | code >> 12);
+      name += static_cast<char>(0x80 | (code >> 6 & 0x3F));
+      name += static_cast<char>(0x80 | (code & 0x3F));
+    } else {
+      name += static_cast<char>(0xF0 | code >> 18);
+      name += static_cast<char>(0x80 | (code >> 12 & 0x3F));
+      name += static_cast<char>(0x80 | (code >> 6 & 0x3F));
+      name += static_cast<char>(0x80 | (code & 0x3F));
+    }
+  }
+  return name;
+}
+
+template <typename T>
+MinidumpRecords<T> Minidump::List(MinidumpStream type) const noexcept {
+  const std::string_view stream = Stream(type);
+  const auto count = ReadRecord<std::uint32_t>(stream);
+  if (!count) {
+    return {};
+  }
+  std::size_t offset = sizeof(*count);
+  if (stream.size() == 8 + std::uint64_t{*count} * sizeof(T)) {
+    offset = 8;
+  }
+  // A truncated list keeps the records that are all there
+  const std::size_t fits = (stream.size() - offset) / sizeof(T);
+  return {stream.data() + offset, std::min<std::size_t>(*count, fits)};
+}
+
+}  // namespace umutech::process_dump
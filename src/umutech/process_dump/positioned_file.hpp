@@ -0,0 +1,126 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+#include <boost/filesystem/path.hpp>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#endif
+
+namespace umutech::process_dump {
+
+// A file read at offsets, with no position of its own: each read is one
+// pread, or a ReadFile at an OVERLAPPED offset
+class PositionedFile {
+ public:
+  PositionedFile() = default;
+  PositionedFile(const PositionedFile&) = delete;
+  PositionedFile& operator=(const PositionedFile&) = delete;
+  ~PositionedFile();
+
+  bool Open(const boost::filesystem::path& filename) noexcept;
+  // Takes a stat, so only when asked
+  std::optional<std::uint64_t> Size() const noexcept;
+  // Returns how many bytes it read, fewer only at the end of the file (or
+  // beyond 1 GiB on Windows), or -1 on error
+  std::ptrdiff_t ReadAt(std::uint64_t offset,
+                        char* buffer,
+                        std::size_t size) const noexcept;
+
+ private:
+#ifdef _WIN32
+  HANDLE file_{INVALID_HANDLE_VALUE};
+#else
+  int file_{-1};
+#endif
+};
+
+#ifdef _WIN32
+inline PositionedFile::~PositionedFile() {
+  if (INVALID_HANDLE_VALUE != file_) {
+    ::CloseHandle(file_);
+  }
+}
+
+inline bool PositionedFile::Open(
+    const boost::filesystem::path& filename) noexcept {
+  file_ = ::CreateFileW(filename.c_str(), GENERIC_READ,
+                        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                        nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS,
+                        nullptr);
+  return INVALID_HANDLE_VALUE != file_;
+}
+
+inline std::optional<std::uint64_t> PositionedFile::Size() const noexcept {
+  LARGE_INTEGER size;
+  if (!::GetFileSizeEx(file_, &size)) {
+    return std::nullopt;
+  }
+  return static_cast<std::uint64_t>(size.QuadPart);
+}
+
+inline std::ptrdiff_t PositionedFile::ReadAt(std::uint64_t offset,
+                                             char* buffer,
+                                             std::size_t size) const noexcept {
+  OVERLAPPED at{};
+  at.Offset = static_cast<DWORD>(offset);
+  at.OffsetHigh = static_cast<DWORD>(offset >> 32);
+  DWORD bytes_read = 0;
+  if (!::ReadFile(file_, buffer,
+                  static_cast<DWORD>(std::min<std::size_t>(size, 1 << 30)),
+                  &bytes_read, &at)) {
+    return ERROR_HANDLE_EOF == ::GetLastError() ? 0 : -1;
+  }
+  return static_cast<std::ptrdiff_t>(bytes_read);
+}
+#else
+inline PositionedFile::~PositionedFile() {
+  if (0 <= file_) {
+    ::close(file_);
+  }
+}
+
+inline bool PositionedFile::Open(
+    const boost::filesystem::path& filename) noexcept {
+  file_ = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  return 0 <= file_;
+}
+
+inline std::optional<std::uint64_t> PositionedFile::Size() const noexcept {
+  struct stat st;
+  if (0 != ::fstat(file_, &st)) {
+    return std::nullopt;
+  }
+  return static_cast<std::uint64_t>(st.st_size);
+}
+
+inline std::ptrdiff_t PositionedFile::ReadAt(std::uint64_t offset,
+                                             char* buffer,
+                                             std::size_t size) const noexcept {
+  for (;;) {
+    const ssize_t bytes_read =
+        ::pread(file_, buffer, size, static_cast<off_t>(offset));
+    if (0 <= bytes_read || EINTR != errno) {
+      return bytes_read;
+    }
+  }
+}
+#endif
+
+}  // namespace umutech::process_dump
@@ -3,26 +3,60 @@
 #define _HAS_EXCEPTIONS 0
 #define BOOST_EXCEPTION_DISABLE
 
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <optional>
 #include <set>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include <boost/algorithm/string.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/nowide/args.hpp>
 #include <boost/nowide/filesystem.hpp>
-#include <boost/nowide/fstream.hpp>
 #include <boost/nowide/iostream.hpp>
 
+#include "archive.hpp"
+#include "bucket.hpp"
+#include "grep.hpp"
+#include "kernel_dump.hpp"
+#include "mapped_file.hpp"
+#include "minidump.hpp"
+#include "triage.hpp"
+
 namespace fs = boost::filesystem;
 
 using boost::nowide::cerr;
 using boost::nowide::cout;
-using boost::nowide::ifstream;
+
+using umutech::process_dump::ArchiveStatus;
+using umutech::process_dump::BucketIndex;
+using umutech::process_dump::ClassifyDump;
+using umutech::process_dump::DumpKind;
+using umutech::process_dump::GrepHit;
+using umutech::process_dump::GrepPattern;
+using umutech::process_dump::KernelDump;
+using umutech::process_dump::MappedFile;
+using umutech::process_dump::Minidump;
+using umutech::process_dump::MinidumpException;
+using umutech::process_dump::MinidumpHeader;
+using umutech::process_dump::kMiscProcessId;
 
 bool IsDumpFile(const fs::path& path) {
   return boost::algorithm::iequals(".dmp", path.extension().string());
 }
 
-void CollectDumpFile(const fs::path& path, std::set<fs::path>& filenames) {
+void CollectDumpFile(const fs::path& path,
+                     std::set<fs::path>& filenames,
+                     std::set<fs::path>& archives) {
   auto status = fs::status(path);
   if (!fs::exists(status)) {
     cerr << "File " << path << " doesn't exist!" << '\n';
@@ -34,6 +68,8 @@ void CollectDumpFile(const fs::path& path, std::set<fs::path>& filenames) {
       if (!fs::is_directory(child.status())) {
         if (IsDumpFile(child.path().extension().string())) {
           filenames.insert(child.path());
+        } else if (umutech::process_dump::IsArchiveName(child.path())) {
+          archives.insert(child.path());
         } else {
 #if _DEBUG
           cout << "Skip file " << child.path() << '\n';
@@ -43,6 +79,8 @@ void CollectDumpFile(const fs::path& path, std::set<fs::path>& filenames) {
     }
   } else if (IsDumpFile(path.extension().string())) {
     filenames.insert(path);
+  } else if (umutech::process_dump::IsArchiveName(path)) {
+    archives.insert(path);
   } else {
 #if _DEBUG
     cout << "Skip file " << path << '\n';
@@ -50,47 +88,433 @@ void CollectDumpFile(const fs::path& path, std::set<fs::path>& filenames) {
   }
 }
 
-bool IsKernelDump(const fs::path& filename) {
-  struct MinidumpHeader {
-    std::uint32_t Signature;
-    std::uint32_t Version;
-    std::uint32_t NumberOfStreams;
-    std::uint32_t StreamDirectoryRva;
-    std::uint32_t CheckSum;
-    union {
-      std::uint32_t Reserved;
-      std::uint32_t TimeDateStamp;
-    };
-    std::uint64_t Flags;
+// Prints what isn't a minidump; returns whether it is one
+bool ReportKind(const fs::path& filename, DumpKind kind) {
+  switch (kind) {
+    case DumpKind::kKernel:
+      cout << "Kernel dump file: " << filename << '\n';
+      return false;
+    case DumpKind::kMinidump:
+      return true;
+    case DumpKind::kCorrupted:
+      cerr << "Corrupted dump file: " << filename << '\n';
+      return false;
+    case DumpKind::kInvalid:
+      cerr << "Invalid dump file: " << filename << '\n';
+      return false;
+    case DumpKind::kUnreadable:
+      cerr << "Can't open dump file: " << filename << '\n';
+      return false;
+  }
+  return false;
+}
+
+// PROCESSOR_ARCHITECTURE_*
+const char* ArchitectureName(std::uint16_t architecture) {
+  switch (architecture) {
+    case 0:
+      return "x86";
+    case 5:
+      return "ARM";
+    case 6:
+      return "IA64";
+    case 9:
+      return "x64";
+    case 12:
+      return "ARM64";
+    default:
+      return "unknown architecture";
+  }
+}
+
+// What tells one crash from another: the exception, the module it came
+// from and the system it ran on
+void PrintMinidump(const Minidump& dump) {
+  if (const auto exception = dump.Exception()) {
+    const MinidumpException& record = exception->ExceptionRecord;
+    cout << "  Exception " << std::hex << record.ExceptionCode << " at "
+         << record.ExceptionAddress;
+    if (const auto module = dump.ModuleAt(record.ExceptionAddress)) {
+      cout << " in " << dump.ModuleName(module->ModuleNameRva) << '+'
+           << record.ExceptionAddress - module->BaseOfImage;
+    }
+    cout << std::dec << " on thread " << exception->ThreadId << '\n';
+  } else {
+    cout << "  No exception\n";
+  }
+  if (const auto system = dump.SystemInfo()) {
+    cout << "  OS " << system->MajorVersion << '.' << system->MinorVersion
+         << '.' << system->BuildNumber << ", "
+         << ArchitectureName(system->ProcessorArchitecture) << ", "
+         << static_cast<unsigned>(system->NumberOfProcessors)
+         << " processors\n";
+  }
+  cout << "  ";
+  if (const auto misc = dump.MiscInfo();
+      misc && (misc->Flags1 & kMiscProcessId)) {
+    cout << "Process " << misc->ProcessId << ", ";
+  }
+  cout << dump.Threads().size() << " threads, " << dump.Modules().size()
+       << " modules\n";
+}
+
+void PrintKernelDump(const KernelDump& dump) {
+  cout << "  Bugcheck " << std::hex << dump.bugcheck_code << " ("
+       << dump.bugcheck_parameters[0] << ", " << dump.bugcheck_parameters[1]
+       << ", " << dump.bugcheck_parameters[2] << ", "
+       << dump.bugcheck_parameters[3] << ")\n"
+       << std::dec;
+  cout << "  Type " << umutech::process_dump::DumpTypeName(dump)
+       << ", build " << dump.minor_version << ", "
+       << umutech::process_dump::MachineName(dump.machine) << ", "
+       << dump.processors << " processors\n";
+}
+
+// Reports a dump by its first kKernelHeaderSize bytes, all that's read of
+// a kernel dump however big; returns whether it's a minidump
+bool ReportHead(const fs::path& filename, std::string_view head) {
+  const DumpKind kind = ClassifyDump(head);
+  if (DumpKind::kKernel == kind) {
+    const auto dump = umutech::process_dump::DecodeKernelDump(head);
+    ReportKind(filename, dump ? kind : DumpKind::kCorrupted);
+    if (dump) {
+      PrintKernelDump(*dump);
+    }
+    return false;
+  }
+  return ReportKind(filename, kind);
+}
+
+void ProcessDumpFile(const fs::path& filename) {
+  char head[umutech::process_dump::kKernelHeaderSize];
+  const std::ptrdiff_t size =
+      umutech::process_dump::ReadHead(filename, head, sizeof(head));
+  if (size < 0) {
+    ReportKind(filename, DumpKind::kUnreadable);
+    return;
+  }
+  if (!ReportHead(filename,
+                  std::string_view(head, static_cast<std::size_t>(size)))) {
+    return;
+  }
+
+  MappedFile file;
+  if (!file.Open(filename)) {
+    ReportKind(filename, DumpKind::kUnreadable);
+    return;
+  }
+  const std::string_view data(file.data(),
+                              static_cast<std::size_t>(file.size()));
+
+  Minidump dump;
+  switch (dump.Parse(data)) {
+    case Minidump::Status::kParsed:
+      break;
+    case Minidump::Status::kTooSmall:
+    case Minidump::Status::kCorrupted:
+      cerr << "Corrupted dump file: " << filename << '\n';
+      return;
+    case Minidump::Status::kNotMinidump:
+      cerr << "Invalid dump file: " << filename << '\n';
+      return;
+  }
+  cout << "Minidump file: " << filename << " with flags " << std::hex
+       << dump.header().Flags << std::dec << '\n';
+  PrintMinidump(dump);
+}
+
+// Calls visit(member_path, head) for each dump in `archive`, with up to
+// `head_size` bytes of its start, and tells what can't be read
+template <typename Visit>
+void ForEachArchivedDump(const fs::path& archive,
+                         std::size_t head_size,
+                         const Visit& visit) {
+  const ArchiveStatus status = umutech::process_dump::ReadArchive(
+      archive, head_size,
+      [&](std::string_view member, std::optional<std::string_view> head) {
+        const fs::path filename = archive / std::string(member);
+        if (head) {
+          visit(filename, *head);
+        } else {
+          cerr << "Can't decompress dump file: " << filename << '\n';
+        }
+      });
+  switch (status) {
+    case ArchiveStatus::kRead:
+      break;
+    case ArchiveStatus::kReadFailed:
+      cerr << "Can't read archive: " << archive << '\n';
+      break;
+    case ArchiveStatus::kBroken:
+      cerr << "Corrupted archive: " << archive << '\n';
+      break;
+    case ArchiveStatus::kUnsupported:
+      cerr << "Can't decompress archive: " << archive
+           << ", this build has no zlib\n";
+      break;
+  }
+}
+
+// Only the heads of the dumps in an archive are decompressed, so there's
+// no more to tell of a minidump than its header
+void ProcessArchive(const fs::path& archive) {
+  ForEachArchivedDump(
+      archive, umutech::process_dump::kKernelHeaderSize,
+      [](const fs::path& filename, std::string_view head) {
+        if (ReportHead(filename, head)) {
+          cout << "Minidump file: " << filename << " with flags " << std::hex
+               << umutech::process_dump::ReadRecord<MinidumpHeader>(head)
+                      ->Flags
+               << std::dec << '\n';
+        }
+      });
+}
+
+// Calls work(i) for each i below `count`, on `jobs` threads
+template <typename Work>
+void ParallelFor(std::size_t count, unsigned jobs, const Work& work) {
+  std::atomic<std::size_t> next{0};
+  const auto run = [&] {
+    for (std::size_t i; (i = next++) < count;) {
+      work(i);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < jobs; ++i) {
+    threads.emplace_back(run);
+  }
+  run();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+// Only the first page of each dump, read on `jobs` threads: on a share
+// of big dumps this is bound by the latency of opening them
+void TriageDumpFiles(const std::set<fs::path>& filenames,
+                     const std::set<fs::path>& archives,
+                     unsigned jobs) {
+  const std::vector<fs::path> files(filenames.begin(), filenames.end());
+  std::vector<DumpKind> kinds(files.size());
+  ParallelFor(files.size(), jobs, [&](std::size_t i) {
+    kinds[i] = umutech::process_dump::TriageDump(files[i]);
+  });
+
+  std::size_t kernel = 0;
+  std::size_t minidumps = 0;
+  std::size_t others = 0;
+  const auto report = [&](const fs::path& filename, DumpKind kind) {
+    if (ReportKind(filename, kind)) {
+      cout << "Minidump file: " << filename << '\n';
+      ++minidumps;
+    } else if (DumpKind::kKernel == kind) {
+      ++kernel;
+    } else {
+      ++others;
+    }
   };
-  constexpr std::uint32_t kMinidumpSignature = 'PMDM';
+  for (std::size_t i = 0; i < files.size(); ++i) {
+    report(files[i], kinds[i]);
+  }
+  // One after another: an archive is read front to back anyway
+  for (const auto& archive : archives) {
+    ForEachArchivedDump(archive, umutech::process_dump::kTriageSize,
+                        [&](const fs::path& filename, std::string_view head) {
+                          report(filename, ClassifyDump(head));
+                        });
+  }
+  cout << kernel << " kernel dumps, " << minidumps << " minidumps, "
+       << others << " other files\n";
+}
 
-  auto size = fs::file_size(filename);
-  if (size < sizeof(MinidumpHeader)) {
-    cerr << "Corrupted dump file: " << filename << '\n';
+// Groups the minidumps by crash signature, with the signatures of the
+// dumps seen before from `index_path`, and adds those of the new ones
+bool BucketDumpFiles(const std::set<fs::path>& filenames,
+                     const fs::path& index_path,
+                     unsigned frames,
+                     unsigned jobs) {
+  BucketIndex index(frames);
+  if (!index.Load(index_path)) {
+    cerr << index_path << " isn't a bucket index\n";
     return false;
   }
 
-  ifstream f(filename);
+  struct Dump {
+    fs::path path;
+    std::uint64_t size;
+    std::int64_t mtime;
+    std::uint64_t signature;
+    std::string_view text;
+    bool is_new;
+  };
+  // Dumps are known by their path from the directory of the index, so it
+  // finds them again from any working directory, and moves with them
+  const fs::path index_dir = fs::absolute(index_path).lexically_normal()
+                                 .parent_path();
+  const auto key_of = [&index_dir](const fs::path& filename) {
+    const fs::path absolute = fs::absolute(filename).lexically_normal();
+    const fs::path relative = absolute.lexically_relative(index_dir);
+    // Another drive
+    return (relative.empty() ? absolute : relative).generic_string();
+  };
+  std::vector<Dump> dumps;
+  std::vector<BucketIndex::NewEntry> added;
+  std::vector<fs::path> added_paths;
+  for (const auto& filename : filenames) {
+    boost::system::error_code ec;
+    const std::uint64_t size = fs::file_size(filename, ec);
+    const std::int64_t mtime = ec ? 0 : fs::last_write_time(filename, ec);
+    if (ec) {
+      ReportKind(filename, DumpKind::kUnreadable);
+      continue;
+    }
+    Dump dump{filename, size, mtime, 0, {}, false};
+    std::string key = key_of(filename);
+    if (const auto* entry = index.Find(key, size, mtime)) {
+      dump.signature = entry->signature;
+      dump.text = entry->text;
+    } else {
+      dump.is_new = true;
+      added.push_back({std::move(key), size, mtime, 0, {}});
+      added_paths.push_back(filename);
+    }
+    dumps.push_back(std::move(dump));
+  }
+
+  // Only the new dumps are read
+  std::vector<DumpKind> kinds(added.size());
+  ParallelFor(added.size(), jobs, [&](std::size_t i) {
+    MappedFile file;
+    if (!file.Open(added_paths[i])) {
+      kinds[i] = DumpKind::kUnreadable;
+      return;
+    }
+    const std::string_view data(file.data(),
+                                static_cast<std::size_t>(file.size()));
+    Minidump dump;
+    kinds[i] = ClassifyDump(data);
+    if (DumpKind::kMinidump != kinds[i]) {
+      return;
+    }
+    if (Minidump::Status::kParsed != dump.Parse(data)) {
+      kinds[i] = DumpKind::kCorrupted;
+      return;
+    }
+    added[i].text = umutech::process_dump::CrashSignature(dump, frames);
+    added[i].signature = umutech::process_dump::SignatureHash(added[i].text);
+  });
+
+  struct Bucket {
+    std::size_t dumps;
+    std::size_t new_dumps;
+    std::string_view text;
+  };
+  std::map<std::uint64_t, Bucket> buckets;
+  std::size_t minidumps = 0;
+  std::size_t new_dumps = 0;
+  for (std::size_t i = 0, j = 0; i < dumps.size(); ++i) {
+    Dump& dump = dumps[i];
+    if (dump.is_new) {
+      const std::size_t k = j++;
+      if (!ReportKind(dump.path, kinds[k])) {
+        continue;
+      }
+      dump.signature = added[k].signature;
+      dump.text = added[k].text;
+      ++new_dumps;
+    }
+    Bucket& bucket = buckets[dump.signature];
+    ++minidumps;
+    ++bucket.dumps;
+    bucket.new_dumps += dump.is_new;
+    bucket.text = dump.text;
+  }
 
-  MinidumpHeader header;
-  f.read(reinterpret_cast<char*>(&header), sizeof(header));
-  if ('EGAP' == header.Signature && '46UD' == header.Version) {
-    return true;
+  // The biggest buckets first
+  std::vector<std::pair<std::uint64_t, Bucket>> sorted(buckets.begin(),
+                                                       buckets.end());
+  std::stable_sort(sorted.begin(), sorted.end(),
+                   [](const auto& a, const auto& b) {
+                     return a.second.dumps > b.second.dumps;
+                   });
+  for (const auto& [signature, bucket] : sorted) {
+    cout << "Bucket " << std::hex << signature << std::dec << ": "
+         << bucket.dumps << " dumps, " << bucket.new_dumps << " new: "
+         << bucket.text << '\n';
   }
-  if (kMinidumpSignature != header.Signature) {
-    cerr << "Invalid dump file: " << filename << '\n';
+  cout << buckets.size() << " buckets of " << minidumps << " minidumps, "
+       << new_dumps << " new\n";
+
+  // What isn't a minidump is looked at again next time
+  std::erase_if(added, [](const BucketIndex::NewEntry& entry) {
+    return entry.text.empty();
+  });
+  if (!index.Append(index_path, added)) {
+    cerr << "Can't write bucket index " << index_path << '\n';
     return false;
   }
-  cout << "Minidump file: " << filename << " with flags " << std::hex
-       << header.Flags << '\n';
-  return false;
+  return true;
 }
 
-void ProcessDumpFile(const fs::path& filename) {
-  if (IsKernelDump(filename)) {
-    cout << "Kernel dump file: " << filename << '\n';
+// Prints the address of each hit of `patterns` in the memory of the
+// minidumps, searched on `jobs` threads
+void GrepDumpFiles(const std::set<fs::path>& filenames,
+                   const std::vector<GrepPattern>& patterns,
+                   unsigned jobs) {
+  const std::vector<fs::path> files(filenames.begin(), filenames.end());
+  std::vector<DumpKind> kinds(files.size());
+  std::vector<std::vector<GrepHit>> hits(files.size());
+  ParallelFor(files.size(), jobs, [&](std::size_t i) {
+    MappedFile file;
+    if (!file.Open(files[i])) {
+      kinds[i] = DumpKind::kUnreadable;
+      return;
+    }
+    const std::string_view data(file.data(),
+                                static_cast<std::size_t>(file.size()));
+    kinds[i] = ClassifyDump(data);
+    Minidump dump;
+    if (DumpKind::kMinidump != kinds[i]) {
+      return;
+    }
+    if (Minidump::Status::kParsed != dump.Parse(data)) {
+      kinds[i] = DumpKind::kCorrupted;
+      return;
+    }
+    hits[i] = umutech::process_dump::GrepMinidump(dump, patterns);
+  });
+
+  std::size_t minidumps = 0;
+  std::size_t found = 0;
+  std::size_t total = 0;
+  for (std::size_t i = 0; i < files.size(); ++i) {
+    if (DumpKind::kMinidump != kinds[i]) {
+      ReportKind(files[i], kinds[i]);
+      continue;
+    }
+    ++minidumps;
+    if (hits[i].empty()) {
+      continue;
+    }
+    ++found;
+    total += hits[i].size();
+    cout << "Minidump file: " << files[i] << '\n';
+    for (const GrepHit& hit : hits[i]) {
+      cout << "  " << std::hex << hit.address << std::dec << ' '
+           << patterns[hit.pattern].spelling
+           << (hit.utf16 ? " in UTF-16\n" : "\n");
+    }
   }
+  cout << total << " hits in " << found << " of " << minidumps
+       << " minidumps\n";
+}
+
+// A number of an option; false if there's none
+bool ParseNumber(int argc, char* argv[], int& i, unsigned& value) {
+  const std::string_view number = i + 1 < argc ? argv[++i] : "";
+  const auto [end, error] = std::from_chars(
+      number.data(), number.data() + number.size(), value);
+  return std::errc{} == error && number.data() + number.size() == end;
 }
 
 int main(int argc, char* argv[]) {
@@ -102,16 +526,111 @@ int main(int argc, char* argv[]) {
   if (argc < 2) {
     cout << "Process .dmp files\n\n"
             "Usage: "
-         << fs::path{argv[0]}.stem().string() << " <file_or_directory>\n";
+         << fs::path{argv[0]}.stem().string()
+         << " [--jobs N] [--buckets <index> [--frames N]] "
+            "[--grep <pattern>]... <file_or_directory>...\n\n"
+            "  --jobs N           Only tell kernel dumps, minidumps and other "
+            "files apart\n"
+            "                     by their first page, on N threads, 0 for "
+            "one per\n"
+            "                     hardware thread\n"
+            "  --buckets <index>  Group minidumps by crash signature, on "
+            "--jobs threads.\n"
+            "                     The index keeps the signatures for the "
+            "next run.\n"
+            "  --frames N         Stack frames in a signature, 8 by default\n"
+            "  --grep <pattern>   Find hex:<bytes>, ptr:<value> or "
+            "str:<text> in the\n"
+            "                     memory of minidumps, on --jobs threads\n\n"
+            "The .dmp files in .zip, .tar, .tar.gz and .tgz archives are read "
+            "too.\n";
     return EXIT_SUCCESS;
   }
 
+  std::optional<unsigned> jobs;
+  std::optional<fs::path> index_path;
+  std::optional<unsigned> frames;
+  std::vector<GrepPattern> patterns;
   std::set<fs::path> filenames;
+  std::set<fs::path> archives;
   for (int i = 1; i < argc; ++i) {
-    CollectDumpFile(fs::path{argv[i]}, filenames);
+    const std::string_view arg = argv[i];
+    if ("--jobs" == arg || "-j" == arg) {
+      unsigned value = 0;
+      if (!ParseNumber(argc, argv, i, value)) {
+        cerr << "--jobs takes a number of threads\n";
+        return EXIT_FAILURE;
+      }
+      jobs = 0 != value ? value
+                        : std::max(1u, std::thread::hardware_concurrency());
+      continue;
+    }
+    if ("--buckets" == arg) {
+      if (argc <= i + 1) {
+        cerr << "--buckets takes the index file\n";
+        return EXIT_FAILURE;
+      }
+      index_path = fs::path{argv[++i]};
+      continue;
+    }
+    if ("--frames" == arg) {
+      frames.emplace();
+      if (!ParseNumber(argc, argv, i, *frames)) {
+        cerr << "--frames takes a number of frames\n";
+        return EXIT_FAILURE;
+      }
+      continue;
+    }
+    if ("--grep" == arg) {
+      if (argc <= i + 1) {
+        cerr << "--grep takes a pattern\n";
+        return EXIT_FAILURE;
+      }
+      const auto pattern = umutech::process_dump::ParseGrepPattern(argv[++i]);
+      if (!pattern) {
+        cerr << "Bad pattern " << argv[i] << '\n';
+        return EXIT_FAILURE;
+      }
+      patterns.push_back(*pattern);
+      continue;
+    }
+    CollectDumpFile(fs::path{argv[i]}, filenames, archives);
   }
 
+  if (frames && !index_path) {
+    cerr << "--frames goes with --buckets\n";
+    return EXIT_FAILURE;
+  }
+  if (index_path && !patterns.empty()) {
+    cerr << "--grep doesn't go with --buckets\n";
+    return EXIT_FAILURE;
+  }
+  if (!patterns.empty()) {
+    // Only the heads of archived dumps can be had without extracting them
+    for (const auto& archive : archives) {
+      cerr << "Can't grep the dumps in archive: " << archive << '\n';
+    }
+    GrepDumpFiles(filenames, patterns, jobs.value_or(1));
+    return EXIT_SUCCESS;
+  }
+  if (index_path) {
+    // The index knows dumps by their size and time, which members lack
+    for (const auto& archive : archives) {
+      cerr << "Can't bucket the dumps in archive: " << archive << '\n';
+    }
+    return BucketDumpFiles(filenames, *index_path, frames.value_or(8),
+                           jobs.value_or(1))
+               ? EXIT_SUCCESS
+               : EXIT_FAILURE;
+  }
+  if (jobs) {
+    TriageDumpFiles(filenames, archives, *jobs);
+    return EXIT_SUCCESS;
+  }
   for (const auto& filename : filenames) {
     ProcessDumpFile(filename);
   }
+  for (const auto& archive : archives) {
+    ProcessArchive(archive);
+  }
 }
@@ -0,0 +1,73 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#include <boost/filesystem/path.hpp>
+
+#include "minidump.hpp"
+#include "positioned_file.hpp"
+
+namespace umutech::process_dump {
+
+enum class DumpKind {
+  kKernel,
+  kMinidump,
+  // Too short for its header
+  kCorrupted,
+  // Neither signature
+  kInvalid,
+  kUnreadable,
+};
+
+// Holds the header of either kind of dump
+constexpr std::size_t kTriageSize = 4096;
+
+// What the first bytes of a file tell about it
+inline DumpKind ClassifyDump(std::string_view head) noexcept {
+  std::uint32_t signature[2];
+  if (head.size() < sizeof(signature)) {
+    return DumpKind::kCorrupted;
+  }
+  std::memcpy(signature, head.data(), sizeof(signature));
+  if ('EGAP' == signature[0] && '46UD' == signature[1]) {
+    return DumpKind::kKernel;
+  }
+  if (kMinidumpSignature != signature[0]) {
+    return DumpKind::kInvalid;
+  }
+  return head.size() < sizeof(MinidumpHeader) ? DumpKind::kCorrupted
+                                              : DumpKind::kMinidump;
+}
+
+// Reads the first `size` bytes of `filename` into `buffer` with one
+// positioned read. Returns how many it read, fewer for a shorter file, or
+// -1 if it can't.
+inline std::ptrdiff_t ReadHead(const boost::filesystem::path& filename,
+                               char* buffer,
+                               std::size_t size) noexcept {
+  PositionedFile file;
+  return file.Open(filename) ? file.ReadAt(0, buffer, size) : -1;
+}
+
+// Reads the first kTriageSize bytes of `filename` and classifies them.
+// There's no stat: a short read tells a short file.
+inline DumpKind TriageDump(const boost::filesystem::path& filename) noexcept {
+  char head[kTriageSize];
+  const std::ptrdiff_t size = ReadHead(filename, head, sizeof(head));
+  if (size < 0) {
+    return DumpKind::kUnreadable;
+  }
+  const std::string_view read_head(head, static_cast<std::size_t>(size));
+  const DumpKind kind = ClassifyDump(read_head);
+  // A short read is the whole file, so its stream directory can be checked
+  if (DumpKind::kMinidump == kind && read_head.size() < kTriageSize &&
+      Minidump::Status::kParsed != Minidump().Parse(read_head)) {
+    return DumpKind::kCorrupted;
+  }
+  return kind;
+}
+
+}  // namespace umutech::process_dump